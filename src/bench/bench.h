@@ -0,0 +1,58 @@
+#ifndef BITCOIN_BENCH_H
+#define BITCOIN_BENCH_H
+
+#include <string>
+
+#include "util.h"
+
+/** Drives one benchmark: the body loops while KeepRunning() is true and
+ *  says how many items (hashes, scripts, signatures...) each pass handles.
+ */
+class CBenchState
+{
+private:
+    int64 nMaxMicros;
+    int64 nStartMicros;
+    int64 nElapsedMicros;
+    int64 nIterations;
+    int64 nItemsPerIteration;
+
+public:
+    CBenchState(int64 nMaxMicrosIn) : nMaxMicros(nMaxMicrosIn), nStartMicros(0), nElapsedMicros(0),
+                                      nIterations(0), nItemsPerIteration(1) { }
+
+    bool KeepRunning()
+    {
+        int64 nNow = GetTimeMicros();
+        if (nIterations++ == 0)
+            nStartMicros = nNow;
+        nElapsedMicros = nNow - nStartMicros;
+        if (nIterations > 1 && nElapsedMicros >= nMaxMicros)
+        {
+            nIterations--;
+            return false;
+        }
+        return true;
+    }
+
+    void SetItemsPerIteration(int64 nItems) { nItemsPerIteration = nItems; }
+
+    int64 GetItems() const { return nIterations * nItemsPerIteration; }
+    int64 GetElapsedMicros() const { return nElapsedMicros; }
+};
+
+typedef void (*BenchFunction)(CBenchState&);
+
+/** Registers a benchmark with the runner in bench_coolcash.cpp. */
+class CBenchRegistration
+{
+public:
+    CBenchRegistration(const std::string& strName, BenchFunction func);
+};
+
+#define BENCHMARK(name) \
+    static void name(CBenchState& state); \
+    static CBenchRegistration benchreg_##name(#name, name); \
+    static void name(CBenchState& state)
+
+#endif
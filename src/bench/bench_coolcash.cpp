@@ -0,0 +1,62 @@
+#include <map>
+
+#include "bench.h"
+#include "main.h"
+#include "wallet.h"
+#include "ui_interface.h"
+
+CWallet* pwalletMain;
+CClientUIInterface uiInterface;
+
+void Shutdown(void* parg)
+{
+    exit(0);
+}
+
+void StartShutdown()
+{
+    exit(0);
+}
+
+typedef std::map<std::string, BenchFunction> BenchMap;
+
+static BenchMap& Benchmarks()
+{
+    static BenchMap benchmarks;
+    return benchmarks;
+}
+
+CBenchRegistration::CBenchRegistration(const std::string& strName, BenchFunction func)
+{
+    Benchmarks().insert(std::make_pair(strName, func));
+}
+
+// Usage: bench_coolcash [-time=<ms per benchmark>] [name prefix ...]
+int main(int argc, char* argv[])
+{
+    ParseParameters(argc, argv);
+    fPrintToConsole = true;
+    int64 nMaxMicros = GetArg("-time", 2000) * 1000;
+
+    std::vector<std::string> vFilters;
+    for (int i = 1; i < argc; i++)
+        if (argv[i][0] != '-')
+            vFilters.push_back(argv[i]);
+
+    printf("%-32s %12s %14s\n", "benchmark", "items", "items/s");
+    BOOST_FOREACH(const BenchMap::value_type& item, Benchmarks())
+    {
+        bool fSelected = vFilters.empty();
+        BOOST_FOREACH(const std::string& strFilter, vFilters)
+            if (item.first.compare(0, strFilter.size(), strFilter) == 0)
+                fSelected = true;
+        if (!fSelected)
+            continue;
+
+        CBenchState state(nMaxMicros);
+        item.second(state);
+        double dPerSec = state.GetElapsedMicros() ? 1000000.0 * state.GetItems() / state.GetElapsedMicros() : 0;
+        printf("%-32s %12"PRI64d" %14.1f\n", item.first.c_str(), state.GetItems(), dPerSec);
+    }
+    return 0;
+}
@@ -0,0 +1,201 @@
+#include "bench.h"
+#include "main.h"
+#include "txdb.h"
+
+// A cache holding a large part of the UTXO set, as during initial block
+// download; items are coins looked up and modified.
+BENCHMARK(coins_cache_update)
+{
+    const unsigned int nCoins = 200000, nUpdates = 1000;
+    CCoinsView viewEmpty;
+    CCoinsViewCache cache(viewEmpty);
+    std::vector<uint256> vTxids;
+    CTxOut txout(50 * COIN, CScript() << OP_DUP << OP_HASH160 << std::vector<unsigned char>(20, 0x11) << OP_EQUALVERIFY << OP_CHECKSIG);
+    for (unsigned int i = 0; i < nCoins; i++)
+    {
+        vTxids.push_back(GetRandHash());
+        CCoinsModifier coins = cache.ModifyCoins(vTxids.back());
+        coins->vout.assign(2, txout);
+    }
+
+    state.SetItemsPerIteration(nUpdates);
+    unsigned int n = 0;
+    while (state.KeepRunning())
+    {
+        for (unsigned int i = 0; i < nUpdates; i++, n++)
+        {
+            // Look up an existing coin and rewrite one of its outputs
+            const uint256 &txid = vTxids[(n * 7919) % nCoins];
+            if (!cache.HaveCoins(txid))
+                printf("coins_cache_update: coin %u missing\n", n);
+            CCoinsModifier coins = cache.ModifyCoins(txid);
+            coins->vout[n % 2] = txout;
+        }
+    }
+}
+
+// Copying coins out of the tip cache, as the per-block view does, with the
+// cache keeping its entries compressed or not
+static void CoinsCacheRead(CBenchState &state, bool fCompressed)
+{
+    const unsigned int nCoins = 200000, nReads = 1000;
+    CCoinsView viewEmpty;
+    CCoinsViewCache cache(viewEmpty);
+    cache.SetCompressed(fCompressed);
+    std::vector<uint256> vTxids;
+    CTxOut txout(50 * COIN, CScript() << OP_DUP << OP_HASH160 << std::vector<unsigned char>(20, 0x11) << OP_EQUALVERIFY << OP_CHECKSIG);
+    for (unsigned int i = 0; i < nCoins; i++)
+    {
+        vTxids.push_back(GetRandHash());
+        CCoins coins;
+        coins.vout.assign(2, txout);
+        cache.SetCoins(vTxids.back(), coins);
+    }
+
+    state.SetItemsPerIteration(nReads);
+    unsigned int n = 0;
+    while (state.KeepRunning())
+    {
+        for (unsigned int i = 0; i < nReads; i++, n++)
+        {
+            CCoins coins;
+            if (!cache.GetCoins(vTxids[(n * 7919) % nCoins], coins))
+                printf("coins_cache_read: coin %u missing\n", n);
+        }
+    }
+}
+
+BENCHMARK(coins_cache_read)
+{
+    CoinsCacheRead(state, false);
+}
+
+BENCHMARK(coins_cache_read_compressed)
+{
+    CoinsCacheRead(state, true);
+}
+
+// The coin database, in memory, with 100000 transactions of two outputs,
+// one of which is spent in half of them
+static void FillCoinsDB(CCoinsViewDB &db, std::vector<uint256> &vTxids)
+{
+    CTxOut txout(50 * COIN, CScript() << OP_DUP << OP_HASH160 << std::vector<unsigned char>(20, 0x11) << OP_EQUALVERIFY << OP_CHECKSIG);
+    CCoinsViewCache cache(db);
+    for (unsigned int i = 0; i < 100000; i++)
+    {
+        vTxids.push_back(GetRandHash());
+        CCoinsModifier coins = cache.ModifyCoins(vTxids.back());
+        coins->vout.assign(2, txout);
+        if (i % 2)
+            coins->vout[0].SetNull();
+    }
+    if (!cache.Flush())
+        printf("FillCoinsDB: flush failed\n");
+}
+
+// Looking up coins in the database, as a cache miss does; every fourth
+// transaction asked for isn't there
+BENCHMARK(coins_db_read)
+{
+    const unsigned int nReads = 1000;
+    CCoinsViewDB db(8 << 20, true, true);
+    std::vector<uint256> vTxids;
+    FillCoinsDB(db, vTxids);
+
+    state.SetItemsPerIteration(nReads);
+    unsigned int n = 0;
+    while (state.KeepRunning())
+    {
+        for (unsigned int i = 0; i < nReads; i++, n++)
+        {
+            CCoins coins;
+            bool fHave = db.GetCoins(n % 4 ? vTxids[(n * 7919) % vTxids.size()] : GetRandHash(), coins);
+            if (fHave != (n % 4 != 0))
+                printf("coins_db_read: coin %u wrong\n", n);
+        }
+    }
+}
+
+// Connecting and flushing blocks that each spend or bring back an output of
+// 1000 transactions: a read of every transaction through a fresh cache,
+// then one write with the changes
+BENCHMARK(coins_db_flush)
+{
+    const unsigned int nChanges = 1000;
+    CCoinsViewDB db(8 << 20, true, true);
+    std::vector<uint256> vTxids;
+    FillCoinsDB(db, vTxids);
+    CTxOut txout(50 * COIN, CScript() << OP_DUP << OP_HASH160 << std::vector<unsigned char>(20, 0x11) << OP_EQUALVERIFY << OP_CHECKSIG);
+
+    state.SetItemsPerIteration(nChanges);
+    unsigned int n = 0;
+    while (state.KeepRunning())
+    {
+        CCoinsViewCache cache(db);
+        for (unsigned int i = 0; i < nChanges; i++, n++)
+        {
+            CCoinsModifier coins = cache.ModifyCoins(vTxids[(n * 7919) % vTxids.size()]);
+            if (coins->IsAvailable(1)) {
+                coins->vout[1].SetNull();
+            } else {
+                if (coins->vout.size() < 2)
+                    coins->vout.resize(2);
+                coins->vout[1] = txout;
+            }
+        }
+        if (!cache.Flush())
+            printf("coins_db_flush: flush failed\n");
+    }
+}
+
+// Connecting blocks that spend 1000 random coins of a set of 200000 and
+// create as many, with the tip cache flushed to the database whenever it
+// outgrows 8 MB; compressed, it holds more of the set and goes to the
+// database less often
+static void CoinsConnectBlock(CBenchState &state, bool fCompressed)
+{
+    const unsigned int nCoins = 200000, nBlockTxs = 1000;
+    const size_t nMaxCacheSize = 8 << 20;
+    CCoinsViewDB db(1 << 20, true, true);
+    std::vector<uint256> vTxids;
+    CTxOut txout(50 * COIN, CScript() << OP_DUP << OP_HASH160 << std::vector<unsigned char>(20, 0x11) << OP_EQUALVERIFY << OP_CHECKSIG);
+    {
+        CCoinsViewCache cache(db);
+        for (unsigned int i = 0; i < nCoins; i++)
+        {
+            vTxids.push_back(GetRandHash());
+            cache.ModifyCoins(vTxids.back())->vout.assign(1, txout);
+        }
+        if (!cache.Flush())
+            printf("coins_connect_block: flush failed\n");
+    }
+
+    CCoinsViewCache tip(db);
+    tip.SetCompressed(fCompressed);
+    state.SetItemsPerIteration(nBlockTxs);
+    while (state.KeepRunning())
+    {
+        CCoinsViewCache view(tip, true);
+        for (unsigned int i = 0; i < nBlockTxs; i++)
+        {
+            unsigned int n = insecure_rand() % nCoins;
+            CTxInUndo undo;
+            if (!view.ModifyCoins(vTxids[n])->Spend(COutPoint(vTxids[n], 0), undo))
+                printf("coins_connect_block: coin %u missing\n", n);
+            vTxids[n] = GetRandHash();
+            view.ModifyCoins(vTxids[n])->vout.assign(1, txout);
+        }
+        if (!view.Flush() || (tip.DynamicMemoryUsage() > nMaxCacheSize && !tip.Flush()))
+            printf("coins_connect_block: flush failed\n");
+    }
+}
+
+BENCHMARK(coins_connect_block)
+{
+    CoinsConnectBlock(state, false);
+}
+
+BENCHMARK(coins_connect_block_compressed)
+{
+    CoinsConnectBlock(state, true);
+}
@@ -0,0 +1,31 @@
+#include "bench.h"
+#include "key.h"
+
+// Signatures by a set of keys, verified round-robin; each key is used many
+// times, as the outputs of busy addresses are
+BENCHMARK(ecdsa_verify)
+{
+    const unsigned int nKeys = 1000;
+    std::vector<CPubKey> vPubKeys;
+    std::vector<uint256> vHashes;
+    std::vector<std::vector<unsigned char> > vSigs;
+    for (unsigned int i = 0; i < nKeys; i++)
+    {
+        CKey key;
+        key.MakeNewKey(i % 2 == 0);
+        uint256 hash = GetRandHash();
+        std::vector<unsigned char> vchSig;
+        key.Sign(hash, vchSig);
+        vPubKeys.push_back(key.GetPubKey());
+        vHashes.push_back(hash);
+        vSigs.push_back(vchSig);
+    }
+
+    state.SetItemsPerIteration(nKeys);
+    while (state.KeepRunning())
+    {
+        for (unsigned int i = 0; i < nKeys; i++)
+            if (!vPubKeys[i].Verify(vHashes[i], vSigs[i]))
+                printf("ecdsa_verify: signature %u failed\n", i);
+    }
+}
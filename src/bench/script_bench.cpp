@@ -0,0 +1,100 @@
+#include <fstream>
+
+#include <boost/algorithm/string/classification.hpp>
+#include <boost/algorithm/string/predicate.hpp>
+#include <boost/algorithm/string/replace.hpp>
+#include <boost/algorithm/string/split.hpp>
+#include <boost/filesystem.hpp>
+#include "json/json_spirit_reader_template.h"
+
+#include "bench.h"
+#include "main.h"
+
+using namespace json_spirit;
+using namespace boost::algorithm;
+
+// The same notation as test/script_tests.cpp
+static CScript ParseBenchScript(const std::string& s)
+{
+    static std::map<std::string, opcodetype> mapOpNames;
+    if (mapOpNames.empty())
+    {
+        for (int op = OP_NOP; op <= OP_NOP10; op++)
+        {
+            std::string strName(GetOpName((opcodetype)op));
+            if (strName == "OP_UNKNOWN")
+                continue;
+            mapOpNames[strName] = (opcodetype)op;
+            replace_first(strName, "OP_", "");
+            mapOpNames[strName] = (opcodetype)op;
+        }
+    }
+
+    CScript result;
+    std::vector<std::string> words;
+    split(words, s, is_any_of(" \t\n"), token_compress_on);
+    BOOST_FOREACH(const std::string& w, words)
+    {
+        if (w.empty())
+            continue;
+        if (all(w, is_digit()) || (starts_with(w, "-") && all(std::string(w.begin()+1, w.end()), is_digit())))
+            result << atoi64(w);
+        else if (starts_with(w, "0x") && IsHex(std::string(w.begin()+2, w.end())))
+        {
+            std::vector<unsigned char> raw = ParseHex(std::string(w.begin()+2, w.end()));
+            result.insert(result.end(), raw.begin(), raw.end());
+        }
+        else if (w.size() >= 2 && starts_with(w, "'") && ends_with(w, "'"))
+            result << std::vector<unsigned char>(w.begin()+1, w.end()-1);
+        else if (mapOpNames.count(w))
+            result << mapOpNames[w];
+        else
+            return CScript();
+    }
+    return result;
+}
+
+static unsigned int CountOps(const CScript& script)
+{
+    unsigned int nOps = 0;
+    CScript::const_iterator pc = script.begin();
+    opcodetype opcode;
+    while (pc < script.end() && script.GetOp(pc, opcode))
+        nOps++;
+    return nOps;
+}
+
+// Every (scriptSig, scriptPubKey) pair of test/data/script_valid.json, run
+// through VerifyScript; items are opcodes, so the rate is in ops/sec.
+BENCHMARK(script_verify_valid)
+{
+    boost::filesystem::path pathData = boost::filesystem::current_path() / "test" / "data" / "script_valid.json";
+    std::ifstream ifs(pathData.string().c_str());
+    Value v;
+    if (!read_stream(ifs, v) || v.type() != array_type)
+    {
+        printf("script_verify_valid: cannot read %s\n", pathData.string().c_str());
+        return;
+    }
+
+    std::vector<std::pair<CScript, CScript> > vScripts;
+    unsigned int nOps = 0;
+    BOOST_FOREACH(const Value& tv, v.get_array())
+    {
+        if (tv.type() != array_type || tv.get_array().size() < 2)
+            continue;
+        CScript scriptSig = ParseBenchScript(tv.get_array()[0].get_str());
+        CScript scriptPubKey = ParseBenchScript(tv.get_array()[1].get_str());
+        vScripts.push_back(std::make_pair(scriptSig, scriptPubKey));
+        nOps += CountOps(scriptSig) + CountOps(scriptPubKey);
+    }
+
+    const unsigned int flags = SCRIPT_VERIFY_P2SH | SCRIPT_VERIFY_STRICTENC;
+    CTransaction txTo;
+    state.SetItemsPerIteration(nOps);
+    while (state.KeepRunning())
+    {
+        for (unsigned int i = 0; i < vScripts.size(); i++)
+            VerifyScript(vScripts[i].first, vScripts[i].second, txTo, 0, flags, 0);
+    }
+}
@@ -0,0 +1,63 @@
+#include "bench.h"
+#include "scrypt.h"
+
+// Mainnet block header used by scrypt_tests
+static const char* strHeaderHex = "020000004c1271c211717198227392b029a64a7971931d351b387bb80db027f270411e398a07046f7d4a08dd815412a8712f874a7ebf0507e3878bd24e20a3b73fd750a667d2f451eac7471b00de6659";
+
+// One header and scrypt_1024_1_1_256_sp per nonce, as the miner used to do
+BENCHMARK(scrypt_mine_single)
+{
+#if defined(USE_SSE2)
+    scrypt_detect_sse2();
+#endif
+    std::vector<unsigned char> vHeader = ParseHex(strHeaderHex);
+    char *scratchpad = scrypt_thread_scratchpad();
+    char hash[32];
+    uint32_t nNonce = 0;
+    while (state.KeepRunning())
+    {
+        le32enc(&vHeader[76], nNonce++);
+        scrypt_1024_1_1_256_sp((const char*)&vHeader[0], hash, scratchpad);
+    }
+}
+
+// A full header per lane through the multi-lane batch path
+BENCHMARK(scrypt_mine_batch)
+{
+    scrypt_detect_multiway();
+    const unsigned int nWays = scrypt_batch_ways();
+    std::vector<unsigned char> vHeader = ParseHex(strHeaderHex);
+    char *scratchpad = scrypt_thread_scratchpad();
+    char phashin[SCRYPT_MAX_WAYS * 80];
+    char phash[SCRYPT_MAX_WAYS * 32];
+    uint32_t nNonce = 0;
+    state.SetItemsPerIteration(nWays);
+    while (state.KeepRunning())
+    {
+        for (unsigned int l = 0; l < nWays; l++)
+        {
+            memcpy(phashin + 80 * l, &vHeader[0], 80);
+            le32enc(phashin + 80 * l + 76, nNonce++);
+        }
+        scrypt_1024_1_1_256_sp_batch(phashin, phash, nWays, scratchpad);
+    }
+}
+
+// The batch path resuming from the midstate of the fixed header prefix
+BENCHMARK(scrypt_mine_midstate)
+{
+    scrypt_detect_multiway();
+    const unsigned int nWays = scrypt_batch_ways();
+    std::vector<unsigned char> vHeader = ParseHex(strHeaderHex);
+    char *scratchpad = scrypt_thread_scratchpad();
+    char phash[SCRYPT_MAX_WAYS * 32];
+    scrypt_midstate midstate;
+    scrypt_1024_1_1_256_midstate((const char*)&vHeader[0], &midstate);
+    uint32_t nNonce = 0;
+    state.SetItemsPerIteration(nWays);
+    while (state.KeepRunning())
+    {
+        scrypt_1024_1_1_256_sp_mine(&midstate, (const char*)&vHeader[0], nNonce, nWays, phash, scratchpad);
+        nNonce += nWays;
+    }
+}
@@ -0,0 +1,28 @@
+#include "bench.h"
+#include "main.h"
+
+// A sweep of many inputs into one output, like those that made checking
+// large transactions slow; items are signature hashes.
+static void MakeSweepTransaction(CTransaction &tx, unsigned int nInputs)
+{
+    CScript scriptSig;
+    scriptSig << std::vector<unsigned char>(72, 0x30) << std::vector<unsigned char>(33, 0x02);
+    for (unsigned int i = 0; i < nInputs; i++)
+        tx.vin.push_back(CTxIn(COutPoint(GetRandHash(), i % 4), scriptSig));
+    tx.vout.push_back(CTxOut(50 * COIN, CScript() << OP_DUP << OP_HASH160 << std::vector<unsigned char>(20, 0x11) << OP_EQUALVERIFY << OP_CHECKSIG));
+}
+
+static const CScript scriptCode = CScript() << OP_DUP << OP_HASH160 << std::vector<unsigned char>(20, 0x22) << OP_EQUALVERIFY << OP_CHECKSIG;
+
+BENCHMARK(sighash_sweep_1000)
+{
+    CTransaction tx;
+    MakeSweepTransaction(tx, 1000);
+    state.SetItemsPerIteration(tx.vin.size());
+    while (state.KeepRunning())
+    {
+        CSignatureHashContext context(tx);
+        for (unsigned int i = 0; i < tx.vin.size(); i++)
+            context.SignatureHash(scriptCode, i, SIGHASH_ALL);
+    }
+}
@@ -12,6 +12,7 @@
 
 class CBlockIndex;
 class CReserveKey;
+namespace boost { namespace asio { namespace ip { class address; } } }
 
 #include "json/json_spirit_reader_template.h"
 #include "json/json_spirit_writer_template.h"
@@ -70,6 +71,11 @@ json_spirit::Object JSONRPCError(int code, const std::string& message);
 
 void StartRPCThreads();
 void StopRPCThreads();
+/** False once StopRPCThreads has begun; long-running calls should then return */
+bool IsRPCRunning();
+/** Whether -rpcallowip lets this address in (loopback always is) */
+bool ClientAllowed(const boost::asio::ip::address& address);
+
 int CommandLineRPC(int argc, char *argv[]);
 
 /** Convert parameter values for RPC call from strings to command-specific JSON objects. */
@@ -204,6 +210,7 @@ extern json_spirit::Value getrawmempool(const json_spirit::Array& params, bool f
 extern json_spirit::Value getblockhash(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value getblock(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value gettxoutsetinfo(const json_spirit::Array& params, bool fHelp);
+extern json_spirit::Value getvalidationstats(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value gettxout(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value verifychain(const json_spirit::Array& params, bool fHelp);
 
@@ -7,180 +7,305 @@
 #include <boost/thread/mutex.hpp>
 #include <boost/thread/locks.hpp>
 #include <boost/thread/condition_variable.hpp>
+#include <boost/thread/thread.hpp>
 
+#include <deque>
 #include <vector>
 #include <algorithm>
 
 template<typename T> class CCheckQueueControl;
 
+/** Scheduling classes of checks; lower values are served first */
+enum
+{
+    CHECKQUEUE_PRIORITY_BLOCK = 0,
+    CHECKQUEUE_PRIORITY_MEMPOOL,
+
+    CHECKQUEUE_PRIORITIES
+};
+
+/** The checks added through one CCheckQueueControl, and their result */
+class CCheckQueueSession
+{
+public:
+    boost::mutex mutex;
+
+    // The owner blocks on this until all of its checks are done
+    boost::condition_variable cond;
+
+    // Number of checks that were added but haven't completed yet
+    unsigned int nTodo;
+
+    // Whether all completed checks succeeded
+    bool fAllOk;
+
+    int nPriority;
+
+    // Number of queues to spread this session's checks over, and the
+    // next one to use
+    unsigned int nQueues;
+    unsigned int nNextQueue;
+
+    CCheckQueueSession(int nPriorityIn) : nTodo(0), fAllOk(true), nPriority(nPriorityIn), nQueues(1), nNextQueue(0) {}
+};
+
 /** Queue for verifications that have to be performed.
   * The verifications are represented by a type T, which must provide an
   * operator(), returning a bool.
   *
-  * One thread (the master) is assumed to push batches of verifications
-  * onto the queue, where they are processed by N-1 worker threads. When
-  * the master is done adding work, it temporarily joins the worker pool
-  * as an N'th worker, until all jobs are done.
+  * Masters (the threads owning a CCheckQueueControl) push batches of
+  * verifications, which are processed by the worker threads as soon as
+  * they are queued. When a master is done adding work, it temporarily
+  * joins the worker pool until all of its own jobs are done.
+  *
+  * Every worker has its own queue, and a master spreads its batches over
+  * all of them. Workers take the newest work from their own queue and,
+  * once that is empty, steal the oldest half of another's, so the only
+  * lock touched on the hot path is that of one queue. Block checks are
+  * always taken before mempool checks.
   */
 template<typename T> class CCheckQueue {
 private:
-    // Mutex to protect the inner state
-    boost::mutex mutex;
+    struct CItem {
+        T check;
+        CCheckQueueSession *psession;
 
-    // Worker threads block on this when out of work
-    boost::condition_variable condWorker;
+        CItem() : psession(NULL) {}
 
-    // Master thread blocks on this when out of work
-    boost::condition_variable condMaster;
+        void swap(CItem &item) {
+            check.swap(item.check);
+            std::swap(psession, item.psession);
+        }
+    };
 
-    // The queue of elements to be processed.
-    // As the order of booleans doesn't matter, it is used as a LIFO (stack)
-    std::vector<T> queue;
+    struct CWorkerQueue {
+        boost::mutex mutex;
+        std::deque<CItem> queue[CHECKQUEUE_PRIORITIES];
+    };
 
-    // The number of workers (including the master) that are idle.
-    int nIdle;
+    // Queue 0 is shared by the masters, queue i > 0 belongs to worker i.
+    std::vector<CWorkerQueue*> vQueues;
 
-    // The total number of workers (including the master).
-    int nTotal;
+    // Mutex for registering workers and for idling
+    boost::mutex mutex;
 
-    // The temporary evaluation result.
-    bool fAllOk;
+    // Worker threads block on this when out of work
+    boost::condition_variable condWorker;
 
-    // Number of verifications that haven't completed yet.
-    // This includes elements that are not anymore in queue, but still in
-    // worker's own batches.
-    unsigned int nTodo;
+    // The number of worker threads, and how many of them are idle
+    unsigned int nWorkers;
+    int nIdle;
 
-    // Whether we're shutting down.
-    bool fQuit;
+    // Bumped after every Add, so that a worker which found nothing can tell
+    // whether work showed up before it went to sleep
+    unsigned int nAddSeq;
 
     // The maximum number of elements to be processed in one batch
     unsigned int nBatchSize;
 
-    // Internal function that does bulk of the verification work.
-    bool Loop(bool fMaster = false) {
-        boost::condition_variable &cond = fMaster ? condMaster : condWorker;
-        std::vector<T> vChecks;
-        vChecks.reserve(nBatchSize);
-        unsigned int nNow = 0;
-        bool fOk = true;
-        do {
-            {
-                boost::unique_lock<boost::mutex> lock(mutex);
-                // first do the clean-up of the previous loop run (allowing us to do it in the same critsect)
-                if (nNow) {
-                    fAllOk &= fOk;
-                    nTodo -= nNow;
-                    if (nTodo == 0 && !fMaster)
-                        // We processed the last element; inform the master he can exit and return the result
-                        condMaster.notify_one();
-                } else {
-                    // first iteration
-                    nTotal++;
-                }
-                // logically, the do loop starts here
-                while (queue.empty()) {
-                    if ((fMaster || fQuit) && nTodo == 0) {
-                        nTotal--;
-                        bool fRet = fAllOk;
-                        // reset the status for new work later
-                        if (fMaster)
-                            fAllOk = true;
-                        // return the current status
-                        return fRet;
+    unsigned int ActiveQueues() const {
+        return std::min((unsigned int)vQueues.size(), nWorkers + 1);
+    }
+
+    // Take a batch of work, preferring higher priorities. A thread's own
+    // queue is tried first and is taken from at the back (newest work);
+    // other queues are stolen from at the front. Either way half of the
+    // queue is taken, up to nBatchSize, so batches shrink as the queues
+    // drain and all threads finish at about the same time.
+    bool GetWork(unsigned int nSelf, unsigned int nQueues, std::vector<CItem> &vBatch) {
+        for (int nPriority = 0; nPriority < CHECKQUEUE_PRIORITIES; nPriority++) {
+            for (unsigned int i = 0; i < nQueues; i++) {
+                CWorkerQueue &wq = *vQueues[(nSelf + i) % nQueues];
+                boost::unique_lock<boost::mutex> lock(wq.mutex);
+                std::deque<CItem> &queue = wq.queue[nPriority];
+                if (queue.empty())
+                    continue;
+                unsigned int nNow = std::min(nBatchSize, (unsigned int)(queue.size() + 1) / 2);
+                vBatch.resize(nNow);
+                for (unsigned int k = 0; k < nNow; k++) {
+                    if (i == 0) {
+                        vBatch[k].swap(queue.back());
+                        queue.pop_back();
+                    } else {
+                        vBatch[k].swap(queue.front());
+                        queue.pop_front();
                     }
-                    nIdle++;
-                    cond.wait(lock); // wait
-                    nIdle--;
-                }
-                // Decide how many work units to process now.
-                // * Do not try to do everything at once, but aim for increasingly smaller batches so
-                //   all workers finish approximately simultaneously.
-                // * Try to account for idle jobs which will instantly start helping.
-                // * Don't do batches smaller than 1 (duh), or larger than nBatchSize.
-                nNow = std::max(1U, std::min(nBatchSize, (unsigned int)queue.size() / (nTotal + nIdle + 1)));
-                vChecks.resize(nNow);
-                for (unsigned int i = 0; i < nNow; i++) {
-                     // We want the lock on the mutex to be as short as possible, so swap jobs from the global
-                     // queue to the local batch vector instead of copying.
-                     vChecks[i].swap(queue.back());
-                     queue.pop_back();
                 }
-                // Check whether we need to do work at all
-                fOk = fAllOk;
+                return true;
             }
-            // execute work
-            BOOST_FOREACH(T &check, vChecks)
-                if (fOk)
-                    fOk = check();
-            vChecks.clear();
-        } while(true);
+        }
+        return false;
     }
 
-public:
-    // Create a new check queue
-    CCheckQueue(unsigned int nBatchSizeIn) :
-        nIdle(0), nTotal(0), fAllOk(true), nTodo(0), fQuit(false), nBatchSize(nBatchSizeIn) {}
+    // Run a batch and account the results to the sessions it came from.
+    void Execute(std::vector<CItem> &vBatch) {
+        unsigned int i = 0;
+        while (i < vBatch.size()) {
+            CCheckQueueSession *psession = vBatch[i].psession;
+            bool fOk;
+            {
+                boost::unique_lock<boost::mutex> lock(psession->mutex);
+                fOk = psession->fAllOk;
+            }
+            // Once one check of a session failed, the rest are skipped
+            unsigned int j = i;
+            for (; j < vBatch.size() && vBatch[j].psession == psession; j++)
+                if (fOk)
+                    fOk = vBatch[j].check();
+            {
+                boost::unique_lock<boost::mutex> lock(psession->mutex);
+                psession->fAllOk &= fOk;
+                psession->nTodo -= j - i;
+                if (psession->nTodo == 0)
+                    // We processed the last element; inform the master he can exit and return the result
+                    psession->cond.notify_all();
+            }
+            // psession may be gone as soon as its lock is released
+            i = j;
+        }
+        vBatch.clear();
+    }
 
-    // Worker thread
-    void Thread() {
-        Loop();
+    void BeginSession(CCheckQueueSession &session) {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        session.nQueues = ActiveQueues();
+        session.nNextQueue = 0;
     }
 
-    // Wait until execution finishes, and return whether all evaluations where succesful.
-    bool Wait() {
-        return Loop(true);
+    // Wait until all checks of a session are done, helping with any work
+    // that is queued meanwhile, and return whether they all succeeded.
+    bool Wait(CCheckQueueSession &session) {
+        // Workers still hold references to the session until its checks
+        // are done, so this must not be left early
+        boost::this_thread::disable_interruption di;
+        std::vector<CItem> vBatch;
+        vBatch.reserve(nBatchSize);
+        while (true) {
+            {
+                boost::unique_lock<boost::mutex> lock(session.mutex);
+                if (session.nTodo == 0)
+                    break;
+            }
+            if (!GetWork(0, session.nQueues, vBatch))
+                break;
+            Execute(vBatch);
+        }
+
+        // Nothing is queued anymore, so what is left is being run by workers
+        boost::unique_lock<boost::mutex> lock(session.mutex);
+        while (session.nTodo > 0)
+            session.cond.wait(lock);
+        bool fRet = session.fAllOk;
+        // reset the status for new work later
+        session.fAllOk = true;
+        return fRet;
     }
 
-    // Add a batch of checks to the queue
-    void Add(std::vector<T> &vChecks) {
-        boost::unique_lock<boost::mutex> lock(mutex);
-        BOOST_FOREACH(T &check, vChecks) {
-            queue.push_back(T());
-            check.swap(queue.back());
+    void Add(CCheckQueueSession &session, std::vector<T> &vChecks) {
+        if (vChecks.empty())
+            return;
+        {
+            boost::unique_lock<boost::mutex> lock(session.mutex);
+            session.nTodo += vChecks.size();
         }
-        nTodo += vChecks.size();
+
+        // Small batches go to the queues in turn, large ones are split
+        // over all of them
+        unsigned int nChunk = std::max(nBatchSize, (unsigned int)(vChecks.size() + session.nQueues - 1) / session.nQueues);
+        for (unsigned int i = 0; i < vChecks.size(); i += nChunk) {
+            CWorkerQueue &wq = *vQueues[session.nNextQueue++ % session.nQueues];
+            boost::unique_lock<boost::mutex> lock(wq.mutex);
+            std::deque<CItem> &queue = wq.queue[session.nPriority];
+            for (unsigned int k = i; k < std::min(i + nChunk, (unsigned int)vChecks.size()); k++) {
+                // We want the lock on the queue to be as short as possible, so swap
+                // jobs into it instead of copying.
+                queue.push_back(CItem());
+                queue.back().check.swap(vChecks[k]);
+                queue.back().psession = &session;
+            }
+        }
+
+        boost::unique_lock<boost::mutex> lock(mutex);
+        nAddSeq++;
         if (vChecks.size() == 1)
             condWorker.notify_one();
-        else if (vChecks.size() > 1)
+        else if (nIdle > 0)
             condWorker.notify_all();
     }
 
+public:
+    // Create a new check queue for up to nMaxWorkers worker threads
+    CCheckQueue(unsigned int nBatchSizeIn, unsigned int nMaxWorkers = 16) :
+        nWorkers(0), nIdle(0), nAddSeq(0), nBatchSize(nBatchSizeIn) {
+        for (unsigned int i = 0; i <= nMaxWorkers; i++)
+            vQueues.push_back(new CWorkerQueue());
+    }
+
+    // Worker thread
+    void Thread() {
+        std::vector<CItem> vBatch;
+        vBatch.reserve(nBatchSize);
+        unsigned int nSelf, nQueues, nSeq;
+        {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            nWorkers++;
+            nSelf = 1 + (nWorkers - 1) % (vQueues.size() - 1);
+            nQueues = ActiveQueues();
+            nSeq = nAddSeq;
+        }
+        do {
+            if (GetWork(nSelf, nQueues, vBatch)) {
+                Execute(vBatch);
+                continue;
+            }
+            boost::unique_lock<boost::mutex> lock(mutex);
+            if (nSeq == nAddSeq) {
+                nIdle++;
+                condWorker.wait(lock); // wait
+                nIdle--;
+            }
+            nQueues = ActiveQueues();
+            nSeq = nAddSeq;
+        } while(true);
+    }
+
     ~CCheckQueue() {
+        for (unsigned int i = 0; i < vQueues.size(); i++)
+            delete vQueues[i];
     }
 
     friend class CCheckQueueControl<T>;
 };
 
 /** RAII-style controller object for a CCheckQueue that guarantees the passed
- *  queue is finished before continuing.
+ *  queue is finished before continuing. Several controls may use the same
+ *  queue at once; each waits only for its own checks.
  */
 template<typename T> class CCheckQueueControl {
 private:
     CCheckQueue<T> *pqueue;
+    CCheckQueueSession session;
     bool fDone;
 
 public:
-    CCheckQueueControl(CCheckQueue<T> *pqueueIn) : pqueue(pqueueIn), fDone(false) {
-        // passed queue is supposed to be unused, or NULL
-        if (pqueue != NULL) {
-            assert(pqueue->nTotal == pqueue->nIdle);
-            assert(pqueue->nTodo == 0);
-            assert(pqueue->fAllOk == true);
-        }
+    CCheckQueueControl(CCheckQueue<T> *pqueueIn, int nPriority = CHECKQUEUE_PRIORITY_BLOCK) :
+        pqueue(pqueueIn), session(nPriority), fDone(false) {
+        // passed queue may be NULL
+        if (pqueue != NULL)
+            pqueue->BeginSession(session);
     }
 
     bool Wait() {
         if (pqueue == NULL)
             return true;
-        bool fRet = pqueue->Wait();
+        bool fRet = pqueue->Wait(session);
         fDone = true;
         return fRet;
     }
 
     void Add(std::vector<T> &vChecks) {
         if (pqueue != NULL)
-            pqueue->Add(vChecks);
+            pqueue->Add(session, vChecks);
     }
 
     ~CCheckQueueControl() {
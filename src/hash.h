@@ -40,6 +40,9 @@ public:
         Init();
     }
 
+    // Continue from a saved hashing state
+    CHashWriter(const SHA256_CTX &ctxIn, int nTypeIn, int nVersionIn) : ctx(ctxIn), nType(nTypeIn), nVersion(nVersionIn) {}
+
     CHashWriter& write(const char *pch, size_t size) {
         SHA256_Update(&ctx, pch, size);
         return (*this);
@@ -6,6 +6,7 @@
 #include "txdb.h"
 #include "walletdb.h"
 #include "bitcoinrpc.h"
+#include "stratum.h"
 #include "net.h"
 #include "init.h"
 #include "util.h"
@@ -87,6 +88,7 @@ bool ShutdownRequested()
 }
 
 static CCoinsViewDB *pcoinsdbview;
+static CCoinsViewAsyncFlush *pcoinsflush;
 
 void Shutdown()
 {
@@ -111,7 +113,10 @@ void Shutdown()
             pblocktree->Flush();
         if (pcoinsTip)
             pcoinsTip->Flush();
+        StopCoinsPrefetch();
         delete pcoinsTip; pcoinsTip = NULL;
+        // Waits for the last snapshot to be written
+        delete pcoinsflush; pcoinsflush = NULL;
         delete pcoinsdbview; pcoinsdbview = NULL;
         delete pblocktree; pblocktree = NULL;
     }
@@ -303,6 +308,7 @@ std::string HelpMessage()
         "  -gen                   " + _("Generate coins (default: 0)") + "\n" +
         "  -datadir=<dir>         " + _("Specify data directory") + "\n" +
         "  -dbcache=<n>           " + _("Set database cache size in megabytes (default: 25)") + "\n" +
+        "  -compresscoinscache    " + _("Keep the coins in the database cache compressed, which fits more of them but makes reading them slower (default: 0)") + "\n" +
         "  -timeout=<n>           " + _("Specify connection timeout in milliseconds (default: 5000)") + "\n" +
         "  -proxy=<ip:port>       " + _("Connect through socks proxy") + "\n" +
         "  -socks=<n>             " + _("Select the version of socks proxy to use (4-5, default: 5)") + "\n" +
@@ -357,6 +363,10 @@ std::string HelpMessage()
         "  -rpcconnect=<ip>       " + _("Send commands to node running on <ip> (default: 127.0.0.1)") + "\n" +
 #endif
         "  -rpcthreads=<n>        " + _("Set the number of threads to service RPC calls (default: 4)") + "\n" +
+        "  -stratum               " + _("Accept stratum mining connections, logged in with -rpcuser and -rpcpassword (default: 0)") + "\n" +
+        "  -stratumport=<port>    " + _("Listen for stratum mining connections on <port> (default: 3333)") + "\n" +
+        "  -stratumaddress=<addr> " + _("Pay blocks mined over stratum to <addr> instead of a wallet key") + "\n" +
+        "  -stratumdifficulty=<n> " + _("Set the stratum share difficulty (default: 16)") + "\n" +
         "  -blocknotify=<cmd>     " + _("Execute command when the best block changes (%s in cmd is replaced by block hash)") + "\n" +
         "  -walletnotify=<cmd>    " + _("Execute command when a wallet transaction changes (%s in cmd is replaced by TxID)") + "\n" +
         "  -spendzeroconfchange   " + _("Spend unconfirmed change when sending transactions (default: 1)") + "\n" +
@@ -370,12 +380,17 @@ std::string HelpMessage()
         "  -txindex               " + _("Maintain a full transaction index (default: 0)") + "\n" +
         "  -loadblock=<file>      " + _("Imports blocks from external blk000??.dat file") + "\n" +
         "  -reindex               " + _("Rebuild block chain index from current blk000??.dat files") + "\n" +
+        "  -assumevalid=<hex>     " + _("Do not check the scripts of this block and its ancestors once it is in the block index (default: none)") + "\n" +
+        "  -assumevalidheight=<n> " + _("Height of the -assumevalid block: blocks below it are not script checked before it arrives, and no other block is accepted at it") + "\n" +
         "  -par=<n>               " + _("Set the number of script verification threads (up to 16, 0 = auto, <0 = leave that many cores free, default: 0)") + "\n" +
+        "  -sigcachemaxmb=<n>     " + _("Limit the signature cache to <n> megabytes (default: 32)") + "\n" +
+        "  -maxscriptcachesize=<n> " + _("Limit the cache of transactions with valid scripts to <n> megabytes (default: 8)") + "\n" +
 
         "\n" + _("Block creation options:") + "\n" +
         "  -blockminsize=<n>      "   + _("Set minimum block size in bytes (default: 0)") + "\n" +
         "  -blockmaxsize=<n>      "   + _("Set maximum block size in bytes (default: 250000)") + "\n" +
         "  -blockprioritysize=<n> "   + _("Set maximum size of high-priority/low-fee transactions in bytes (default: 27000)") + "\n" +
+        "  -maxworkunits=<n>      "   + _("Keep at most <n> getwork units for share submission (default: 10000)") + "\n" +
 
         "\n" + _("SSL options: (see the Coolcash Wiki for SSL setup instructions)") + "\n" +
         "  -rpcssl                                  " + _("Use OpenSSL (https) for JSON-RPC connections") + "\n" +
@@ -557,6 +572,22 @@ bool AppInit2(boost::thread_group& threadGroup)
     fDebug = GetBoolArg("-debug");
     fBenchmark = GetBoolArg("-benchmark");
 
+    if (mapArgs.count("-assumevalid"))
+    {
+        std::string strAssumeValid = mapArgs["-assumevalid"];
+        if (strAssumeValid.size() != 64 || !IsHex(strAssumeValid))
+            return InitError(strprintf(_("Invalid block hash for -assumevalid=<hex>: '%s'"), strAssumeValid.c_str()));
+        hashAssumeValid.SetHex(strAssumeValid);
+        nAssumeValidHeight = GetArg("-assumevalidheight", -1);
+        if (nAssumeValidHeight >= 0)
+            printf("Not checking the scripts of block %s and its ancestors, or of blocks below height %d before it is known\n",
+                   hashAssumeValid.ToString().c_str(), nAssumeValidHeight);
+        else
+            printf("Not checking the scripts of block %s and its ancestors, once it is in the block index\n", hashAssumeValid.ToString().c_str());
+    }
+    else if (mapArgs.count("-assumevalidheight"))
+        return InitError(_("-assumevalidheight requires -assumevalid"));
+
     // -par=0 means autodetect, but nScriptCheckThreads==0 means no concurrency
     nScriptCheckThreads = GetArg("-par", 0);
     if (nScriptCheckThreads <= 0)
@@ -675,6 +706,7 @@ bool AppInit2(boost::thread_group& threadGroup)
 #if defined(USE_SSE2)
     scrypt_detect_sse2();
 #endif
+    scrypt_detect_multiway();
 
     // ********************************************************* Step 5: verify wallet database integrity
 
@@ -863,7 +895,7 @@ bool AppInit2(boost::thread_group& threadGroup)
     nTotalCache -= nBlockTreeDBCache;
     size_t nCoinDBCache = nTotalCache / 2; // use half of the remaining cache for coindb cache
     nTotalCache -= nCoinDBCache;
-    nCoinCacheSize = nTotalCache / 300; // coins in memory require around 300 bytes
+    nCoinCacheUsage = nTotalCache; // the rest is for the in-memory coins cache
 
     bool fLoaded = false;
     while (!fLoaded) {
@@ -877,16 +909,31 @@ bool AppInit2(boost::thread_group& threadGroup)
             try {
                 UnloadBlockIndex();
                 delete pcoinsTip;
+                delete pcoinsflush;
                 delete pcoinsdbview;
                 delete pblocktree;
 
                 pblocktree = new CBlockTreeDB(nBlockTreeDBCache, false, fReindex);
                 pcoinsdbview = new CCoinsViewDB(nCoinDBCache, false, fReindex);
-                pcoinsTip = new CCoinsViewCache(*pcoinsdbview);
+                pcoinsflush = new CCoinsViewAsyncFlush(*pcoinsdbview);
+                pcoinsTip = new CCoinsViewCache(*pcoinsflush);
+                // Fits several times as many coins in -dbcache, but every
+                // coin a block spends is decompressed and compressed again
+                pcoinsTip->SetCompressed(GetBoolArg("-compresscoinscache", false));
 
                 if (fReindex)
                     pblocktree->WriteReindexing(true);
 
+                if (!pcoinsdbview->CheckVersion()) {
+                    strLoadError = _("The chainstate database was written by an incompatible version");
+                    break;
+                }
+
+                if (!pcoinsdbview->Upgrade()) {
+                    strLoadError = _("Error upgrading chainstate database");
+                    break;
+                }
+
                 if (!LoadBlockIndex()) {
                     strLoadError = _("Error loading block database");
                     break;
@@ -1087,6 +1134,7 @@ bool AppInit2(boost::thread_group& threadGroup)
         BOOST_FOREACH(string strFile, mapMultiArgs["-loadblock"])
             vImportFiles.push_back(strFile);
     }
+    threadGroup.create_thread(boost::bind(&ThreadCoinsPrefetch, pcoinsdbview));
     threadGroup.create_thread(boost::bind(&ThreadImport, vImportFiles));
 
     // ********************************************************* Step 10: load peers
@@ -1128,6 +1176,13 @@ bool AppInit2(boost::thread_group& threadGroup)
     if (fServer)
         StartRPCThreads();
 
+    if (GetBoolArg("-stratum", false))
+    {
+        std::string strError;
+        if (!StartStratumServer(threadGroup, strError))
+            return InitError(strError);
+    }
+
     // Generate coins in the background
     if (pwalletMain)
         GenerateBitcoins(GetBoolArg("-gen", false), pwalletMain);
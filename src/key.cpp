@@ -2,11 +2,18 @@
 // Distributed under the MIT/X11 software license, see the accompanying
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
+#include <map>
+
+#include <boost/shared_ptr.hpp>
+#include <boost/thread/locks.hpp>
+#include <boost/thread/shared_mutex.hpp>
+
 #include <openssl/ecdsa.h>
 #include <openssl/rand.h>
 #include <openssl/obj_mac.h>
 
 #include "key.h"
+#include "util.h"
 
 
 // anonymous namespace with local implementation code (OpenSSL interaction)
@@ -256,6 +263,96 @@ public:
     }
 };
 
+// The secp256k1 group shared by all verification keys. It carries a table
+// of precomputed multiples of the generator, which ECDSA_verify uses for
+// the u1*G half of its work; a group made by EC_KEY_new_by_curve_name for
+// every key does not have one.
+class CVerifyGroup {
+public:
+    EC_GROUP *group;
+
+    CVerifyGroup() {
+        group = EC_GROUP_new_by_curve_name(NID_secp256k1);
+        assert(group != NULL);
+        // Without the table verification still works, only slower
+        if (!EC_GROUP_precompute_mult(group, NULL))
+            printf("CVerifyGroup() : EC_GROUP_precompute_mult failed, verifying without precomputation\n");
+    }
+
+    ~CVerifyGroup() {
+        EC_GROUP_free(group);
+    }
+};
+
+// Parse a public key into an EC_KEY that is ready to be shared between
+// threads for verification, or return NULL if it does not decode.
+EC_KEY *NewVerifyKey(const CPubKey &pubkey, const EC_GROUP *group) {
+    EC_KEY *pkey = EC_KEY_new();
+    if (pkey == NULL)
+        return NULL;
+    const unsigned char* pbegin = pubkey.begin();
+    if (!EC_KEY_set_group(pkey, group) || !o2i_ECPublicKey(&pkey, &pbegin, pubkey.size())) {
+        EC_KEY_free(pkey);
+        return NULL;
+    }
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+    // Attach the ECDSA method data now, rather than in the first
+    // ECDSA_verify, which may run on several threads at once
+    ECDSA_get_ex_data(pkey, 0);
+#endif
+    return pkey;
+}
+
+// Public keys that were already parsed for verification. Outputs of the
+// same key are often spent together, and a transaction is checked once when
+// it enters the memory pool and again in its block.
+class CVerifyKeyCache {
+private:
+    static const unsigned int nShards = 16;
+    static const unsigned int nMaxShardSize = 512;
+
+    typedef std::map<CPubKey, boost::shared_ptr<EC_KEY> > map_t;
+
+    struct CShard {
+        boost::shared_mutex cs;
+        map_t mapKeys;
+    };
+
+    CVerifyGroup verifygroup;
+    CShard shards[nShards];
+
+public:
+    boost::shared_ptr<EC_KEY> Get(const CPubKey &pubkey) {
+        // Byte 1 is the start of the x coordinate, so keys spread evenly
+        CShard &shard = shards[pubkey[1] % nShards];
+        {
+            boost::shared_lock<boost::shared_mutex> lock(shard.cs);
+            map_t::const_iterator it = shard.mapKeys.find(pubkey);
+            if (it != shard.mapKeys.end())
+                return it->second;
+        }
+
+        EC_KEY *pkey = NewVerifyKey(pubkey, verifygroup.group);
+        if (pkey == NULL)
+            return boost::shared_ptr<EC_KEY>();
+        boost::shared_ptr<EC_KEY> key(pkey, EC_KEY_free);
+
+        boost::unique_lock<boost::shared_mutex> lock(shard.cs);
+        if (shard.mapKeys.size() >= nMaxShardSize) {
+            // Evict the entry next to the new one, which is as good as random;
+            // threads still using it keep it alive through their shared_ptr
+            map_t::iterator it = shard.mapKeys.lower_bound(pubkey);
+            if (it == shard.mapKeys.end())
+                it = shard.mapKeys.begin();
+            shard.mapKeys.erase(it);
+        }
+        shard.mapKeys.insert(std::make_pair(pubkey, key));
+        return key;
+    }
+};
+
+CVerifyKeyCache verifykeycache;
+
 }; // end of anonymous namespace
 
 bool CKey::Check(const unsigned char *vch) {
@@ -343,10 +440,11 @@ bool CKey::SignCompact(const uint256 &hash, std::vector<unsigned char>& vchSig)
 bool CPubKey::Verify(const uint256 &hash, const std::vector<unsigned char>& vchSig) const {
     if (!IsValid())
         return false;
-    CECKey key;
-    if (!key.SetPubKey(*this))
+    boost::shared_ptr<EC_KEY> pkey = verifykeycache.Get(*this);
+    if (!pkey)
         return false;
-    if (!key.Verify(hash, vchSig))
+    // -1 = error, 0 = bad sig, 1 = good
+    if (ECDSA_verify(0, (unsigned char*)&hash, sizeof(hash), &vchSig[0], vchSig.size(), pkey.get()) != 1)
         return false;
     return true;
 }
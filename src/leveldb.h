@@ -50,6 +50,10 @@ public:
 
         batch.Delete(slKey);
     }
+
+    void Clear() {
+        batch.Clear();
+    }
 };
 
 class CLevelDB
@@ -148,6 +152,11 @@ public:
     leveldb::Iterator *NewIterator() {
         return pdb->NewIterator(iteroptions);
     }
+
+    // iterator for short lookups, which (unlike scans) should fill the block cache
+    leveldb::Iterator *NewLookupIterator() {
+        return pdb->NewIterator(readoptions);
+    }
 };
 
 #endif // BITCOIN_LEVELDB_H
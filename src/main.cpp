@@ -11,6 +11,7 @@
 #include "init.h"
 #include "ui_interface.h"
 #include "checkqueue.h"
+#include "shardedcache.h"
 #include <boost/algorithm/string/replace.hpp>
 #include <boost/filesystem.hpp>
 #include <boost/filesystem/fstream.hpp>
@@ -43,6 +44,8 @@ int nBestHeight = -1;
 uint256 nBestChainWork = 0;
 uint256 nBestInvalidWork = 0;
 uint256 hashBestChain = 0;
+boost::mutex csBestBlock;
+boost::condition_variable cvBlockChange;
 CBlockIndex* pindexBest = NULL;
 set<CBlockIndex*, CBlockIndexWorkComparator> setBlockIndexValid; // may contain all CBlockIndex*'s that have validness >=BLOCK_VALID_TRANSACTIONS, and must contain those who aren't failed
 int64 nTimeBestReceived = 0;
@@ -51,7 +54,12 @@ bool fImporting = false;
 bool fReindex = false;
 bool fBenchmark = false;
 bool fTxIndex = false;
-unsigned int nCoinCacheSize = 5000;
+uint256 hashAssumeValid = 0;
+int nAssumeValidHeight = -1;
+size_t nCoinCacheUsage = 5000 * 300;
+
+/** Script checks of blocks and of transactions entering the memory pool */
+static CCheckQueue<CScriptCheck> scriptcheckqueue(128, MAX_SCRIPTCHECK_THREADS);
 
 /** Fees smaller than this (in satoshi) are considered zero fee (for transaction creation) */
 int64 CTransaction::nMinTxFee = 100000;
@@ -173,58 +181,219 @@ void static ResendWalletTransactions()
 //
 
 bool CCoinsView::GetCoins(const uint256 &txid, CCoins &coins) { return false; }
+bool CCoinsView::GetCoinsBatch(const std::vector<uint256> &vTxid, CCoinsMap &mapCoins) {
+    BOOST_FOREACH(const uint256 &txid, vTxid) {
+        CCoins coins;
+        if (GetCoins(txid, coins))
+            mapCoins[txid].coins.swap(coins);
+    }
+    return true;
+}
 bool CCoinsView::SetCoins(const uint256 &txid, const CCoins &coins) { return false; }
 bool CCoinsView::HaveCoins(const uint256 &txid) { return false; }
 CBlockIndex *CCoinsView::GetBestBlock() { return NULL; }
 bool CCoinsView::SetBestBlock(CBlockIndex *pindex) { return false; }
-bool CCoinsView::BatchWrite(const std::map<uint256, CCoins> &mapCoins, CBlockIndex *pindex) { return false; }
+bool CCoinsView::BatchWrite(CCoinsMap &mapCoins, CBlockIndex *pindex) { return false; }
 bool CCoinsView::GetStats(CCoinsStats &stats) { return false; }
 
 
 CCoinsViewBacked::CCoinsViewBacked(CCoinsView &viewIn) : base(&viewIn) { }
 bool CCoinsViewBacked::GetCoins(const uint256 &txid, CCoins &coins) { return base->GetCoins(txid, coins); }
+bool CCoinsViewBacked::GetCoinsBatch(const std::vector<uint256> &vTxid, CCoinsMap &mapCoins) { return base->GetCoinsBatch(vTxid, mapCoins); }
 bool CCoinsViewBacked::SetCoins(const uint256 &txid, const CCoins &coins) { return base->SetCoins(txid, coins); }
 bool CCoinsViewBacked::HaveCoins(const uint256 &txid) { return base->HaveCoins(txid); }
 CBlockIndex *CCoinsViewBacked::GetBestBlock() { return base->GetBestBlock(); }
 bool CCoinsViewBacked::SetBestBlock(CBlockIndex *pindex) { return base->SetBestBlock(pindex); }
 void CCoinsViewBacked::SetBackend(CCoinsView &viewIn) { base = &viewIn; }
-bool CCoinsViewBacked::BatchWrite(const std::map<uint256, CCoins> &mapCoins, CBlockIndex *pindex) { return base->BatchWrite(mapCoins, pindex); }
+bool CCoinsViewBacked::BatchWrite(CCoinsMap &mapCoins, CBlockIndex *pindex) { return base->BatchWrite(mapCoins, pindex); }
 bool CCoinsViewBacked::GetStats(CCoinsStats &stats) { return base->GetStats(stats); }
 
-CCoinsViewCache::CCoinsViewCache(CCoinsView &baseIn, bool fDummy) : CCoinsViewBacked(baseIn), pindexTip(NULL) { }
+CCoinsKeyHasher::CCoinsKeyHasher() : salt(GetRandHash()) { }
+
+// Uncompressed public keys are kept as they are, as rebuilding them from
+// their compressed form would cost a point decompression on every read
+static const int SER_COINSCACHE = SER_DISK | SER_FASTCOMPRESS;
+
+void CCoinsCacheEntry::GetCoins(CCoins &coinsOut) const {
+    if (!(flags & COMPRESSED)) {
+        coinsOut = coins;
+        return;
+    }
+    CDataStream ss(vchCompressed, SER_COINSCACHE, CLIENT_VERSION);
+    ss >> coinsOut;
+}
+
+void CCoinsCacheEntry::Compress() {
+    if ((flags & COMPRESSED) || coins.IsPruned())
+        return;
+    CDataStream ss(SER_COINSCACHE, CLIENT_VERSION);
+    ss.reserve(::GetSerializeSize(coins, SER_COINSCACHE, CLIENT_VERSION));
+    ss << coins;
+    vchCompressed.assign(ss.begin(), ss.end());
+    CCoins().swap(coins);
+    flags |= COMPRESSED;
+}
+
+void CCoinsCacheEntry::Expand() {
+    if (!(flags & COMPRESSED))
+        return;
+    GetCoins(coins);
+    std::vector<unsigned char>().swap(vchCompressed);
+    flags &= ~COMPRESSED;
+}
+
+void CCoinsCacheEntry::SwapCoins(CCoinsCacheEntry &other) {
+    coins.swap(other.coins);
+    vchCompressed.swap(other.vchCompressed);
+    unsigned char fCompressedOther = other.flags & COMPRESSED;
+    other.flags = (other.flags & ~COMPRESSED) | (flags & COMPRESSED);
+    flags = (flags & ~COMPRESSED) | fCompressedOther;
+}
+
+void CCoinsCacheEntry::SaveBase() {
+    if (flags & (DIRTY | FRESH))
+        return;
+    if (flags & COMPRESSED) {
+        CCoins coinsBase;
+        GetCoins(coinsBase);
+        GetUnspent(coinsBase, vchBaseUnspent);
+    } else {
+        GetUnspent(coins, vchBaseUnspent);
+    }
+}
+
+void CCoinsCacheEntry::GetUnspent(const CCoins &coins, std::vector<unsigned char> &vch) {
+    vch.assign((coins.vout.size() + 7) / 8, 0);
+    for (unsigned int i = 0; i < coins.vout.size(); i++)
+        if (!coins.vout[i].IsNull())
+            vch[i / 8] |= 1 << (i % 8);
+}
+
+CCoinsViewCache::CCoinsViewCache(CCoinsView &baseIn, bool fDummy) : CCoinsViewBacked(baseIn), pindexTip(NULL), cachedCoinsUsage(0), fCompressed(false), fHasModifier(false) { }
+
+CCoinsViewCache::~CCoinsViewCache() {
+    assert(!fHasModifier);
+}
 
 bool CCoinsViewCache::GetCoins(const uint256 &txid, CCoins &coins) {
-    if (cacheCoins.count(txid)) {
-        coins = cacheCoins[txid];
+    CCoinsMap::iterator it = FetchCoins(txid);
+    if (it != cacheCoins.end()) {
+        it->second.GetCoins(coins);
         return true;
     }
-    if (base->GetCoins(txid, coins)) {
-        cacheCoins[txid] = coins;
+    return false;
+}
+
+bool CCoinsViewCache::GetCoinsBatch(const std::vector<uint256> &vTxid, CCoinsMap &mapCoins) {
+    if (!FetchCoinsBatch(vTxid))
+        return false;
+    BOOST_FOREACH(const uint256 &txid, vTxid) {
+        CCoinsMap::const_iterator it = cacheCoins.find(txid);
+        if (it != cacheCoins.end())
+            it->second.GetCoins(mapCoins[txid].coins);
+    }
+    return true;
+}
+
+bool CCoinsViewCache::FetchCoinsBatch(const std::vector<uint256> &vTxid) {
+    std::vector<uint256> vMissing;
+    BOOST_FOREACH(const uint256 &txid, vTxid)
+        if (!cacheCoins.count(txid))
+            vMissing.push_back(txid);
+    if (vMissing.empty())
         return true;
+
+    CCoinsMap mapFetched;
+    if (!base->GetCoinsBatch(vMissing, mapFetched))
+        return false;
+    for (CCoinsMap::iterator it = mapFetched.begin(); it != mapFetched.end(); it++) {
+        CCoinsMap::iterator ret = cacheCoins.insert(std::make_pair(it->first, CCoinsCacheEntry())).first;
+        ret->second.coins.swap(it->second.coins);
+        // As in FetchCoins
+        if (ret->second.coins.IsPruned())
+            ret->second.flags = CCoinsCacheEntry::FRESH;
+        StoreEntry(ret->second);
+        cachedCoinsUsage += ret->second.DynamicMemoryUsage();
     }
-    return false;
+    return true;
 }
 
-std::map<uint256,CCoins>::iterator CCoinsViewCache::FetchCoins(const uint256 &txid) {
-    std::map<uint256,CCoins>::iterator it = cacheCoins.lower_bound(txid);
-    if (it != cacheCoins.end() && it->first == txid)
+CCoinsMap::iterator CCoinsViewCache::FetchCoins(const uint256 &txid) {
+    CCoinsMap::iterator it = cacheCoins.find(txid);
+    if (it != cacheCoins.end())
         return it;
     CCoins tmp;
     if (!base->GetCoins(txid,tmp))
         return cacheCoins.end();
-    std::map<uint256,CCoins>::iterator ret = cacheCoins.insert(it, std::make_pair(txid, CCoins()));
-    tmp.swap(ret->second);
+    CCoinsMap::iterator ret = cacheCoins.insert(std::make_pair(txid, CCoinsCacheEntry())).first;
+    tmp.swap(ret->second.coins);
+    if (ret->second.coins.IsPruned()) {
+        // The base only has an empty entry for this txid; ours can be considered fresh.
+        ret->second.flags = CCoinsCacheEntry::FRESH;
+    }
+    StoreEntry(ret->second);
+    cachedCoinsUsage += ret->second.DynamicMemoryUsage();
     return ret;
 }
 
-CCoins &CCoinsViewCache::GetCoins(const uint256 &txid) {
-    std::map<uint256,CCoins>::iterator it = FetchCoins(txid);
+const CCoins &CCoinsViewCache::GetCoins(const uint256 &txid) {
+    CCoinsMap::iterator it = FetchCoins(txid);
     assert(it != cacheCoins.end());
-    return it->second;
+    if (it->second.flags & CCoinsCacheEntry::COMPRESSED) {
+        // The reference handed out must stay valid, so the entry can't be
+        // compressed again until it is next modified
+        cachedCoinsUsage -= it->second.DynamicMemoryUsage();
+        it->second.Expand();
+        cachedCoinsUsage += it->second.DynamicMemoryUsage();
+    }
+    return it->second.coins;
+}
+
+CCoinsModifier CCoinsViewCache::ModifyCoins(const uint256 &txid) {
+    assert(!fHasModifier);
+    std::pair<CCoinsMap::iterator, bool> ret = cacheCoins.insert(std::make_pair(txid, CCoinsCacheEntry()));
+    if (ret.second) {
+        if (!base->GetCoins(txid, ret.first->second.coins)) {
+            // The base does not have this entry; mark it as fresh.
+            ret.first->second.coins = CCoins();
+            ret.first->second.flags = CCoinsCacheEntry::FRESH;
+        } else if (ret.first->second.coins.IsPruned()) {
+            // The base only has a pruned entry for this; mark it as fresh.
+            ret.first->second.flags = CCoinsCacheEntry::FRESH;
+        }
+    } else {
+        cachedCoinsUsage -= ret.first->second.DynamicMemoryUsage();
+        ret.first->second.Expand();
+    }
+    // Assume that whenever ModifyCoins is called, the entry will be modified.
+    ret.first->second.SaveBase();
+    ret.first->second.flags |= CCoinsCacheEntry::DIRTY;
+    return CCoinsModifier(*this, ret.first);
 }
 
 bool CCoinsViewCache::SetCoins(const uint256 &txid, const CCoins &coins) {
-    cacheCoins[txid] = coins;
+    assert(!fHasModifier);
+    std::pair<CCoinsMap::iterator, bool> ret = cacheCoins.insert(std::make_pair(txid, CCoinsCacheEntry()));
+    if (ret.second) {
+        // As in ModifyCoins, the base has to be known to write the changes
+        if (!base->GetCoins(txid, ret.first->second.coins) || ret.first->second.coins.IsPruned())
+            ret.first->second.flags = CCoinsCacheEntry::FRESH;
+    } else {
+        cachedCoinsUsage -= ret.first->second.DynamicMemoryUsage();
+    }
+    // An entry that was fresh stays so, as the base still has no unspent
+    // version; spending it entirely makes it disappear
+    if ((ret.first->second.flags & CCoinsCacheEntry::FRESH) && coins.IsPruned()) {
+        cacheCoins.erase(ret.first);
+        return true;
+    }
+    ret.first->second.SaveBase();
+    CCoinsCacheEntry entry;
+    entry.coins = coins;
+    ret.first->second.SwapCoins(entry);
+    ret.first->second.flags |= CCoinsCacheEntry::DIRTY;
+    StoreEntry(ret.first->second);
+    cachedCoinsUsage += ret.first->second.DynamicMemoryUsage();
     return true;
 }
 
@@ -243,17 +412,51 @@ bool CCoinsViewCache::SetBestBlock(CBlockIndex *pindex) {
     return true;
 }
 
-bool CCoinsViewCache::BatchWrite(const std::map<uint256, CCoins> &mapCoins, CBlockIndex *pindex) {
-    for (std::map<uint256, CCoins>::const_iterator it = mapCoins.begin(); it != mapCoins.end(); it++)
-        cacheCoins[it->first] = it->second;
+bool CCoinsViewCache::BatchWrite(CCoinsMap &mapCoins, CBlockIndex *pindex) {
+    assert(!fHasModifier);
+    for (CCoinsMap::iterator it = mapCoins.begin(); it != mapCoins.end(); it++) {
+        if (!(it->second.flags & CCoinsCacheEntry::DIRTY))
+            continue; // Ignore non-dirty entries (optimization).
+        CCoinsMap::iterator itUs = cacheCoins.find(it->first);
+        if (itUs == cacheCoins.end()) {
+            // A fresh entry that was spent again never has to reach the base
+            if ((it->second.flags & CCoinsCacheEntry::FRESH) && it->second.IsPruned())
+                continue;
+            CCoinsCacheEntry &entry = cacheCoins[it->first];
+            // It can only be fresh here if it was fresh in the child, as
+            // it may just have been flushed from this cache otherwise
+            entry.flags = CCoinsCacheEntry::DIRTY | (it->second.flags & CCoinsCacheEntry::FRESH);
+            entry.SwapCoins(it->second);
+            // What the child took for its base is what was flushed from here
+            entry.vchBaseUnspent.swap(it->second.vchBaseUnspent);
+            StoreEntry(entry);
+            cachedCoinsUsage += entry.DynamicMemoryUsage();
+        } else {
+            cachedCoinsUsage -= itUs->second.DynamicMemoryUsage();
+            if ((itUs->second.flags & CCoinsCacheEntry::FRESH) && it->second.IsPruned()) {
+                // The base doesn't have this entry, and it is spent now, so
+                // it can be forgotten altogether
+                cacheCoins.erase(itUs);
+            } else {
+                itUs->second.SaveBase();
+                itUs->second.SwapCoins(it->second);
+                StoreEntry(itUs->second);
+                cachedCoinsUsage += itUs->second.DynamicMemoryUsage();
+                itUs->second.flags |= CCoinsCacheEntry::DIRTY;
+            }
+        }
+    }
     pindexTip = pindex;
     return true;
 }
 
 bool CCoinsViewCache::Flush() {
+    assert(!fHasModifier);
     bool fOk = base->BatchWrite(cacheCoins, pindexTip);
-    if (fOk)
+    if (fOk) {
         cacheCoins.clear();
+        cachedCoinsUsage = 0;
+    }
     return fOk;
 }
 
@@ -261,6 +464,45 @@ unsigned int CCoinsViewCache::GetCacheSize() {
     return cacheCoins.size();
 }
 
+size_t CCoinsViewCache::DynamicMemoryUsage() const {
+    return memusage::DynamicUsage(cacheCoins) + cachedCoinsUsage;
+}
+
+void CCoinsViewCache::SetCompressed(bool fCompressedIn) {
+    assert(!fHasModifier);
+    fCompressed = fCompressedIn;
+    for (CCoinsMap::iterator it = cacheCoins.begin(); it != cacheCoins.end(); it++) {
+        cachedCoinsUsage -= it->second.DynamicMemoryUsage();
+        StoreEntry(it->second);
+        cachedCoinsUsage += it->second.DynamicMemoryUsage();
+    }
+}
+
+void CCoinsViewCache::StoreEntry(CCoinsCacheEntry &entry) {
+    if (fCompressed)
+        entry.Compress();
+    else
+        entry.Expand();
+}
+
+CCoinsModifier::CCoinsModifier(CCoinsViewCache &cacheIn, CCoinsMap::iterator itIn) : cache(cacheIn), it(itIn) {
+    assert(!cache.fHasModifier);
+    cache.fHasModifier = true;
+}
+
+CCoinsModifier::~CCoinsModifier() {
+    assert(cache.fHasModifier);
+    cache.fHasModifier = false;
+    it->second.coins.Cleanup();
+    if ((it->second.flags & CCoinsCacheEntry::FRESH) && it->second.coins.IsPruned()) {
+        cache.cacheCoins.erase(it);
+    } else {
+        // If the coin still exists after the modification, account for its new usage
+        cache.StoreEntry(it->second);
+        cache.cachedCoinsUsage += it->second.DynamicMemoryUsage();
+    }
+}
+
 /** CCoinsView that brings transactions from a memorypool into view.
     It does not check for spendings by memory pool transactions. */
 CCoinsViewMemPool::CCoinsViewMemPool(CCoinsView &baseIn, CTxMemPool &mempoolIn) : CCoinsViewBacked(baseIn), mempool(mempoolIn) { }
@@ -276,10 +518,157 @@ bool CCoinsViewMemPool::GetCoins(const uint256 &txid, CCoins &coins) {
     return false;
 }
 
+bool CCoinsViewMemPool::GetCoinsBatch(const std::vector<uint256> &vTxid, CCoinsMap &mapCoins) {
+    if (!base->GetCoinsBatch(vTxid, mapCoins))
+        return false;
+    BOOST_FOREACH(const uint256 &txid, vTxid) {
+        if (!mapCoins.count(txid) && mempool.exists(txid)) {
+            const CTransaction &tx = mempool.lookup(txid);
+            mapCoins[txid].coins = CCoins(tx, MEMPOOL_HEIGHT);
+        }
+    }
+    return true;
+}
+
 bool CCoinsViewMemPool::HaveCoins(const uint256 &txid) {
     return mempool.exists(txid) || base->HaveCoins(txid);
 }
 
+CCoinsViewAsyncFlush::CCoinsViewAsyncFlush(CCoinsView &baseIn) : CCoinsViewBacked(baseIn), pindexFrozen(NULL), fPending(false), fFailed(false), fStop(false) {
+    thread = boost::thread(boost::bind(&CCoinsViewAsyncFlush::Thread, this));
+}
+
+CCoinsViewAsyncFlush::~CCoinsViewAsyncFlush() {
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        fStop = true;
+        cond.notify_all();
+    }
+    // A snapshot still pending is written first
+    thread.join();
+}
+
+void CCoinsViewAsyncFlush::Thread() {
+    RenameThread("bitcoin-flush");
+    boost::unique_lock<boost::mutex> lock(mutex);
+    while (true) {
+        while (!fPending && !fStop)
+            cond.wait(lock);
+        if (!fPending)
+            return;
+
+        // Readers only look up entries in the snapshot, which is left alone
+        // until the base has it
+        lock.unlock();
+        bool fOk = false;
+        {
+            CValidationTimer timer(VALIDATION_FLUSH_WRITE);
+            try {
+                fOk = base->BatchWrite(mapFrozen, pindexFrozen);
+            } catch (std::exception &e) {
+                printf("CCoinsViewAsyncFlush::Thread() : %s\n", e.what());
+            }
+        }
+        if (!fOk)
+            AbortNode(_("Failed to write to coin database"));
+        lock.lock();
+
+        // After a failure the snapshot is kept, so that reads still see it
+        if (fOk)
+            mapFrozen.clear();
+        else
+            fFailed = true;
+        fPending = false;
+        cond.notify_all();
+    }
+}
+
+bool CCoinsViewAsyncFlush::GetCoins(const uint256 &txid, CCoins &coins) {
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        CCoinsMap::const_iterator it = mapFrozen.find(txid);
+        if (it != mapFrozen.end()) {
+            it->second.GetCoins(coins);
+            return true;
+        }
+    }
+    // Entries missing from the snapshot aren't changed by writing it
+    return base->GetCoins(txid, coins);
+}
+
+bool CCoinsViewAsyncFlush::GetCoinsBatch(const std::vector<uint256> &vTxid, CCoinsMap &mapCoins) {
+    std::vector<uint256> vMissing;
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        BOOST_FOREACH(const uint256 &txid, vTxid) {
+            CCoinsMap::const_iterator it = mapFrozen.find(txid);
+            if (it != mapFrozen.end())
+                it->second.GetCoins(mapCoins[txid].coins);
+            else
+                vMissing.push_back(txid);
+        }
+    }
+    return vMissing.empty() || base->GetCoinsBatch(vMissing, mapCoins);
+}
+
+bool CCoinsViewAsyncFlush::SetCoins(const uint256 &txid, const CCoins &coins) {
+    if (!Sync())
+        return false;
+    return base->SetCoins(txid, coins);
+}
+
+bool CCoinsViewAsyncFlush::HaveCoins(const uint256 &txid) {
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        if (mapFrozen.count(txid))
+            return true;
+    }
+    return base->HaveCoins(txid);
+}
+
+CBlockIndex *CCoinsViewAsyncFlush::GetBestBlock() {
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        if (fPending || fFailed)
+            return pindexFrozen;
+    }
+    return base->GetBestBlock();
+}
+
+bool CCoinsViewAsyncFlush::SetBestBlock(CBlockIndex *pindex) {
+    if (!Sync())
+        return false;
+    return base->SetBestBlock(pindex);
+}
+
+bool CCoinsViewAsyncFlush::BatchWrite(CCoinsMap &mapCoins, CBlockIndex *pindex) {
+    boost::unique_lock<boost::mutex> lock(mutex);
+    while (fPending)
+        cond.wait(lock);
+    if (fFailed)
+        return false;
+    // The caller's map comes back empty, so this is no copy
+    mapFrozen.swap(mapCoins);
+    mapCoins.clear();
+    pindexFrozen = pindex;
+    fPending = true;
+    cond.notify_all();
+    return true;
+}
+
+bool CCoinsViewAsyncFlush::GetStats(CCoinsStats &stats) {
+    if (!Sync())
+        return false;
+    return base->GetStats(stats);
+}
+
+bool CCoinsViewAsyncFlush::Sync() {
+    boost::unique_lock<boost::mutex> lock(mutex);
+    while (fPending)
+        cond.wait(lock);
+    return !fFailed;
+}
+
 CCoinsViewCache *pcoinsTip = NULL;
 CBlockTreeDB *pblocktree = NULL;
 
@@ -656,8 +1045,10 @@ void CTxMemPool::pruneSpent(const uint256 &hashTx, CCoins &coins)
     }
 }
 
+static void CacheScriptExecution(const uint256& hashTx, unsigned int flags);
+
 bool CTxMemPool::accept(CValidationState &state, CTransaction &tx, bool fCheckInputs, bool fLimitFree,
-                        bool* pfMissingInputs, bool fRejectInsaneFee)
+                        bool* pfMissingInputs, bool fRejectInsaneFee, bool fReleaseMain)
 {
     if (pfMissingInputs)
         *pfMissingInputs = false;
@@ -799,10 +1190,57 @@ bool CTxMemPool::accept(CValidationState &state, CTransaction &tx, bool fCheckIn
 
         // Check against previous transactions
         // This is done last to help prevent CPU exhaustion denial-of-service attacks.
-        if (!tx.CheckInputs(state, view, true, SCRIPT_VERIFY_P2SH | SCRIPT_VERIFY_STRICTENC))
+        // The scripts of transactions with several inputs are run on the
+        // script check threads, behind any block that is being connected.
+        const unsigned int flags = SCRIPT_VERIFY_P2SH | SCRIPT_VERIFY_STRICTENC;
+        std::vector<CScriptCheck> vChecks;
+        bool fParallel = nScriptCheckThreads && tx.vin.size() > 1;
+        if (!tx.CheckInputs(state, view, true, flags, fParallel ? &vChecks : NULL))
         {
             return error("CTxMemPool::accept() : ConnectInputs failed %s", hash.ToString().c_str());
         }
+
+        if (!vChecks.empty())
+        {
+            CBlockIndex *pindexPrev = view.GetBestBlock();
+            bool fScriptsOk;
+            {
+                // view holds copies of all inputs, so the checks don't need cs_main
+                REVERSE_LOCK_IF(cs_main, fReleaseMain);
+                CCheckQueueControl<CScriptCheck> control(&scriptcheckqueue, CHECKQUEUE_PRIORITY_MEMPOOL);
+                control.Add(vChecks);
+                fScriptsOk = control.Wait();
+            }
+
+            // Run the checks again one by one to find out whether the failure
+            // is one to punish the sender for
+            if (!fScriptsOk)
+            {
+                tx.CheckInputs(state, view, true, flags);
+                if (state.IsValid())
+                    state.Invalid();
+                return error("CTxMemPool::accept() : ConnectInputs failed %s", hash.ToString().c_str());
+            }
+            CacheScriptExecution(hash, flags);
+
+            if (fReleaseMain)
+            {
+                // The chain and the pool may have changed while cs_main was released
+                LOCK(cs);
+                if (mapTx.count(hash))
+                    return false;
+                BOOST_FOREACH(const CTxIn& txin, tx.vin)
+                    if (mapNextTx.count(txin.prevout))
+                        return state.Invalid(error("CTxMemPool::accept() : inputs spent while checking scripts %s", hash.ToString().c_str()));
+                if (pcoinsTip->GetBestBlock() != pindexPrev)
+                {
+                    CCoinsViewMemPool viewMemPool(*pcoinsTip, *this);
+                    CCoinsViewCache viewNew(viewMemPool);
+                    if (!tx.CheckInputs(state, viewNew, false, flags))
+                        return error("CTxMemPool::accept() : inputs changed %s", hash.ToString().c_str());
+                }
+            }
+        }
     }
 
     // Store transaction in memory
@@ -825,10 +1263,10 @@ bool CTxMemPool::accept(CValidationState &state, CTransaction &tx, bool fCheckIn
     return true;
 }
 
-bool CTransaction::AcceptToMemoryPool(CValidationState &state, bool fCheckInputs, bool fLimitFree, bool* pfMissingInputs, bool fRejectInsaneFee)
+bool CTransaction::AcceptToMemoryPool(CValidationState &state, bool fCheckInputs, bool fLimitFree, bool* pfMissingInputs, bool fRejectInsaneFee, bool fReleaseMain)
 {
     try {
-        return mempool.accept(state, *this, fCheckInputs, fLimitFree, pfMissingInputs, fRejectInsaneFee);
+        return mempool.accept(state, *this, fCheckInputs, fLimitFree, pfMissingInputs, fRejectInsaneFee, fReleaseMain);
     } catch(std::runtime_error &e) {
         return state.Abort(_("System error: ") + e.what());
     }
@@ -1069,12 +1507,18 @@ CBlockIndex* FindBlockByHeight(int nHeight)
     return pblockindex;
 }
 
-bool CBlock::ReadFromDisk(const CBlockIndex* pindex)
+bool CBlock::ReadFromDisk(const CBlockIndex* pindex, bool fCheckPOW)
 {
-    if (!ReadFromDisk(pindex->GetBlockPos()))
+    if (!ReadFromDisk(pindex->GetBlockPos(), false))
         return false;
     if (GetHash() != pindex->GetBlockHash())
         return error("CBlock::ReadFromDisk() : GetHash() doesn't match index");
+    // The header matches the index, so a proof-of-work hash stored there
+    // saves running scrypt again here and in CheckBlock
+    if (pindex->hashPoW != 0)
+        SetPoWHash(pindex->hashPoW);
+    if (fCheckPOW && !CheckProofOfWork(GetPoWHash(), nBits))
+        return error("CBlock::ReadFromDisk() : errors in block header");
     return true;
 }
 
@@ -1213,6 +1657,53 @@ bool CheckProofOfWork(uint256 hash, unsigned int nBits)
     return true;
 }
 
+// Hash the headers in [nBegin, nEnd) of *pvHeaders into *pvHash
+void static ThreadPoWHash(const std::vector<CBlockHeader>* pvHeaders, std::vector<uint256>* pvHash, unsigned int nBegin, unsigned int nEnd)
+{
+    std::vector<char> vInput(80 * (nEnd - nBegin));
+    for (unsigned int i = nBegin; i < nEnd; i++)
+        memcpy(&vInput[80 * (i - nBegin)], BEGIN((*pvHeaders)[i].nVersion), 80);
+    scrypt_1024_1_1_256_batch(&vInput[0], BEGIN((*pvHash)[nBegin]), nEnd - nBegin);
+}
+
+bool CheckProofOfWorkBatch(const std::vector<CBlockHeader>& vHeaders, std::vector<bool>& vfValid, std::vector<uint256>* pvPoWHash)
+{
+    vfValid.assign(vHeaders.size(), false);
+    if (vHeaders.empty())
+        return true;
+
+    // Give every thread a whole number of multi-lane passes
+    const unsigned int nWays = scrypt_batch_ways();
+    unsigned int nThreads = std::max(1u, boost::thread::hardware_concurrency());
+    unsigned int nPerThread = (vHeaders.size() + nThreads - 1) / nThreads;
+    nPerThread = (nPerThread + nWays - 1) / nWays * nWays;
+
+    std::vector<uint256> vHash(vHeaders.size());
+    if (nPerThread >= vHeaders.size())
+        ThreadPoWHash(&vHeaders, &vHash, 0, vHeaders.size());
+    else
+    {
+        // The threads write into vHash, so they must be waited for even when
+        // this thread is interrupted
+        boost::this_thread::disable_interruption di;
+        boost::thread_group threadGroup;
+        for (unsigned int nBegin = 0; nBegin < vHeaders.size(); nBegin += nPerThread)
+            threadGroup.create_thread(boost::bind(&ThreadPoWHash, &vHeaders, &vHash, nBegin,
+                                                  std::min(nBegin + nPerThread, (unsigned int)vHeaders.size())));
+        threadGroup.join_all();
+    }
+
+    bool fAllValid = true;
+    for (unsigned int i = 0; i < vHeaders.size(); i++)
+    {
+        vfValid[i] = CheckProofOfWork(vHash[i], vHeaders[i].nBits);
+        fAllValid &= vfValid[i];
+    }
+    if (pvPoWHash)
+        pvPoWHash->swap(vHash);
+    return fAllValid;
+}
+
 // Return maximum amount of blocks that other nodes claim to have
 int GetNumBlocksOfPeers()
 {
@@ -1365,16 +1856,16 @@ void CTransaction::UpdateCoins(CValidationState &state, CCoinsViewCache &inputs,
     // mark inputs spent
     if (!IsCoinBase()) {
         BOOST_FOREACH(const CTxIn &txin, vin) {
-            CCoins &coins = inputs.GetCoins(txin.prevout.hash);
+            CCoinsModifier coins = inputs.ModifyCoins(txin.prevout.hash);
             CTxInUndo undo;
-            ret = coins.Spend(txin.prevout, undo);
+            ret = coins->Spend(txin.prevout, undo);
             assert(ret);
             txundo.vprevout.push_back(undo);
         }
     }
 
     // add outputs
-    assert(inputs.SetCoins(txhash, CCoins(*this, nHeight)));
+    *inputs.ModifyCoins(txhash) = CCoins(*this, nHeight);
 }
 
 bool CTransaction::HaveInputs(CCoinsViewCache &inputs) const
@@ -1400,7 +1891,7 @@ bool CTransaction::HaveInputs(CCoinsViewCache &inputs) const
 
 bool CScriptCheck::operator()() const {
     const CScript &scriptSig = ptxTo->vin[nIn].scriptSig;
-    if (!VerifyScript(scriptSig, scriptPubKey, *ptxTo, nIn, nFlags, nHashType))
+    if (!VerifyScript(scriptSig, scriptPubKey, *ptxTo, nIn, nFlags, nHashType, psighash.get()))
         return error("CScriptCheck() : %s VerifySignature failed", ptxTo->GetHash().ToString().c_str());
     return true;
 }
@@ -1410,6 +1901,70 @@ bool VerifySignature(const CCoins& txFrom, const CTransaction& txTo, unsigned in
     return CScriptCheck(txFrom, txTo, nIn, flags, nHashType)();
 }
 
+// Transactions whose scripts all passed, and under which flags.  A transaction
+// id commits to the outputs it spends, so once its scripts passed in the memory
+// pool they need not run again when it shows up in a block.  Entries are salted
+// digests of the txid in a CShardedCache, like the signature cache's.
+class CScriptExecutionCache
+{
+private:
+    struct CEntry
+    {
+        uint256 hash;
+        unsigned int nFlags;
+
+        CEntry() : nFlags(0) { }
+    };
+
+    CShardedCache<CEntry, 16> cache;
+
+    uint256 GetEntryHash(const uint256& hashTx) const
+    {
+        const uint256& salt = cache.GetSalt();
+        uint256 entry;
+        SHA256_CTX ctx;
+        SHA256_Init(&ctx);
+        SHA256_Update(&ctx, salt.begin(), salt.size());
+        SHA256_Update(&ctx, hashTx.begin(), hashTx.size());
+        SHA256_Final((unsigned char*)&entry, &ctx);
+        return entry;
+    }
+
+public:
+    // -maxscriptcachesize is in megabytes; 0 turns the cache off
+    CScriptExecutionCache() : cache(std::max((int64)0, GetArg("-maxscriptcachesize", 8)) * 1024 * 1024) { }
+
+    // Every verification flag asked for must have been checked
+    bool Get(const uint256& hashTx, unsigned int flags)
+    {
+        CEntry entry;
+        if (!cache.Get(GetEntryHash(hashTx), entry))
+            return false;
+        flags &= ~SCRIPT_VERIFY_NOCACHE;
+        return (flags & ~entry.nFlags) == 0;
+    }
+
+    void Set(const uint256& hashTx, unsigned int flags)
+    {
+        CEntry entry;
+        entry.hash = GetEntryHash(hashTx);
+        entry.nFlags = flags;
+        cache.Set(entry);
+    }
+};
+
+static CScriptExecutionCache& ScriptExecutionCache()
+{
+    // Constructed on first use, after the arguments have been parsed
+    static CScriptExecutionCache cache;
+    return cache;
+}
+
+static void CacheScriptExecution(const uint256& hashTx, unsigned int flags)
+{
+    ScriptExecutionCache().Set(hashTx, flags);
+}
+
 bool CTransaction::CheckInputs(CValidationState &state, CCoinsViewCache &inputs, bool fScriptChecks, unsigned int flags, std::vector<CScriptCheck> *pvChecks) const
 {
     if (!IsCoinBase())
@@ -1463,13 +2018,28 @@ bool CTransaction::CheckInputs(CValidationState &state, CCoinsViewCache &inputs,
         // Skip ECDSA signature verification when connecting blocks
         // before the last block chain checkpoint. This is safe because block merkle hashes are
         // still computed and checked, and any change will be caught at the next checkpoint.
+        // Scripts that already passed under these flags (typically when the
+        // transaction entered the memory pool) need not run again.
+        uint256 hash;
         if (fScriptChecks) {
+            hash = GetHash();
+            if (ScriptExecutionCache().Get(hash, flags))
+                fScriptChecks = false;
+        }
+
+        if (fScriptChecks) {
+            // What the signature hashes of all inputs have in common is
+            // hashed once, and shared by their checks
+            boost::shared_ptr<const CSignatureHashContext> psighash;
+            if (vin.size() > 1)
+                psighash.reset(new CSignatureHashContext(*this));
+
             for (unsigned int i = 0; i < vin.size(); i++) {
                 const COutPoint &prevout = vin[i].prevout;
                 const CCoins &coins = inputs.GetCoins(prevout.hash);
 
                 // Verify signature
-                CScriptCheck check(coins, *this, i, flags, 0);
+                CScriptCheck check(coins, *this, i, flags, 0, psighash);
                 if (pvChecks) {
                     pvChecks->push_back(CScriptCheck());
                     check.swap(pvChecks->back());
@@ -1484,6 +2054,10 @@ bool CTransaction::CheckInputs(CValidationState &state, CCoinsViewCache &inputs,
                     return state.DoS(100,false);
                 }
             }
+
+            // Deferred checks have not run yet; only remember checks that did
+            if (!pvChecks && !(flags & SCRIPT_VERIFY_NOCACHE))
+                CacheScriptExecution(hash, flags);
         }
     }
 
@@ -1518,23 +2092,24 @@ bool CBlock::DisconnectBlock(CValidationState &state, CBlockIndex *pindex, CCoin
         uint256 hash = tx.GetHash();
 
         // check that all outputs are available
-        if (!view.HaveCoins(hash)) {
+        if (!view.HaveCoins(hash))
             fClean = fClean && error("DisconnectBlock() : outputs still spent? database corrupted");
-            view.SetCoins(hash, CCoins());
+        {
+            // the modifier must be gone before the inputs are restored below
+            CCoinsModifier outs = view.ModifyCoins(hash);
+
+            CCoins outsBlock = CCoins(tx, pindex->nHeight);
+            // The CCoins serialization does not serialize negative numbers.
+            // No network rules currently depend on the version here, so an inconsistency is harmless
+            // but it must be corrected before txout nversion ever influences a network rule.
+            if (outsBlock.nVersion < 0)
+                outs->nVersion = outsBlock.nVersion;
+            if (*outs != outsBlock)
+                fClean = fClean && error("DisconnectBlock() : added transaction mismatch? database corrupted");
+
+            // remove outputs
+            *outs = CCoins();
         }
-        CCoins &outs = view.GetCoins(hash);
-
-        CCoins outsBlock = CCoins(tx, pindex->nHeight);
-        // The CCoins serialization does not serialize negative numbers.
-        // No network rules currently depend on the version here, so an inconsistency is harmless
-        // but it must be corrected before txout nversion ever influences a network rule.
-        if (outsBlock.nVersion < 0)
-            outs.nVersion = outsBlock.nVersion;
-        if (outs != outsBlock)
-            fClean = fClean && error("DisconnectBlock() : added transaction mismatch? database corrupted");
-
-        // remove outputs
-        outs = CCoins();
 
         // restore inputs
         if (i > 0) { // not coinbases
@@ -1605,15 +2180,235 @@ void static FlushBlockFile(bool fFinalize = false)
 
 bool FindUndoPos(CValidationState &state, int nFile, CDiskBlockPos &pos, unsigned int nAddSize);
 
-static CCheckQueue<CScriptCheck> scriptcheckqueue(128);
-
 void ThreadScriptCheck() {
     RenameThread("bitcoin-scriptch");
     scriptcheckqueue.Thread();
 }
 
+static CCoinsPrefetcher coinsprefetcher;
+
+void ThreadCoinsPrefetch(CCoinsView* pviewDB) {
+    RenameThread("bitcoin-prefetch");
+    coinsprefetcher.Thread(pviewDB);
+}
+
+void StopCoinsPrefetch() {
+    coinsprefetcher.Stop();
+}
+
+static const char* pszValidationPhases[VALIDATION_PHASES] = {
+    "processblock",
+    "checkblock",
+    "acceptblock",
+    "connectblock",
+    "connectblock.fetch",
+    "connectblock.inputs",
+    "connectblock.dispatch",
+    "connectblock.wait",
+    "connectblock.undo",
+    "setbestchain",
+    "flush",
+    "flush.write",
+};
+
+static boost::mutex csValidationStats;
+static CValidationPhaseStats validationStats[VALIDATION_PHASES];
+
+void RecordValidationTime(int nPhase, int64 nMicros) {
+    assert(nPhase >= 0 && nPhase < VALIDATION_PHASES);
+    nMicros = std::max(nMicros, (int64)0);
+    int nBucket = 0;
+    while (nBucket < CValidationPhaseStats::nBuckets - 1 && nMicros >= ((int64)1 << nBucket))
+        nBucket++;
+
+    boost::unique_lock<boost::mutex> lock(csValidationStats);
+    CValidationPhaseStats &stats = validationStats[nPhase];
+    stats.nCount++;
+    stats.nTotalMicros += nMicros;
+    stats.nMaxMicros = std::max(stats.nMaxMicros, nMicros);
+    stats.vBuckets[nBucket]++;
+}
+
+void GetValidationStats(std::vector<CValidationPhaseStats> &vStats, bool fReset) {
+    boost::unique_lock<boost::mutex> lock(csValidationStats);
+    vStats.assign(validationStats, validationStats + VALIDATION_PHASES);
+    for (int i = 0; i < VALIDATION_PHASES; i++) {
+        vStats[i].strName = pszValidationPhases[i];
+        if (fReset) {
+            validationStats[i].nCount = 0;
+            validationStats[i].nTotalMicros = 0;
+            validationStats[i].nMaxMicros = 0;
+            memset(validationStats[i].vBuckets, 0, sizeof(validationStats[i].vBuckets));
+        }
+    }
+}
+
+// Find the txids whose outputs the inputs of block spend, other than the
+// ones created in the block itself, without duplicates
+static void GetBlockInputTxids(const CBlock &block, vector<uint256> &vTxid) {
+    set<uint256> setCreated;
+    vTxid.clear();
+    BOOST_FOREACH(const CTransaction &tx, block.vtx) {
+        if (!tx.IsCoinBase()) {
+            BOOST_FOREACH(const CTxIn &txin, tx.vin) {
+                if (!setCreated.count(txin.prevout.hash))
+                    vTxid.push_back(txin.prevout.hash);
+            }
+        }
+        setCreated.insert(tx.GetHash());
+    }
+    // Sorted only to drop the duplicates; CCoinsViewDB::GetCoinsBatch puts
+    // them in database key order itself
+    sort(vTxid.begin(), vTxid.end());
+    vTxid.erase(unique(vTxid.begin(), vTxid.end()), vTxid.end());
+}
+
+void CCoinsPrefetcher::Add(const CBlock &block) {
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        if (!fActive)
+            return;
+    }
+
+    vector<uint256> vTxid;
+    GetBlockInputTxids(block, vTxid);
+    if (vTxid.empty())
+        return;
+
+    boost::unique_lock<boost::mutex> lock(mutex);
+    if (queue.size() >= nMaxQueued)
+        queue.pop_front();
+    queue.push_back(vector<uint256>());
+    queue.back().swap(vTxid);
+    cond.notify_one();
+}
+
+void CCoinsPrefetcher::Thread(CCoinsView *pviewIn) {
+    {
+        boost::unique_lock<boost::mutex> lock(csView);
+        pview = pviewIn;
+    }
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        fActive = true;
+    }
+    condDone.notify_all();
+
+    vector<uint256> vTxid;
+    while (true) {
+        {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            while (queue.empty())
+                cond.wait(lock);
+            vTxid.swap(queue.front());
+            queue.pop_front();
+        }
+
+        boost::unique_lock<boost::mutex> lock(csView);
+        if (pview == NULL)
+            return;
+        boost::this_thread::interruption_point();
+        // Only the reading matters; ConnectBlock fetches the coins again
+        CCoinsMap mapCoins;
+        try {
+            pview->GetCoinsBatch(vTxid, mapCoins);
+        } catch (std::exception &e) {
+            // A real read failure will show up when the block is connected
+        }
+        vTxid.clear();
+
+        {
+            boost::unique_lock<boost::mutex> lockDone(mutex);
+            nBatches++;
+        }
+        condDone.notify_all();
+    }
+}
+
+void CCoinsPrefetcher::Stop() {
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        fActive = false;
+        queue.clear();
+    }
+    boost::unique_lock<boost::mutex> lock(csView);
+    pview = NULL;
+}
+
+bool CCoinsPrefetcher::WaitActive(int64 nTimeoutMillis) {
+    boost::system_time timeEnd = boost::get_system_time() + boost::posix_time::milliseconds(nTimeoutMillis);
+    boost::unique_lock<boost::mutex> lock(mutex);
+    while (!fActive)
+        if (!condDone.timed_wait(lock, timeEnd))
+            return fActive;
+    return true;
+}
+
+bool CCoinsPrefetcher::WaitBatches(unsigned int nMinBatches, int64 nTimeoutMillis) {
+    boost::system_time timeEnd = boost::get_system_time() + boost::posix_time::milliseconds(nTimeoutMillis);
+    boost::unique_lock<boost::mutex> lock(mutex);
+    while (nBatches < nMinBatches)
+        if (!condDone.timed_wait(lock, timeEnd))
+            return nBatches >= nMinBatches;
+    return true;
+}
+
+// Whether the scripts of a block may be taken for valid because of
+// -assumevalid: only if it is the -assumevalid block or one of its
+// ancestors. Until the block is known, that can't be told, so only
+// blocks below -assumevalidheight are taken for valid; AcceptBlock
+// admits no other block at that height, so a chain made of them has to
+// run through the -assumevalid block to grow past it.
+bool IsAssumedValid(const CBlockIndex* pindex)
+{
+    const CBlockIndex* pindexFound = NULL;
+    if (hashAssumeValid != 0) {
+        map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashAssumeValid);
+        if (mi != mapBlockIndex.end())
+            pindexFound = (*mi).second;
+    }
+
+    // The block and its ancestors by height, found once.  Keyed on the hash
+    // too, as an index entry at a reused address may be another block.
+    static uint256 hashCached = 0;
+    static const CBlockIndex* pindexAssumeValid = NULL;
+    static vector<const CBlockIndex*> vAncestors;
+    if (pindexAssumeValid != pindexFound || hashCached != hashAssumeValid) {
+        hashCached = hashAssumeValid;
+        pindexAssumeValid = pindexFound;
+        vAncestors.clear();
+        if (pindexFound) {
+            vAncestors.resize(pindexFound->nHeight + 1, NULL);
+            for (const CBlockIndex* pindexWalk = pindexFound; pindexWalk; pindexWalk = pindexWalk->pprev)
+                vAncestors[pindexWalk->nHeight] = pindexWalk;
+        }
+    }
+    if (pindexAssumeValid == NULL)
+        return hashAssumeValid != 0 && pindex->nHeight < nAssumeValidHeight;
+    return pindex->nHeight < (int)vAncestors.size() && vAncestors[pindex->nHeight] == pindex;
+}
+
+// Once the initial download is done, warn if the best chain doesn't contain
+// the -assumevalid block, which then didn't save any script checks and is
+// probably mistyped or on a fork
+static void CheckAssumeValid()
+{
+    static bool fChecked = false;
+    if (fChecked || hashAssumeValid == 0 || IsInitialBlockDownload())
+        return;
+    fChecked = true;
+
+    map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashAssumeValid);
+    if (mi != mapBlockIndex.end() && ((*mi).second == pindexBest || (*mi).second->pnext != NULL))
+        return;
+    printf("WARNING: -assumevalid block %s is not in the best chain\n", hashAssumeValid.ToString().c_str());
+    strMiscWarning = _("Warning: The -assumevalid block is not in the best chain; check the -assumevalid setting.");
+}
+
 bool CBlock::ConnectBlock(CValidationState &state, CBlockIndex* pindex, CCoinsViewCache &view, bool fJustCheck)
 {
+    int64 nConnectStart = GetTimeMicros();
+
     // Check it again in case a previous version let a bad block in
     if (!CheckBlock(state, !fJustCheck, !fJustCheck))
         return false;
@@ -1629,7 +2424,17 @@ bool CBlock::ConnectBlock(CValidationState &state, CBlockIndex* pindex, CCoinsVi
         return true;
     }
 
-    bool fScriptChecks = pindex->nHeight >= Checkpoints::GetTotalBlocksEstimate();
+    bool fScriptChecks = pindex->nHeight >= Checkpoints::GetTotalBlocksEstimate() && !IsAssumedValid(pindex);
+
+    // Bring all coins spent by the block into the view at once, rather than
+    // reading them from disk one by one as the inputs are walked
+    {
+        CValidationTimer timerFetch(VALIDATION_CONNECT_FETCH);
+        std::vector<uint256> vTxid;
+        GetBlockInputTxids(*this, vTxid);
+        if (!view.FetchCoinsBatch(vTxid))
+            return state.Abort(_("Failed to read coin database"));
+    }
 
     // Do not allow blocks that contain transactions which 'overwrite' older transactions,
     // unless those are already completely spent.
@@ -1664,6 +2469,7 @@ bool CBlock::ConnectBlock(CValidationState &state, CBlockIndex* pindex, CCoinsVi
     CCheckQueueControl<CScriptCheck> control(fScriptChecks && nScriptCheckThreads ? &scriptcheckqueue : NULL);
 
     int64 nStart = GetTimeMicros();
+    int64 nTimeDispatch = 0;
     int64 nFees = 0;
     int nInputs = 0;
     unsigned int nSigOps = 0;
@@ -1699,7 +2505,9 @@ bool CBlock::ConnectBlock(CValidationState &state, CBlockIndex* pindex, CCoinsVi
             std::vector<CScriptCheck> vChecks;
             if (!tx.CheckInputs(state, view, fScriptChecks, flags, nScriptCheckThreads ? &vChecks : NULL))
                 return false;
+            int64 nDispatchStart = GetTimeMicros();
             control.Add(vChecks);
+            nTimeDispatch += GetTimeMicros() - nDispatchStart;
         }
 
         CTxUndo txundo;
@@ -1726,6 +2534,8 @@ bool CBlock::ConnectBlock(CValidationState &state, CBlockIndex* pindex, CCoinsVi
     if (fJustCheck)
         return true;
 
+    int64 nUndoStart = GetTimeMicros();
+
     // Write undo information to disk
     if (pindex->GetUndoPos().IsNull() || (pindex->nStatus & BLOCK_VALID_MASK) < BLOCK_VALID_SCRIPTS)
     {
@@ -1748,10 +2558,26 @@ bool CBlock::ConnectBlock(CValidationState &state, CBlockIndex* pindex, CCoinsVi
             return state.Abort(_("Failed to write block index"));
     }
 
+    // Remember the proof-of-work hash CheckBlock computed, for indexes
+    // created before it was stored
+    if (pindex->hashPoW == 0)
+    {
+        pindex->hashPoW = GetPoWHash();
+        if (!pblocktree->WritePoWHash(pindex->GetBlockHash(), pindex->hashPoW))
+            return state.Abort(_("Failed to write block index"));
+    }
+
     if (fTxIndex)
         if (!pblocktree->WriteTxIndex(vPos))
             return state.Abort(_("Failed to write transaction index"));
 
+    int64 nEnd = GetTimeMicros();
+    RecordValidationTime(VALIDATION_CONNECT_INPUTS, nTime - nTimeDispatch);
+    RecordValidationTime(VALIDATION_CONNECT_DISPATCH, nTimeDispatch);
+    RecordValidationTime(VALIDATION_CONNECT_WAIT, nTime2 - nTime);
+    RecordValidationTime(VALIDATION_CONNECT_UNDO, nEnd - nUndoStart);
+    RecordValidationTime(VALIDATION_CONNECTBLOCK, nEnd - nConnectStart);
+
     // add this block to the view's block chain
     assert(view.SetBestBlock(pindex));
 
@@ -1764,6 +2590,8 @@ bool CBlock::ConnectBlock(CValidationState &state, CBlockIndex* pindex, CCoinsVi
 
 bool SetBestChain(CValidationState &state, CBlockIndex* pindexNew)
 {
+    CValidationTimer timer(VALIDATION_SETBESTCHAIN);
+
     // All modifications to the coin state will be done in this cache.
     // Only when all have succeeded, we push it to pcoinsTip.
     CCoinsViewCache view(*pcoinsTip, true);
@@ -1851,7 +2679,7 @@ bool SetBestChain(CValidationState &state, CBlockIndex* pindexNew)
 
     // Make sure it's successfully written to disk before changing memory structure
     bool fIsInitialDownload = IsInitialBlockDownload();
-    if (!fIsInitialDownload || pcoinsTip->GetCacheSize() > nCoinCacheSize) {
+    if (!fIsInitialDownload || pcoinsTip->DynamicMemoryUsage() > nCoinCacheUsage) {
         // Typical CCoins structures on disk are around 100 bytes in size.
         // Pushing a new one to the database can cause it to be written
         // twice (once in the log, and once in the tables). This is already
@@ -1859,6 +2687,7 @@ bool SetBestChain(CValidationState &state, CBlockIndex* pindexNew)
         // overwrite one. Still, use a conservative safety factor of 2.
         if (!CheckDiskSpace(100 * 2 * 2 * pcoinsTip->GetCacheSize()))
             return state.Error();
+        CValidationTimer timerFlush(VALIDATION_FLUSH);
         FlushBlockFile();
         pblocktree->Sync();
         if (!pcoinsTip->Flush())
@@ -1907,11 +2736,18 @@ bool SetBestChain(CValidationState &state, CBlockIndex* pindexNew)
     nBestChainWork = pindexNew->nChainWork;
     nTimeBestReceived = GetTime();
     nTransactionsUpdated++;
+    {
+        // Wake up getblocktemplate long polls
+        boost::lock_guard<boost::mutex> lock(csBestBlock);
+        cvBlockChange.notify_all();
+    }
     printf("SetBestChain: new best=%s  height=%d  log2_work=%.8g  tx=%lu  date=%s progress=%f\n",
       hashBestChain.ToString().c_str(), nBestHeight, log(nBestChainWork.getdouble())/log(2.0), (unsigned long)pindexNew->nChainTx,
       DateTimeStrFormat("%Y-%m-%d %H:%M:%S", pindexBest->GetBlockTime()).c_str(),
       Checkpoints::GuessVerificationProgress(pindexBest));
 
+    CheckAssumeValid();
+
     // Check the version of the last 100 blocks to see if we need to upgrade:
     if (!fIsInitialDownload)
     {
@@ -1967,10 +2803,13 @@ bool CBlock::AddToBlockIndex(CValidationState &state, const CDiskBlockPos &pos)
     pindexNew->nDataPos = pos.nPos;
     pindexNew->nUndoPos = 0;
     pindexNew->nStatus = BLOCK_VALID_TRANSACTIONS | BLOCK_HAVE_DATA;
+    pindexNew->hashPoW = GetPoWHash();
     setBlockIndexValid.insert(pindexNew);
 
     if (!pblocktree->WriteBlockIndex(CDiskBlockIndex(pindexNew)))
         return state.Abort(_("Failed to write block index"));
+    if (!pblocktree->WritePoWHash(hash, pindexNew->hashPoW))
+        return state.Abort(_("Failed to write block index"));
 
     // New best?
     if (!ConnectBestBlock(state))
@@ -2165,6 +3004,8 @@ bool CBlock::CheckBlock(CValidationState &state, bool fCheckPOW, bool fCheckMerk
 
 bool CBlock::AcceptBlock(CValidationState &state, CDiskBlockPos *dbp)
 {
+    CValidationTimer timer(VALIDATION_ACCEPTBLOCK);
+
     // Check for duplicate
     uint256 hash = GetHash();
     if (mapBlockIndex.count(hash))
@@ -2197,6 +3038,10 @@ bool CBlock::AcceptBlock(CValidationState &state, CDiskBlockPos *dbp)
         if (!Checkpoints::CheckBlock(nHeight, hash))
             return state.DoS(100, error("AcceptBlock() : rejected by checkpoint lock-in at %d", nHeight));
 
+        // Only the -assumevalid block may sit at -assumevalidheight
+        if (nHeight == nAssumeValidHeight && hash != hashAssumeValid)
+            return state.Invalid(error("AcceptBlock() : rejected by -assumevalid lock-in at %d", nHeight));
+
         // Don't accept any forks from the main chain prior to last checkpoint
         CBlockIndex* pcheckpoint = Checkpoints::GetLastCheckpoint(mapBlockIndex);
         if (pcheckpoint && nHeight < pcheckpoint->nHeight)
@@ -2270,6 +3115,15 @@ bool CBlockIndex::IsSuperMajority(int minVersion, const CBlockIndex* pstart, uns
     return (nFound >= nRequired);
 }
 
+// Queue the inputs of the orphans waiting for a block for prefetching
+static void PrefetchOrphanInputs(const uint256 &hashPrev)
+{
+    for (multimap<uint256, CBlock*>::iterator mi = mapOrphanBlocksByPrev.lower_bound(hashPrev);
+         mi != mapOrphanBlocksByPrev.upper_bound(hashPrev);
+         ++mi)
+        coinsprefetcher.Add(*(*mi).second);
+}
+
 bool ProcessBlock(CValidationState &state, CNode* pfrom, CBlock* pblock, CDiskBlockPos *dbp)
 {
     // Check for duplicate
@@ -2279,9 +3133,15 @@ bool ProcessBlock(CValidationState &state, CNode* pfrom, CBlock* pblock, CDiskBl
     if (mapOrphanBlocks.count(hash))
         return state.Invalid(error("ProcessBlock() : already have block (orphan) %s", hash.ToString().c_str()));
 
-    // Preliminary checks
-    if (!pblock->CheckBlock(state))
-        return error("ProcessBlock() : CheckBlock FAILED");
+    CValidationTimer timer(VALIDATION_PROCESSBLOCK);
+
+    // Preliminary checks; only timed here, ConnectBlock and the miner call
+    // CheckBlock too
+    {
+        CValidationTimer timerCheck(VALIDATION_CHECKBLOCK);
+        if (!pblock->CheckBlock(state))
+            return error("ProcessBlock() : CheckBlock FAILED");
+    }
 
     CBlockIndex* pcheckpoint = Checkpoints::GetLastCheckpoint(mapBlockIndex);
     if (pcheckpoint && pblock->hashPrevBlock != hashBestChain)
@@ -2320,6 +3180,10 @@ bool ProcessBlock(CValidationState &state, CNode* pfrom, CBlock* pblock, CDiskBl
         return true;
     }
 
+    // Orphans that build on this block are connected next; have their
+    // inputs read while this one is
+    PrefetchOrphanInputs(hash);
+
     // Store to disk
     if (!pblock->AcceptBlock(state, dbp))
         return error("ProcessBlock() : AcceptBlock FAILED");
@@ -2337,6 +3201,7 @@ bool ProcessBlock(CValidationState &state, CNode* pfrom, CBlock* pblock, CDiskBl
             CBlock* pblockOrphan = (*mi).second;
             // Use a dummy CValidationState so someone can't setup nodes to counter-DoS based on orphan resolution (that is, feeding people an invalid block based on LegitBlockX in order to get anyone relaying LegitBlockX banned)
             CValidationState stateDummy;
+            PrefetchOrphanInputs(pblockOrphan->GetHash());
             if (pblockOrphan->AcceptBlock(stateDummy))
                 vWorkQueue.push_back(pblockOrphan->GetHash());
             mapOrphanBlocks.erase(pblockOrphan->GetHash());
@@ -2650,6 +3515,47 @@ bool VerifyDB(int nCheckLevel, int nCheckDepth)
         nCheckDepth = nBestHeight;
     nCheckLevel = std::max(0, std::min(4, nCheckLevel));
     printf("Verifying last %i blocks at level %i\n", nCheckDepth, nCheckLevel);
+
+    // Check the proof of work of all headers in range up front, hashing
+    // those without a stored proof-of-work hash in parallel.
+    // Blocks read back below must hash to these same headers.
+    std::vector<CBlockIndex*> vpindexCheck;
+    for (CBlockIndex* pindex = pindexBest; pindex && pindex->pprev && pindex->nHeight >= nBestHeight-nCheckDepth; pindex = pindex->pprev)
+    {
+        if (pindex->hashPoW != 0)
+        {
+            if (!CheckProofOfWork(pindex->hashPoW, pindex->nBits))
+                return error("VerifyDB() : *** proof of work failed at %d, hash=%s", pindex->nHeight, pindex->GetBlockHash().ToString().c_str());
+            continue;
+        }
+        vpindexCheck.push_back(pindex);
+    }
+    // A chunk at a time, so that shutdown doesn't wait for the whole chain
+    // to be hashed, and the hashes found so far are kept
+    const unsigned int nPoWChunk = 2048;
+    for (unsigned int nBegin = 0; nBegin < vpindexCheck.size(); nBegin += nPoWChunk)
+    {
+        boost::this_thread::interruption_point();
+        unsigned int nEnd = std::min(nBegin + nPoWChunk, (unsigned int)vpindexCheck.size());
+        std::vector<CBlockHeader> vHeaders;
+        for (unsigned int i = nBegin; i < nEnd; i++)
+            vHeaders.push_back(vpindexCheck[i]->GetBlockHeader());
+        std::vector<bool> vfValid;
+        std::vector<uint256> vPoWHash;
+        if (!CheckProofOfWorkBatch(vHeaders, vfValid, &vPoWHash))
+        {
+            for (unsigned int i = 0; i < vfValid.size(); i++)
+                if (!vfValid[i])
+                    return error("VerifyDB() : *** proof of work failed at %d, hash=%s", vpindexCheck[nBegin + i]->nHeight, vpindexCheck[nBegin + i]->GetBlockHash().ToString().c_str());
+        }
+        for (unsigned int i = nBegin; i < nEnd; i++)
+        {
+            vpindexCheck[i]->hashPoW = vPoWHash[i - nBegin];
+            if (!pblocktree->WritePoWHash(vpindexCheck[i]->GetBlockHash(), vPoWHash[i - nBegin]))
+                return error("VerifyDB() : failed to write proof-of-work hash");
+        }
+    }
+
     CCoinsViewCache coins(*pcoinsTip, true);
     CBlockIndex* pindexState = pindexBest;
     CBlockIndex* pindexFailure = NULL;
@@ -2662,10 +3568,10 @@ bool VerifyDB(int nCheckLevel, int nCheckDepth)
             break;
         CBlock block;
         // check level 0: read from disk
-        if (!block.ReadFromDisk(pindex))
+        if (!block.ReadFromDisk(pindex, false))
             return error("VerifyDB() : *** block.ReadFromDisk failed at %d, hash=%s", pindex->nHeight, pindex->GetBlockHash().ToString().c_str());
         // check level 1: verify block validity
-        if (nCheckLevel >= 1 && !block.CheckBlock(state))
+        if (nCheckLevel >= 1 && !block.CheckBlock(state, false))
             return error("VerifyDB() : *** found bad block at %d, hash=%s\n", pindex->nHeight, pindex->GetBlockHash().ToString().c_str());
         // check level 2: verify undo validity
         if (nCheckLevel >= 2 && pindex) {
@@ -2677,7 +3583,7 @@ bool VerifyDB(int nCheckLevel, int nCheckDepth)
             }
         }
         // check level 3: check for inconsistencies during memory-only disconnect of tip blocks
-        if (nCheckLevel >= 3 && pindex == pindexState && (coins.GetCacheSize() + pcoinsTip->GetCacheSize()) <= 2*nCoinCacheSize + 32000) {
+        if (nCheckLevel >= 3 && pindex == pindexState && (coins.DynamicMemoryUsage() + pcoinsTip->DynamicMemoryUsage()) <= nCoinCacheUsage) {
             bool fClean = true;
             if (!block.DisconnectBlock(state, pindex, coins, &fClean))
                 return error("VerifyDB() : *** irrecoverable inconsistency in block data at %d, hash=%s", pindex->nHeight, pindex->GetBlockHash().ToString().c_str());
@@ -2699,7 +3605,7 @@ bool VerifyDB(int nCheckLevel, int nCheckDepth)
             boost::this_thread::interruption_point();
             pindex = pindex->pnext;
             CBlock block;
-            if (!block.ReadFromDisk(pindex))
+            if (!block.ReadFromDisk(pindex, false))
                 return error("VerifyDB() : *** block.ReadFromDisk failed at %d, hash=%s", pindex->nHeight, pindex->GetBlockHash().ToString().c_str());
             if (!block.ConnectBlock(state, pindex, coins))
                 return error("VerifyDB() : *** found unconnectable block at %d, hash=%s", pindex->nHeight, pindex->GetBlockHash().ToString().c_str());
@@ -2887,12 +3793,29 @@ void PrintBlockTree()
     }
 }
 
+// Process a block read by LoadExternalBlockFile; false if loading must stop
+static bool ProcessExternalBlock(CBlock &block, uint64 nBlockPos, CDiskBlockPos *dbp, int &nLoaded)
+{
+    LOCK(cs_main);
+    if (dbp)
+        dbp->nPos = nBlockPos;
+    CValidationState state;
+    if (ProcessBlock(state, NULL, &block, dbp))
+        nLoaded++;
+    return !state.IsError();
+}
+
 bool LoadExternalBlockFile(FILE* fileIn, CDiskBlockPos *dbp)
 {
     int64 nStart = GetTimeMillis();
 
     int nLoaded = 0;
     try {
+        // A block is only processed after the next one was read and its
+        // inputs were queued for prefetching, so that they are read from the
+        // coin database while the block before it is connected.
+        boost::shared_ptr<CBlock> pblockPending;
+        uint64 nPendingPos = 0;
         CBufferedFile blkdat(fileIn, 2*MAX_BLOCK_SIZE, MAX_BLOCK_SIZE+8, SER_DISK, CLIENT_VERSION);
         uint64 nStartByte = 0;
         if (dbp) {
@@ -2931,25 +3854,33 @@ bool LoadExternalBlockFile(FILE* fileIn, CDiskBlockPos *dbp)
                 // read block
                 uint64 nBlockPos = blkdat.GetPos();
                 blkdat.SetLimit(nBlockPos + nSize);
-                CBlock block;
-                blkdat >> block;
+                boost::shared_ptr<CBlock> pblock(new CBlock());
+                blkdat >> *pblock;
                 nRewind = blkdat.GetPos();
 
-                // process block
+                // process the block before it
                 if (nBlockPos >= nStartByte) {
-                    LOCK(cs_main);
-                    if (dbp)
-                        dbp->nPos = nBlockPos;
-                    CValidationState state;
-                    if (ProcessBlock(state, NULL, &block, dbp))
-                        nLoaded++;
-                    if (state.IsError())
-                        break;
+                    coinsprefetcher.Add(*pblock);
+                    if (pblockPending) {
+                        boost::shared_ptr<CBlock> pblockProcess;
+                        pblockProcess.swap(pblockPending);
+                        if (!ProcessExternalBlock(*pblockProcess, nPendingPos, dbp, nLoaded))
+                            break;
+                    }
+                    pblockPending = pblock;
+                    nPendingPos = nBlockPos;
                 }
             } catch (std::exception &e) {
                 printf("%s() : Deserialize or I/O error caught during load\n", __PRETTY_FUNCTION__);
             }
         }
+        if (pblockPending) {
+            try {
+                ProcessExternalBlock(*pblockPending, nPendingPos, dbp, nLoaded);
+            } catch (std::exception &e) {
+                printf("%s() : Deserialize or I/O error caught during load\n", __PRETTY_FUNCTION__);
+            }
+        }
         fclose(fileIn);
     } catch(std::runtime_error &e) {
         AbortNode(_("Error: system error: ") + e.what());
@@ -3556,7 +4487,9 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
 
         bool fMissingInputs = false;
         CValidationState state;
-        if (tx.AcceptToMemoryPool(state, true, true, &fMissingInputs))
+        // cs_main is held exactly once here, so it can be released while
+        // the transaction's scripts are checked
+        if (tx.AcceptToMemoryPool(state, true, true, &fMissingInputs, false, true))
         {
             RelayTransaction(tx, inv.hash);
             mapAlreadyAskedFor.erase(inv);
@@ -4146,16 +5079,56 @@ void SHA256Transform(void* pstate, void* pinput, const void* pinit)
         ((uint32_t*)pstate)[i] = ctx.h[i];
 }
 
-// Some explaining would be appreciated
-class COrphan
+/** What CreateNewBlock learned about one memory pool transaction.  It only
+ *  depends on the transaction and the outputs it spends, so it is kept from
+ *  one call to the next and recomputed only for new transactions or when an
+ *  in-pool parent goes away.
+ */
+class CTemplateTx
 {
 public:
     CTransaction* ptx;
+    std::vector<uint256> vParents;  // memory pool transactions it spends
+    unsigned int nTxSize;
+    double dValueIn;                // sum of confirmed input values ...
+    double dValueHeightIn;          // ... and of value * height, for the priority
+    int64 nTotalIn;
+    bool fMissingInputs;
+
+    // Set once CheckInputs with scripts has passed
+    bool fChecked;
+    int64 nTxFees;
+    unsigned int nTxSigOps;
+
+    unsigned int nGeneration;       // last CreateNewBlock that saw it in the pool
+
+    CTemplateTx() : ptx(NULL), nTxSize(0), dValueIn(0), dValueHeightIn(0), nTotalIn(0), fMissingInputs(false),
+                    fChecked(false), nTxFees(0), nTxSigOps(0), nGeneration(0) { }
+
+    // Priority is sum(valuein * age) / txsize, counting confirmed inputs only
+    double GetPriority(int nHeight) const
+    {
+        return (dValueIn * (nHeight + 1) - dValueHeightIn) / nTxSize;
+    }
+
+    // This is a more accurate fee-per-kilobyte than is used by the client code, because the
+    // client code rounds up the size to the nearest 1K. That's good, because it gives an
+    // incentive to create smaller transactions.
+    double GetFeePerKb() const
+    {
+        return double(nTotalIn - ptx->GetValueOut()) / (double(nTxSize)/1000.0);
+    }
+};
+
+class COrphan
+{
+public:
+    CTemplateTx* ptx;
     set<uint256> setDependsOn;
     double dPriority;
     double dFeePerKb;
 
-    COrphan(CTransaction* ptxIn)
+    COrphan(CTemplateTx* ptxIn)
     {
         ptx = ptxIn;
         dPriority = dFeePerKb = 0;
@@ -4164,18 +5137,41 @@ public:
     void print() const
     {
         printf("COrphan(hash=%s, dPriority=%.1f, dFeePerKb=%.1f)\n",
-               ptx->GetHash().ToString().c_str(), dPriority, dFeePerKb);
+               ptx->ptx->GetHash().ToString().c_str(), dPriority, dFeePerKb);
         BOOST_FOREACH(uint256 hash, setDependsOn)
             printf("   setDependsOn %s\n", hash.ToString().c_str());
     }
 };
 
+/** State CreateNewBlock keeps between calls, guarded by cs_main and mempool.cs. */
+class CBlockTemplateCache
+{
+public:
+    std::map<uint256, CTemplateTx> mapTx;
+    unsigned int nGeneration;
+
+    // The last selection, reused while neither the tip nor the pool changes
+    CBlockIndex* pindexPrev;
+    unsigned int nTransactionsUpdatedLast;
+    bool fSelectionValid;
+    std::vector<CTransaction> vtx;
+    std::vector<int64> vTxFees;
+    std::vector<int64> vTxSigOps;
+    int64 nFees;
+    uint64 nBlockSize;
+
+    CBlockTemplateCache() : nGeneration(0), pindexPrev(NULL), nTransactionsUpdatedLast(0), fSelectionValid(false),
+                            nFees(0), nBlockSize(0) { }
+};
+
+static CBlockTemplateCache templatecache;
+
 
 uint64 nLastBlockTx = 0;
 uint64 nLastBlockSize = 0;
 
 // We want to sort transactions by priority and fee, so:
-typedef boost::tuple<double, double, CTransaction*> TxPriority;
+typedef boost::tuple<double, double, CTemplateTx*> TxPriority;
 class TxPriorityCompare
 {
     bool byFee;
@@ -4198,6 +5194,42 @@ public:
     }
 };
 
+// Look at the inputs of a memory pool transaction
+static void AnalyzeTemplateTx(CTemplateTx& entry, CTransaction& tx, CCoinsViewCache& view)
+{
+    entry = CTemplateTx();
+    entry.ptx = &tx;
+    BOOST_FOREACH(const CTxIn& txin, tx.vin)
+    {
+        // Read prev transaction
+        if (!view.HaveCoins(txin.prevout.hash))
+        {
+            // This should never happen; all transactions in the memory
+            // pool should connect to either transactions in the chain
+            // or other transactions in the memory pool.
+            if (!mempool.mapTx.count(txin.prevout.hash))
+            {
+                printf("ERROR: mempool transaction missing input\n");
+                if (fDebug) assert("mempool transaction missing input" == 0);
+                entry.fMissingInputs = true;
+                return;
+            }
+
+            // Has to wait for dependencies
+            entry.vParents.push_back(txin.prevout.hash);
+            entry.nTotalIn += mempool.mapTx[txin.prevout.hash].vout[txin.prevout.n].nValue;
+            continue;
+        }
+        const CCoins &coins = view.GetCoins(txin.prevout.hash);
+
+        int64 nValueIn = coins.vout[txin.prevout.n].nValue;
+        entry.nTotalIn += nValueIn;
+        entry.dValueIn += (double)nValueIn;
+        entry.dValueHeightIn += (double)nValueIn * coins.nHeight;
+    }
+    entry.nTxSize = ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
+}
+
 CBlockTemplate* CreateNewBlock(const CScript& scriptPubKeyIn)
 {
     // Create new block
@@ -4238,12 +5270,48 @@ CBlockTemplate* CreateNewBlock(const CScript& scriptPubKeyIn)
     {
         LOCK2(cs_main, mempool.cs);
         CBlockIndex* pindexPrev = pindexBest;
+        CBlockTemplateCache& cache = templatecache;
+
+        if (cache.fSelectionValid && cache.pindexPrev == pindexPrev &&
+            cache.nTransactionsUpdatedLast == nTransactionsUpdated)
+        {
+            // Nothing changed since the last template; reuse its selection
+            pblock->vtx.insert(pblock->vtx.end(), cache.vtx.begin(), cache.vtx.end());
+            pblocktemplate->vTxFees.insert(pblocktemplate->vTxFees.end(), cache.vTxFees.begin(), cache.vTxFees.end());
+            pblocktemplate->vTxSigOps.insert(pblocktemplate->vTxSigOps.end(), cache.vTxSigOps.begin(), cache.vTxSigOps.end());
+            nFees = cache.nFees;
+            nLastBlockTx = cache.vtx.size();
+            nLastBlockSize = cache.nBlockSize;
+            printf("CreateNewBlock(): total size %"PRI64u" (unchanged)\n", cache.nBlockSize);
+
+            pblock->vtx[0].vout[0].nValue = GetBlockValue(pindexPrev->nHeight+1, nFees);
+            pblocktemplate->vTxFees[0] = -nFees;
+            pblock->hashPrevBlock  = pindexPrev->GetBlockHash();
+            pblock->UpdateTime(pindexPrev);
+            pblock->nBits          = GetNextWorkRequired(pindexPrev, pblock);
+            pblock->nNonce         = 0;
+            pblock->vtx[0].vin[0].scriptSig = CScript() << OP_0 << OP_0;
+            pblocktemplate->vTxSigOps[0] = pblock->vtx[0].GetLegacySigOpCount();
+            return pblocktemplate.release();
+        }
+        bool fSameTxs = cache.fSelectionValid && cache.pindexPrev == pindexPrev;
+        cache.fSelectionValid = false;
+
+        // Cached coin heights only survive the chain being extended
+        if (cache.pindexPrev != pindexPrev && (pindexPrev->pprev == NULL || pindexPrev->pprev != cache.pindexPrev))
+            cache.mapTx.clear();
+        cache.pindexPrev = pindexPrev;
+        cache.nTransactionsUpdatedLast = nTransactionsUpdated;
+        unsigned int nGeneration = ++cache.nGeneration;
+
         CCoinsViewCache view(*pcoinsTip, true);
 
         // Priority order to process transactions
         list<COrphan> vOrphan; // list memory doesn't move
         map<uint256, vector<COrphan*> > mapDependers;
         bool fPrintPriority = GetBoolArg("-printpriority");
+        bool fNonFinal = false;
+        unsigned int nAnalyzed = 0;
 
         // This vector will be sorted into a priority queue:
         vector<TxPriority> vecPriority;
@@ -4251,70 +5319,57 @@ CBlockTemplate* CreateNewBlock(const CScript& scriptPubKeyIn)
         for (map<uint256, CTransaction>::iterator mi = mempool.mapTx.begin(); mi != mempool.mapTx.end(); ++mi)
         {
             CTransaction& tx = (*mi).second;
-            if (tx.IsCoinBase() || !tx.IsFinal())
+            if (tx.IsCoinBase())
                 continue;
-
-            COrphan* porphan = NULL;
-            double dPriority = 0;
-            int64 nTotalIn = 0;
-            bool fMissingInputs = false;
-            BOOST_FOREACH(const CTxIn& txin, tx.vin)
+            if (!tx.IsFinal())
             {
-                // Read prev transaction
-                if (!view.HaveCoins(txin.prevout.hash))
-                {
-                    // This should never happen; all transactions in the memory
-                    // pool should connect to either transactions in the chain
-                    // or other transactions in the memory pool.
-                    if (!mempool.mapTx.count(txin.prevout.hash))
-                    {
-                        printf("ERROR: mempool transaction missing input\n");
-                        if (fDebug) assert("mempool transaction missing input" == 0);
-                        fMissingInputs = true;
-                        if (porphan)
-                            vOrphan.pop_back();
-                        break;
-                    }
-
-                    // Has to wait for dependencies
-                    if (!porphan)
-                    {
-                        // Use list for automatic deletion
-                        vOrphan.push_back(COrphan(&tx));
-                        porphan = &vOrphan.back();
-                    }
-                    mapDependers[txin.prevout.hash].push_back(porphan);
-                    porphan->setDependsOn.insert(txin.prevout.hash);
-                    nTotalIn += mempool.mapTx[txin.prevout.hash].vout[txin.prevout.n].nValue;
-                    continue;
-                }
-                const CCoins &coins = view.GetCoins(txin.prevout.hash);
-
-                int64 nValueIn = coins.vout[txin.prevout.n].nValue;
-                nTotalIn += nValueIn;
-
-                int nConf = pindexPrev->nHeight - coins.nHeight + 1;
-
-                dPriority += (double)nValueIn * nConf;
+                fNonFinal = true;
+                continue;
             }
-            if (fMissingInputs) continue;
-
-            // Priority is sum(valuein * age) / txsize
-            unsigned int nTxSize = ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
-            dPriority /= nTxSize;
 
-            // This is a more accurate fee-per-kilobyte than is used by the client code, because the
-            // client code rounds up the size to the nearest 1K. That's good, because it gives an
-            // incentive to create smaller transactions.
-            double dFeePerKb =  double(nTotalIn-tx.GetValueOut()) / (double(nTxSize)/1000.0);
+            // Reuse what an earlier call found out, unless a parent it was
+            // waiting for has left the pool (mined, or evicted)
+            CTemplateTx& entry = cache.mapTx[(*mi).first];
+            bool fAnalyze = (entry.ptx == NULL || entry.fMissingInputs);
+            BOOST_FOREACH(const uint256& hashParent, entry.vParents)
+                if (!mempool.mapTx.count(hashParent))
+                    fAnalyze = true;
+            if (fAnalyze)
+            {
+                AnalyzeTemplateTx(entry, tx, view);
+                nAnalyzed++;
+            }
+            entry.ptx = &tx;
+            entry.nGeneration = nGeneration;
+            if (entry.fMissingInputs)
+                continue;
 
-            if (porphan)
+            double dPriority = entry.GetPriority(pindexPrev->nHeight);
+            double dFeePerKb = entry.GetFeePerKb();
+            if (!entry.vParents.empty())
             {
+                // Use list for automatic deletion
+                vOrphan.push_back(COrphan(&entry));
+                COrphan* porphan = &vOrphan.back();
+                BOOST_FOREACH(const uint256& hashParent, entry.vParents)
+                {
+                    if (porphan->setDependsOn.insert(hashParent).second)
+                        mapDependers[hashParent].push_back(porphan);
+                }
                 porphan->dPriority = dPriority;
                 porphan->dFeePerKb = dFeePerKb;
             }
             else
-                vecPriority.push_back(TxPriority(dPriority, dFeePerKb, &(*mi).second));
+                vecPriority.push_back(TxPriority(dPriority, dFeePerKb, &entry));
+        }
+
+        // Forget transactions that have left the pool
+        for (map<uint256, CTemplateTx>::iterator it = cache.mapTx.begin(); it != cache.mapTx.end(); )
+        {
+            if (it->second.nGeneration != nGeneration)
+                cache.mapTx.erase(it++);
+            else
+                ++it;
         }
 
         // Collect transactions into block
@@ -4322,6 +5377,7 @@ CBlockTemplate* CreateNewBlock(const CScript& scriptPubKeyIn)
         uint64 nBlockTx = 0;
         int nBlockSigOps = 100;
         bool fSortedByFee = (nBlockPrioritySize <= 0);
+        unsigned int nChecked = 0;
 
         TxPriorityCompare comparer(fSortedByFee);
         std::make_heap(vecPriority.begin(), vecPriority.end(), comparer);
@@ -4331,13 +5387,14 @@ CBlockTemplate* CreateNewBlock(const CScript& scriptPubKeyIn)
             // Take highest priority transaction off the priority queue:
             double dPriority = vecPriority.front().get<0>();
             double dFeePerKb = vecPriority.front().get<1>();
-            CTransaction& tx = *(vecPriority.front().get<2>());
+            CTemplateTx& entry = *(vecPriority.front().get<2>());
+            CTransaction& tx = *entry.ptx;
 
             std::pop_heap(vecPriority.begin(), vecPriority.end(), comparer);
             vecPriority.pop_back();
 
             // Size limits
-            unsigned int nTxSize = ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
+            unsigned int nTxSize = entry.nTxSize;
             if (nBlockSize + nTxSize >= nBlockMaxSize)
                 continue;
 
@@ -4363,15 +5420,29 @@ CBlockTemplate* CreateNewBlock(const CScript& scriptPubKeyIn)
             if (!tx.HaveInputs(view))
                 continue;
 
-            int64 nTxFees = tx.GetValueIn(view)-tx.GetValueOut();
-
-            nTxSigOps += tx.GetP2SHSigOpCount(view);
-            if (nBlockSigOps + nTxSigOps >= MAX_BLOCK_SIGOPS)
-                continue;
-
+            // Scripts, fees and P2SH sigops only depend on the spent outputs,
+            // so they are checked once per transaction
             CValidationState state;
-            if (!tx.CheckInputs(state, view, true, SCRIPT_VERIFY_P2SH))
-                continue;
+            if (!entry.fChecked)
+            {
+                entry.nTxFees = tx.GetValueIn(view)-tx.GetValueOut();
+                entry.nTxSigOps = nTxSigOps + tx.GetP2SHSigOpCount(view);
+                if (nBlockSigOps + entry.nTxSigOps >= MAX_BLOCK_SIGOPS)
+                    continue;
+                if (!tx.CheckInputs(state, view, true, SCRIPT_VERIFY_P2SH))
+                    continue;
+                entry.fChecked = true;
+                nChecked++;
+            }
+            else
+            {
+                if (nBlockSigOps + entry.nTxSigOps >= MAX_BLOCK_SIGOPS)
+                    continue;
+                if (!tx.CheckInputs(state, view, false))
+                    continue;
+            }
+            int64 nTxFees = entry.nTxFees;
+            nTxSigOps = entry.nTxSigOps;
 
             CTxUndo txundo;
             uint256 hash = tx.GetHash();
@@ -4412,7 +5483,8 @@ CBlockTemplate* CreateNewBlock(const CScript& scriptPubKeyIn)
 
         nLastBlockTx = nBlockTx;
         nLastBlockSize = nBlockSize;
-        printf("CreateNewBlock(): total size %"PRI64u"\n", nBlockSize);
+        printf("CreateNewBlock(): total size %"PRI64u", %u of %"PRIszu" transactions analyzed, %u scripts checked\n",
+               nBlockSize, nAnalyzed, mempool.mapTx.size(), nChecked);
 
         pblock->vtx[0].vout[0].nValue = GetBlockValue(pindexPrev->nHeight+1, nFees);
         pblocktemplate->vTxFees[0] = -nFees;
@@ -4425,13 +5497,28 @@ CBlockTemplate* CreateNewBlock(const CScript& scriptPubKeyIn)
         pblock->vtx[0].vin[0].scriptSig = CScript() << OP_0 << OP_0;
         pblocktemplate->vTxSigOps[0] = pblock->vtx[0].GetLegacySigOpCount();
 
-        CBlockIndex indexDummy(*pblock);
-        indexDummy.pprev = pindexPrev;
-        indexDummy.nHeight = pindexPrev->nHeight + 1;
-        CCoinsViewCache viewNew(*pcoinsTip, true);
-        CValidationState state;
-        if (!pblock->ConnectBlock(state, &indexDummy, viewNew, true))
-            throw std::runtime_error("CreateNewBlock() : ConnectBlock failed");
+        // The same transactions on the same tip already passed this check
+        fSameTxs = fSameTxs && cache.vtx.size() + 1 == pblock->vtx.size();
+        for (unsigned int i = 1; fSameTxs && i < pblock->vtx.size(); i++)
+            fSameTxs = (pblock->vtx[i] == cache.vtx[i - 1]);
+        if (!fSameTxs)
+        {
+            CBlockIndex indexDummy(*pblock);
+            indexDummy.pprev = pindexPrev;
+            indexDummy.nHeight = pindexPrev->nHeight + 1;
+            CCoinsViewCache viewNew(*pcoinsTip, true);
+            CValidationState state;
+            if (!pblock->ConnectBlock(state, &indexDummy, viewNew, true))
+                throw std::runtime_error("CreateNewBlock() : ConnectBlock failed");
+        }
+
+        // Time-locked transactions can become final without the pool changing
+        cache.fSelectionValid = !fNonFinal;
+        cache.vtx.assign(pblock->vtx.begin() + 1, pblock->vtx.end());
+        cache.vTxFees.assign(pblocktemplate->vTxFees.begin() + 1, pblocktemplate->vTxFees.end());
+        cache.vTxSigOps.assign(pblocktemplate->vTxSigOps.begin() + 1, pblocktemplate->vTxSigOps.end());
+        cache.nFees = nFees;
+        cache.nBlockSize = nBlockSize;
     }
 
     return pblocktemplate.release();
@@ -4549,136 +5636,287 @@ bool CheckWork(CBlock* pblock, CWallet& wallet, CReserveKey& reservekey)
     return true;
 }
 
-void static GoldbitMiner(CWallet *pwallet)
+// Hash counter of one miner thread.  Only its own thread writes it, so it
+// needs no lock; the padding keeps each counter on its own cache line.
+struct CMinerThreadStats
 {
-    printf("GoldbitMiner started\n");
-    SetThreadPriority(THREAD_PRIORITY_LOWEST);
-    RenameThread("Coolcash-miner");
+    volatile unsigned int nHashes;
+    char padding[64 - sizeof(unsigned int)];
+};
 
-    // Each thread has its own key and counter
-    CReserveKey reservekey(pwallet);
-    unsigned int nExtraNonce = 0;
+/** Work shared by the miner threads.  One producer thread keeps a block
+ *  template current; every hashing thread takes a unit of work from it
+ *  (the template with a coinbase extranonce nobody else is using), scans
+ *  the nonce range of that unit and comes back for another.
+ */
+class CMinerWork
+{
+private:
+    mutable boost::mutex mutex;
+    boost::condition_variable cond;
+    CWallet* pwallet;
+    // Guards reservekey; taken before cs_main, never together with mutex
+    boost::mutex mutexKey;
+    CReserveKey reservekey;
+    CBlock blockTemplate;
+    CBlockIndex* pindexPrev;
+    unsigned int nNextExtraNonce;
 
-    try { loop {
-        while (vNodes.empty())
-            MilliSleep(1000);
+public:
+    // Bumped whenever the template changes; workers poll it without locking
+    volatile unsigned int nWorkId;
+    volatile bool fStale;
+    std::vector<CMinerThreadStats> vStats;
 
-        //
-        // Create new block
-        //
-        unsigned int nTransactionsUpdatedLast = nTransactionsUpdated;
-        CBlockIndex* pindexPrev = pindexBest;
+    CMinerWork(CWallet* pwalletIn, unsigned int nThreads) : pwallet(pwalletIn), reservekey(pwalletIn), pindexPrev(NULL),
+                                                            nNextExtraNonce(0), nWorkId(0), fStale(false), vStats(nThreads)
+    {
+        for (unsigned int i = 0; i < nThreads; i++)
+            vStats[i].nHashes = 0;
+    }
 
-        auto_ptr<CBlockTemplate> pblocktemplate(CreateNewBlockWithKey(reservekey));
-        if (!pblocktemplate.get())
-            return;
-        CBlock *pblock = &pblocktemplate->block;
-        IncrementExtraNonce(pblock, pindexPrev, nExtraNonce);
+    // Build a new template on top of pindexBest and hand it to the workers.
+    // The template is built without holding mutex, so workers keep hashing
+    // the old one meanwhile; only the swap happens under it.
+    bool Rebuild()
+    {
+        CBlockIndex* pindexPrevNew = pindexBest;
+        auto_ptr<CBlockTemplate> pblocktemplate;
+        {
+            boost::unique_lock<boost::mutex> lockKey(mutexKey);
+            pblocktemplate.reset(CreateNewBlockWithKey(reservekey));
+        }
 
-        printf("Running GoldbitMiner with %"PRIszu" transactions in block (%u bytes)\n", pblock->vtx.size(),
-               ::GetSerializeSize(*pblock, SER_NETWORK, PROTOCOL_VERSION));
+        boost::unique_lock<boost::mutex> lock(mutex);
+        nWorkId++;
+        if (!pblocktemplate.get() || pblocktemplate->block.hashPrevBlock != *pindexPrevNew->phashBlock)
+        {
+            // Out of keys, or the tip moved while the template was built
+            pindexPrev = NULL;
+            return false;
+        }
+        blockTemplate = pblocktemplate->block;
+        pindexPrev = pindexPrevNew;
+        nNextExtraNonce = 0;
+        fStale = false;
+        cond.notify_all();
+        printf("GoldbitMiner: new template with %"PRIszu" transactions (%u bytes)\n", blockTemplate.vtx.size(),
+               ::GetSerializeSize(blockTemplate, SER_NETWORK, PROTOCOL_VERSION));
+        return true;
+    }
 
-        //
-        // Pre-build hash buffers
-        //
-        char pmidstatebuf[32+16]; char* pmidstate = alignup<16>(pmidstatebuf);
-        char pdatabuf[128+16];    char* pdata     = alignup<16>(pdatabuf);
-        char phash1buf[64+16];    char* phash1    = alignup<16>(phash1buf);
+    // Take the workers off the current template until the next Rebuild
+    void Clear()
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        pindexPrev = NULL;
+        nWorkId++;
+    }
+
+    // Wait for a template and claim the next extranonce of it
+    void GetWork(CBlock& block, CBlockIndex*& pindexPrevRet, unsigned int& nWorkIdRet)
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        while (pindexPrev == NULL || fStale)
+            cond.wait(lock);
+        block = blockTemplate;
+        pindexPrevRet = pindexPrev;
+        nWorkIdRet = nWorkId;
+        unsigned int nExtraNonce = ++nNextExtraNonce;
+        lock.unlock();
+
+        unsigned int nHeight = pindexPrevRet->nHeight+1; // Height first in coinbase required for block.version=2
+        block.vtx[0].vin[0].scriptSig = (CScript() << nHeight << CBigNum(nExtraNonce)) + COINBASE_FLAGS;
+        assert(block.vtx[0].vin[0].scriptSig.size() <= 100);
+        block.hashMerkleRoot = block.BuildMerkleTree();
+    }
 
-        FormatHashBuffers(pblock, pmidstate, pdata, phash1);
+    // Submit a solved block; the template is rebuilt either way, as its
+    // coinbase key has now been used
+    void SubmitWork(CBlock* pblock)
+    {
+        {
+            boost::unique_lock<boost::mutex> lockKey(mutexKey);
+            SetThreadPriority(THREAD_PRIORITY_NORMAL);
+            CheckWork(pblock, *pwallet, reservekey);
+            SetThreadPriority(THREAD_PRIORITY_LOWEST);
+        }
+        boost::unique_lock<boost::mutex> lock(mutex);
+        fStale = true;
+    }
+};
 
-        unsigned int& nBlockTime = *(unsigned int*)(pdata + 64 + 4);
-        unsigned int& nBlockBits = *(unsigned int*)(pdata + 64 + 8);
-        //unsigned int& nBlockNonce = *(unsigned int*)(pdata + 64 + 12);
+static CCriticalSection cs_minerstats;
+static std::vector<double> vMinerThreadHashesPerSec;
 
+void static GoldbitMiner(boost::shared_ptr<CMinerWork> pwork, unsigned int nThread)
+{
+    printf("GoldbitMiner %u started\n", nThread);
+    SetThreadPriority(THREAD_PRIORITY_LOWEST);
+    RenameThread("Coolcash-miner");
+
+    // Consecutive nonces are hashed together by the multi-lane scrypt kernel
+    const unsigned int nWays = scrypt_batch_ways();
+    char *scratchpad = scrypt_thread_scratchpad();
+    uint256 thash[SCRYPT_MAX_WAYS];
+    volatile unsigned int& nHashes = pwork->vStats[nThread].nHashes;
+
+    try { loop {
+        CBlock block;
+        CBlock *pblock = &block;
+        CBlockIndex* pindexPrev;
+        unsigned int nWorkId;
+        pwork->GetWork(block, pindexPrev, nWorkId);
+
+        // The first 64 header bytes stay fixed for this unit of work
+        scrypt_midstate scryptmidstate;
+        scrypt_1024_1_1_256_midstate(BEGIN(pblock->nVersion), &scryptmidstate);
 
         //
         // Search
         //
-        int64 nStart = GetTime();
         uint256 hashTarget = CBigNum().SetCompact(pblock->nBits).getuint256();
         loop
         {
-            unsigned int nHashesDone = 0;
+            bool fFound = false;
 
-            uint256 thash;
-            char scratchpad[SCRYPT_SCRATCHPAD_SIZE];
             loop
             {
-                scrypt_1024_1_1_256_sp(BEGIN(pblock->nVersion), BEGIN(thash), scratchpad);
+                scrypt_1024_1_1_256_sp_mine(&scryptmidstate, BEGIN(pblock->nVersion), pblock->nNonce, nWays,
+                                            BEGIN(thash[0]), scratchpad);
 
-                if (thash <= hashTarget)
-                {
-                    // Found a solution
-                    SetThreadPriority(THREAD_PRIORITY_NORMAL);
-                    CheckWork(pblock, *pwallet, reservekey);
-                    SetThreadPriority(THREAD_PRIORITY_LOWEST);
-                    break;
-                }
-                pblock->nNonce += 1;
-                nHashesDone += 1;
-                if ((pblock->nNonce & 0xFF) == 0)
-                    break;
-            }
-
-            // Meter hashes/sec
-            static int64 nHashCounter;
-            if (nHPSTimerStart == 0)
-            {
-                nHPSTimerStart = GetTimeMillis();
-                nHashCounter = 0;
-            }
-            else
-                nHashCounter += nHashesDone;
-            if (GetTimeMillis() - nHPSTimerStart > 4000)
-            {
-                static CCriticalSection cs;
+                for (unsigned int l = 0; l < nWays; l++)
                 {
-                    LOCK(cs);
-                    if (GetTimeMillis() - nHPSTimerStart > 4000)
+                    if (thash[l] <= hashTarget)
                     {
-                        dHashesPerSec = 1000.0 * nHashCounter / (GetTimeMillis() - nHPSTimerStart);
-                        nHPSTimerStart = GetTimeMillis();
-                        nHashCounter = 0;
-                        static int64 nLogTime;
-                        if (GetTime() - nLogTime > 30 * 60)
-                        {
-                            nLogTime = GetTime();
-                            printf("hashmeter %6.0f khash/s\n", dHashesPerSec/1000.0);
-                        }
+                        // Found a solution
+                        pblock->nNonce += l;
+                        pwork->SubmitWork(pblock);
+                        fFound = true;
+                        break;
                     }
                 }
+                if (fFound)
+                    break;
+                pblock->nNonce += nWays;
+                nHashes += nWays;
+                if ((pblock->nNonce & 0xFF) < nWays)
+                    break;
             }
 
-            // Check for stop or if block needs to be rebuilt
+            // Check for stop or if the work went stale
             boost::this_thread::interruption_point();
-            if (vNodes.empty())
+            if (fFound || pwork->nWorkId != nWorkId)
                 break;
             if (pblock->nNonce >= 0xffff0000)
                 break;
-            if (nTransactionsUpdated != nTransactionsUpdatedLast && GetTime() - nStart > 60)
-                break;
-            if (pindexPrev != pindexBest)
-                break;
 
             // Update nTime every few seconds
             pblock->UpdateTime(pindexPrev);
-            nBlockTime = ByteReverse(pblock->nTime);
             if (fTestNet)
             {
                 // Changing pblock->nTime can change work required on testnet:
-                nBlockBits = ByteReverse(pblock->nBits);
                 hashTarget = CBigNum().SetCompact(pblock->nBits).getuint256();
             }
         }
     } }
     catch (boost::thread_interrupted)
     {
-        printf("GoldbitMiner terminated\n");
+        printf("GoldbitMiner %u terminated\n", nThread);
         throw;
     }
 }
 
+// Turn the per-thread hash counters into hashes/sec every few seconds
+void static MeterMinerThreads(CMinerWork* pwork, std::vector<unsigned int>& vLastHashes)
+{
+    int64 nNow = GetTimeMillis();
+    if (nHPSTimerStart == 0)
+    {
+        nHPSTimerStart = nNow;
+        for (unsigned int i = 0; i < vLastHashes.size(); i++)
+            vLastHashes[i] = pwork->vStats[i].nHashes;
+        return;
+    }
+    if (nNow - nHPSTimerStart <= 4000)
+        return;
+
+    std::vector<double> vRates(vLastHashes.size());
+    double dTotal = 0;
+    for (unsigned int i = 0; i < vLastHashes.size(); i++)
+    {
+        unsigned int nHashes = pwork->vStats[i].nHashes;
+        vRates[i] = 1000.0 * (unsigned int)(nHashes - vLastHashes[i]) / (nNow - nHPSTimerStart);
+        vLastHashes[i] = nHashes;
+        dTotal += vRates[i];
+    }
+    {
+        LOCK(cs_minerstats);
+        vMinerThreadHashesPerSec.swap(vRates);
+    }
+    dHashesPerSec = dTotal;
+    nHPSTimerStart = nNow;
+
+    static int64 nLogTime;
+    if (GetTime() - nLogTime > 30 * 60)
+    {
+        nLogTime = GetTime();
+        printf("hashmeter %6.0f khash/s\n", dHashesPerSec/1000.0);
+    }
+}
+
+// Template producer: rebuilds the shared template when the tip changes,
+// when a block was found, or when the mempool changed and it is a minute old
+void static GoldbitMinerTemplates(boost::shared_ptr<CMinerWork> pwork)
+{
+    printf("GoldbitMiner template producer started\n");
+    RenameThread("Coolcash-minertmpl");
+
+    std::vector<unsigned int> vLastHashes(pwork->vStats.size());
+    nHPSTimerStart = 0;
+
+    try { loop {
+        while (vNodes.empty())
+        {
+            pwork->Clear();
+            MilliSleep(1000);
+        }
+
+        unsigned int nTransactionsUpdatedLast = nTransactionsUpdated;
+        CBlockIndex* pindexPrev = pindexBest;
+        if (!pwork->Rebuild())
+        {
+            MilliSleep(1000);
+            continue;
+        }
+        int64 nStart = GetTime();
+
+        loop
+        {
+            MilliSleep(100);
+            MeterMinerThreads(pwork.get(), vLastHashes);
+
+            if (vNodes.empty() || pwork->fStale)
+                break;
+            if (pindexPrev != pindexBest)
+                break;
+            if (nTransactionsUpdated != nTransactionsUpdatedLast && GetTime() - nStart > 60)
+                break;
+        }
+    } }
+    catch (boost::thread_interrupted)
+    {
+        printf("GoldbitMiner template producer terminated\n");
+        throw;
+    }
+}
+
+std::vector<double> GetMinerThreadHashesPerSec()
+{
+    LOCK(cs_minerstats);
+    return vMinerThreadHashesPerSec;
+}
+
 void GenerateBitcoins(bool fGenerate, CWallet* pwallet)
 {
     static boost::thread_group* minerThreads = NULL;
@@ -4689,17 +5927,27 @@ void GenerateBitcoins(bool fGenerate, CWallet* pwallet)
 
     if (minerThreads != NULL)
     {
+        // Not joined: the caller may hold cs_main, which a miner thread can
+        // be waiting for.  The threads share ownership of their CMinerWork,
+        // so it lives until the last of them has exited.
         minerThreads->interrupt_all();
         delete minerThreads;
         minerThreads = NULL;
+        {
+            LOCK(cs_minerstats);
+            vMinerThreadHashesPerSec.clear();
+        }
+        dHashesPerSec = 0;
     }
 
     if (nThreads == 0 || !fGenerate)
         return;
 
+    boost::shared_ptr<CMinerWork> pminerwork(new CMinerWork(pwallet, nThreads));
     minerThreads = new boost::thread_group();
+    minerThreads->create_thread(boost::bind(&GoldbitMinerTemplates, pminerwork));
     for (int i = 0; i < nThreads; i++)
-        minerThreads->create_thread(boost::bind(&GoldbitMiner, pwallet));
+        minerThreads->create_thread(boost::bind(&GoldbitMiner, pminerwork, i));
 }
 
 // Amount compression:
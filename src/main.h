@@ -11,11 +11,16 @@
 #include "script.h"
 #include "scrypt.h"
 #include "config.h"
+#include "memusage.h"
 
 #include <list>
 
+#include <boost/shared_ptr.hpp>
+#include <boost/unordered_map.hpp>
+
 class CWallet;
 class CBlock;
+class CBlockHeader;
 class CBlockIndex;
 class CKeyItem;
 class CReserveKey;
@@ -38,6 +43,8 @@ extern uint256 nBestChainWork;
 extern uint256 nBestInvalidWork;
 extern uint256 hashBestChain;
 extern CBlockIndex* pindexBest;
+extern boost::mutex csBestBlock;
+extern boost::condition_variable cvBlockChange;
 extern unsigned int nTransactionsUpdated;
 extern uint64 nLastBlockTx;
 extern uint64 nLastBlockSize;
@@ -53,7 +60,9 @@ extern bool fReindex;
 extern bool fBenchmark;
 extern int nScriptCheckThreads;
 extern bool fTxIndex;
-extern unsigned int nCoinCacheSize;
+extern uint256 hashAssumeValid;
+extern int nAssumeValidHeight;
+extern size_t nCoinCacheUsage;
 
 // Settings
 extern int64 nTransactionFee;
@@ -102,6 +111,8 @@ void UnloadBlockIndex();
 bool VerifyDB(int nCheckLevel, int nCheckDepth);
 /** Print the loaded block tree */
 void PrintBlockTree();
+/** Whether -assumevalid lets the scripts of a block go unchecked */
+bool IsAssumedValid(const CBlockIndex* pindex);
 /** Find a block by height in the currently-connected chain */
 CBlockIndex* FindBlockByHeight(int nHeight);
 /** Process protocol messages received from a given node */
@@ -110,8 +121,14 @@ bool ProcessMessages(CNode* pfrom);
 bool SendMessages(CNode* pto, bool fSendTrickle);
 /** Run an instance of the script checking thread */
 void ThreadScriptCheck();
+/** Run the thread that prefetches block inputs from the coin database view */
+void ThreadCoinsPrefetch(CCoinsView* pviewDB);
+/** Stop prefetching, so that the view given to ThreadCoinsPrefetch may be deleted */
+void StopCoinsPrefetch();
 /** Run the miner threads */
 void GenerateBitcoins(bool fGenerate, CWallet* pwallet);
+/** Recent hashes/sec of each miner thread */
+std::vector<double> GetMinerThreadHashesPerSec();
 /** Generate a new block, without valid proof-of-work */
 CBlockTemplate* CreateNewBlock(const CScript& scriptPubKeyIn);
 CBlockTemplate* CreateNewBlockWithKey(CReserveKey& reservekey);
@@ -123,6 +140,11 @@ void FormatHashBuffers(CBlock* pblock, char* pmidstate, char* pdata, char* phash
 bool CheckWork(CBlock* pblock, CWallet& wallet, CReserveKey& reservekey);
 /** Check whether a block hash satisfies the proof-of-work requirement specified by nBits */
 bool CheckProofOfWork(uint256 hash, unsigned int nBits);
+/** Check the proof of work of many headers at once, hashing them with the multi-lane scrypt
+ *  kernels on worker threads. vfValid receives the result for each header, and pvPoWHash (if
+ *  given) the scrypt hashes; returns true if all pass. Not an interruption point, so callers
+ *  should hand it bounded chunks. */
+bool CheckProofOfWorkBatch(const std::vector<CBlockHeader>& vHeaders, std::vector<bool>& vfValid, std::vector<uint256>* pvPoWHash = NULL);
 /** Calculate the minimum amount of work a received block needs, without knowing its direct parent */
 unsigned int ComputeMinWork(unsigned int nBase, int64 nTime);
 /** Get the number of active peers */
@@ -145,6 +167,57 @@ bool VerifySignature(const CCoins& txFrom, const CTransaction& txTo, unsigned in
 bool AbortNode(const std::string &msg);
 
 
+/** Timed phases of block validation */
+enum
+{
+    VALIDATION_PROCESSBLOCK = 0,
+    VALIDATION_CHECKBLOCK,
+    VALIDATION_ACCEPTBLOCK,
+    VALIDATION_CONNECTBLOCK,
+    VALIDATION_CONNECT_FETCH,       // reading the coins spent by the block into the view
+    VALIDATION_CONNECT_INPUTS,      // checking inputs, with the scripts if run inline
+    VALIDATION_CONNECT_DISPATCH,    // queueing script checks for the script check threads
+    VALIDATION_CONNECT_WAIT,        // waiting for the script check threads
+    VALIDATION_CONNECT_UNDO,        // writing undo data and the block and transaction index
+    VALIDATION_SETBESTCHAIN,
+    VALIDATION_FLUSH,               // syncing the block files and handing the coins cache to the database writer
+    VALIDATION_FLUSH_WRITE,         // writing a snapshot of the coins cache to the database, in the background
+
+    VALIDATION_PHASES
+};
+
+/** How long one phase of block validation took over all blocks so far.
+ *  Bucket i counts the runs that took less than 2^i microseconds, the last
+ *  bucket all that took longer. */
+struct CValidationPhaseStats
+{
+    static const int nBuckets = 32;
+
+    std::string strName;
+    uint64 nCount;
+    int64 nTotalMicros;
+    int64 nMaxMicros;
+    uint64 vBuckets[nBuckets];
+};
+
+/** Add a run of a phase to its statistics */
+void RecordValidationTime(int nPhase, int64 nMicros);
+/** Get the statistics of all phases, and optionally start over */
+void GetValidationStats(std::vector<CValidationPhaseStats> &vStats, bool fReset = false);
+
+/** Records the time from its construction to its destruction as a run of a phase */
+class CValidationTimer
+{
+private:
+    int nPhase;
+    int64 nStart;
+
+public:
+    CValidationTimer(int nPhaseIn) : nPhase(nPhaseIn), nStart(GetTimeMicros()) {}
+    ~CValidationTimer() { RecordValidationTime(nPhase, GetTimeMicros() - nStart); }
+};
+
+
 
 
 
@@ -639,7 +712,9 @@ void UpdateCoins(const CTransaction& tx, CValidationState &state, CCoinsViewCach
     bool CheckTransaction(CValidationState &state) const;
 
     // Try to accept this transaction into the memory pool
-    bool AcceptToMemoryPool(CValidationState &state, bool fCheckInputs=true, bool fLimitFree = true, bool* pfMissingInputs=NULL, bool fRejectInsaneFee = false);
+    // fReleaseMain lets cs_main, which the caller must hold exactly once
+    // and with no locks taken after it, be released during script checks.
+    bool AcceptToMemoryPool(CValidationState &state, bool fCheckInputs=true, bool fLimitFree = true, bool* pfMissingInputs=NULL, bool fRejectInsaneFee = false, bool fReleaseMain = false);
 
 protected:
     static const CTxOut &GetOutputFor(const CTxIn& input, CCoinsViewCache& mapInputs);
@@ -1043,6 +1118,14 @@ public:
                 return false;
         return true;
     }
+
+    // heap memory held by this object, for cache accounting
+    size_t DynamicMemoryUsage() const {
+        size_t ret = memusage::DynamicUsage(vout);
+        BOOST_FOREACH(const CTxOut &out, vout)
+            ret += memusage::DynamicUsage(out.scriptPubKey);
+        return ret;
+    }
 };
 
 /** Closure representing one script verification
@@ -1055,12 +1138,14 @@ private:
     unsigned int nIn;
     unsigned int nFlags;
     int nHashType;
+    boost::shared_ptr<const CSignatureHashContext> psighash;
 
 public:
     CScriptCheck() {}
-    CScriptCheck(const CCoins& txFromIn, const CTransaction& txToIn, unsigned int nInIn, unsigned int nFlagsIn, int nHashTypeIn) :
+    CScriptCheck(const CCoins& txFromIn, const CTransaction& txToIn, unsigned int nInIn, unsigned int nFlagsIn, int nHashTypeIn,
+                 const boost::shared_ptr<const CSignatureHashContext>& psighashIn = boost::shared_ptr<const CSignatureHashContext>()) :
         scriptPubKey(txFromIn.vout[txToIn.vin[nInIn].prevout.n].scriptPubKey),
-        ptxTo(&txToIn), nIn(nInIn), nFlags(nFlagsIn), nHashType(nHashTypeIn) { }
+        ptxTo(&txToIn), nIn(nInIn), nFlags(nFlagsIn), nHashType(nHashTypeIn), psighash(psighashIn) { }
 
     bool operator()() const;
 
@@ -1070,6 +1155,7 @@ public:
         std::swap(nIn, check.nIn);
         std::swap(nFlags, check.nFlags);
         std::swap(nHashType, check.nHashType);
+        psighash.swap(check.psighash);
     }
 };
 
@@ -1284,6 +1370,13 @@ public:
         return Hash(BEGIN(nVersion), END(nNonce));
     }
 
+    uint256 GetPoWHash() const
+    {
+        uint256 thash;
+        scrypt_1024_1_1_256(BEGIN(nVersion), BEGIN(thash));
+        return thash;
+    }
+
     int64 GetBlockTime() const
     {
         return (int64)nTime;
@@ -1300,6 +1393,8 @@ public:
 
     // memory only
     mutable std::vector<uint256> vMerkleTree;
+    mutable uint256 hashPoWCached;      // scrypt hash of the header...
+    mutable uint256 hashPoWCachedFor;   // ...whose GetHash() was this
 
     CBlock()
     {
@@ -1323,13 +1418,27 @@ public:
         CBlockHeader::SetNull();
         vtx.clear();
         vMerkleTree.clear();
+        hashPoWCached = 0;
+        hashPoWCachedFor = 0;
     }
 
+    // Same as CBlockHeader::GetPoWHash, but remembers the result until the header changes
     uint256 GetPoWHash() const
     {
-        uint256 thash;
-        scrypt_1024_1_1_256(BEGIN(nVersion), BEGIN(thash));
-        return thash;
+        uint256 hash = GetHash();
+        if (hash != hashPoWCachedFor)
+        {
+            hashPoWCached = CBlockHeader::GetPoWHash();
+            hashPoWCachedFor = hash;
+        }
+        return hashPoWCached;
+    }
+
+    // Seed the cache with a proof-of-work hash computed earlier for this header
+    void SetPoWHash(const uint256& hashPoW) const
+    {
+        hashPoWCached = hashPoW;
+        hashPoWCachedFor = GetHash();
     }
 
     CBlockHeader GetBlockHeader() const
@@ -1426,7 +1535,7 @@ public:
         return true;
     }
 
-    bool ReadFromDisk(const CDiskBlockPos &pos)
+    bool ReadFromDisk(const CDiskBlockPos &pos, bool fCheckPOW = true)
     {
         SetNull();
 
@@ -1444,7 +1553,7 @@ public:
         }
 
         // Check the header
-        if (!CheckProofOfWork(GetPoWHash(), nBits))
+        if (fCheckPOW && !CheckProofOfWork(GetPoWHash(), nBits))
             return error("CBlock::ReadFromDisk() : errors in block header");
 
         return true;
@@ -1485,7 +1594,8 @@ public:
     bool ConnectBlock(CValidationState &state, CBlockIndex *pindex, CCoinsViewCache &coins, bool fJustCheck=false);
 
     // Read a block from disk
-    bool ReadFromDisk(const CBlockIndex* pindex);
+    // fCheckPOW may be false if the header in pindex has already been checked
+    bool ReadFromDisk(const CBlockIndex* pindex, bool fCheckPOW = true);
 
     // Add this block to the block index, and if necessary, switch the active block chain to this
     bool AddToBlockIndex(CValidationState &state, const CDiskBlockPos &pos);
@@ -1628,6 +1738,10 @@ public:
     unsigned int nBits;
     unsigned int nNonce;
 
+    // scrypt proof-of-work hash of the header, or 0 if not known yet.
+    // Stored next to the index in the block tree database, not in CDiskBlockIndex.
+    uint256 hashPoW;
+
 
     CBlockIndex()
     {
@@ -1648,6 +1762,7 @@ public:
         nTime          = 0;
         nBits          = 0;
         nNonce         = 0;
+        hashPoW        = 0;
     }
 
     CBlockIndex(CBlockHeader& block)
@@ -1669,6 +1784,7 @@ public:
         nTime          = block.nTime;
         nBits          = block.nBits;
         nNonce         = block.nNonce;
+        hashPoW        = 0;
     }
 
     CDiskBlockPos GetBlockPos() const {
@@ -2063,7 +2179,7 @@ public:
     std::map<uint256, CTransaction> mapTx;
     std::map<COutPoint, CInPoint> mapNextTx;
 
-    bool accept(CValidationState &state, CTransaction &tx, bool fCheckInputs, bool fLimitFree, bool* pfMissingInputs, bool fRejectInsaneFee = false);
+    bool accept(CValidationState &state, CTransaction &tx, bool fCheckInputs, bool fLimitFree, bool* pfMissingInputs, bool fRejectInsaneFee = false, bool fReleaseMain = false);
     bool addUnchecked(const uint256& hash, const CTransaction &tx);
     bool remove(const CTransaction &tx, bool fRecursive = false);
     bool removeConflicts(const CTransaction &tx);
@@ -2103,6 +2219,79 @@ struct CCoinsStats
     CCoinsStats() : nHeight(0), hashBlock(0), nTransactions(0), nTransactionOutputs(0), nSerializedSize(0), hashSerialized(0), nTotalAmount(0) {}
 };
 
+/** Salted hasher for the txids keying the coins cache */
+class CCoinsKeyHasher
+{
+private:
+    uint256 salt;
+
+public:
+    CCoinsKeyHasher();
+    size_t operator()(const uint256 &key) const {
+        return key.GetHash(salt);
+    }
+};
+
+/** A CCoins in a CCoinsViewCache, with its state relative to the base view.
+ *  The coins may be kept compressed, serialized much as on disk, which takes
+ *  a fraction of the memory of the CTxOuts and their scripts; anything
+ *  reading entries of a CCoinsMap must be prepared for that.
+ */
+struct CCoinsCacheEntry
+{
+    CCoins coins; // Empty while compressed
+    std::vector<unsigned char> vchCompressed;
+
+    // Which outputs the base view has unspent, one bit each. Recorded when
+    // an entry that isn't FRESH is first changed, so that the changes can be
+    // written to the base without reading it back.
+    std::vector<unsigned char> vchBaseUnspent;
+
+    unsigned char flags;
+
+    enum Flags {
+        DIRTY = (1 << 0), // This cache entry is potentially different from the version in the base view.
+        FRESH = (1 << 1), // The base view does not have this entry, or only a pruned one.
+        COMPRESSED = (1 << 2), // The coins are only held in vchCompressed.
+    };
+
+    CCoinsCacheEntry() : coins(), flags(0) {}
+
+    // Whether the coins are entirely spent; compressed ones never are
+    bool IsPruned() const {
+        return !(flags & COMPRESSED) && coins.IsPruned();
+    }
+
+    // Copy the coins out, decompressing them if needed
+    void GetCoins(CCoins &coinsOut) const;
+
+    // Switch to the compressed form (unless pruned) and back
+    void Compress();
+    void Expand();
+
+    // Exchange the coins, in whichever form, with those of another entry;
+    // the other flags stay where they are
+    void SwapCoins(CCoinsCacheEntry &other);
+
+    // Record vchBaseUnspent from the coins as they are now, unless the
+    // entry was already changed or the base has nothing unspent anyway
+    void SaveBase();
+
+    // Whether output n is set in a bitmap like vchBaseUnspent
+    static bool IsUnspent(const std::vector<unsigned char> &vch, unsigned int n) {
+        return n / 8 < vch.size() && ((vch[n / 8] >> (n % 8)) & 1);
+    }
+
+    // The bitmap of the unspent outputs of coins
+    static void GetUnspent(const CCoins &coins, std::vector<unsigned char> &vch);
+
+    size_t DynamicMemoryUsage() const {
+        return coins.DynamicMemoryUsage() + memusage::DynamicUsage(vchCompressed) + memusage::DynamicUsage(vchBaseUnspent);
+    }
+};
+
+typedef boost::unordered_map<uint256, CCoinsCacheEntry, CCoinsKeyHasher> CCoinsMap;
+
 /** Abstract view on the open txout dataset. */
 class CCoinsView
 {
@@ -2110,6 +2299,11 @@ public:
     // Retrieve the CCoins (unspent transaction outputs) for a given txid
     virtual bool GetCoins(const uint256 &txid, CCoins &coins);
 
+    // Retrieve the CCoins for each of the given txids, which must not repeat,
+    // into mapCoins; txids without any are left out. Views that read from
+    // disk answer this in one pass, instead of one random read per txid.
+    virtual bool GetCoinsBatch(const std::vector<uint256> &vTxid, CCoinsMap &mapCoins);
+
     // Modify the CCoins for a given txid
     virtual bool SetCoins(const uint256 &txid, const CCoins &coins);
 
@@ -2123,8 +2317,10 @@ public:
     // Modify the currently active block index
     virtual bool SetBestBlock(CBlockIndex *pindex);
 
-    // Do a bulk modification (multiple SetCoins + one SetBestBlock)
-    virtual bool BatchWrite(const std::map<uint256, CCoins> &mapCoins, CBlockIndex *pindex);
+    // Do a bulk modification (multiple SetCoins + one SetBestBlock).
+    // Only entries flagged DIRTY are written; the contents of mapCoins may
+    // be moved out.
+    virtual bool BatchWrite(CCoinsMap &mapCoins, CBlockIndex *pindex);
 
     // Calculate statistics about the unspent transaction output set
     virtual bool GetStats(CCoinsStats &stats);
@@ -2142,37 +2338,76 @@ protected:
 public:
     CCoinsViewBacked(CCoinsView &viewIn);
     bool GetCoins(const uint256 &txid, CCoins &coins);
+    bool GetCoinsBatch(const std::vector<uint256> &vTxid, CCoinsMap &mapCoins);
     bool SetCoins(const uint256 &txid, const CCoins &coins);
     bool HaveCoins(const uint256 &txid);
     CBlockIndex *GetBestBlock();
     bool SetBestBlock(CBlockIndex *pindex);
     void SetBackend(CCoinsView &viewIn);
-    bool BatchWrite(const std::map<uint256, CCoins> &mapCoins, CBlockIndex *pindex);
+    bool BatchWrite(CCoinsMap &mapCoins, CBlockIndex *pindex);
     bool GetStats(CCoinsStats &stats);
 };
 
+/** A reference to a mutable cache entry. While it exists no other entry of
+ *  the cache may be modified; on destruction the cache's memory accounting
+ *  is brought up to date.
+ */
+class CCoinsModifier
+{
+private:
+    CCoinsViewCache &cache;
+    CCoinsMap::iterator it;
+    CCoinsModifier(CCoinsViewCache &cacheIn, CCoinsMap::iterator itIn);
+
+public:
+    CCoins *operator->() { return &it->second.coins; }
+    CCoins &operator*() { return it->second.coins; }
+    ~CCoinsModifier();
+    friend class CCoinsViewCache;
+};
+
 /** CCoinsView that adds a memory cache for transactions to another CCoinsView */
 class CCoinsViewCache : public CCoinsViewBacked
 {
 protected:
     CBlockIndex *pindexTip;
-    std::map<uint256,CCoins> cacheCoins;
+    CCoinsMap cacheCoins;
+
+    // Heap memory used by the entries in cacheCoins
+    size_t cachedCoinsUsage;
+
+    // Whether entries are kept compressed while not handed out by reference
+    bool fCompressed;
+
+    // Whether a CCoinsModifier is outstanding
+    bool fHasModifier;
 
 public:
     CCoinsViewCache(CCoinsView &baseIn, bool fDummy = false);
+    ~CCoinsViewCache();
 
     // Standard CCoinsView methods
     bool GetCoins(const uint256 &txid, CCoins &coins);
+    bool GetCoinsBatch(const std::vector<uint256> &vTxid, CCoinsMap &mapCoins);
     bool SetCoins(const uint256 &txid, const CCoins &coins);
     bool HaveCoins(const uint256 &txid);
     CBlockIndex *GetBestBlock();
     bool SetBestBlock(CBlockIndex *pindex);
-    bool BatchWrite(const std::map<uint256, CCoins> &mapCoins, CBlockIndex *pindex);
+    bool BatchWrite(CCoinsMap &mapCoins, CBlockIndex *pindex);
 
-    // Return a modifiable reference to a CCoins. Check HaveCoins first.
+    // Bring the CCoins of the given txids, which must not repeat, into the
+    // cache. The ones it doesn't hold yet are asked from the base in a
+    // single GetCoinsBatch call.
+    bool FetchCoinsBatch(const std::vector<uint256> &vTxid);
+
+    // Return a reference to a CCoins. Check HaveCoins first.
     // Many methods explicitly require a CCoinsViewCache because of this method, to reduce
     // copying.
-    CCoins &GetCoins(const uint256 &txid);
+    const CCoins &GetCoins(const uint256 &txid);
+
+    // Return a modifiable reference to a CCoins, which is created empty if
+    // it doesn't exist yet. The entry is assumed to be modified.
+    CCoinsModifier ModifyCoins(const uint256 &txid);
 
     // Push the modifications applied to this cache to its base.
     // Failure to call this method before destruction will cause the changes to be forgotten.
@@ -2181,8 +2416,22 @@ public:
     // Calculate the size of the cache (in number of transactions)
     unsigned int GetCacheSize();
 
+    // Calculate the heap memory used by the cache, in bytes
+    size_t DynamicMemoryUsage() const;
+
+    // Keep the entries compressed, at the cost of decompressing them on
+    // every read. Entries that a reference is returned to (GetCoins,
+    // ModifyCoins) are expanded until modified or flushed.
+    void SetCompressed(bool fCompressedIn);
+
 private:
-    std::map<uint256,CCoins>::iterator FetchCoins(const uint256 &txid);
+    CCoinsMap::iterator FetchCoins(const uint256 &txid);
+
+    // Bring an entry into the form the cache keeps its entries in
+    void StoreEntry(CCoinsCacheEntry &entry);
+
+    // CCoinsModifier needs direct access to the map and accounting
+    friend class CCoinsModifier;
 };
 
 /** CCoinsView that brings transactions from a memorypool into view.
@@ -2195,9 +2444,101 @@ protected:
 public:
     CCoinsViewMemPool(CCoinsView &baseIn, CTxMemPool &mempoolIn);
     bool GetCoins(const uint256 &txid, CCoins &coins);
+    bool GetCoinsBatch(const std::vector<uint256> &vTxid, CCoinsMap &mapCoins);
     bool HaveCoins(const uint256 &txid);
 };
 
+/** CCoinsView that writes the changes flushed into it to its base on a
+ *  thread of its own. BatchWrite takes the flushed entries over as a frozen
+ *  snapshot and returns right away, so that block processing doesn't wait
+ *  for the database; until the snapshot is written, reads look in it before
+ *  the base. Only one snapshot is written at a time: a flush that comes in
+ *  while the previous one is still being written waits for it. The best
+ *  block is written in the same batch as the coins, so the base is always
+ *  consistent, if possibly behind.
+ */
+class CCoinsViewAsyncFlush : public CCoinsViewBacked
+{
+private:
+    // Protects the snapshot and the flags
+    boost::mutex mutex;
+    boost::condition_variable cond;
+
+    // The snapshot being written, and the best block it goes with
+    CCoinsMap mapFrozen;
+    CBlockIndex *pindexFrozen;
+
+    // Whether the snapshot still has to be written
+    bool fPending;
+
+    // Whether writing a snapshot failed; no later ones are accepted then
+    bool fFailed;
+
+    bool fStop;
+
+    boost::thread thread;
+
+    void Thread();
+
+public:
+    CCoinsViewAsyncFlush(CCoinsView &baseIn);
+    ~CCoinsViewAsyncFlush();
+
+    bool GetCoins(const uint256 &txid, CCoins &coins);
+    bool GetCoinsBatch(const std::vector<uint256> &vTxid, CCoinsMap &mapCoins);
+    bool SetCoins(const uint256 &txid, const CCoins &coins);
+    bool HaveCoins(const uint256 &txid);
+    CBlockIndex *GetBestBlock();
+    bool SetBestBlock(CBlockIndex *pindex);
+    bool BatchWrite(CCoinsMap &mapCoins, CBlockIndex *pindex);
+    bool GetStats(CCoinsStats &stats);
+
+    // Wait until all snapshots handed over are written; false if one failed
+    bool Sync();
+};
+
+/** Reads the coins spent by blocks that are about to be connected from the
+ *  coin database on a thread of its own, so that the database cache and the
+ *  OS already hold them when ConnectBlock asks for them. This overlaps disk
+ *  reads for one block with verifying the one before it. */
+class CCoinsPrefetcher
+{
+private:
+    // Protects queue, fActive and nBatches
+    boost::mutex mutex;
+    boost::condition_variable cond;
+    std::deque<std::vector<uint256> > queue;
+    bool fActive;
+
+    // Batches read so far; condDone is signalled when it or fActive changes
+    unsigned int nBatches;
+    boost::condition_variable condDone;
+
+    // Held while reading from pview
+    boost::mutex csView;
+    CCoinsView *pview;
+
+    // Blocks queued at most; when the thread falls behind, the oldest are dropped
+    static const unsigned int nMaxQueued = 8;
+
+public:
+    CCoinsPrefetcher() : fActive(false), nBatches(0), pview(NULL) {}
+
+    // Queue the coins a block spends, except those it creates itself
+    void Add(const CBlock &block);
+
+    // Prefetch thread; runs until interrupted
+    void Thread(CCoinsView *pviewIn);
+
+    // Drop queued work and stop using the view
+    void Stop();
+
+    // Wait until the thread accepts work, or until at least nMinBatches
+    // batches have been read; false on timeout. Used by the tests.
+    bool WaitActive(int64 nTimeoutMillis);
+    bool WaitBatches(unsigned int nMinBatches, int64 nTimeoutMillis);
+};
+
 /** Global variable that points to the active CCoinsView (protected by cs_main) */
 extern CCoinsViewCache *pcoinsTip;
 
@@ -0,0 +1,2 @@
+// No build information available
+#define BUILD_DATE "2026-10-17 12:00:22 +0000"
@@ -206,6 +206,67 @@ Value gettxoutsetinfo(const Array& params, bool fHelp)
     return ret;
 }
 
+// Upper end of the bucket the given fraction of runs falls in, in milliseconds
+static double ValidationPercentile(const CValidationPhaseStats &stats, double dFraction)
+{
+    uint64 nRank = (uint64)(dFraction * stats.nCount);
+    uint64 nSeen = 0;
+    for (int i = 0; i < CValidationPhaseStats::nBuckets - 1; i++)
+    {
+        nSeen += stats.vBuckets[i];
+        if (nSeen > nRank)
+            return std::min((double)((int64)1 << i), (double)stats.nMaxMicros) / 1000.0;
+    }
+    return stats.nMaxMicros / 1000.0;
+}
+
+Value getvalidationstats(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() > 1)
+        throw runtime_error(
+            "getvalidationstats [reset=false]\n"
+            "Returns how long each phase of block validation took, over all blocks since\n"
+            "startup or the last reset. Percentiles are the upper ends of histogram buckets,\n"
+            "which are powers of two microseconds; \"histogram\" lists the non-empty ones,\n"
+            "except that the last bucket has no upper end and so a null \"below_ms\".");
+
+    bool fReset = false;
+    if (params.size() > 0)
+        fReset = params[0].get_bool();
+
+    std::vector<CValidationPhaseStats> vStats;
+    GetValidationStats(vStats, fReset);
+
+    Object ret;
+    BOOST_FOREACH(const CValidationPhaseStats &stats, vStats)
+    {
+        Object phase;
+        phase.push_back(Pair("count", (boost::int64_t)stats.nCount));
+        phase.push_back(Pair("total_ms", stats.nTotalMicros / 1000.0));
+        phase.push_back(Pair("mean_ms", stats.nCount ? stats.nTotalMicros / 1000.0 / stats.nCount : 0.0));
+        phase.push_back(Pair("max_ms", stats.nMaxMicros / 1000.0));
+        phase.push_back(Pair("p50_ms", ValidationPercentile(stats, 0.50)));
+        phase.push_back(Pair("p90_ms", ValidationPercentile(stats, 0.90)));
+        phase.push_back(Pair("p99_ms", ValidationPercentile(stats, 0.99)));
+        Array histogram;
+        for (int i = 0; i < CValidationPhaseStats::nBuckets; i++)
+        {
+            if (stats.vBuckets[i] == 0)
+                continue;
+            Object bucket;
+            if (i < CValidationPhaseStats::nBuckets - 1)
+                bucket.push_back(Pair("below_ms", ((int64)1 << i) / 1000.0));
+            else
+                bucket.push_back(Pair("below_ms", Value::null));
+            bucket.push_back(Pair("count", (boost::int64_t)stats.vBuckets[i]));
+            histogram.push_back(bucket);
+        }
+        phase.push_back(Pair("histogram", histogram));
+        ret.push_back(Pair(stats.strName, phase));
+    }
+    return ret;
+}
+
 Value gettxout(const Array& params, bool fHelp)
 {
     if (fHelp || params.size() < 2 || params.size() > 3)
@@ -11,6 +11,9 @@
 using namespace json_spirit;
 using namespace std;
 
+// Longest a getblocktemplate long poll waits before returning anyway, in seconds
+static const int LONGPOLL_TIMEOUT = 300;
+
 // Return average network hashes per second based on the last 'lookup' blocks,
 // or from the last difficulty change if 'lookup' is nonpositive.
 // If 'height' is nonnegative, compute the estimate at the time when a given block was found.
@@ -85,6 +88,150 @@ void ShutdownRPCMining()
     delete pMiningKey; pMiningKey = NULL;
 }
 
+static const int64 DEFAULT_MAX_WORK_UNITS = 10000;
+
+/** Work units handed out by getwork and getworkex, keyed by merkle root.
+ *  Units built from the same CreateNewBlock call share its template, which
+ *  is freed with the last of them.  All units are dropped when the tip
+ *  changes, and the least recently issued ones once more than
+ *  -maxworkunits are outstanding, so memory no longer grows with the
+ *  request rate.  Safe to use from several RPC threads.
+ */
+class CWorkCache
+{
+private:
+    struct CWorkUnit
+    {
+        boost::shared_ptr<CBlockTemplate> pblocktemplate;
+        CScript scriptSig;
+        std::list<uint256>::iterator itLRU;
+    };
+
+    boost::mutex mutex;
+    std::map<uint256, CWorkUnit> mapWork;
+    std::list<uint256> lruWork; // most recently issued first
+
+    // Template new units are made from
+    boost::shared_ptr<CBlockTemplate> pblocktemplate;
+    CBlockIndex* pindexPrev;
+    unsigned int nTransactionsUpdatedLast;
+    int64 nStart;
+    unsigned int nExtraNonce;
+
+public:
+    // Read without the lock by getmininginfo
+    volatile unsigned int nUnits;
+    volatile uint64 nIssued;
+    volatile uint64 nHits;
+    volatile uint64 nStale;
+    volatile uint64 nEvicted;
+
+    CWorkCache() : pindexPrev(NULL), nTransactionsUpdatedLast(0), nStart(0), nExtraNonce(0),
+                   nUnits(0), nIssued(0), nHits(0), nStale(0), nEvicted(0) { }
+
+    // Make a new unit of work and return its header, plus the coinbase and its
+    // merkle branch when asked for
+    void GetWork(CBlockHeader& header, CTransaction* pcoinbase = NULL, std::vector<uint256>* pvMerkleBranch = NULL)
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+
+        // Update block
+        if (pindexPrev != pindexBest ||
+            (nTransactionsUpdated != nTransactionsUpdatedLast && GetTime() - nStart > 60))
+        {
+            if (pindexPrev != pindexBest)
+            {
+                // Deallocate old blocks since they're obsolete now
+                mapWork.clear();
+                lruWork.clear();
+                nUnits = 0;
+            }
+
+            // Clear pindexPrev so future getworks make a new block, despite any failures from here on
+            pindexPrev = NULL;
+
+            // Store the pindexBest used before CreateNewBlock, to avoid races
+            nTransactionsUpdatedLast = nTransactionsUpdated;
+            CBlockIndex* pindexPrevNew = pindexBest;
+            nStart = GetTime();
+
+            // Create new block; cs_main also keeps the key away from a concurrent CheckWork
+            {
+                LOCK(cs_main);
+                pblocktemplate.reset(CreateNewBlockWithKey(*pMiningKey));
+            }
+            if (!pblocktemplate)
+                throw JSONRPCError(RPC_OUT_OF_MEMORY, "Out of memory");
+
+            // Need to update only after we know CreateNewBlock succeeded
+            pindexPrev = pindexPrevNew;
+        }
+        CBlock* pblock = &pblocktemplate->block; // pointer for convenience
+
+        // Update nTime
+        pblock->UpdateTime(pindexPrev);
+        pblock->nNonce = 0;
+
+        // Update nExtraNonce
+        IncrementExtraNonce(pblock, pindexPrev, nExtraNonce);
+
+        // Save
+        CWorkUnit& unit = mapWork[pblock->hashMerkleRoot];
+        if (unit.pblocktemplate)
+            lruWork.erase(unit.itLRU);
+        unit.pblocktemplate = pblocktemplate;
+        unit.scriptSig = pblock->vtx[0].vin[0].scriptSig;
+        unit.itLRU = lruWork.insert(lruWork.begin(), pblock->hashMerkleRoot);
+
+        unsigned int nMaxUnits = std::max((int64)1, GetArg("-maxworkunits", DEFAULT_MAX_WORK_UNITS));
+        while (mapWork.size() > nMaxUnits)
+        {
+            mapWork.erase(lruWork.back());
+            lruWork.pop_back();
+            nEvicted++;
+        }
+        nUnits = mapWork.size();
+        nIssued++;
+
+        header = *pblock;
+        if (pcoinbase)
+            *pcoinbase = pblock->vtx[0];
+        if (pvMerkleBranch)
+            *pvMerkleBranch = pblock->GetMerkleBranch(0);
+    }
+
+    // Look up the unit a submitted header was made from and, if pblock is
+    // given, copy out its block with the coinbase it was handed out with
+    bool GetSubmittedBlock(const uint256& hashMerkleRoot, CBlock* pblock)
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+
+        std::map<uint256, CWorkUnit>::iterator mi = mapWork.find(hashMerkleRoot);
+        if (mi == mapWork.end())
+        {
+            // Issued on an earlier tip, or evicted
+            nStale++;
+            return false;
+        }
+        const CWorkUnit& unit = (*mi).second;
+        if (unit.pblocktemplate->block.hashPrevBlock != hashBestChain)
+        {
+            nStale++;
+            return false;
+        }
+        nHits++;
+
+        if (pblock)
+        {
+            *pblock = unit.pblocktemplate->block;
+            pblock->vtx[0].vin[0].scriptSig = unit.scriptSig;
+        }
+        return true;
+    }
+};
+
+static CWorkCache workcache;
+
 Value getgenerate(const Array& params, bool fHelp)
 {
     if (fHelp || params.size() != 0)
@@ -155,7 +302,19 @@ Value getmininginfo(const Array& params, bool fHelp)
     obj.push_back(Pair("generate",      GetBoolArg("-gen")));
     obj.push_back(Pair("genproclimit",  (int)GetArg("-genproclimit", -1)));
     obj.push_back(Pair("hashespersec",  gethashespersec(params, false)));
+    Array threadrates;
+    if (GetTimeMillis() - nHPSTimerStart <= 8000)
+        BOOST_FOREACH(double dRate, GetMinerThreadHashesPerSec())
+            threadrates.push_back((boost::int64_t)dRate);
+    obj.push_back(Pair("threadhashespersec", threadrates));
     obj.push_back(Pair("networkhashps", getnetworkhashps(params, false)));
+    Object workunits;
+    workunits.push_back(Pair("size",    (int)workcache.nUnits));
+    workunits.push_back(Pair("issued",  (uint64_t)workcache.nIssued));
+    workunits.push_back(Pair("hits",    (uint64_t)workcache.nHits));
+    workunits.push_back(Pair("stale",   (uint64_t)workcache.nStale));
+    workunits.push_back(Pair("evicted", (uint64_t)workcache.nEvicted));
+    obj.push_back(Pair("workunits",     workunits));
     obj.push_back(Pair("pooledtx",      (uint64_t)mempool.size()));
     obj.push_back(Pair("testnet",       fTestNet));
     return obj;
@@ -176,70 +335,22 @@ Value getworkex(const Array& params, bool fHelp)
     if (IsInitialBlockDownload())
         throw JSONRPCError(RPC_CLIENT_IN_INITIAL_DOWNLOAD, "Coolcash is downloading blocks...");
 
-    typedef map<uint256, pair<CBlock*, CScript> > mapNewBlock_t;
-    static mapNewBlock_t mapNewBlock;    // FIXME: thread safety
-    static vector<CBlockTemplate*> vNewBlockTemplate;
     static CReserveKey reservekey(pwalletMain);
 
     if (params.size() == 0)
     {
-        // Update block
-        static unsigned int nTransactionsUpdatedLast;
-        static CBlockIndex* pindexPrev;
-        static int64 nStart;
-        static CBlockTemplate* pblocktemplate;
-        if (pindexPrev != pindexBest ||
-            (nTransactionsUpdated != nTransactionsUpdatedLast && GetTime() - nStart > 60))
-        {
-            if (pindexPrev != pindexBest)
-            {
-                // Deallocate old blocks since they're obsolete now
-                mapNewBlock.clear();
-                BOOST_FOREACH(CBlockTemplate* pblocktemplate, vNewBlockTemplate)
-                    delete pblocktemplate;
-                vNewBlockTemplate.clear();
-            }
-
-            // Clear pindexPrev so future getworks make a new block, despite any failures from here on
-            pindexPrev = NULL;
-
-            // Store the pindexBest used before CreateNewBlock, to avoid races
-            nTransactionsUpdatedLast = nTransactionsUpdated;
-            CBlockIndex* pindexPrevNew = pindexBest;
-            nStart = GetTime();
-
-            // Create new block
-            pblocktemplate = CreateNewBlockWithKey(*pMiningKey);
-            if (!pblocktemplate)
-                throw JSONRPCError(RPC_OUT_OF_MEMORY, "Out of memory");
-            vNewBlockTemplate.push_back(pblocktemplate);
-
-            // Need to update only after we know CreateNewBlock succeeded
-            pindexPrev = pindexPrevNew;
-        }
-        CBlock* pblock = &pblocktemplate->block; // pointer for convenience
-
-        // Update nTime
-        pblock->UpdateTime(pindexPrev);
-        pblock->nNonce = 0;
-
-        // Update nExtraNonce
-        static unsigned int nExtraNonce = 0;
-        IncrementExtraNonce(pblock, pindexPrev, nExtraNonce);
-
-        // Save
-        mapNewBlock[pblock->hashMerkleRoot] = make_pair(pblock, pblock->vtx[0].vin[0].scriptSig);
+        CBlock block;
+        CTransaction coinbaseTx;
+        std::vector<uint256> merkle;
+        workcache.GetWork(block, &coinbaseTx, &merkle);
 
         // Pre-build hash buffers
         char pmidstate[32];
         char pdata[128];
         char phash1[64];
-        FormatHashBuffers(pblock, pmidstate, pdata, phash1);
-
-        uint256 hashTarget = CBigNum().SetCompact(pblock->nBits).getuint256();
+        FormatHashBuffers(&block, pmidstate, pdata, phash1);
 
-        CTransaction coinbaseTx = pblock->vtx[0];
-        std::vector<uint256> merkle = pblock->GetMerkleBranch(0);
+        uint256 hashTarget = CBigNum().SetCompact(block.nBits).getuint256();
 
         Object result;
         result.push_back(Pair("data",     HexStr(BEGIN(pdata), END(pdata))));
@@ -279,21 +390,19 @@ Value getworkex(const Array& params, bool fHelp)
             ((unsigned int*)pdata)[i] = ByteReverse(((unsigned int*)pdata)[i]);
 
         // Get saved block
-        if (!mapNewBlock.count(pdata->hashMerkleRoot))
+        CBlock block;
+        if (!workcache.GetSubmittedBlock(pdata->hashMerkleRoot, &block))
             return false;
-        CBlock* pblock = mapNewBlock[pdata->hashMerkleRoot].first;
 
-        pblock->nTime = pdata->nTime;
-        pblock->nNonce = pdata->nNonce;
+        block.nTime = pdata->nTime;
+        block.nNonce = pdata->nNonce;
 
-        if(coinbase.size() == 0)
-            pblock->vtx[0].vin[0].scriptSig = mapNewBlock[pdata->hashMerkleRoot].second;
-        else
-            CDataStream(coinbase, SER_NETWORK, PROTOCOL_VERSION) >> pblock->vtx[0];
+        if(coinbase.size() != 0)
+            CDataStream(coinbase, SER_NETWORK, PROTOCOL_VERSION) >> block.vtx[0];
 
-        pblock->hashMerkleRoot = pblock->BuildMerkleTree();
+        block.hashMerkleRoot = block.BuildMerkleTree();
 
-        return CheckWork(pblock, *pwalletMain, reservekey);
+        return CheckWork(&block, *pwalletMain, reservekey);
     }
 }
 
@@ -316,66 +425,18 @@ Value getwork(const Array& params, bool fHelp)
     if (IsInitialBlockDownload())
         throw JSONRPCError(RPC_CLIENT_IN_INITIAL_DOWNLOAD, "Coolcash is downloading blocks...");
 
-    typedef map<uint256, pair<CBlock*, CScript> > mapNewBlock_t;
-    static mapNewBlock_t mapNewBlock;    // FIXME: thread safety
-    static vector<CBlockTemplate*> vNewBlockTemplate;
-
     if (params.size() == 0)
     {
-        // Update block
-        static unsigned int nTransactionsUpdatedLast;
-        static CBlockIndex* pindexPrev;
-        static int64 nStart;
-        static CBlockTemplate* pblocktemplate;
-        if (pindexPrev != pindexBest ||
-            (nTransactionsUpdated != nTransactionsUpdatedLast && GetTime() - nStart > 60))
-        {
-            if (pindexPrev != pindexBest)
-            {
-                // Deallocate old blocks since they're obsolete now
-                mapNewBlock.clear();
-                BOOST_FOREACH(CBlockTemplate* pblocktemplate, vNewBlockTemplate)
-                    delete pblocktemplate;
-                vNewBlockTemplate.clear();
-            }
-
-            // Clear pindexPrev so future getworks make a new block, despite any failures from here on
-            pindexPrev = NULL;
-
-            // Store the pindexBest used before CreateNewBlock, to avoid races
-            nTransactionsUpdatedLast = nTransactionsUpdated;
-            CBlockIndex* pindexPrevNew = pindexBest;
-            nStart = GetTime();
-
-            // Create new block
-            pblocktemplate = CreateNewBlockWithKey(*pMiningKey);
-            if (!pblocktemplate)
-                throw JSONRPCError(RPC_OUT_OF_MEMORY, "Out of memory");
-            vNewBlockTemplate.push_back(pblocktemplate);
-
-            // Need to update only after we know CreateNewBlock succeeded
-            pindexPrev = pindexPrevNew;
-        }
-        CBlock* pblock = &pblocktemplate->block; // pointer for convenience
-
-        // Update nTime
-        pblock->UpdateTime(pindexPrev);
-        pblock->nNonce = 0;
-
-        // Update nExtraNonce
-        static unsigned int nExtraNonce = 0;
-        IncrementExtraNonce(pblock, pindexPrev, nExtraNonce);
-
-        // Save
-        mapNewBlock[pblock->hashMerkleRoot] = make_pair(pblock, pblock->vtx[0].vin[0].scriptSig);
+        CBlock block;
+        workcache.GetWork(block);
 
         // Pre-build hash buffers
         char pmidstate[32];
         char pdata[128];
         char phash1[64];
-        FormatHashBuffers(pblock, pmidstate, pdata, phash1);
+        FormatHashBuffers(&block, pmidstate, pdata, phash1);
 
-        uint256 hashTarget = CBigNum().SetCompact(pblock->nBits).getuint256();
+        uint256 hashTarget = CBigNum().SetCompact(block.nBits).getuint256();
 
         Object result;
         result.push_back(Pair("midstate", HexStr(BEGIN(pmidstate), END(pmidstate)))); // deprecated
@@ -396,18 +457,22 @@ Value getwork(const Array& params, bool fHelp)
         for (int i = 0; i < 128/4; i++)
             ((unsigned int*)pdata)[i] = ByteReverse(((unsigned int*)pdata)[i]);
 
+        // The submitted header is final, so the block is only copied out of
+        // the cache for shares that meet the target
+        CBlockHeader header = *pdata;
+        bool fSolved = (header.GetPoWHash() <= CBigNum().SetCompact(header.nBits).getuint256());
+
         // Get saved block
-        if (!mapNewBlock.count(pdata->hashMerkleRoot))
+        CBlock block;
+        if (!workcache.GetSubmittedBlock(pdata->hashMerkleRoot, fSolved ? &block : NULL) || !fSolved)
             return false;
-        CBlock* pblock = mapNewBlock[pdata->hashMerkleRoot].first;
 
-        pblock->nTime = pdata->nTime;
-        pblock->nNonce = pdata->nNonce;
-        pblock->vtx[0].vin[0].scriptSig = mapNewBlock[pdata->hashMerkleRoot].second;
-        pblock->hashMerkleRoot = pblock->BuildMerkleTree();
+        block.nTime = pdata->nTime;
+        block.nNonce = pdata->nNonce;
+        block.hashMerkleRoot = block.BuildMerkleTree();
 
         assert(pwalletMain != NULL);
-        return CheckWork(pblock, *pwalletMain, *pMiningKey);
+        return CheckWork(&block, *pwalletMain, *pMiningKey);
     }
 }
 
@@ -432,12 +497,15 @@ Value getblocktemplate(const Array& params, bool fHelp)
             "  \"sizelimit\" : limit of block size\n"
             "  \"bits\" : compressed target of next block\n"
             "  \"height\" : height of the next block\n"
+            "  \"longpollid\" : pass as \"longpollid\" in [params] to wait until the template changes\n"
             "See https://en.bitcoin.it/wiki/BIP_0022 for full specification.");
 
     std::string strMode = "template";
+    Value lpval = Value::null;
     if (params.size() > 0)
     {
         const Object& oparam = params[0].get_obj();
+        lpval = find_value(oparam, "longpollid");
         const Value& modeval = find_value(oparam, "mode");
         if (modeval.type() == str_type)
             strMode = modeval.get_str();
@@ -458,8 +526,49 @@ Value getblocktemplate(const Array& params, bool fHelp)
     if (IsInitialBlockDownload())
         throw JSONRPCError(RPC_CLIENT_IN_INITIAL_DOWNLOAD, "Coolcash is downloading blocks...");
 
-    // Update block
     static unsigned int nTransactionsUpdatedLast;
+    if (lpval.type() != null_type)
+    {
+        // Wait until the best block changes, or transactions changed and a
+        // minute has passed, or the long poll times out
+        uint256 hashWatchedChain;
+        unsigned int nTransactionsUpdatedLastLP;
+        if (lpval.type() == str_type)
+        {
+            // Format: <hashBestChain><nTransactionsUpdatedLast>
+            std::string lpstr = lpval.get_str();
+            hashWatchedChain.SetHex(lpstr.substr(0, 64));
+            nTransactionsUpdatedLastLP = atoi64(lpstr.size() > 64 ? lpstr.substr(64) : "0");
+        }
+        else
+        {
+            hashWatchedChain = hashBestChain;
+            nTransactionsUpdatedLastLP = nTransactionsUpdatedLast;
+        }
+
+        boost::system_time timeStart = boost::get_system_time();
+        boost::system_time timeCheckTx = timeStart + boost::posix_time::minutes(1);
+        boost::system_time timeEnd = timeStart + boost::posix_time::seconds(LONGPOLL_TIMEOUT);
+        boost::unique_lock<boost::mutex> lock(csBestBlock);
+        while (hashBestChain == hashWatchedChain && IsRPCRunning())
+        {
+            if (!cvBlockChange.timed_wait(lock, std::min(timeCheckTx, timeEnd)))
+            {
+                if (boost::get_system_time() >= timeEnd)
+                    break;
+                // Check transactions for an update
+                if (nTransactionsUpdated != nTransactionsUpdatedLastLP)
+                    break;
+                timeCheckTx += boost::posix_time::seconds(10);
+            }
+        }
+        if (!IsRPCRunning())
+            throw JSONRPCError(RPC_CLIENT_NOT_CONNECTED, "Shutting down");
+    }
+
+    LOCK(cs_main);
+
+    // Update block
     static CBlockIndex* pindexPrev;
     static int64 nStart;
     static CBlockTemplate* pblocktemplate;
@@ -556,6 +665,7 @@ Value getblocktemplate(const Array& params, bool fHelp)
     result.push_back(Pair("curtime", (int64_t)pblock->nTime));
     result.push_back(Pair("bits", HexBits(pblock->nBits)));
     result.push_back(Pair("height", (int64_t)(pindexPrev->nHeight+1)));
+    result.push_back(Pair("longpollid", pindexPrev->GetBlockHash().GetHex() + i64tostr(nTransactionsUpdatedLast)));
 
     return result;
 }
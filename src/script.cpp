@@ -3,7 +3,6 @@
 // Distributed under the MIT/X11 software license, see the accompanying
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 #include <boost/foreach.hpp>
-#include <boost/tuple/tuple.hpp>
 
 using namespace std;
 using namespace boost;
@@ -13,33 +12,153 @@ using namespace boost;
 #include "bignum.h"
 #include "key.h"
 #include "main.h"
+#include "shardedcache.h"
 #include "sync.h"
 #include "util.h"
 
-bool CheckSig(vector<unsigned char> vchSig, const vector<unsigned char> &vchPubKey, const CScript &scriptCode, const CTransaction& txTo, unsigned int nIn, int nHashType, int flags);
+bool CheckSig(vector<unsigned char> vchSig, const vector<unsigned char> &vchPubKey, const CScript &scriptCode, const CTransaction& txTo, unsigned int nIn, int nHashType, int flags,
+              const CSignatureHashContext* psighash = NULL);
 
 
 
 typedef vector<unsigned char> valtype;
-static const valtype vchFalse(0);
-static const valtype vchZero(0);
-static const valtype vchTrue(1, 1);
-static const CBigNum bnZero(0);
-static const CBigNum bnOne(1);
-static const CBigNum bnFalse(0);
-static const CBigNum bnTrue(1);
-static const size_t nMaxNumSize = 4;
+
+/** Element of the interpreter's stack.
+ *
+ * Almost everything a script pushes (numbers, hashes, public keys and
+ * signatures) is at most a few dozen bytes, so elements up to
+ * INLINE_SIZE bytes are stored inside the object and only larger ones go
+ * to the heap.  Copying, swapping and popping the common elements then
+ * never touches the allocator.  Elements never change size once built.
+ */
+class CStackValue
+{
+private:
+    static const unsigned int INLINE_SIZE = 80;
+
+    unsigned int nSize;
+    union
+    {
+        unsigned char vchInline[INLINE_SIZE];
+        unsigned char* pchHeap;
+    };
+
+    void Init(const unsigned char* pbegin, unsigned int n)
+    {
+        nSize = n;
+        if (nSize > INLINE_SIZE)
+            pchHeap = (unsigned char*)malloc(nSize);
+        if (nSize)
+            memcpy(begin(), pbegin, nSize);
+    }
+
+    void Free()
+    {
+        if (nSize > INLINE_SIZE)
+            free(pchHeap);
+    }
+
+public:
+    CStackValue() : nSize(0) { }
+
+    /** Element of n bytes, left for the caller to fill in */
+    explicit CStackValue(unsigned int n) : nSize(n)
+    {
+        if (nSize > INLINE_SIZE)
+            pchHeap = (unsigned char*)malloc(nSize);
+    }
+
+    CStackValue(const unsigned char* pbegin, const unsigned char* pend) { Init(pbegin, pend - pbegin); }
+    explicit CStackValue(const valtype& vch) { Init(vch.empty() ? NULL : &vch[0], vch.size()); }
+    explicit CStackValue(const CScriptNum& bn) { nSize = bn.serialize(vchInline); }
+
+    CStackValue(const CStackValue& other) { Init(other.begin(), other.nSize); }
+
+    CStackValue& operator=(const CStackValue& other)
+    {
+        if (this != &other)
+        {
+            Free();
+            Init(other.begin(), other.nSize);
+        }
+        return *this;
+    }
+
+    ~CStackValue() { Free(); }
+
+    unsigned char* begin() { return nSize > INLINE_SIZE ? pchHeap : vchInline; }
+    const unsigned char* begin() const { return nSize > INLINE_SIZE ? pchHeap : vchInline; }
+    unsigned char* end() { return begin() + nSize; }
+    const unsigned char* end() const { return begin() + nSize; }
+    unsigned int size() const { return nSize; }
+    bool empty() const { return nSize == 0; }
+    unsigned char operator[](unsigned int i) const { return begin()[i]; }
+
+    valtype getvch() const { return valtype(begin(), end()); }
+
+    friend bool operator==(const CStackValue& a, const CStackValue& b)
+    {
+        return a.nSize == b.nSize && memcmp(a.begin(), b.begin(), a.nSize) == 0;
+    }
+
+    // The heap pointer lives in the same bytes as the inline data, so a
+    // swap is a swap of the raw storage.
+    friend void swap(CStackValue& a, CStackValue& b)
+    {
+        unsigned char vchTmp[INLINE_SIZE];
+        memcpy(vchTmp, a.vchInline, INLINE_SIZE);
+        memcpy(a.vchInline, b.vchInline, INLINE_SIZE);
+        memcpy(b.vchInline, vchTmp, INLINE_SIZE);
+        std::swap(a.nSize, b.nSize);
+    }
+};
+
+typedef vector<CStackValue> CScriptStack;
+
+static const CStackValue vchFalse;
+static const CStackValue vchTrue(CScriptNum(1));
+
+// std::vector copies every element when it grows the stack or shifts part
+// of it, which reallocates each large element; these move them with swaps.
+static void ReserveStack(CScriptStack& stack, size_t nExtra)
+{
+    if (stack.capacity() >= stack.size() + nExtra)
+        return;
+    CScriptStack stackNew;
+    stackNew.reserve(std::max(2 * stack.capacity(), stack.size() + nExtra));
+    stackNew.resize(stack.size());
+    for (unsigned int i = 0; i < stack.size(); i++)
+        swap(stackNew[i], stack[i]);
+    stack.swap(stackNew);
+}
+
+static void EraseStack(CScriptStack& stack, CScriptStack::iterator first, CScriptStack::iterator last)
+{
+    CScriptStack::iterator it = first;
+    for (CScriptStack::iterator jt = last; jt != stack.end(); ++it, ++jt)
+        swap(*it, *jt);
+    stack.erase(it, stack.end());
+}
+
+static void InsertStack(CScriptStack& stack, CScriptStack::iterator pos, const CStackValue& value)
+{
+    unsigned int nPos = pos - stack.begin();
+    CStackValue valueCopy(value);
+    ReserveStack(stack, 1);
+    stack.push_back(CStackValue());
+    swap(stack.back(), valueCopy);
+    for (unsigned int i = stack.size() - 1; i > nPos; i--)
+        swap(stack[i], stack[i-1]);
+}
 
 
-CBigNum CastToBigNum(const valtype& vch)
+static inline CScriptNum CastToScriptNum(const CStackValue& v)
 {
-    if (vch.size() > nMaxNumSize)
-        throw runtime_error("CastToBigNum() : overflow");
-    // Get rid of extra leading zeros
-    return CBigNum(CBigNum(vch).getvch());
+    return CScriptNum(v.begin(), v.end());
 }
 
-bool CastToBool(const valtype& vch)
+template<typename T>
+bool CastToBool(const T& vch)
 {
     for (unsigned int i = 0; i < vch.size(); i++)
     {
@@ -62,7 +181,8 @@ bool CastToBool(const valtype& vch)
 //
 #define stacktop(i)  (stack.at(stack.size()+(i)))
 #define altstacktop(i)  (altstack.at(altstack.size()+(i)))
-static inline void popstack(vector<valtype>& stack)
+template<typename T>
+static inline void popstack(vector<T>& stack)
 {
     if (stack.empty())
         throw runtime_error("popstack() : stack empty");
@@ -289,16 +409,16 @@ bool IsCanonicalSignature(const valtype &vchSig) {
     return true;
 }
 
-bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, const CTransaction& txTo, unsigned int nIn, unsigned int flags, int nHashType)
+static bool EvalScript(CScriptStack& stack, const CScript& script, const CTransaction& txTo, unsigned int nIn, unsigned int flags, int nHashType,
+                       const CSignatureHashContext* psighash)
 {
-    CAutoBN_CTX pctx;
     CScript::const_iterator pc = script.begin();
     CScript::const_iterator pend = script.end();
     CScript::const_iterator pbegincodehash = script.begin();
     opcodetype opcode;
     valtype vchPushValue;
     vector<bool> vfExec;
-    vector<valtype> altstack;
+    CScriptStack altstack;
     if (script.size() > 10000)
         return false;
     int nOpCount = 0;
@@ -310,6 +430,10 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
         {
             bool fExec = !count(vfExec.begin(), vfExec.end(), false);
 
+            // No opcode pushes more than three elements, so the ones that
+            // copy an element already on the stack can push it directly.
+            ReserveStack(stack, 3);
+
             //
             // Read instruction
             //
@@ -338,7 +462,7 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                 return false; // Disabled opcodes.
 
             if (fExec && 0 <= opcode && opcode <= OP_PUSHDATA4)
-                stack.push_back(vchPushValue);
+                stack.push_back(CStackValue(vchPushValue));
             else if (fExec || (OP_IF <= opcode && opcode <= OP_ENDIF))
             switch (opcode)
             {
@@ -364,8 +488,8 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                 case OP_16:
                 {
                     // ( -- value)
-                    CBigNum bn((int)opcode - (int)(OP_1 - 1));
-                    stack.push_back(bn.getvch());
+                    CScriptNum bn((int)opcode - (int)(OP_1 - 1));
+                    stack.push_back(CStackValue(bn));
                 }
                 break;
 
@@ -387,7 +511,7 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     {
                         if (stack.size() < 1)
                             return false;
-                        valtype& vch = stacktop(-1);
+                        CStackValue& vch = stacktop(-1);
                         fValue = CastToBool(vch);
                         if (opcode == OP_NOTIF)
                             fValue = !fValue;
@@ -441,7 +565,9 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                 {
                     if (stack.size() < 1)
                         return false;
-                    altstack.push_back(stacktop(-1));
+                    ReserveStack(altstack, 1);
+                    altstack.push_back(CStackValue());
+                    swap(altstack.back(), stacktop(-1));
                     popstack(stack);
                 }
                 break;
@@ -450,7 +576,8 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                 {
                     if (altstack.size() < 1)
                         return false;
-                    stack.push_back(altstacktop(-1));
+                    stack.push_back(CStackValue());
+                    swap(stack.back(), altstacktop(-1));
                     popstack(altstack);
                 }
                 break;
@@ -470,10 +597,8 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     // (x1 x2 -- x1 x2 x1 x2)
                     if (stack.size() < 2)
                         return false;
-                    valtype vch1 = stacktop(-2);
-                    valtype vch2 = stacktop(-1);
-                    stack.push_back(vch1);
-                    stack.push_back(vch2);
+                    stack.push_back(stacktop(-2));
+                    stack.push_back(stacktop(-2));
                 }
                 break;
 
@@ -482,12 +607,9 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     // (x1 x2 x3 -- x1 x2 x3 x1 x2 x3)
                     if (stack.size() < 3)
                         return false;
-                    valtype vch1 = stacktop(-3);
-                    valtype vch2 = stacktop(-2);
-                    valtype vch3 = stacktop(-1);
-                    stack.push_back(vch1);
-                    stack.push_back(vch2);
-                    stack.push_back(vch3);
+                    stack.push_back(stacktop(-3));
+                    stack.push_back(stacktop(-3));
+                    stack.push_back(stacktop(-3));
                 }
                 break;
 
@@ -496,10 +618,8 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     // (x1 x2 x3 x4 -- x1 x2 x3 x4 x1 x2)
                     if (stack.size() < 4)
                         return false;
-                    valtype vch1 = stacktop(-4);
-                    valtype vch2 = stacktop(-3);
-                    stack.push_back(vch1);
-                    stack.push_back(vch2);
+                    stack.push_back(stacktop(-4));
+                    stack.push_back(stacktop(-4));
                 }
                 break;
 
@@ -508,9 +628,9 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     // (x1 x2 x3 x4 x5 x6 -- x3 x4 x5 x6 x1 x2)
                     if (stack.size() < 6)
                         return false;
-                    valtype vch1 = stacktop(-6);
-                    valtype vch2 = stacktop(-5);
-                    stack.erase(stack.end()-6, stack.end()-4);
+                    CStackValue vch1 = stacktop(-6);
+                    CStackValue vch2 = stacktop(-5);
+                    EraseStack(stack, stack.end()-6, stack.end()-4);
                     stack.push_back(vch1);
                     stack.push_back(vch2);
                 }
@@ -531,7 +651,7 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     // (x - 0 | x x)
                     if (stack.size() < 1)
                         return false;
-                    valtype vch = stacktop(-1);
+                    CStackValue vch = stacktop(-1);
                     if (CastToBool(vch))
                         stack.push_back(vch);
                 }
@@ -540,8 +660,8 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                 case OP_DEPTH:
                 {
                     // -- stacksize
-                    CBigNum bn(stack.size());
-                    stack.push_back(bn.getvch());
+                    CScriptNum bn(stack.size());
+                    stack.push_back(CStackValue(bn));
                 }
                 break;
 
@@ -559,8 +679,7 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     // (x -- x x)
                     if (stack.size() < 1)
                         return false;
-                    valtype vch = stacktop(-1);
-                    stack.push_back(vch);
+                    stack.push_back(stacktop(-1));
                 }
                 break;
 
@@ -569,7 +688,7 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     // (x1 x2 -- x2)
                     if (stack.size() < 2)
                         return false;
-                    stack.erase(stack.end() - 2);
+                    EraseStack(stack, stack.end()-2, stack.end()-1);
                 }
                 break;
 
@@ -578,8 +697,7 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     // (x1 x2 -- x1 x2 x1)
                     if (stack.size() < 2)
                         return false;
-                    valtype vch = stacktop(-2);
-                    stack.push_back(vch);
+                    stack.push_back(stacktop(-2));
                 }
                 break;
 
@@ -590,13 +708,13 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     // (xn ... x2 x1 x0 n - ... x2 x1 x0 xn)
                     if (stack.size() < 2)
                         return false;
-                    int n = CastToBigNum(stacktop(-1)).getint();
+                    int n = CastToScriptNum(stacktop(-1)).getint();
                     popstack(stack);
                     if (n < 0 || n >= (int)stack.size())
                         return false;
-                    valtype vch = stacktop(-n-1);
+                    CStackValue vch = stacktop(-n-1);
                     if (opcode == OP_ROLL)
-                        stack.erase(stack.end()-n-1);
+                        EraseStack(stack, stack.end()-n-1, stack.end()-n);
                     stack.push_back(vch);
                 }
                 break;
@@ -627,8 +745,8 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     // (x1 x2 -- x2 x1 x2)
                     if (stack.size() < 2)
                         return false;
-                    valtype vch = stacktop(-1);
-                    stack.insert(stack.end()-2, vch);
+                    CStackValue vch = stacktop(-1);
+                    InsertStack(stack, stack.end()-2, vch);
                 }
                 break;
 
@@ -638,8 +756,8 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     // (in -- in size)
                     if (stack.size() < 1)
                         return false;
-                    CBigNum bn(stacktop(-1).size());
-                    stack.push_back(bn.getvch());
+                    CScriptNum bn(stacktop(-1).size());
+                    stack.push_back(CStackValue(bn));
                 }
                 break;
 
@@ -654,8 +772,8 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     // (x1 x2 - bool)
                     if (stack.size() < 2)
                         return false;
-                    valtype& vch1 = stacktop(-2);
-                    valtype& vch2 = stacktop(-1);
+                    CStackValue& vch1 = stacktop(-2);
+                    CStackValue& vch2 = stacktop(-1);
                     bool fEqual = (vch1 == vch2);
                     // OP_NOTEQUAL is disabled because it would be too easy to say
                     // something like n != 1 and have some wiseguy pass in 1 with extra
@@ -689,19 +807,19 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     // (in -- out)
                     if (stack.size() < 1)
                         return false;
-                    CBigNum bn = CastToBigNum(stacktop(-1));
+                    CScriptNum bn = CastToScriptNum(stacktop(-1));
                     switch (opcode)
                     {
-                    case OP_1ADD:       bn += bnOne; break;
-                    case OP_1SUB:       bn -= bnOne; break;
+                    case OP_1ADD:       bn += 1; break;
+                    case OP_1SUB:       bn -= 1; break;
                     case OP_NEGATE:     bn = -bn; break;
-                    case OP_ABS:        if (bn < bnZero) bn = -bn; break;
-                    case OP_NOT:        bn = (bn == bnZero); break;
-                    case OP_0NOTEQUAL:  bn = (bn != bnZero); break;
+                    case OP_ABS:        if (bn < 0) bn = -bn; break;
+                    case OP_NOT:        bn = (bn == 0); break;
+                    case OP_0NOTEQUAL:  bn = (bn != 0); break;
                     default:            assert(!"invalid opcode"); break;
                     }
                     popstack(stack);
-                    stack.push_back(bn.getvch());
+                    stack.push_back(CStackValue(bn));
                 }
                 break;
 
@@ -722,9 +840,9 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     // (x1 x2 -- out)
                     if (stack.size() < 2)
                         return false;
-                    CBigNum bn1 = CastToBigNum(stacktop(-2));
-                    CBigNum bn2 = CastToBigNum(stacktop(-1));
-                    CBigNum bn;
+                    CScriptNum bn1 = CastToScriptNum(stacktop(-2));
+                    CScriptNum bn2 = CastToScriptNum(stacktop(-1));
+                    CScriptNum bn(0);
                     switch (opcode)
                     {
                     case OP_ADD:
@@ -735,8 +853,8 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                         bn = bn1 - bn2;
                         break;
 
-                    case OP_BOOLAND:             bn = (bn1 != bnZero && bn2 != bnZero); break;
-                    case OP_BOOLOR:              bn = (bn1 != bnZero || bn2 != bnZero); break;
+                    case OP_BOOLAND:             bn = (bn1 != 0 && bn2 != 0); break;
+                    case OP_BOOLOR:              bn = (bn1 != 0 || bn2 != 0); break;
                     case OP_NUMEQUAL:            bn = (bn1 == bn2); break;
                     case OP_NUMEQUALVERIFY:      bn = (bn1 == bn2); break;
                     case OP_NUMNOTEQUAL:         bn = (bn1 != bn2); break;
@@ -750,7 +868,7 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     }
                     popstack(stack);
                     popstack(stack);
-                    stack.push_back(bn.getvch());
+                    stack.push_back(CStackValue(bn));
 
                     if (opcode == OP_NUMEQUALVERIFY)
                     {
@@ -767,9 +885,9 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     // (x min max -- out)
                     if (stack.size() < 3)
                         return false;
-                    CBigNum bn1 = CastToBigNum(stacktop(-3));
-                    CBigNum bn2 = CastToBigNum(stacktop(-2));
-                    CBigNum bn3 = CastToBigNum(stacktop(-1));
+                    CScriptNum bn1 = CastToScriptNum(stacktop(-3));
+                    CScriptNum bn2 = CastToScriptNum(stacktop(-2));
+                    CScriptNum bn3 = CastToScriptNum(stacktop(-1));
                     bool fValue = (bn2 <= bn1 && bn1 < bn3);
                     popstack(stack);
                     popstack(stack);
@@ -791,23 +909,24 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     // (in -- hash)
                     if (stack.size() < 1)
                         return false;
-                    valtype& vch = stacktop(-1);
-                    valtype vchHash((opcode == OP_RIPEMD160 || opcode == OP_SHA1 || opcode == OP_HASH160) ? 20 : 32);
+                    const CStackValue& vch = stacktop(-1);
+                    CStackValue vchHash((opcode == OP_RIPEMD160 || opcode == OP_SHA1 || opcode == OP_HASH160) ? 20 : 32);
                     if (opcode == OP_RIPEMD160)
-                        RIPEMD160(&vch[0], vch.size(), &vchHash[0]);
+                        RIPEMD160(vch.begin(), vch.size(), vchHash.begin());
                     else if (opcode == OP_SHA1)
-                        SHA1(&vch[0], vch.size(), &vchHash[0]);
+                        SHA1(vch.begin(), vch.size(), vchHash.begin());
                     else if (opcode == OP_SHA256)
-                        SHA256(&vch[0], vch.size(), &vchHash[0]);
+                        SHA256(vch.begin(), vch.size(), vchHash.begin());
                     else if (opcode == OP_HASH160)
                     {
-                        uint160 hash160 = Hash160(vch);
-                        memcpy(&vchHash[0], &hash160, sizeof(hash160));
+                        unsigned char hash1[32];
+                        SHA256(vch.begin(), vch.size(), hash1);
+                        RIPEMD160(hash1, sizeof(hash1), vchHash.begin());
                     }
                     else if (opcode == OP_HASH256)
                     {
                         uint256 hash = Hash(vch.begin(), vch.end());
-                        memcpy(&vchHash[0], &hash, sizeof(hash));
+                        memcpy(vchHash.begin(), &hash, sizeof(hash));
                     }
                     popstack(stack);
                     stack.push_back(vchHash);
@@ -828,8 +947,8 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     if (stack.size() < 2)
                         return false;
 
-                    valtype& vchSig    = stacktop(-2);
-                    valtype& vchPubKey = stacktop(-1);
+                    valtype vchSig    = stacktop(-2).getvch();
+                    valtype vchPubKey = stacktop(-1).getvch();
 
                     ////// debug print
                     //PrintHex(vchSig.begin(), vchSig.end(), "sig: %s\n");
@@ -843,7 +962,7 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
 
                     bool fSuccess = (!fStrictEncodings || (IsCanonicalSignature(vchSig) && IsCanonicalPubKey(vchPubKey)));
                     if (fSuccess)
-                        fSuccess = CheckSig(vchSig, vchPubKey, scriptCode, txTo, nIn, nHashType, flags);
+                        fSuccess = CheckSig(vchSig, vchPubKey, scriptCode, txTo, nIn, nHashType, flags, psighash);
 
                     popstack(stack);
                     popstack(stack);
@@ -867,7 +986,7 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     if ((int)stack.size() < i)
                         return false;
 
-                    int nKeysCount = CastToBigNum(stacktop(-i)).getint();
+                    int nKeysCount = CastToScriptNum(stacktop(-i)).getint();
                     if (nKeysCount < 0 || nKeysCount > 20)
                         return false;
                     nOpCount += nKeysCount;
@@ -878,7 +997,7 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     if ((int)stack.size() < i)
                         return false;
 
-                    int nSigsCount = CastToBigNum(stacktop(-i)).getint();
+                    int nSigsCount = CastToScriptNum(stacktop(-i)).getint();
                     if (nSigsCount < 0 || nSigsCount > nKeysCount)
                         return false;
                     int isig = ++i;
@@ -892,20 +1011,20 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     // Drop the signatures, since there's no way for a signature to sign itself
                     for (int k = 0; k < nSigsCount; k++)
                     {
-                        valtype& vchSig = stacktop(-isig-k);
+                        valtype vchSig = stacktop(-isig-k).getvch();
                         scriptCode.FindAndDelete(CScript(vchSig));
                     }
 
                     bool fSuccess = true;
                     while (fSuccess && nSigsCount > 0)
                     {
-                        valtype& vchSig    = stacktop(-isig);
-                        valtype& vchPubKey = stacktop(-ikey);
+                        valtype vchSig    = stacktop(-isig).getvch();
+                        valtype vchPubKey = stacktop(-ikey).getvch();
 
                         // Check signature
                         bool fOk = (!fStrictEncodings || (IsCanonicalSignature(vchSig) && IsCanonicalPubKey(vchPubKey)));
                         if (fOk)
-                            fOk = CheckSig(vchSig, vchPubKey, scriptCode, txTo, nIn, nHashType, flags);
+                            fOk = CheckSig(vchSig, vchPubKey, scriptCode, txTo, nIn, nHashType, flags, psighash);
 
                         if (fOk) {
                             isig++;
@@ -955,7 +1074,20 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
     return true;
 }
 
-
+bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, const CTransaction& txTo, unsigned int nIn, unsigned int flags, int nHashType)
+{
+    CScriptStack stackEval;
+    stackEval.reserve(stack.size());
+    BOOST_FOREACH(const valtype& vch, stack)
+        stackEval.push_back(CStackValue(vch));
+    bool fResult = EvalScript(stackEval, script, txTo, nIn, flags, nHashType, NULL);
+    // Callers such as CombineSignatures use the stack even on failure
+    stack.clear();
+    stack.reserve(stackEval.size());
+    BOOST_FOREACH(const CStackValue& v, stackEval)
+        stack.push_back(v.getvch());
+    return fResult;
+}
 
 
 
@@ -1024,65 +1156,121 @@ uint256 SignatureHash(CScript scriptCode, const CTransaction& txTo, unsigned int
     return ss.GetHash();
 }
 
+CSignatureHashContext::CSignatureHashContext(const CTransaction& txToIn) : ptxTo(&txToIn)
+{
+    // Serialized the same way as CTransaction, with every scriptSig blanked
+    CDataStream ss(SER_GETHASH, 0);
+    ss << ptxTo->nVersion;
+    WriteCompactSize(ss, ptxTo->vin.size());
+    vScriptPos.reserve(ptxTo->vin.size());
+    BOOST_FOREACH(const CTxIn& txin, ptxTo->vin)
+    {
+        ss << txin.prevout;
+        vScriptPos.push_back(ss.size());
+        ss << CScript() << txin.nSequence;
+    }
+    ss << ptxTo->vout << ptxTo->nLockTime;
+    vchBlank.assign(ss.begin(), ss.end());
+
+    // Hash up to each input's script in one pass
+    vMidstate.resize(vScriptPos.size());
+    SHA256_CTX ctx;
+    SHA256_Init(&ctx);
+    unsigned int nPos = 0;
+    for (unsigned int i = 0; i < vScriptPos.size(); i++)
+    {
+        SHA256_Update(&ctx, &vchBlank[nPos], vScriptPos[i] - nPos);
+        nPos = vScriptPos[i];
+        vMidstate[i] = ctx;
+    }
+}
+
+uint256 CSignatureHashContext::SignatureHash(const CScript& scriptCode, unsigned int nIn, int nHashType) const
+{
+    // NONE, SINGLE and ANYONECANPAY change more than the signed input's script
+    if ((nHashType & 0x1f) == SIGHASH_NONE || (nHashType & 0x1f) == SIGHASH_SINGLE ||
+        (nHashType & SIGHASH_ANYONECANPAY) || nIn >= vScriptPos.size())
+        return ::SignatureHash(scriptCode, *ptxTo, nIn, nHashType);
+
+    CScript scriptCodeSigned(scriptCode);
+    scriptCodeSigned.FindAndDelete(CScript(OP_CODESEPARATOR));
+
+    // Skip the blank script's length byte, which is all it is
+    unsigned int nRest = vScriptPos[nIn] + 1;
+    CHashWriter ss(vMidstate[nIn], SER_GETHASH, 0);
+    ss << scriptCodeSigned;
+    ss.write((const char*)&vchBlank[nRest], vchBlank.size() - nRest);
+    ss << nHashType;
+    return ss.GetHash();
+}
+
 
 // Valid signature cache, to avoid doing expensive ECDSA signature checking
 // twice for every transaction (once when accepted into memory pool, and
 // again when accepted into the block chain)
+//
+// Entries are salted 32-byte digests of (signature hash, public key,
+// signature) in a CShardedCache, so memory use is set in megabytes by
+// -sigcachemaxmb, and lookups from the script check threads rarely wait on
+// each other.
 
 class CSignatureCache
 {
 private:
-     // sigdata_type is (signature hash, signature, public key):
-    typedef boost::tuple<uint256, std::vector<unsigned char>, CPubKey> sigdata_type;
-    std::set< sigdata_type> setValid;
-    boost::shared_mutex cs_sigcache;
+    struct CEntry
+    {
+        uint256 hash;
+    };
+
+    CShardedCache<CEntry, 32> cache;
+
+    uint256 GetEntryHash(const uint256 &hash, const std::vector<unsigned char>& vchSig, const CPubKey& pubKey) const
+    {
+        const uint256& salt = cache.GetSalt();
+        uint256 entry;
+        SHA256_CTX ctx;
+        SHA256_Init(&ctx);
+        SHA256_Update(&ctx, salt.begin(), salt.size());
+        SHA256_Update(&ctx, hash.begin(), hash.size());
+        SHA256_Update(&ctx, pubKey.begin(), pubKey.size());
+        SHA256_Update(&ctx, vchSig.empty() ? NULL : &vchSig[0], vchSig.size());
+        SHA256_Final((unsigned char*)&entry, &ctx);
+        return entry;
+    }
+
+    // -sigcachemaxmb is in megabytes; 0 turns the cache off. Older versions
+    // limited the cache with -maxsigcachesize, in entries, which is still
+    // understood so that existing settings keep their meaning.
+    static uint64 GetMaxBytes()
+    {
+        int64 nMaxCacheSize;
+        if (mapArgs.count("-sigcachemaxmb") || !mapArgs.count("-maxsigcachesize"))
+            nMaxCacheSize = GetArg("-sigcachemaxmb", 32) * 1024 * 1024;
+        else
+            nMaxCacheSize = GetArg("-maxsigcachesize", 50000) * (int64)sizeof(CEntry);
+        return std::max((int64)0, nMaxCacheSize);
+    }
 
 public:
+    CSignatureCache() : cache(GetMaxBytes()) { }
+
     bool
     Get(const uint256 &hash, const std::vector<unsigned char>& vchSig, const CPubKey& pubKey)
     {
-        boost::shared_lock<boost::shared_mutex> lock(cs_sigcache);
-
-        sigdata_type k(hash, vchSig, pubKey);
-        std::set<sigdata_type>::iterator mi = setValid.find(k);
-        if (mi != setValid.end())
-            return true;
-        return false;
+        CEntry entry;
+        return cache.Get(GetEntryHash(hash, vchSig, pubKey), entry);
     }
 
     void Set(const uint256 &hash, const std::vector<unsigned char>& vchSig, const CPubKey& pubKey)
     {
-        // DoS prevention: limit cache size to less than 10MB
-        // (~200 bytes per cache entry times 50,000 entries)
-        // Since there are a maximum of 20,000 signature operations per block
-        // 50,000 is a reasonable default.
-        int64 nMaxCacheSize = GetArg("-maxsigcachesize", 50000);
-        if (nMaxCacheSize <= 0) return;
-
-        boost::unique_lock<boost::shared_mutex> lock(cs_sigcache);
-
-        while (static_cast<int64>(setValid.size()) > nMaxCacheSize)
-        {
-            // Evict a random entry. Random because that helps
-            // foil would-be DoS attackers who might try to pre-generate
-            // and re-use a set of valid signatures just-slightly-greater
-            // than our cache size.
-            uint256 randomHash = GetRandHash();
-            std::vector<unsigned char> unused;
-            std::set<sigdata_type>::iterator it =
-                setValid.lower_bound(sigdata_type(randomHash, unused, unused));
-            if (it == setValid.end())
-                it = setValid.begin();
-            setValid.erase(*it);
-        }
-
-        sigdata_type k(hash, vchSig, pubKey);
-        setValid.insert(k);
+        CEntry entry;
+        entry.hash = GetEntryHash(hash, vchSig, pubKey);
+        cache.Set(entry);
     }
 };
 
 bool CheckSig(vector<unsigned char> vchSig, const vector<unsigned char> &vchPubKey, const CScript &scriptCode,
-              const CTransaction& txTo, unsigned int nIn, int nHashType, int flags)
+              const CTransaction& txTo, unsigned int nIn, int nHashType, int flags, const CSignatureHashContext* psighash)
 {
     static CSignatureCache signatureCache;
 
@@ -1099,7 +1287,7 @@ bool CheckSig(vector<unsigned char> vchSig, const vector<unsigned char> &vchPubK
         return false;
     vchSig.pop_back();
 
-    uint256 sighash = SignatureHash(scriptCode, txTo, nIn, nHashType);
+    uint256 sighash = psighash ? psighash->SignatureHash(scriptCode, nIn, nHashType) : SignatureHash(scriptCode, txTo, nIn, nHashType);
 
     if (signatureCache.Get(sighash, vchSig, pubkey))
         return true;
@@ -1475,14 +1663,14 @@ bool ExtractDestinations(const CScript& scriptPubKey, txnouttype& typeRet, vecto
 }
 
 bool VerifyScript(const CScript& scriptSig, const CScript& scriptPubKey, const CTransaction& txTo, unsigned int nIn,
-                  unsigned int flags, int nHashType)
+                  unsigned int flags, int nHashType, const CSignatureHashContext* psighash)
 {
-    vector<vector<unsigned char> > stack, stackCopy;
-    if (!EvalScript(stack, scriptSig, txTo, nIn, flags, nHashType))
+    CScriptStack stack, stackCopy;
+    if (!EvalScript(stack, scriptSig, txTo, nIn, flags, nHashType, psighash))
         return false;
     if (flags & SCRIPT_VERIFY_P2SH)
         stackCopy = stack;
-    if (!EvalScript(stack, scriptPubKey, txTo, nIn, flags, nHashType))
+    if (!EvalScript(stack, scriptPubKey, txTo, nIn, flags, nHashType, psighash))
         return false;
     if (stack.empty())
         return false;
@@ -1501,11 +1689,11 @@ bool VerifyScript(const CScript& scriptSig, const CScript& scriptPubKey, const C
         // an empty stack and the EvalScript above would return false.
         assert(!stackCopy.empty());
 
-        const valtype& pubKeySerialized = stackCopy.back();
+        const CStackValue& pubKeySerialized = stackCopy.back();
         CScript pubKey2(pubKeySerialized.begin(), pubKeySerialized.end());
         popstack(stackCopy);
 
-        if (!EvalScript(stackCopy, pubKey2, txTo, nIn, flags, nHashType))
+        if (!EvalScript(stackCopy, pubKey2, txTo, nIn, flags, nHashType, psighash))
             return false;
         if (stackCopy.empty())
             return false;
@@ -1843,7 +2031,7 @@ bool CScriptCompressor::IsToPubKey(CPubKey &pubkey) const
     return false;
 }
 
-bool CScriptCompressor::Compress(std::vector<unsigned char> &out) const
+bool CScriptCompressor::Compress(std::vector<unsigned char> &out, bool fFast) const
 {
     CKeyID keyID;
     if (IsToKeyID(keyID)) {
@@ -1860,7 +2048,7 @@ bool CScriptCompressor::Compress(std::vector<unsigned char> &out) const
         return true;
     }
     CPubKey pubkey;
-    if (IsToPubKey(pubkey)) {
+    if (!(fFast && script.size() == 67) && IsToPubKey(pubkey)) {
         out.resize(33);
         memcpy(&out[1], &pubkey[1], 32);
         if (pubkey[0] == 0x02 || pubkey[0] == 0x03) {
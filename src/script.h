@@ -5,12 +5,16 @@
 #ifndef H_BITCOIN_SCRIPT
 #define H_BITCOIN_SCRIPT
 
+#include <limits>
+#include <stdexcept>
 #include <string>
 #include <vector>
 
 #include <boost/foreach.hpp>
 #include <boost/variant.hpp>
 
+#include <openssl/sha.h>
+
 #include "keystore.h"
 #include "bignum.h"
 
@@ -240,6 +244,133 @@ inline std::string StackString(const std::vector<std::vector<unsigned char> >& v
 
 
 
+class scriptnum_error : public std::runtime_error
+{
+public:
+    explicit scriptnum_error(const std::string& str) : std::runtime_error(str) {}
+};
+
+/** Numeric script operand.
+ *
+ * Script numbers are little-endian sign-magnitude byte vectors of at most
+ * nMaxNumSize bytes; results of arithmetic on them may be one byte longer
+ * and are still pushed, but cannot be used as operands again.  All of that
+ * fits in an int64, so the interpreter does not need CBigNum for it.  The
+ * encoding produced by getvch()/serialize() is the same as CBigNum::getvch().
+ */
+class CScriptNum
+{
+public:
+    static const size_t nMaxNumSize = 4;
+
+    explicit CScriptNum(const int64& n) : m_value(n) { }
+
+    CScriptNum(const unsigned char* pbegin, const unsigned char* pend)
+    {
+        if ((size_t)(pend - pbegin) > nMaxNumSize)
+            throw scriptnum_error("CScriptNum() : overflow");
+        m_value = set_vch(pbegin, pend);
+    }
+
+    explicit CScriptNum(const std::vector<unsigned char>& vch)
+    {
+        if (vch.size() > nMaxNumSize)
+            throw scriptnum_error("CScriptNum() : overflow");
+        m_value = vch.empty() ? 0 : set_vch(&vch[0], &vch[0] + vch.size());
+    }
+
+    inline bool operator==(const int64& rhs) const    { return m_value == rhs; }
+    inline bool operator!=(const int64& rhs) const    { return m_value != rhs; }
+    inline bool operator<=(const int64& rhs) const    { return m_value <= rhs; }
+    inline bool operator< (const int64& rhs) const    { return m_value <  rhs; }
+    inline bool operator>=(const int64& rhs) const    { return m_value >= rhs; }
+    inline bool operator> (const int64& rhs) const    { return m_value >  rhs; }
+
+    inline bool operator==(const CScriptNum& rhs) const { return operator==(rhs.m_value); }
+    inline bool operator!=(const CScriptNum& rhs) const { return operator!=(rhs.m_value); }
+    inline bool operator<=(const CScriptNum& rhs) const { return operator<=(rhs.m_value); }
+    inline bool operator< (const CScriptNum& rhs) const { return operator< (rhs.m_value); }
+    inline bool operator>=(const CScriptNum& rhs) const { return operator>=(rhs.m_value); }
+    inline bool operator> (const CScriptNum& rhs) const { return operator> (rhs.m_value); }
+
+    inline CScriptNum operator+(const int64& rhs) const     { return CScriptNum(m_value + rhs); }
+    inline CScriptNum operator-(const int64& rhs) const     { return CScriptNum(m_value - rhs); }
+    inline CScriptNum operator+(const CScriptNum& rhs) const { return operator+(rhs.m_value); }
+    inline CScriptNum operator-(const CScriptNum& rhs) const { return operator-(rhs.m_value); }
+
+    inline CScriptNum& operator+=(const CScriptNum& rhs)    { return operator+=(rhs.m_value); }
+    inline CScriptNum& operator-=(const CScriptNum& rhs)    { return operator-=(rhs.m_value); }
+
+    inline CScriptNum operator-() const { return CScriptNum(-m_value); }
+
+    inline CScriptNum& operator=(const int64& rhs)  { m_value = rhs; return *this; }
+    inline CScriptNum& operator+=(const int64& rhs) { m_value += rhs; return *this; }
+    inline CScriptNum& operator-=(const int64& rhs) { m_value -= rhs; return *this; }
+
+    int getint() const
+    {
+        if (m_value > std::numeric_limits<int>::max())
+            return std::numeric_limits<int>::max();
+        else if (m_value < std::numeric_limits<int>::min())
+            return std::numeric_limits<int>::min();
+        return (int)m_value;
+    }
+
+    std::vector<unsigned char> getvch() const
+    {
+        unsigned char pch[9];
+        unsigned int nSize = serialize(m_value, pch);
+        return std::vector<unsigned char>(pch, pch + nSize);
+    }
+
+    unsigned int serialize(unsigned char* pch) const { return serialize(m_value, pch); }
+
+    /** Write the minimal encoding of n to pch, which must have room for 9
+     *  bytes, and return its length (0 for zero). */
+    static unsigned int serialize(const int64& n, unsigned char* pch)
+    {
+        if (n == 0)
+            return 0;
+
+        const bool fNegative = n < 0;
+        uint64 nAbs = fNegative ? ~(uint64)n + 1 : (uint64)n;
+        unsigned int nSize = 0;
+        while (nAbs)
+        {
+            pch[nSize++] = nAbs & 0xff;
+            nAbs >>= 8;
+        }
+
+        // The top bit of the last byte is the sign; if the magnitude already
+        // uses it, add a byte for the sign alone.
+        if (pch[nSize - 1] & 0x80)
+            pch[nSize++] = fNegative ? 0x80 : 0;
+        else if (fNegative)
+            pch[nSize - 1] |= 0x80;
+        return nSize;
+    }
+
+private:
+    static int64 set_vch(const unsigned char* pbegin, const unsigned char* pend)
+    {
+        if (pbegin == pend)
+            return 0;
+
+        const unsigned int nSize = pend - pbegin;
+        int64 result = 0;
+        for (unsigned int i = 0; i < nSize; i++)
+            result |= (int64)pbegin[i] << (8 * i);
+
+        // If the input's last byte has the sign bit set, the result is
+        // negative; "negative zero" encodings come out as plain 0.
+        if (pbegin[nSize - 1] & 0x80)
+            return -(result & ~((int64)0x80 << (8 * (nSize - 1))));
+        return result;
+    }
+
+    int64 m_value;
+};
+
 /** Serialized script, used inside transaction inputs and outputs */
 class CScript : public std::vector<unsigned char>
 {
@@ -625,7 +756,9 @@ protected:
     bool IsToScriptID(CScriptID &hash) const;
     bool IsToPubKey(CPubKey &pubkey) const;
 
-    bool Compress(std::vector<unsigned char> &out) const;
+    // With fFast, scripts whose compact form takes elliptic curve arithmetic
+    // to decode are left as they are
+    bool Compress(std::vector<unsigned char> &out, bool fFast = false) const;
     unsigned int GetSpecialSize(unsigned int nSize) const;
     bool Decompress(unsigned int nSize, const std::vector<unsigned char> &out);
 public:
@@ -633,7 +766,7 @@ public:
 
     unsigned int GetSerializeSize(int nType, int nVersion) const {
         std::vector<unsigned char> compr;
-        if (Compress(compr))
+        if (Compress(compr, (nType & SER_FASTCOMPRESS) != 0))
             return compr.size();
         unsigned int nSize = script.size() + nSpecialScripts;
         return script.size() + VARINT(nSize).GetSerializeSize(nType, nVersion);
@@ -642,7 +775,7 @@ public:
     template<typename Stream>
     void Serialize(Stream &s, int nType, int nVersion) const {
         std::vector<unsigned char> compr;
-        if (Compress(compr)) {
+        if (Compress(compr, (nType & SER_FASTCOMPRESS) != 0)) {
             s << CFlatData(&compr[0], &compr[compr.size()]);
             return;
         }
@@ -670,6 +803,32 @@ public:
 bool IsCanonicalPubKey(const std::vector<unsigned char> &vchPubKey);
 bool IsCanonicalSignature(const std::vector<unsigned char> &vchSig);
 
+/** The parts of a transaction's signature hashes that are the same for all
+ *  of its inputs.  SignatureHash() copies and serializes the whole
+ *  transaction for every input; with this only the bytes from the signed
+ *  input on are hashed again.  Built once per transaction and shared by the
+ *  checks of all of its inputs; only SIGHASH_ALL is sped up, other hash
+ *  types fall back to SignatureHash().
+ */
+class CSignatureHashContext
+{
+private:
+    const CTransaction* ptxTo;
+
+    // The transaction serialized with all input scripts empty
+    std::vector<unsigned char> vchBlank;
+
+    // Offset of each input's (empty) script in vchBlank, and the hashing
+    // state after everything before it
+    std::vector<unsigned int> vScriptPos;
+    std::vector<SHA256_CTX> vMidstate;
+
+public:
+    CSignatureHashContext(const CTransaction& txToIn);
+
+    uint256 SignatureHash(const CScript& scriptCode, unsigned int nIn, int nHashType) const;
+};
+
 uint256 SignatureHash(CScript scriptCode, const CTransaction& txTo, unsigned int nIn, int nHashType);
 bool EvalScript(std::vector<std::vector<unsigned char> >& stack, const CScript& script, const CTransaction& txTo, unsigned int nIn, unsigned int flags, int nHashType);
 bool Solver(const CScript& scriptPubKey, txnouttype& typeRet, std::vector<std::vector<unsigned char> >& vSolutionsRet);
@@ -681,7 +840,8 @@ bool ExtractDestination(const CScript& scriptPubKey, CTxDestination& addressRet)
 bool ExtractDestinations(const CScript& scriptPubKey, txnouttype& typeRet, std::vector<CTxDestination>& addressRet, int& nRequiredRet);
 bool SignSignature(const CKeyStore& keystore, const CScript& fromPubKey, CTransaction& txTo, unsigned int nIn, int nHashType=SIGHASH_ALL);
 bool SignSignature(const CKeyStore& keystore, const CTransaction& txFrom, CTransaction& txTo, unsigned int nIn, int nHashType=SIGHASH_ALL);
-bool VerifyScript(const CScript& scriptSig, const CScript& scriptPubKey, const CTransaction& txTo, unsigned int nIn, unsigned int flags, int nHashType);
+bool VerifyScript(const CScript& scriptSig, const CScript& scriptPubKey, const CTransaction& txTo, unsigned int nIn, unsigned int flags, int nHashType,
+                  const CSignatureHashContext* psighash = NULL);
 
 // Given two sets of signatures for scriptPubKey, possibly with OP_0 placeholders,
 // combine them intelligently and return the result.
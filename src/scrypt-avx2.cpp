@@ -0,0 +1,180 @@
+/*
+ * Copyright 2009 Colin Percival, 2011 ArtForz, 2012-2013 pooler
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * This file was originally written by Colin Percival as part of the Tarsnap
+ * online backup system.
+ */
+
+/*
+ * 4-way and 8-way interleaved scrypt(1024,1,1) for AVX2.
+ *
+ * Every 32-bit lane of a vector belongs to a different input, so word k of
+ * the scrypt state for all lanes lives in X[k].  The scratchpad uses the
+ * same interleaving (V[i * 32 + k] holds word k of block i for every lane),
+ * which keeps the first loop a plain sequence of stores; the data-dependent
+ * reads of the second loop are done with AVX2 gathers.
+ *
+ * Only the SMix core is done here: B holds the 128-byte PBKDF2 output of
+ * each lane back to back and is overwritten with the mixed blocks, and the
+ * PBKDF2 stages around it are left to scrypt.cpp.
+ */
+
+#include "scrypt.h"
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <immintrin.h>
+
+#define ROTL_128(a, b) _mm_or_si128(_mm_slli_epi32((a), (b)), _mm_srli_epi32((a), 32 - (b)))
+#define ROTL_256(a, b) _mm256_or_si256(_mm256_slli_epi32((a), (b)), _mm256_srli_epi32((a), 32 - (b)))
+
+#define SALSA_STEP_128(d, a, b, s) x[d] = _mm_xor_si128(x[d], ROTL_128(_mm_add_epi32(x[a], x[b]), s))
+#define SALSA_STEP_256(d, a, b, s) x[d] = _mm256_xor_si256(x[d], ROTL_256(_mm256_add_epi32(x[a], x[b]), s))
+
+#define SALSA_DOUBLEROUND(STEP) do { \
+	/* Operate on columns. */ \
+	STEP( 4,  0, 12,  7);  STEP( 9,  5,  1,  7); \
+	STEP(14, 10,  6,  7);  STEP( 3, 15, 11,  7); \
+	STEP( 8,  4,  0,  9);  STEP(13,  9,  5,  9); \
+	STEP( 2, 14, 10,  9);  STEP( 7,  3, 15,  9); \
+	STEP(12,  8,  4, 13);  STEP( 1, 13,  9, 13); \
+	STEP( 6,  2, 14, 13);  STEP(11,  7,  3, 13); \
+	STEP( 0, 12,  8, 18);  STEP( 5,  1, 13, 18); \
+	STEP(10,  6,  2, 18);  STEP(15, 11,  7, 18); \
+	/* Operate on rows. */ \
+	STEP( 1,  0,  3,  7);  STEP( 6,  5,  4,  7); \
+	STEP(11, 10,  9,  7);  STEP(12, 15, 14,  7); \
+	STEP( 2,  1,  0,  9);  STEP( 7,  6,  5,  9); \
+	STEP( 8, 11, 10,  9);  STEP(13, 12, 15,  9); \
+	STEP( 3,  2,  1, 13);  STEP( 4,  7,  6, 13); \
+	STEP( 9,  8, 11, 13);  STEP(14, 13, 12, 13); \
+	STEP( 0,  3,  2, 18);  STEP( 5,  4,  7, 18); \
+	STEP(10,  9,  8, 18);  STEP(15, 14, 13, 18); \
+} while (0)
+
+static inline void xor_salsa8_4way(__m128i B[16], const __m128i Bx[16])
+{
+	__m128i x[16];
+	int i;
+
+	for (i = 0; i < 16; i++)
+		x[i] = B[i] = _mm_xor_si128(B[i], Bx[i]);
+	for (i = 0; i < 8; i += 2)
+		SALSA_DOUBLEROUND(SALSA_STEP_128);
+	for (i = 0; i < 16; i++)
+		B[i] = _mm_add_epi32(B[i], x[i]);
+}
+
+static inline void xor_salsa8_8way(__m256i B[16], const __m256i Bx[16])
+{
+	__m256i x[16];
+	int i;
+
+	for (i = 0; i < 16; i++)
+		x[i] = B[i] = _mm256_xor_si256(B[i], Bx[i]);
+	for (i = 0; i < 8; i += 2)
+		SALSA_DOUBLEROUND(SALSA_STEP_256);
+	for (i = 0; i < 16; i++)
+		B[i] = _mm256_add_epi32(B[i], x[i]);
+}
+
+void scrypt_core_avx2_4way(uint8_t *B, char *scratchpad)
+{
+	union {
+		__m128i i128[32];
+		uint32_t u32[32 * 4];
+	} X;
+	__m128i *V;
+	__m128i vj;
+	uint32_t i, k, l;
+
+	V = (__m128i *)(((uintptr_t)(scratchpad) + 63) & ~ (uintptr_t)(63));
+
+	for (l = 0; l < 4; l++)
+		for (k = 0; k < 32; k++)
+			X.u32[k * 4 + l] = le32dec(&B[128 * l + 4 * k]);
+
+	for (i = 0; i < 1024; i++) {
+		for (k = 0; k < 32; k++)
+			V[i * 32 + k] = X.i128[k];
+		xor_salsa8_4way(&X.i128[0], &X.i128[16]);
+		xor_salsa8_4way(&X.i128[16], &X.i128[0]);
+	}
+	for (i = 0; i < 1024; i++) {
+		/* Word index of V[j * 32][lane] is (j * 32) * 4 + lane. */
+		vj = _mm_and_si128(X.i128[16], _mm_set1_epi32(1023));
+		vj = _mm_add_epi32(_mm_slli_epi32(vj, 7), _mm_setr_epi32(0, 1, 2, 3));
+		for (k = 0; k < 32; k++) {
+			X.i128[k] = _mm_xor_si128(X.i128[k], _mm_i32gather_epi32((const int *)V, vj, 4));
+			vj = _mm_add_epi32(vj, _mm_set1_epi32(4));
+		}
+		xor_salsa8_4way(&X.i128[0], &X.i128[16]);
+		xor_salsa8_4way(&X.i128[16], &X.i128[0]);
+	}
+
+	for (l = 0; l < 4; l++)
+		for (k = 0; k < 32; k++)
+			le32enc(&B[128 * l + 4 * k], X.u32[k * 4 + l]);
+}
+
+void scrypt_core_avx2_8way(uint8_t *B, char *scratchpad)
+{
+	union {
+		__m256i i256[32];
+		uint32_t u32[32 * 8];
+	} X;
+	__m256i *V;
+	__m256i vj;
+	uint32_t i, k, l;
+
+	V = (__m256i *)(((uintptr_t)(scratchpad) + 63) & ~ (uintptr_t)(63));
+
+	for (l = 0; l < 8; l++)
+		for (k = 0; k < 32; k++)
+			X.u32[k * 8 + l] = le32dec(&B[128 * l + 4 * k]);
+
+	for (i = 0; i < 1024; i++) {
+		for (k = 0; k < 32; k++)
+			V[i * 32 + k] = X.i256[k];
+		xor_salsa8_8way(&X.i256[0], &X.i256[16]);
+		xor_salsa8_8way(&X.i256[16], &X.i256[0]);
+	}
+	for (i = 0; i < 1024; i++) {
+		/* Word index of V[j * 32][lane] is (j * 32) * 8 + lane. */
+		vj = _mm256_and_si256(X.i256[16], _mm256_set1_epi32(1023));
+		vj = _mm256_add_epi32(_mm256_slli_epi32(vj, 8), _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7));
+		for (k = 0; k < 32; k++) {
+			X.i256[k] = _mm256_xor_si256(X.i256[k], _mm256_i32gather_epi32((const int *)V, vj, 4));
+			vj = _mm256_add_epi32(vj, _mm256_set1_epi32(8));
+		}
+		xor_salsa8_8way(&X.i256[0], &X.i256[16]);
+		xor_salsa8_8way(&X.i256[16], &X.i256[0]);
+	}
+
+	for (l = 0; l < 8; l++)
+		for (k = 0; k < 32; k++)
+			le32enc(&B[128 * l + 4 * k], X.u32[k * 8 + l]);
+}
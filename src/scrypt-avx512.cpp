@@ -0,0 +1,114 @@
+/*
+ * Copyright 2009 Colin Percival, 2011 ArtForz, 2012-2013 pooler
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * This file was originally written by Colin Percival as part of the Tarsnap
+ * online backup system.
+ */
+
+/*
+ * 16-way interleaved scrypt(1024,1,1) for AVX-512F.  The layout is the same
+ * as in scrypt-avx2.cpp, with sixteen lanes per vector.
+ */
+
+#include "scrypt.h"
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <immintrin.h>
+
+#define SALSA_STEP_512(d, a, b, s) x[d] = _mm512_xor_si512(x[d], _mm512_rol_epi32(_mm512_add_epi32(x[a], x[b]), s))
+
+static inline void xor_salsa8_16way(__m512i B[16], const __m512i Bx[16])
+{
+	__m512i x[16];
+	int i;
+
+	for (i = 0; i < 16; i++)
+		x[i] = B[i] = _mm512_xor_si512(B[i], Bx[i]);
+	for (i = 0; i < 8; i += 2) {
+		/* Operate on columns. */
+		SALSA_STEP_512( 4,  0, 12,  7);  SALSA_STEP_512( 9,  5,  1,  7);
+		SALSA_STEP_512(14, 10,  6,  7);  SALSA_STEP_512( 3, 15, 11,  7);
+		SALSA_STEP_512( 8,  4,  0,  9);  SALSA_STEP_512(13,  9,  5,  9);
+		SALSA_STEP_512( 2, 14, 10,  9);  SALSA_STEP_512( 7,  3, 15,  9);
+		SALSA_STEP_512(12,  8,  4, 13);  SALSA_STEP_512( 1, 13,  9, 13);
+		SALSA_STEP_512( 6,  2, 14, 13);  SALSA_STEP_512(11,  7,  3, 13);
+		SALSA_STEP_512( 0, 12,  8, 18);  SALSA_STEP_512( 5,  1, 13, 18);
+		SALSA_STEP_512(10,  6,  2, 18);  SALSA_STEP_512(15, 11,  7, 18);
+
+		/* Operate on rows. */
+		SALSA_STEP_512( 1,  0,  3,  7);  SALSA_STEP_512( 6,  5,  4,  7);
+		SALSA_STEP_512(11, 10,  9,  7);  SALSA_STEP_512(12, 15, 14,  7);
+		SALSA_STEP_512( 2,  1,  0,  9);  SALSA_STEP_512( 7,  6,  5,  9);
+		SALSA_STEP_512( 8, 11, 10,  9);  SALSA_STEP_512(13, 12, 15,  9);
+		SALSA_STEP_512( 3,  2,  1, 13);  SALSA_STEP_512( 4,  7,  6, 13);
+		SALSA_STEP_512( 9,  8, 11, 13);  SALSA_STEP_512(14, 13, 12, 13);
+		SALSA_STEP_512( 0,  3,  2, 18);  SALSA_STEP_512( 5,  4,  7, 18);
+		SALSA_STEP_512(10,  9,  8, 18);  SALSA_STEP_512(15, 14, 13, 18);
+	}
+	for (i = 0; i < 16; i++)
+		B[i] = _mm512_add_epi32(B[i], x[i]);
+}
+
+void scrypt_core_avx512_16way(uint8_t *B, char *scratchpad)
+{
+	union {
+		__m512i i512[32];
+		uint32_t u32[32 * 16];
+	} X;
+	__m512i *V;
+	__m512i vj;
+	uint32_t i, k, l;
+
+	V = (__m512i *)(((uintptr_t)(scratchpad) + 63) & ~ (uintptr_t)(63));
+
+	for (l = 0; l < 16; l++)
+		for (k = 0; k < 32; k++)
+			X.u32[k * 16 + l] = le32dec(&B[128 * l + 4 * k]);
+
+	for (i = 0; i < 1024; i++) {
+		for (k = 0; k < 32; k++)
+			V[i * 32 + k] = X.i512[k];
+		xor_salsa8_16way(&X.i512[0], &X.i512[16]);
+		xor_salsa8_16way(&X.i512[16], &X.i512[0]);
+	}
+	for (i = 0; i < 1024; i++) {
+		/* Word index of V[j * 32][lane] is (j * 32) * 16 + lane. */
+		vj = _mm512_and_si512(X.i512[16], _mm512_set1_epi32(1023));
+		vj = _mm512_add_epi32(_mm512_slli_epi32(vj, 9),
+		    _mm512_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15));
+		for (k = 0; k < 32; k++) {
+			X.i512[k] = _mm512_xor_si512(X.i512[k], _mm512_i32gather_epi32(vj, (const int *)V, 4));
+			vj = _mm512_add_epi32(vj, _mm512_set1_epi32(16));
+		}
+		xor_salsa8_16way(&X.i512[0], &X.i512[16]);
+		xor_salsa8_16way(&X.i512[16], &X.i512[0]);
+	}
+
+	for (l = 0; l < 16; l++)
+		for (k = 0; k < 32; k++)
+			le32enc(&B[128 * l + 4 * k], X.u32[k * 16 + l]);
+}
@@ -32,9 +32,21 @@
 #include <stdlib.h>
 #include <stdint.h>
 #include <string.h>
+#include <algorithm>
+#include <new>
 #include <openssl/sha.h>
+#include <boost/bind.hpp>
+#include <boost/thread/once.hpp>
+#include <boost/thread/tss.hpp>
+
+#ifndef WIN32
+#include <sys/mman.h>
+#if !defined(MAP_ANONYMOUS) && defined(MAP_ANON)
+#define MAP_ANONYMOUS MAP_ANON
+#endif
+#endif
 
-#if defined(USE_SSE2) && !defined(USE_SSE2_ALWAYS)
+#if (defined(USE_SSE2) && !defined(USE_SSE2_ALWAYS)) || defined(USE_AVX2)
 #ifdef _MSC_VER
 // MSVC 64bit is unable to use inline asm
 #include <intrin.h>
@@ -185,6 +197,60 @@ PBKDF2_SHA256(const uint8_t *passwd, size_t passwdlen, const uint8_t *salt,
 	memset(&PShctx, 0, sizeof(HMAC_SHA256_CTX));
 }
 
+/*
+ * Key an HMAC-SHA256 operation with an 80-byte scrypt input.  The key is
+ * longer than a block, so it is really SHA256(input); pmidstate, if given,
+ * is the SHA256 state after the first 64 bytes of input.
+ */
+static void
+scrypt_hmac_key(HMAC_SHA256_CTX *ctx, const uint8_t *input, const SHA256_CTX *pmidstate)
+{
+	SHA256_CTX kctx;
+	unsigned char khash[32];
+
+	if (pmidstate) {
+		memcpy(&kctx, pmidstate, sizeof(SHA256_CTX));
+		SHA256_Update(&kctx, input + 64, 16);
+	} else {
+		SHA256_Init(&kctx);
+		SHA256_Update(&kctx, input, 80);
+	}
+	SHA256_Final(khash, &kctx);
+	HMAC_SHA256_Init(ctx, khash, 32);
+
+	/* Clean the stack. */
+	memset(khash, 0, 32);
+}
+
+/* PBKDF2_SHA256 with c = 1 and an already keyed HMAC state. */
+static void
+PBKDF2_SHA256_keyed(const HMAC_SHA256_CTX *keyctx, const uint8_t *salt,
+    size_t saltlen, uint8_t *buf, size_t dkLen)
+{
+	HMAC_SHA256_CTX PShctx, hctx;
+	size_t i;
+	uint8_t ivec[4];
+	uint8_t U[32];
+	size_t clen;
+
+	memcpy(&PShctx, keyctx, sizeof(HMAC_SHA256_CTX));
+	HMAC_SHA256_Update(&PShctx, salt, saltlen);
+
+	for (i = 0; i * 32 < dkLen; i++) {
+		be32enc(ivec, (uint32_t)(i + 1));
+		memcpy(&hctx, &PShctx, sizeof(HMAC_SHA256_CTX));
+		HMAC_SHA256_Update(&hctx, ivec, 4);
+		HMAC_SHA256_Final(U, &hctx);
+
+		clen = dkLen - i * 32;
+		if (clen > 32)
+			clen = 32;
+		memcpy(&buf[i * 32], U, clen);
+	}
+
+	memset(&PShctx, 0, sizeof(HMAC_SHA256_CTX));
+}
+
 #define ROTL(a, b) (((a) << (b)) | ((a) >> (32 - (b))))
 
 static inline void xor_salsa8(uint32_t B[16], const uint32_t Bx[16])
@@ -253,17 +319,14 @@ static inline void xor_salsa8(uint32_t B[16], const uint32_t Bx[16])
 	B[15] += x15;
 }
 
-void scrypt_1024_1_1_256_sp_generic(const char *input, char *output, char *scratchpad)
+void scrypt_core_generic(uint8_t *B, char *scratchpad)
 {
-	uint8_t B[128];
 	uint32_t X[32];
 	uint32_t *V;
 	uint32_t i, j, k;
 
 	V = (uint32_t *)(((uintptr_t)(scratchpad) + 63) & ~ (uintptr_t)(63));
 
-	PBKDF2_SHA256((const uint8_t *)input, 80, (const uint8_t *)input, 80, 1, B, 128);
-
 	for (k = 0; k < 32; k++)
 		X[k] = le32dec(&B[4 * k]);
 
@@ -282,13 +345,21 @@ void scrypt_1024_1_1_256_sp_generic(const char *input, char *output, char *scrat
 
 	for (k = 0; k < 32; k++)
 		le32enc(&B[4 * k], X[k]);
+}
+
+void scrypt_1024_1_1_256_sp_generic(const char *input, char *output, char *scratchpad)
+{
+	uint8_t B[128];
 
+	PBKDF2_SHA256((const uint8_t *)input, 80, (const uint8_t *)input, 80, 1, B, 128);
+	scrypt_core_generic(B, scratchpad);
 	PBKDF2_SHA256((const uint8_t *)input, 80, B, 128, 1, (uint8_t *)output, 32);
 }
 
 #if defined(USE_SSE2)
 // By default, set to generic scrypt function. This will prevent crash in case when scrypt_detect_sse2() wasn't called
 void (*scrypt_1024_1_1_256_sp_detected)(const char *input, char *output, char *scratchpad) = &scrypt_1024_1_1_256_sp_generic;
+static void (*scrypt_core_detected)(uint8_t *B, char *scratchpad) = &scrypt_core_generic;
 
 void scrypt_detect_sse2()
 {
@@ -311,19 +382,322 @@ void scrypt_detect_sse2()
     if (cpuid_edx & 1<<26)
     {
         scrypt_1024_1_1_256_sp_detected = &scrypt_1024_1_1_256_sp_sse2;
+        scrypt_core_detected = &scrypt_core_sse2;
         printf("scrypt: using scrypt-sse2 as detected.\n");
     }
     else
     {
         scrypt_1024_1_1_256_sp_detected = &scrypt_1024_1_1_256_sp_generic;
+        scrypt_core_detected = &scrypt_core_generic;
         printf("scrypt: using scrypt-generic, SSE2 unavailable.\n");
     }
 #endif // USE_SSE2_ALWAYS
 }
 #endif
 
+#if defined(USE_SSE2_ALWAYS)
+#define scrypt_core_1way scrypt_core_sse2
+#elif defined(USE_SSE2)
+#define scrypt_core_1way scrypt_core_detected
+#else
+#define scrypt_core_1way scrypt_core_generic
+#endif
+
 void scrypt_1024_1_1_256(const char *input, char *output)
 {
-	char scratchpad[SCRYPT_SCRATCHPAD_SIZE];
-    scrypt_1024_1_1_256_sp(input, output, scratchpad);
+    scrypt_1024_1_1_256_sp(input, output, scrypt_thread_scratchpad());
+}
+
+// One V array per lane of the widest kernel; 2 MiB, the size of an x86 huge page
+static const size_t SCRYPT_POOL_PAD_SIZE = SCRYPT_MAX_WAYS * 131072;
+static const size_t SCRYPT_HUGE_PAGE_SIZE = 2 * 1024 * 1024;
+
+// Every hashing thread makes a scratchpad, but how they are backed is only
+// logged by the first
+static boost::once_flag scratchpadLogFlag = BOOST_ONCE_INIT;
+
+static void LogScratchpadBacking(const char *strBacking)
+{
+    printf("scrypt: per-thread scratchpads use %s\n", strBacking);
+}
+
+/** Scratchpad owned by one thread, backed by huge pages where the OS allows. */
+class CScryptScratchpad
+{
+private:
+    char *pBase;
+    size_t nMapped;
+    char *pPad;
+
+public:
+    CScryptScratchpad() : pBase(NULL), nMapped(0), pPad(NULL)
+    {
+        const char *strBacking = Allocate();
+        if (pPad == NULL)
+            throw std::bad_alloc();
+
+        // Touch every page from the owning thread, so first-touch placement
+        // puts the whole pad on that thread's NUMA node before hashing starts.
+        memset(pPad, 0, SCRYPT_POOL_PAD_SIZE);
+
+        boost::call_once(scratchpadLogFlag, boost::bind(&LogScratchpadBacking, strBacking));
+    }
+
+    ~CScryptScratchpad()
+    {
+#ifdef WIN32
+        if (nMapped)
+            VirtualFree(pBase, 0, MEM_RELEASE);
+        else
+            free(pBase);
+#else
+        if (nMapped)
+            munmap(pBase, nMapped);
+        else
+            free(pBase);
+#endif
+    }
+
+    char *get() const { return pPad; }
+
+private:
+    const char *Allocate()
+    {
+#ifdef WIN32
+        // Large pages need SeLockMemoryPrivilege; without it this just fails
+        SIZE_T nLargePage = GetLargePageMinimum();
+        if (nLargePage && SCRYPT_POOL_PAD_SIZE % nLargePage == 0)
+        {
+            pBase = (char *)VirtualAlloc(NULL, SCRYPT_POOL_PAD_SIZE, MEM_RESERVE | MEM_COMMIT | MEM_LARGE_PAGES, PAGE_READWRITE);
+            if (pBase)
+            {
+                nMapped = SCRYPT_POOL_PAD_SIZE;
+                pPad = pBase;
+                return "large pages";
+            }
+        }
+        pBase = (char *)VirtualAlloc(NULL, SCRYPT_POOL_PAD_SIZE, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+        if (pBase)
+        {
+            nMapped = SCRYPT_POOL_PAD_SIZE;
+            pPad = pBase;
+            return "4 KiB pages";
+        }
+#else
+#if defined(MAP_HUGETLB)
+        // Explicitly reserved huge pages (vm.nr_hugepages)
+        void *p = mmap(NULL, SCRYPT_POOL_PAD_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (p != MAP_FAILED)
+        {
+            pBase = pPad = (char *)p;
+            nMapped = SCRYPT_POOL_PAD_SIZE;
+            return "2 MiB huge pages";
+        }
+#endif
+#if defined(MAP_ANONYMOUS)
+        // Otherwise map a huge-page aligned range and ask for transparent
+        // huge pages, which the kernel may or may not grant
+        size_t nSize = SCRYPT_POOL_PAD_SIZE + SCRYPT_HUGE_PAGE_SIZE;
+        void *q = mmap(NULL, nSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (q != MAP_FAILED)
+        {
+            pBase = (char *)q;
+            nMapped = nSize;
+            pPad = (char *)(((uintptr_t)pBase + SCRYPT_HUGE_PAGE_SIZE - 1) & ~(uintptr_t)(SCRYPT_HUGE_PAGE_SIZE - 1));
+#if defined(MADV_HUGEPAGE)
+            if (madvise(pPad, SCRYPT_POOL_PAD_SIZE, MADV_HUGEPAGE) == 0)
+                return "transparent huge pages";
+#endif
+            return "4 KiB pages";
+        }
+#endif
+#endif
+        pBase = (char *)malloc(SCRYPT_BATCH_SCRATCHPAD_SIZE);
+        pPad = pBase ? (char *)(((uintptr_t)pBase + 63) & ~(uintptr_t)63) : NULL;
+        return "malloc";
+    }
+};
+
+static boost::thread_specific_ptr<CScryptScratchpad> scryptpad;
+
+char *scrypt_thread_scratchpad()
+{
+    if (scryptpad.get() == NULL)
+        scryptpad.reset(new CScryptScratchpad());
+    return scryptpad->get();
+}
+
+// Interleaved kernels usable on this CPU, widest first
+struct ScryptMultiKernel
+{
+    unsigned int nWays;
+    void (*pfn)(uint8_t *B, char *scratchpad);
+};
+static ScryptMultiKernel vScryptKernels[3];
+static unsigned int nScryptKernels = 0;
+
+int scrypt_batch_ways()
+{
+    return nScryptKernels ? vScryptKernels[0].nWays : 1;
+}
+
+#if defined(USE_AVX2)
+static uint64_t scrypt_xgetbv()
+{
+#if defined(_MSC_VER)
+    return _xgetbv(0);
+#else
+    uint32_t eax, edx;
+    __asm__ __volatile__("xgetbv" : "=a"(eax), "=d"(edx) : "c"(0));
+    return ((uint64_t)edx << 32) | eax;
+#endif
+}
+#endif
+
+void scrypt_detect_multiway()
+{
+#if defined(USE_AVX2)
+    unsigned int eax = 0, ebx = 0, ecx = 0, edx = 0;
+    bool fAVX2 = false, fAVX512 = false;
+#if defined(_MSC_VER)
+    int x86cpuid[4];
+    __cpuid(x86cpuid, 1);
+    ecx = (unsigned int)x86cpuid[2];
+#else
+    __get_cpuid(1, &eax, &ebx, &ecx, &edx);
+#endif
+    // The OS must save the YMM (and for AVX-512 the ZMM/opmask) state
+    // across context switches, which it reports through XCR0.
+    if (ecx & (1 << 27))
+    {
+        uint64_t xcr0 = scrypt_xgetbv();
+        bool fYMM = (xcr0 & 0x06) == 0x06;
+        bool fZMM = (xcr0 & 0xe6) == 0xe6;
+#if defined(_MSC_VER)
+        __cpuidex(x86cpuid, 7, 0);
+        ebx = (unsigned int)x86cpuid[1];
+#else
+        if (__get_cpuid_max(0, NULL) >= 7)
+            __cpuid_count(7, 0, eax, ebx, ecx, edx);
+        else
+            ebx = 0;
+#endif
+        fAVX2 = fYMM && (ebx & (1 << 5));
+        fAVX512 = fZMM && (ebx & (1 << 16));
+    }
+
+    nScryptKernels = 0;
+    if (fAVX512)
+    {
+        vScryptKernels[nScryptKernels].nWays = 16;
+        vScryptKernels[nScryptKernels++].pfn = &scrypt_core_avx512_16way;
+    }
+    if (fAVX2)
+    {
+        vScryptKernels[nScryptKernels].nWays = 8;
+        vScryptKernels[nScryptKernels++].pfn = &scrypt_core_avx2_8way;
+        vScryptKernels[nScryptKernels].nWays = 4;
+        vScryptKernels[nScryptKernels++].pfn = &scrypt_core_avx2_4way;
+    }
+    if (fAVX512)
+        printf("scrypt: using 16-way AVX-512 for batches.\n");
+    else if (fAVX2)
+        printf("scrypt: using 8-way AVX2 for batches.\n");
+    else
+        printf("scrypt: AVX2 unavailable, batches use the single-lane kernel.\n");
+#endif // USE_AVX2
+}
+
+// Hash nLanes inputs through one pass of core.  Both PBKDF2 stages of a lane
+// are keyed with the same input, so the keyed HMAC state is made once.
+static void scrypt_1024_1_1_256_lanes(void (*core)(uint8_t *B, char *scratchpad), unsigned int nLanes,
+                                      const char *input, char *output, char *scratchpad,
+                                      const SHA256_CTX *pmidstate)
+{
+    HMAC_SHA256_CTX keyctx[SCRYPT_MAX_WAYS];
+    uint8_t B[SCRYPT_MAX_WAYS * 128];
+
+    for (unsigned int l = 0; l < nLanes; l++)
+    {
+        const uint8_t *pin = (const uint8_t *)input + 80 * l;
+        scrypt_hmac_key(&keyctx[l], pin, pmidstate);
+        PBKDF2_SHA256_keyed(&keyctx[l], pin, 80, B + 128 * l, 128);
+    }
+    core(B, scratchpad);
+    for (unsigned int l = 0; l < nLanes; l++)
+        PBKDF2_SHA256_keyed(&keyctx[l], B + 128 * l, 128, (uint8_t *)output + 32 * l, 32);
+
+    memset(keyctx, 0, sizeof(keyctx));
+}
+
+static void scrypt_1024_1_1_256_sp_batch_midstate(const char *input, char *output, unsigned int nCount,
+                                                  char *scratchpad, const SHA256_CTX *pmidstate)
+{
+    unsigned int i = 0;
+
+    // Run as many full passes as possible, narrowing the kernel as the
+    // remaining count shrinks.
+    for (unsigned int k = 0; k < nScryptKernels; k++)
+    {
+        const ScryptMultiKernel& kernel = vScryptKernels[k];
+        for (; nCount - i >= kernel.nWays; i += kernel.nWays)
+            scrypt_1024_1_1_256_lanes(kernel.pfn, kernel.nWays, input + 80 * i, output + 32 * i, scratchpad, pmidstate);
+    }
+    if (i == nCount)
+        return;
+
+    // Fill the narrowest kernel by repeating the last input if that still
+    // beats running the remainder through the single-lane kernel.
+    if (nScryptKernels > 0)
+    {
+        const ScryptMultiKernel& kernel = vScryptKernels[nScryptKernels - 1];
+        if (2 * (nCount - i) >= kernel.nWays)
+        {
+            char pin[SCRYPT_MAX_WAYS * 80];
+            char pout[SCRYPT_MAX_WAYS * 32];
+            for (unsigned int l = 0; l < kernel.nWays; l++)
+                memcpy(pin + 80 * l, input + 80 * std::min(i + l, nCount - 1), 80);
+            scrypt_1024_1_1_256_lanes(kernel.pfn, kernel.nWays, pin, pout, scratchpad, pmidstate);
+            memcpy(output + 32 * i, pout, 32 * (nCount - i));
+            return;
+        }
+    }
+    for (; i < nCount; i++)
+        scrypt_1024_1_1_256_lanes(scrypt_core_1way, 1, input + 80 * i, output + 32 * i, scratchpad, pmidstate);
+}
+
+void scrypt_1024_1_1_256_sp_batch(const char *input, char *output, unsigned int nCount, char *scratchpad)
+{
+    scrypt_1024_1_1_256_sp_batch_midstate(input, output, nCount, scratchpad, NULL);
+}
+
+void scrypt_1024_1_1_256_batch(const char *input, char *output, unsigned int nCount)
+{
+    scrypt_1024_1_1_256_sp_batch(input, output, nCount, scrypt_thread_scratchpad());
+}
+
+void scrypt_1024_1_1_256_midstate(const char *input, scrypt_midstate *pmidstate)
+{
+    SHA256_Init(&pmidstate->ctx);
+    SHA256_Update(&pmidstate->ctx, input, 64);
+}
+
+void scrypt_1024_1_1_256_sp_mine(const scrypt_midstate *pmidstate, const char *input, uint32_t nNonce,
+                                 unsigned int nCount, char *output, char *scratchpad)
+{
+    char pin[SCRYPT_MAX_WAYS * 80];
+
+    while (nCount > 0)
+    {
+        unsigned int nLanes = std::min(nCount, (unsigned int)SCRYPT_MAX_WAYS);
+        for (unsigned int l = 0; l < nLanes; l++)
+        {
+            memcpy(pin + 80 * l, input, 76);
+            le32enc(pin + 80 * l + 76, nNonce + l);
+        }
+        scrypt_1024_1_1_256_sp_batch_midstate(pin, output, nLanes, scratchpad, &pmidstate->ctx);
+        nNonce += nLanes;
+        nCount -= nLanes;
+        output += 32 * nLanes;
+    }
 }
@@ -2,12 +2,61 @@
 #define SCRYPT_H
 #include <stdlib.h>
 #include <stdint.h>
+#include <openssl/sha.h>
 
 static const int SCRYPT_SCRATCHPAD_SIZE = 131072 + 63;
 
+// Multi-lane kernels hash up to SCRYPT_MAX_WAYS inputs at once and need one
+// 128 KiB V array per lane.
+static const int SCRYPT_MAX_WAYS = 16;
+static const int SCRYPT_BATCH_SCRATCHPAD_SIZE = SCRYPT_MAX_WAYS * 131072 + 63;
+
 void scrypt_1024_1_1_256(const char *input, char *output);
 void scrypt_1024_1_1_256_sp_generic(const char *input, char *output, char *scratchpad);
 
+// SMix core of scrypt(1024,1,1) on the 128-byte PBKDF2 block of each lane.
+// B holds one block per lane back to back and is mixed in place.
+void scrypt_core_generic(uint8_t *B, char *scratchpad);
+
+// Scratchpad for any scrypt call on the calling thread, with room for
+// SCRYPT_BATCH_SCRATCHPAD_SIZE bytes.  It is made on first use, reused for
+// the life of the thread and freed when the thread exits.  Where the OS
+// allows it is backed by 2 MiB huge pages, and since the owning thread is
+// the first to touch it, it is placed on that thread's NUMA node.
+char *scrypt_thread_scratchpad();
+
+// Hash nCount consecutive 80-byte inputs into nCount consecutive 32-byte
+// outputs, using the widest interleaved kernel the CPU supports.
+// scratchpad must hold SCRYPT_BATCH_SCRATCHPAD_SIZE bytes; the variant
+// without one uses scrypt_thread_scratchpad().
+void scrypt_1024_1_1_256_batch(const char *input, char *output, unsigned int nCount);
+void scrypt_1024_1_1_256_sp_batch(const char *input, char *output, unsigned int nCount, char *scratchpad);
+
+// Number of inputs the selected multi-lane kernel hashes per pass (1 if none).
+int scrypt_batch_ways();
+void scrypt_detect_multiway();
+
+// Mining hashes headers that differ only in their last 16 bytes (nTime,
+// nBits and nNonce).  The PBKDF2 key is SHA256 of the whole 80-byte header,
+// so scrypt_1024_1_1_256_midstate() hashes the first 64 bytes once per work
+// unit and scrypt_1024_1_1_256_sp_mine() resumes from that state for every
+// nonce.  It hashes nCount consecutive nonces starting at nNonce (stored at
+// byte 76 of input) into nCount consecutive 32-byte outputs; scratchpad must
+// hold SCRYPT_BATCH_SCRATCHPAD_SIZE bytes.
+struct scrypt_midstate
+{
+    SHA256_CTX ctx;
+};
+void scrypt_1024_1_1_256_midstate(const char *input, scrypt_midstate *pmidstate);
+void scrypt_1024_1_1_256_sp_mine(const scrypt_midstate *pmidstate, const char *input, uint32_t nNonce,
+                                 unsigned int nCount, char *output, char *scratchpad);
+
+#if defined(USE_AVX2)
+void scrypt_core_avx2_4way(uint8_t *B, char *scratchpad);
+void scrypt_core_avx2_8way(uint8_t *B, char *scratchpad);
+void scrypt_core_avx512_16way(uint8_t *B, char *scratchpad);
+#endif
+
 #if defined(USE_SSE2)
 #if defined(_M_X64) || defined(__x86_64__) || defined(_M_AMD64) || (defined(MAC_OSX) && defined(__i386__))
 #define USE_SSE2_ALWAYS 1
@@ -18,6 +67,7 @@ void scrypt_1024_1_1_256_sp_generic(const char *input, char *output, char *scrat
 
 void scrypt_detect_sse2();
 void scrypt_1024_1_1_256_sp_sse2(const char *input, char *output, char *scratchpad);
+void scrypt_core_sse2(uint8_t *B, char *scratchpad);
 extern void (*scrypt_1024_1_1_256_sp_detected)(const char *input, char *output, char *scratchpad);
 #else
 #define scrypt_1024_1_1_256_sp(input, output, scratchpad) scrypt_1024_1_1_256_sp_generic((input), (output), (scratchpad))
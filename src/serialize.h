@@ -50,6 +50,9 @@ enum
     SER_NETWORK         = (1 << 0),
     SER_DISK            = (1 << 1),
     SER_GETHASH         = (1 << 2),
+
+    // modifiers
+    SER_FASTCOMPRESS    = (1 << 16), // only use compact encodings that are cheap to decode
 };
 
 #define IMPLEMENT_SERIALIZE(statements)    \
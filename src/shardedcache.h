@@ -0,0 +1,110 @@
+// Copyright (c) 2013 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+#ifndef BITCOIN_SHARDEDCACHE_H
+#define BITCOIN_SHARDEDCACHE_H
+
+#include <vector>
+
+#include <boost/thread/locks.hpp>
+#include <boost/thread/shared_mutex.hpp>
+
+#include "uint256.h"
+#include "util.h"
+
+/** Fixed-size table of entries keyed by salted 256-bit digests, for caches
+ *  of validation results that many threads look up at once.
+ *
+ *  Memory use is set in bytes up front. The table is split into nShards
+ *  shards with a lock each, and an entry can only live in one small bucket
+ *  of its shard, so lookups rarely wait on each other. When a bucket is
+ *  full a random entry is evicted, which keeps attackers from pushing out
+ *  entries of their choice with pre-generated data.
+ *
+ *  Entry must have a uint256 member named hash, which is null in empty
+ *  slots. Callers derive it from the data they cache and GetSalt(), so
+ *  that it can't be predicted by others.
+ */
+template <typename Entry, unsigned int nShards>
+class CShardedCache
+{
+private:
+    static const unsigned int nBucketSize = 8;
+
+    struct CShard
+    {
+        boost::shared_mutex cs;
+        std::vector<Entry> vEntries;
+    };
+
+    CShard shards[nShards];
+    unsigned int nBucketsPerShard;
+    uint256 salt;
+
+    // Shard and first slot of the bucket an entry belongs in
+    void Locate(const uint256& hash, CShard*& pshard, unsigned int& nSlot)
+    {
+        uint64 n = hash.Get64();
+        pshard = &shards[n % nShards];
+        nSlot = ((n / nShards) % nBucketsPerShard) * nBucketSize;
+    }
+
+public:
+    // A size too small for one bucket per shard turns the cache off
+    CShardedCache(uint64 nMaxBytes) : salt(GetRandHash())
+    {
+        nBucketsPerShard = nMaxBytes / sizeof(Entry) / (nShards * nBucketSize);
+        if (nBucketsPerShard > 0)
+            for (unsigned int i = 0; i < nShards; i++)
+                shards[i].vEntries.resize(nBucketsPerShard * nBucketSize);
+    }
+
+    const uint256& GetSalt() const { return salt; }
+
+    // Find the entry with the given hash, and copy it into entry
+    bool Get(const uint256& hash, Entry& entry)
+    {
+        if (nBucketsPerShard == 0)
+            return false;
+
+        CShard* pshard;
+        unsigned int nSlot;
+        Locate(hash, pshard, nSlot);
+
+        boost::shared_lock<boost::shared_mutex> lock(pshard->cs);
+        for (unsigned int i = 0; i < nBucketSize; i++)
+        {
+            if (pshard->vEntries[nSlot + i].hash == hash)
+            {
+                entry = pshard->vEntries[nSlot + i];
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // Store entry, replacing the one with the same hash if there is one
+    void Set(const Entry& entry)
+    {
+        if (nBucketsPerShard == 0)
+            return;
+
+        CShard* pshard;
+        unsigned int nSlot;
+        Locate(entry.hash, pshard, nSlot);
+
+        boost::unique_lock<boost::shared_mutex> lock(pshard->cs);
+        for (unsigned int i = 0; i < nBucketSize; i++)
+        {
+            Entry& slot = pshard->vEntries[nSlot + i];
+            if (slot.hash == entry.hash || slot.hash == 0)
+            {
+                slot = entry;
+                return;
+            }
+        }
+        pshard->vEntries[nSlot + insecure_rand() % nBucketSize] = entry;
+    }
+};
+
+#endif // BITCOIN_SHARDEDCACHE_H
@@ -0,0 +1,644 @@
+// Copyright (c) 2009-2014 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "stratum.h"
+#include "main.h"
+#include "wallet.h"
+#include "base58.h"
+#include "bitcoinrpc.h"
+#include "init.h"
+
+#include <boost/asio.hpp>
+#include <boost/shared_ptr.hpp>
+
+#ifndef WIN32
+#include <fcntl.h>
+#endif
+
+using namespace json_spirit;
+using namespace std;
+
+//
+// Stratum mining server
+//
+// Speaks the line-based JSON protocol of stratum mining pools over plain
+// TCP: miners subscribe, get a job pushed whenever the block template
+// changes, and submit shares against it.  The coinbase is split around an
+// 8 byte extra nonce; the first half is unique to each connection and the
+// second half is rolled by the miner, so no work is ever handed out twice.
+// All connections are served by one thread, like the peer sockets in net.cpp.
+//
+
+static const unsigned int STRATUM_EXTRANONCE1_SIZE = 4;
+static const unsigned int STRATUM_EXTRANONCE2_SIZE = 4;
+static const unsigned int MAX_STRATUM_CLIENTS = 128;
+static const unsigned int MAX_STRATUM_JOBS = 16;
+static const unsigned int MAX_STRATUM_LINE = 16 * 1024;
+static const unsigned int MAX_STRATUM_SEND = 1024 * 1024;
+
+class CStratumJob
+{
+public:
+    unsigned int nJobId;
+    boost::shared_ptr<CBlockTemplate> pblocktemplate;
+    CBlockIndex* pindexPrev;
+    std::vector<unsigned char> vchCoinbase1;    // serialized coinbase up to the extra nonce...
+    std::vector<unsigned char> vchCoinbase2;    // ...and after it
+    std::vector<uint256> vMerkleBranch;
+    mruset<uint256> setSubmitted;               // header hashes of the latest shares seen for this job
+
+    CStratumJob() : nJobId(0), pindexPrev(NULL), setSubmitted(MAX_STRATUM_SHARES) { }
+};
+
+class CStratumClient
+{
+public:
+    SOCKET hSocket;
+    std::string strAddr;
+    std::string strRecv;
+    std::string strSend;
+    std::vector<unsigned char> vchExtraNonce1;
+    bool fSubscribed;
+    bool fAuthorized;
+    bool fDisconnect;
+
+    CStratumClient(SOCKET hSocketIn, const std::string& strAddrIn, unsigned int nExtraNonce1) :
+        hSocket(hSocketIn), strAddr(strAddrIn), fSubscribed(false), fAuthorized(false), fDisconnect(false)
+    {
+        for (unsigned int i = 0; i < STRATUM_EXTRANONCE1_SIZE; i++)
+            vchExtraNonce1.push_back((nExtraNonce1 >> (8 * (STRATUM_EXTRANONCE1_SIZE - 1 - i))) & 0xff);
+    }
+
+    void Send(const Object& obj)
+    {
+        strSend += write_string(Value(obj), false) + "\n";
+        if (strSend.size() > MAX_STRATUM_SEND)
+            fDisconnect = true;
+    }
+};
+
+static SOCKET hStratumListenSocket = INVALID_SOCKET;
+static CReserveKey* pStratumKey = NULL;
+static CScript scriptStratumPayout;
+
+// Only touched by the stratum thread
+static std::map<unsigned int, CStratumJob> mapStratumJobs;
+static unsigned int nStratumJobId = 0;
+static unsigned int nTransactionsUpdatedStratum = 0;
+static int64 nStratumJobTime = 0;
+static uint256 hashStratumShareTarget;
+
+static std::string HexUInt32(unsigned int n)
+{
+    return strprintf("%08x", n);
+}
+
+static bool ParseHexUInt32(const Value& val, unsigned int& n)
+{
+    if (val.type() != str_type || val.get_str().size() != 8 || !IsHex(val.get_str()))
+        return false;
+    n = strtoul(val.get_str().c_str(), NULL, 16);
+    return true;
+}
+
+static Object StratumReply(const Value& result, const Value& error, const Value& id)
+{
+    Object reply;
+    reply.push_back(Pair("id", id));
+    reply.push_back(Pair("result", result));
+    reply.push_back(Pair("error", error));
+    return reply;
+}
+
+static Object StratumError(int nCode, const std::string& strMessage, const Value& id)
+{
+    Array error;
+    error.push_back(nCode);
+    error.push_back(strMessage);
+    error.push_back(Value::null);
+    return StratumReply(Value::null, error, id);
+}
+
+static Object StratumNotify(const std::string& strMethod, const Array& params)
+{
+    Object notify;
+    notify.push_back(Pair("id", Value::null));
+    notify.push_back(Pair("method", strMethod));
+    notify.push_back(Pair("params", params));
+    return notify;
+}
+
+static Object GetJobNotify(const CStratumJob& job, bool fClean)
+{
+    const CBlock& block = job.pblocktemplate->block;
+
+    // Miners read the previous block hash as eight byte-swapped words
+    uint256 hashPrev = block.hashPrevBlock;
+    for (int i = 0; i < 8; i++)
+        ((unsigned int*)&hashPrev)[i] = ByteReverse(((unsigned int*)&hashPrev)[i]);
+
+    Array branch;
+    BOOST_FOREACH(const uint256& hash, job.vMerkleBranch)
+        branch.push_back(HexStr(BEGIN(hash), END(hash)));
+
+    Array params;
+    params.push_back(strprintf("%x", job.nJobId));
+    params.push_back(HexStr(BEGIN(hashPrev), END(hashPrev)));
+    params.push_back(HexStr(job.vchCoinbase1));
+    params.push_back(HexStr(job.vchCoinbase2));
+    params.push_back(branch);
+    params.push_back(HexUInt32(block.nVersion));
+    params.push_back(HexUInt32(block.nBits));
+    params.push_back(HexUInt32(block.nTime));
+    params.push_back(fClean);
+    return StratumNotify("mining.notify", params);
+}
+
+static Object GetDifficultyNotify()
+{
+    Array params;
+    params.push_back((boost::int64_t)GetArg("-stratumdifficulty", DEFAULT_STRATUM_DIFFICULTY));
+    return StratumNotify("mining.set_difficulty", params);
+}
+
+// Make a new job when the tip has moved, or the memory pool has changed and
+// the current job is a minute old.  Returns true if clients need to hear of it.
+static bool UpdateStratumJob(bool& fClean)
+{
+    CBlockIndex* pindexPrev = pindexBest;
+    const CStratumJob* pjobLast = mapStratumJobs.empty() ? NULL : &mapStratumJobs.rbegin()->second;
+    fClean = (pjobLast == NULL || pjobLast->pindexPrev != pindexPrev);
+    if (!fClean && (nTransactionsUpdated == nTransactionsUpdatedStratum || GetTime() - nStratumJobTime <= 60))
+        return false;
+    if (IsInitialBlockDownload())
+        return false;
+
+    nTransactionsUpdatedStratum = nTransactionsUpdated;
+    nStratumJobTime = GetTime();
+
+    CStratumJob job;
+    if (pStratumKey)
+        job.pblocktemplate.reset(CreateNewBlockWithKey(*pStratumKey));
+    else
+        job.pblocktemplate.reset(CreateNewBlock(scriptStratumPayout));
+    if (!job.pblocktemplate)
+        return false;
+    CBlock& block = job.pblocktemplate->block;
+    {
+        LOCK(cs_main);
+        job.pindexPrev = mapBlockIndex[block.hashPrevBlock];
+    }
+    fClean = (pjobLast == NULL || pjobLast->pindexPrev != job.pindexPrev);
+
+    SplitStratumCoinbase(block.vtx[0], job.pindexPrev->nHeight + 1, job.vchCoinbase1, job.vchCoinbase2);
+    block.BuildMerkleTree();
+    job.vMerkleBranch = block.GetMerkleBranch(0);
+
+    if (fClean)
+        mapStratumJobs.clear();
+    while (mapStratumJobs.size() >= MAX_STRATUM_JOBS)
+        mapStratumJobs.erase(mapStratumJobs.begin());
+    job.nJobId = ++nStratumJobId;
+    mapStratumJobs[job.nJobId] = job;
+    return true;
+}
+
+void SplitStratumCoinbase(CTransaction& txCoinbase, int nHeight, std::vector<unsigned char>& vchCoinbase1, std::vector<unsigned char>& vchCoinbase2)
+{
+    // Height first in coinbase required for block.version=2, then room for the extra nonce
+    unsigned int nHeightSize = (CScript() << nHeight).size();
+    std::vector<unsigned char> vchExtraNonce(STRATUM_EXTRANONCE1_SIZE + STRATUM_EXTRANONCE2_SIZE, 0);
+    txCoinbase.vin[0].scriptSig = (CScript() << nHeight << vchExtraNonce) + COINBASE_FLAGS;
+    assert(txCoinbase.vin[0].scriptSig.size() <= 100);
+
+    // The extra nonce follows the version, the input count, the null prevout,
+    // the script length, the height and the push opcode
+    CDataStream ssCoinbase(SER_NETWORK, PROTOCOL_VERSION);
+    ssCoinbase << txCoinbase;
+    std::vector<unsigned char> vchCoinbase(ssCoinbase.begin(), ssCoinbase.end());
+    unsigned int nOffset = 4 + 1 + 36 + GetSizeOfCompactSize(txCoinbase.vin[0].scriptSig.size()) + nHeightSize + 1;
+    assert(vchCoinbase[nOffset - 1] == vchExtraNonce.size());
+    vchCoinbase1.assign(vchCoinbase.begin(), vchCoinbase.begin() + nOffset);
+    vchCoinbase2.assign(vchCoinbase.begin() + nOffset + vchExtraNonce.size(), vchCoinbase.end());
+}
+
+bool JoinStratumCoinbase(const std::vector<unsigned char>& vchCoinbase1, const std::vector<unsigned char>& vchExtraNonce, const std::vector<unsigned char>& vchCoinbase2, CTransaction& txCoinbase)
+{
+    std::vector<unsigned char> vchCoinbase(vchCoinbase1);
+    vchCoinbase.insert(vchCoinbase.end(), vchExtraNonce.begin(), vchExtraNonce.end());
+    vchCoinbase.insert(vchCoinbase.end(), vchCoinbase2.begin(), vchCoinbase2.end());
+    try {
+        CDataStream ssCoinbase(vchCoinbase, SER_NETWORK, PROTOCOL_VERSION);
+        ssCoinbase >> txCoinbase;
+        return ssCoinbase.empty();
+    }
+    catch (std::exception &e) {
+        return false;
+    }
+}
+
+int CheckStratumShare(const CBlockHeader& header, const uint256& hashShareTarget, mruset<uint256>& setSubmitted, uint256& hashPoW)
+{
+    if (!setSubmitted.insert(header.GetHash()).second)
+        return STRATUM_DUPLICATE_SHARE;
+
+    hashPoW = header.GetPoWHash();
+    if (hashPoW > hashShareTarget)
+        return STRATUM_LOW_DIFFICULTY;
+    return 0;
+}
+
+bool StratumAuthorized(const std::string& strUser, const std::string& strPassword)
+{
+    // Without a password there is nothing to check against
+    const std::string& strRPCUser = mapArgs["-rpcuser"];
+    const std::string& strRPCPassword = mapArgs["-rpcpassword"];
+    if (strRPCPassword.empty())
+        return false;
+
+    std::string strUserName = strUser.substr(0, strUser.find('.'));
+    return TimingResistantEqual(strUserName + ":" + strPassword, strRPCUser + ":" + strRPCPassword);
+}
+
+// Found a block: hand it to ProcessBlock the same way CheckWork does
+static void SubmitStratumBlock(CBlock& block, const uint256& hashPoW)
+{
+    printf("StratumServer:\n");
+    printf("proof-of-work found  \n  hash: %s  \ntarget: %s\n", hashPoW.GetHex().c_str(),
+           CBigNum().SetCompact(block.nBits).getuint256().GetHex().c_str());
+    block.print();
+    printf("generated %s\n", FormatMoney(block.vtx[0].vout[0].nValue).c_str());
+
+    LOCK(cs_main);
+    if (block.hashPrevBlock != hashBestChain)
+    {
+        error("StratumServer : generated block is stale");
+        return;
+    }
+
+    if (pStratumKey)
+    {
+        // Remove key from key pool
+        pStratumKey->KeepKey();
+
+        // Track how many getdata requests this block gets
+        LOCK(pwalletMain->cs_wallet);
+        pwalletMain->mapRequestCount[block.GetHash()] = 0;
+    }
+
+    CValidationState state;
+    if (!ProcessBlock(state, NULL, &block))
+        error("StratumServer : ProcessBlock, block not accepted");
+}
+
+static Object StratumSubmit(CStratumClient& client, const Array& params, const Value& id)
+{
+    if (!client.fSubscribed)
+        return StratumError(STRATUM_NOT_SUBSCRIBED, "Not subscribed", id);
+    if (!client.fAuthorized)
+        return StratumError(STRATUM_UNAUTHORIZED, "Unauthorized worker", id);
+
+    // params: worker name, job id, extranonce2, ntime, nonce
+    if (params.size() < 5 || params[1].type() != str_type || params[2].type() != str_type)
+        return StratumError(STRATUM_OTHER, "Invalid parameters", id);
+    unsigned int nJobId = strtoul(params[1].get_str().c_str(), NULL, 16);
+    std::map<unsigned int, CStratumJob>::iterator mi = mapStratumJobs.find(nJobId);
+    if (mi == mapStratumJobs.end())
+        return StratumError(STRATUM_JOB_NOT_FOUND, "Job not found", id);
+    CStratumJob& job = (*mi).second;
+    const CBlock& blockTemplate = job.pblocktemplate->block;
+
+    std::vector<unsigned char> vchExtraNonce2 = ParseHex(params[2].get_str());
+    unsigned int nTime, nNonce;
+    if (vchExtraNonce2.size() != STRATUM_EXTRANONCE2_SIZE || !ParseHexUInt32(params[3], nTime) || !ParseHexUInt32(params[4], nNonce))
+        return StratumError(STRATUM_OTHER, "Invalid parameters", id);
+    if (nTime < blockTemplate.nTime || nTime > GetAdjustedTime() + 2 * 60 * 60)
+        return StratumError(STRATUM_OTHER, "ntime out of range", id);
+
+    // Rebuild the coinbase with this connection's and the miner's extra nonce
+    std::vector<unsigned char> vchExtraNonce(client.vchExtraNonce1);
+    vchExtraNonce.insert(vchExtraNonce.end(), vchExtraNonce2.begin(), vchExtraNonce2.end());
+    CTransaction txCoinbase;
+    if (!JoinStratumCoinbase(job.vchCoinbase1, vchExtraNonce, job.vchCoinbase2, txCoinbase))
+        return StratumError(STRATUM_OTHER, "Invalid parameters", id);
+
+    CBlockHeader header;
+    header.nVersion = blockTemplate.nVersion;
+    header.hashPrevBlock = blockTemplate.hashPrevBlock;
+    header.hashMerkleRoot = CBlock::CheckMerkleBranch(txCoinbase.GetHash(), job.vMerkleBranch, 0);
+    header.nTime = nTime;
+    header.nBits = blockTemplate.nBits;
+    header.nNonce = nNonce;
+
+    uint256 hashPoW;
+    int nError = CheckStratumShare(header, hashStratumShareTarget, job.setSubmitted, hashPoW);
+    if (nError == STRATUM_DUPLICATE_SHARE)
+        return StratumError(nError, "Duplicate share", id);
+    if (nError == STRATUM_LOW_DIFFICULTY)
+        return StratumError(nError, "Low difficulty share", id);
+
+    if (hashPoW <= CBigNum().SetCompact(header.nBits).getuint256())
+    {
+        CBlock block(blockTemplate);
+        block.vtx[0] = txCoinbase;
+        block.hashMerkleRoot = header.hashMerkleRoot;
+        block.nTime = header.nTime;
+        block.nNonce = header.nNonce;
+        block.SetPoWHash(hashPoW);
+        SubmitStratumBlock(block, hashPoW);
+    }
+
+    return StratumReply(true, Value::null, id);
+}
+
+static void ProcessStratumMessage(CStratumClient& client, const std::string& strLine)
+{
+    Value valRequest;
+    if (!read_string(strLine, valRequest) || valRequest.type() != obj_type)
+    {
+        client.fDisconnect = true;
+        return;
+    }
+    const Object& request = valRequest.get_obj();
+    Value id = find_value(request, "id");
+    Value valMethod = find_value(request, "method");
+    Value valParams = find_value(request, "params");
+    if (valMethod.type() != str_type)
+    {
+        client.Send(StratumError(STRATUM_OTHER, "Method must be a string", id));
+        return;
+    }
+    const std::string& strMethod = valMethod.get_str();
+    Array params;
+    if (valParams.type() == array_type)
+        params = valParams.get_array();
+
+    if (strMethod == "mining.subscribe")
+    {
+        Array subscription;
+        subscription.push_back("mining.notify");
+        subscription.push_back(HexStr(client.vchExtraNonce1));
+        Array subscriptions;
+        subscriptions.push_back(subscription);
+        Array result;
+        result.push_back(subscriptions);
+        result.push_back(HexStr(client.vchExtraNonce1));
+        result.push_back((int)STRATUM_EXTRANONCE2_SIZE);
+        client.Send(StratumReply(result, Value::null, id));
+
+        client.fSubscribed = true;
+        client.Send(GetDifficultyNotify());
+        if (!mapStratumJobs.empty())
+            client.Send(GetJobNotify(mapStratumJobs.rbegin()->second, true));
+    }
+    else if (strMethod == "mining.authorize")
+    {
+        // params: user name, password
+        if (params.size() < 2 || params[0].type() != str_type || params[1].type() != str_type)
+        {
+            client.Send(StratumError(STRATUM_OTHER, "Invalid parameters", id));
+            return;
+        }
+        client.fAuthorized = StratumAuthorized(params[0].get_str(), params[1].get_str());
+        if (!client.fAuthorized)
+            printf("StratumServer : incorrect password from %s\n", client.strAddr.c_str());
+        client.Send(StratumReply(client.fAuthorized, Value::null, id));
+    }
+    else if (strMethod == "mining.submit")
+    {
+        client.Send(StratumSubmit(client, params, id));
+    }
+    else
+        client.Send(StratumError(STRATUM_OTHER, "Method not found", id));
+}
+
+static void AcceptStratumClient(std::list<CStratumClient>& listClients)
+{
+    struct sockaddr_storage sockaddr;
+    socklen_t len = sizeof(sockaddr);
+    SOCKET hSocket = accept(hStratumListenSocket, (struct sockaddr*)&sockaddr, &len);
+    if (hSocket == INVALID_SOCKET)
+        return;
+
+    CService addr;
+    addr.SetSockAddr((const struct sockaddr*)&sockaddr);
+    boost::system::error_code ec;
+    boost::asio::ip::address address = boost::asio::ip::address::from_string(addr.ToStringIP(), ec);
+    if (ec || !ClientAllowed(address) || listClients.size() >= MAX_STRATUM_CLIENTS)
+    {
+        printf("StratumServer : connection from %s refused\n", addr.ToString().c_str());
+        closesocket(hSocket);
+        return;
+    }
+
+#ifdef WIN32
+    u_long nOne = 1;
+    ioctlsocket(hSocket, FIONBIO, &nOne);
+#else
+    fcntl(hSocket, F_SETFL, O_NONBLOCK);
+#endif
+
+    static unsigned int nExtraNonce1 = 0;
+    listClients.push_back(CStratumClient(hSocket, addr.ToString(), ++nExtraNonce1));
+    printf("StratumServer : accepted connection from %s\n", addr.ToString().c_str());
+}
+
+static void ReceiveStratumClient(CStratumClient& client)
+{
+    char pchBuf[0x1000];
+    int nBytes = recv(client.hSocket, pchBuf, sizeof(pchBuf), MSG_DONTWAIT);
+    if (nBytes > 0)
+    {
+        client.strRecv.append(pchBuf, nBytes);
+        size_t nPos;
+        while (!client.fDisconnect && (nPos = client.strRecv.find('\n')) != std::string::npos)
+        {
+            std::string strLine = client.strRecv.substr(0, nPos);
+            client.strRecv.erase(0, nPos + 1);
+            if (strLine.find_first_not_of(" \r\t") != std::string::npos)
+                ProcessStratumMessage(client, strLine);
+        }
+        if (client.strRecv.size() > MAX_STRATUM_LINE)
+            client.fDisconnect = true;
+    }
+    else if (nBytes == 0)
+        client.fDisconnect = true;
+    else
+    {
+        int nErr = WSAGetLastError();
+        if (nErr != WSAEWOULDBLOCK && nErr != WSAEMSGSIZE && nErr != WSAEINTR && nErr != WSAEINPROGRESS)
+            client.fDisconnect = true;
+    }
+}
+
+static void SendStratumClient(CStratumClient& client)
+{
+    int nBytes = send(client.hSocket, client.strSend.data(), client.strSend.size(), MSG_NOSIGNAL | MSG_DONTWAIT);
+    if (nBytes > 0)
+        client.strSend.erase(0, nBytes);
+    else if (nBytes < 0)
+    {
+        int nErr = WSAGetLastError();
+        if (nErr != WSAEWOULDBLOCK && nErr != WSAEMSGSIZE && nErr != WSAEINTR && nErr != WSAEINPROGRESS)
+            client.fDisconnect = true;
+    }
+}
+
+static void ThreadStratumServer()
+{
+    RenameThread("coolcash-stratum");
+    printf("ThreadStratumServer started\n");
+
+    std::list<CStratumClient> listClients;
+    try
+    {
+        loop
+        {
+            // Push a new job when the template changes
+            bool fClean;
+            bool fSubscribers = false;
+            BOOST_FOREACH(const CStratumClient& client, listClients)
+                fSubscribers |= client.fSubscribed;
+            if (fSubscribers && UpdateStratumJob(fClean))
+            {
+                const CStratumJob& job = mapStratumJobs.rbegin()->second;
+                Object notify = GetJobNotify(job, fClean);
+                BOOST_FOREACH(CStratumClient& client, listClients)
+                    if (client.fSubscribed)
+                        client.Send(notify);
+            }
+
+            fd_set fdsetRecv;
+            fd_set fdsetSend;
+            FD_ZERO(&fdsetRecv);
+            FD_ZERO(&fdsetSend);
+            SOCKET hSocketMax = hStratumListenSocket;
+            FD_SET(hStratumListenSocket, &fdsetRecv);
+            BOOST_FOREACH(const CStratumClient& client, listClients)
+            {
+                FD_SET(client.hSocket, &fdsetRecv);
+                if (!client.strSend.empty())
+                    FD_SET(client.hSocket, &fdsetSend);
+                hSocketMax = max(hSocketMax, client.hSocket);
+            }
+
+            struct timeval timeout;
+            timeout.tv_sec  = 0;
+            timeout.tv_usec = 100000; // frequency to check for new templates
+            int nSelect = select(hSocketMax + 1, &fdsetRecv, &fdsetSend, NULL, &timeout);
+            boost::this_thread::interruption_point();
+            if (nSelect == SOCKET_ERROR)
+            {
+                printf("StratumServer : select failed: %d\n", WSAGetLastError());
+                MilliSleep(100);
+                continue;
+            }
+
+            if (FD_ISSET(hStratumListenSocket, &fdsetRecv))
+                AcceptStratumClient(listClients);
+
+            for (std::list<CStratumClient>::iterator it = listClients.begin(); it != listClients.end(); )
+            {
+                CStratumClient& client = *it;
+                if (FD_ISSET(client.hSocket, &fdsetRecv))
+                    ReceiveStratumClient(client);
+                if (!client.fDisconnect && !client.strSend.empty() && FD_ISSET(client.hSocket, &fdsetSend))
+                    SendStratumClient(client);
+                if (client.fDisconnect)
+                {
+                    printf("StratumServer : %s disconnected\n", client.strAddr.c_str());
+                    closesocket(client.hSocket);
+                    listClients.erase(it++);
+                }
+                else
+                    ++it;
+            }
+        }
+    }
+    catch (boost::thread_interrupted)
+    {
+        BOOST_FOREACH(CStratumClient& client, listClients)
+            closesocket(client.hSocket);
+        closesocket(hStratumListenSocket);
+        hStratumListenSocket = INVALID_SOCKET;
+        mapStratumJobs.clear();
+        delete pStratumKey; pStratumKey = NULL;
+        printf("ThreadStratumServer exited\n");
+        throw;
+    }
+}
+
+bool StartStratumServer(boost::thread_group& threadGroup, std::string& strError)
+{
+    // Where the mined coins go
+    if (mapArgs.count("-stratumaddress"))
+    {
+        CBitcoinAddress address(mapArgs["-stratumaddress"]);
+        if (!address.IsValid())
+        {
+            strError = strprintf(_("Invalid -stratumaddress: '%s'"), mapArgs["-stratumaddress"].c_str());
+            return false;
+        }
+        scriptStratumPayout.SetDestination(address.Get());
+    }
+    else if (pwalletMain)
+        pStratumKey = new CReserveKey(pwalletMain);
+    else
+    {
+        strError = _("-stratum needs a wallet or -stratumaddress to pay to");
+        return false;
+    }
+
+    // Miners log in with the RPC credentials
+    if (mapArgs["-rpcpassword"] == "")
+    {
+        strError = _("-stratum needs -rpcpassword to authorize miners");
+        return false;
+    }
+
+    int64 nDifficulty = GetArg("-stratumdifficulty", DEFAULT_STRATUM_DIFFICULTY);
+    if (nDifficulty < 1)
+    {
+        strError = strprintf(_("Invalid -stratumdifficulty: '%s'"), mapArgs["-stratumdifficulty"].c_str());
+        return false;
+    }
+    hashStratumShareTarget = ((CBigNum(0xffff) << 224) / nDifficulty).getuint256();
+
+    // Only reachable from the addresses allowed to use RPC
+    CService addrBind(mapArgs.count("-rpcallowip") ? "0.0.0.0" : "127.0.0.1", (int)GetArg("-stratumport", DEFAULT_STRATUM_PORT));
+    struct sockaddr_in sockaddr;
+    socklen_t len = sizeof(sockaddr);
+    addrBind.GetSockAddr((struct sockaddr*)&sockaddr, &len);
+
+    SOCKET hSocket = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    if (hSocket == INVALID_SOCKET)
+    {
+        strError = strprintf("Error: Couldn't open socket for stratum connections (socket returned error %d)", WSAGetLastError());
+        return false;
+    }
+
+    int nOne = 1;
+#ifdef SO_NOSIGPIPE
+    setsockopt(hSocket, SOL_SOCKET, SO_NOSIGPIPE, (void*)&nOne, sizeof(int));
+#endif
+#ifdef WIN32
+    ioctlsocket(hSocket, FIONBIO, (u_long*)&nOne);
+#else
+    setsockopt(hSocket, SOL_SOCKET, SO_REUSEADDR, (void*)&nOne, sizeof(int));
+    fcntl(hSocket, F_SETFL, O_NONBLOCK);
+#endif
+
+    if (::bind(hSocket, (struct sockaddr*)&sockaddr, len) == SOCKET_ERROR || listen(hSocket, SOMAXCONN) == SOCKET_ERROR)
+    {
+        int nErr = WSAGetLastError();
+        strError = strprintf(_("Unable to bind to %s on this computer (bind returned error %d, %s)"), addrBind.ToString().c_str(), nErr, strerror(nErr));
+        closesocket(hSocket);
+        return false;
+    }
+    printf("Stratum server bound to %s\n", addrBind.ToString().c_str());
+
+    hStratumListenSocket = hSocket;
+    threadGroup.create_thread(&ThreadStratumServer);
+    return true;
+}
@@ -0,0 +1,54 @@
+// Copyright (c) 2009-2014 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+#ifndef BITCOIN_STRATUM_H
+#define BITCOIN_STRATUM_H
+
+#include <string>
+#include <vector>
+
+#include <boost/thread.hpp>
+
+#include "mruset.h"
+#include "uint256.h"
+
+class CBlockHeader;
+class CTransaction;
+
+/** Default port for stratum mining connections */
+static const int DEFAULT_STRATUM_PORT = 3333;
+/** Default share difficulty; in the units scrypt stratum miners use, a
+ *  difficulty 1 share takes about 2^16 hashes */
+static const int DEFAULT_STRATUM_DIFFICULTY = 16;
+/** Shares remembered per job to turn down duplicates; the oldest are
+ *  forgotten first */
+static const unsigned int MAX_STRATUM_SHARES = 10000;
+
+/** Stratum error codes */
+enum StratumErrorCode
+{
+    STRATUM_OTHER            = 20,
+    STRATUM_JOB_NOT_FOUND    = 21,
+    STRATUM_DUPLICATE_SHARE  = 22,
+    STRATUM_LOW_DIFFICULTY   = 23,
+    STRATUM_UNAUTHORIZED     = 24,
+    STRATUM_NOT_SUBSCRIBED   = 25,
+};
+
+/** Give txCoinbase room for the extra nonce after the height, and split its
+ *  serialization around it */
+void SplitStratumCoinbase(CTransaction& txCoinbase, int nHeight, std::vector<unsigned char>& vchCoinbase1, std::vector<unsigned char>& vchCoinbase2);
+/** Put a coinbase back together around the extra nonce; false if the result
+ *  doesn't parse */
+bool JoinStratumCoinbase(const std::vector<unsigned char>& vchCoinbase1, const std::vector<unsigned char>& vchExtraNonce, const std::vector<unsigned char>& vchCoinbase2, CTransaction& txCoinbase);
+/** Check a share against the share target, and that it isn't in setSubmitted
+ *  already; returns 0 or a StratumErrorCode */
+int CheckStratumShare(const CBlockHeader& header, const uint256& hashShareTarget, mruset<uint256>& setSubmitted, uint256& hashPoW);
+/** Miners log in with -rpcuser, optionally followed by '.' and a worker
+ *  name, and -rpcpassword */
+bool StratumAuthorized(const std::string& strUser, const std::string& strPassword);
+
+/** Bind the stratum port and start serving mining jobs on it */
+bool StartStratumServer(boost::thread_group& threadGroup, std::string& strError);
+
+#endif
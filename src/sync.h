@@ -121,6 +121,41 @@ typedef CMutexLock<CCriticalSection> CCriticalBlock;
         LeaveCritical(); \
     }
 
+/** Releases a critical section the caller holds for its lifetime, and
+ *  takes it back when destroyed, also when an exception unwinds the stack.
+ *  Does nothing if fActive is false. */
+class CCriticalSectionReverseLock
+{
+private:
+    CCriticalSection& cs;
+    const char* pszName;
+    const char* pszFile;
+    int nLine;
+    bool fActive;
+
+public:
+    CCriticalSectionReverseLock(CCriticalSection& csIn, const char* pszNameIn, const char* pszFileIn, int nLineIn, bool fActiveIn = true) :
+        cs(csIn), pszName(pszNameIn), pszFile(pszFileIn), nLine(nLineIn), fActive(fActiveIn)
+    {
+        if (fActive)
+        {
+            cs.unlock();
+            LeaveCritical();
+        }
+    }
+
+    ~CCriticalSectionReverseLock()
+    {
+        if (fActive)
+        {
+            EnterCritical(pszName, pszFile, nLine, (void*)(&cs));
+            cs.lock();
+        }
+    }
+};
+
+#define REVERSE_LOCK_IF(cs,fActive) CCriticalSectionReverseLock reverselock(cs, #cs, __FILE__, __LINE__, fActive)
+
 class CSemaphore
 {
 private:
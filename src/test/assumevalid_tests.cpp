@@ -0,0 +1,185 @@
+#include <boost/test/unit_test.hpp>
+#include <vector>
+
+#include "main.h"
+#include "util.h"
+
+BOOST_AUTO_TEST_SUITE(assumevalid_tests)
+
+// Adds a block on top of pprev to mapBlockIndex
+static CBlockIndex *AddBlockIndex(CBlockIndex *pprev)
+{
+    CBlockIndex *pindex = new CBlockIndex();
+    pindex->pprev = pprev;
+    pindex->nHeight = pprev ? pprev->nHeight + 1 : 0;
+    std::map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.insert(std::make_pair(GetRandHash(), pindex)).first;
+    pindex->phashBlock = &((*mi).first);
+    return pindex;
+}
+
+BOOST_AUTO_TEST_CASE(assumevalid_ancestors)
+{
+    // A chain of 10 blocks, with a side chain of 3 forking off after the 6th
+    std::vector<CBlockIndex*> vMain, vSide;
+    for (int i = 0; i < 10; i++)
+        vMain.push_back(AddBlockIndex(i ? vMain.back() : NULL));
+    for (int i = 0; i < 3; i++)
+        vSide.push_back(AddBlockIndex(i ? vSide.back() : vMain[5]));
+
+    uint256 hashAssumeValidOld = hashAssumeValid;
+
+    // Nothing is skipped without -assumevalid, or with a block that isn't known
+    hashAssumeValid = 0;
+    BOOST_CHECK(!IsAssumedValid(vMain[3]));
+    hashAssumeValid = GetRandHash();
+    BOOST_FOREACH(CBlockIndex *pindex, vMain)
+        BOOST_CHECK(!IsAssumedValid(pindex));
+    BOOST_FOREACH(CBlockIndex *pindex, vSide)
+        BOOST_CHECK(!IsAssumedValid(pindex));
+
+    // A block on the main chain: it and its ancestors, not what comes after
+    // it or the side chain
+    hashAssumeValid = vMain[7]->GetBlockHash();
+    for (int i = 0; i < 10; i++)
+        BOOST_CHECK_EQUAL(IsAssumedValid(vMain[i]), i <= 7);
+    BOOST_FOREACH(CBlockIndex *pindex, vSide)
+        BOOST_CHECK(!IsAssumedValid(pindex));
+
+    // A block on the side chain: the main chain only up to the fork
+    hashAssumeValid = vSide[2]->GetBlockHash();
+    for (int i = 0; i < 10; i++)
+        BOOST_CHECK_EQUAL(IsAssumedValid(vMain[i]), i <= 5);
+    BOOST_FOREACH(CBlockIndex *pindex, vSide)
+        BOOST_CHECK(IsAssumedValid(pindex));
+
+    // Restoring the setting also drops the cached ancestors, before the
+    // blocks they point to are freed
+    hashAssumeValid = hashAssumeValidOld;
+    BOOST_CHECK(!IsAssumedValid(vMain[0]));
+    BOOST_FOREACH(CBlockIndex *pindex, vSide) {
+        mapBlockIndex.erase(pindex->GetBlockHash());
+        delete pindex;
+    }
+    BOOST_FOREACH(CBlockIndex *pindex, vMain) {
+        mapBlockIndex.erase(pindex->GetBlockHash());
+        delete pindex;
+    }
+}
+
+// Nonces that solve the blocks assumevalid_processblock builds, in the
+// order it builds them, as scrypt at the genesis difficulty is too slow to
+// search for in a test
+static const unsigned int pnNonces[] = {
+    0x00219daf, 0x002f0e2e, 0x00299715, 0x004a0377, 0x000d038e,
+    0x001a72eb, 0x000c49b2, 0x00291522, 0x001449c1, 0x00005c46,
+    0x00081f86, 0x0001690f, 0x00015c4a, 0x00060136, 0x00017bc1,
+};
+
+// A block at nHeight on top of hashPrev, with the next nonce of pnNonces,
+// whose coinbase pays to an output no script can spend
+static CBlock MakeBlock(const uint256& hashPrev, int nHeight, unsigned int nTime, unsigned int nBits,
+                        const std::vector<CTransaction>& vtx, unsigned char nExtraNonce, unsigned int& nBlock)
+{
+    CBlock block;
+    block.nVersion = 2;
+    block.hashPrevBlock = hashPrev;
+    block.nTime = nTime;
+    block.nBits = nBits;
+    CTransaction txCoinbase;
+    txCoinbase.vin.resize(1);
+    txCoinbase.vin[0].prevout.SetNull();
+    txCoinbase.vin[0].scriptSig = CScript() << nHeight << nExtraNonce;
+    txCoinbase.vout.resize(1);
+    txCoinbase.vout[0].nValue = COIN;
+    txCoinbase.vout[0].scriptPubKey = CScript() << OP_FALSE;
+    block.vtx.push_back(txCoinbase);
+    block.vtx.insert(block.vtx.end(), vtx.begin(), vtx.end());
+    block.hashMerkleRoot = block.BuildMerkleTree();
+    BOOST_REQUIRE(nBlock < sizeof(pnNonces) / sizeof(pnNonces[0]));
+    block.nNonce = pnNonces[nBlock++];
+    BOOST_CHECK(CheckProofOfWork(block.GetPoWHash(), block.nBits));
+    return block;
+}
+
+// The same, on top of the best block
+static CBlock MakeBlock(const std::vector<CTransaction>& vtx, unsigned char nExtraNonce, unsigned int& nBlock)
+{
+    return MakeBlock(pindexBest->GetBlockHash(), pindexBest->nHeight + 1, pindexBest->nTime + 30, pindexBest->nBits,
+                     vtx, nExtraNonce, nBlock);
+}
+
+BOOST_AUTO_TEST_CASE(assumevalid_processblock)
+{
+    // The nonces only fit a chain built on the genesis block
+    BOOST_REQUIRE(pindexBest == pindexGenesisBlock);
+
+    uint256 hashAssumeValidOld = hashAssumeValid;
+    int nAssumeValidHeightOld = nAssumeValidHeight;
+    hashAssumeValid = 0;
+    nAssumeValidHeight = -1;
+    unsigned int nBlock = 0;
+    std::vector<CTransaction> vtxNone;
+
+    // Enough blocks for the first coinbase to mature
+    std::vector<CTransaction> vtxBad(1);
+    for (int i = 0; i < COINBASE_MATURITY + 1; i++)
+    {
+        CBlock block = MakeBlock(vtxNone, 0, nBlock);
+        CValidationState state;
+        BOOST_CHECK(ProcessBlock(state, NULL, &block));
+        if (i == 0)
+        {
+            // A spend of its coinbase can't pass the script checks
+            vtxBad[0].vin.resize(1);
+            vtxBad[0].vin[0].prevout = COutPoint(block.vtx[0].GetHash(), 0);
+            vtxBad[0].vout.resize(1);
+            vtxBad[0].vout[0].nValue = COIN;
+            vtxBad[0].vout[0].scriptPubKey = CScript() << OP_TRUE;
+        }
+    }
+    BOOST_CHECK_EQUAL(nBestHeight, COINBASE_MATURITY + 1);
+    CBlockIndex *pindexFork = pindexBest;
+
+    // Without -assumevalid, a block with that spend is not connected
+    {
+        CBlock block = MakeBlock(vtxBad, 0, nBlock);
+        CValidationState state;
+        ProcessBlock(state, NULL, &block);
+        BOOST_CHECK(pindexBest == pindexFork);
+    }
+
+    // Two blocks on top of the fork point, the second of which is the
+    // -assumevalid block; it isn't known when the first is connected
+    CBlock blockSkip = MakeBlock(vtxBad, 1, nBlock);
+    CBlock blockAssumeValid = MakeBlock(blockSkip.GetHash(), pindexFork->nHeight + 2, blockSkip.nTime + 30, blockSkip.nBits,
+                                       vtxNone, 0, nBlock);
+    CBlock blockOther = MakeBlock(blockSkip.GetHash(), pindexFork->nHeight + 2, blockSkip.nTime + 30, blockSkip.nBits,
+                                  vtxNone, 1, nBlock);
+    hashAssumeValid = blockAssumeValid.GetHash();
+    nAssumeValidHeight = pindexFork->nHeight + 2;
+
+    // The scripts of the block below it are skipped, so it is connected
+    {
+        CValidationState state;
+        BOOST_CHECK(ProcessBlock(state, NULL, &blockSkip));
+        BOOST_CHECK(hashBestChain == blockSkip.GetHash());
+    }
+
+    // No other block is accepted at the -assumevalid height
+    {
+        CValidationState state;
+        BOOST_CHECK(!ProcessBlock(state, NULL, &blockOther));
+        BOOST_CHECK(!mapBlockIndex.count(blockOther.GetHash()));
+    }
+
+    {
+        CValidationState state;
+        BOOST_CHECK(ProcessBlock(state, NULL, &blockAssumeValid));
+        BOOST_CHECK(hashBestChain == blockAssumeValid.GetHash());
+    }
+
+    hashAssumeValid = hashAssumeValidOld;
+    nAssumeValidHeight = nAssumeValidHeightOld;
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,118 @@
+#include <boost/test/unit_test.hpp>
+#include <boost/thread.hpp>
+
+#include "checkqueue.h"
+#include "util.h"
+
+BOOST_AUTO_TEST_SUITE(checkqueue_tests)
+
+static boost::mutex csCount;
+static int nCount = 0;
+
+struct CFakeCheck
+{
+    bool fResult;
+
+    CFakeCheck() : fResult(true) {}
+    CFakeCheck(bool fResultIn) : fResult(fResultIn) {}
+
+    bool operator()()
+    {
+        boost::unique_lock<boost::mutex> lock(csCount);
+        nCount++;
+        return fResult;
+    }
+
+    void swap(CFakeCheck& check) { std::swap(fResult, check.fResult); }
+};
+
+static void AddChecks(CCheckQueueControl<CFakeCheck>& control, int nChecks, int nFail)
+{
+    // Batches of varying sizes, like the inputs of a block's transactions
+    int nAdded = 0;
+    for (int nSize = 1; nAdded < nChecks; nSize = nSize % 300 + 7)
+    {
+        std::vector<CFakeCheck> vChecks;
+        for (int i = 0; i < nSize && nAdded < nChecks; i++, nAdded++)
+            vChecks.push_back(CFakeCheck(nAdded != nFail));
+        control.Add(vChecks);
+    }
+}
+
+static void RunSession(CCheckQueue<CFakeCheck>* pqueue, int nPriority, int nChecks, int nFail, bool* pfResult)
+{
+    CCheckQueueControl<CFakeCheck> control(pqueue, nPriority);
+    AddChecks(control, nChecks, nFail);
+    *pfResult = control.Wait();
+}
+
+BOOST_AUTO_TEST_CASE(checkqueue_results)
+{
+    CCheckQueue<CFakeCheck> queue(16, 4);
+    boost::thread_group threadGroup;
+    for (int i = 0; i < 3; i++)
+        threadGroup.create_thread(boost::bind(&CCheckQueue<CFakeCheck>::Thread, &queue));
+
+    for (int nChecks = 0; nChecks < 5000; nChecks = nChecks * 3 + 1)
+    {
+        nCount = 0;
+        CCheckQueueControl<CFakeCheck> control(&queue);
+        AddChecks(control, nChecks, -1);
+        BOOST_CHECK(control.Wait());
+        BOOST_CHECK_EQUAL(nCount, nChecks);
+    }
+
+    // A failure is reported, and doesn't leak into the next round
+    {
+        CCheckQueueControl<CFakeCheck> control(&queue);
+        AddChecks(control, 1000, 500);
+        BOOST_CHECK(!control.Wait());
+    }
+    {
+        CCheckQueueControl<CFakeCheck> control(&queue);
+        AddChecks(control, 1000, -1);
+        BOOST_CHECK(control.Wait());
+    }
+
+    threadGroup.interrupt_all();
+    threadGroup.join_all();
+}
+
+BOOST_AUTO_TEST_CASE(checkqueue_sessions)
+{
+    // Block and mempool checks sharing the queue each get their own result
+    CCheckQueue<CFakeCheck> queue(16, 4);
+    boost::thread_group threadGroup;
+    for (int i = 0; i < 3; i++)
+        threadGroup.create_thread(boost::bind(&CCheckQueue<CFakeCheck>::Thread, &queue));
+
+    for (int nRound = 0; nRound < 20; nRound++)
+    {
+        nCount = 0;
+        bool fBlockOk = false, fMempoolOk = true, fMempool2Ok = false;
+        boost::thread_group masters;
+        masters.create_thread(boost::bind(&RunSession, &queue, (int)CHECKQUEUE_PRIORITY_BLOCK, 3000, -1, &fBlockOk));
+        masters.create_thread(boost::bind(&RunSession, &queue, (int)CHECKQUEUE_PRIORITY_MEMPOOL, 2000, nRound * 97, &fMempoolOk));
+        masters.create_thread(boost::bind(&RunSession, &queue, (int)CHECKQUEUE_PRIORITY_MEMPOOL, 500, -1, &fMempool2Ok));
+        masters.join_all();
+        BOOST_CHECK(fBlockOk);
+        BOOST_CHECK(!fMempoolOk);
+        BOOST_CHECK(fMempool2Ok);
+    }
+
+    threadGroup.interrupt_all();
+    threadGroup.join_all();
+}
+
+BOOST_AUTO_TEST_CASE(checkqueue_no_workers)
+{
+    // Without worker threads the master does all the work itself
+    CCheckQueue<CFakeCheck> queue(16, 4);
+    nCount = 0;
+    CCheckQueueControl<CFakeCheck> control(&queue);
+    AddChecks(control, 1000, -1);
+    BOOST_CHECK(control.Wait());
+    BOOST_CHECK_EQUAL(nCount, 1000);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,646 @@
+#include <boost/test/unit_test.hpp>
+#include <map>
+#include <vector>
+
+#include "main.h"
+#include "txdb.h"
+#include "util.h"
+
+BOOST_AUTO_TEST_SUITE(coins_tests)
+
+// In-memory stand-in for the coin database
+class CCoinsViewTest : public CCoinsView
+{
+public:
+    std::map<uint256, CCoins> mapCoins;
+    CBlockIndex *pindexBest;
+    unsigned int nWrites;
+
+    CCoinsViewTest() : pindexBest(NULL), nWrites(0) {}
+
+    bool GetCoins(const uint256 &txid, CCoins &coins)
+    {
+        std::map<uint256, CCoins>::iterator it = mapCoins.find(txid);
+        if (it == mapCoins.end())
+            return false;
+        coins = it->second;
+        return true;
+    }
+
+    bool HaveCoins(const uint256 &txid)
+    {
+        CCoins coins;
+        return GetCoins(txid, coins);
+    }
+
+    CBlockIndex *GetBestBlock() { return pindexBest; }
+
+    bool BatchWrite(CCoinsMap &mapWrite, CBlockIndex *pindex)
+    {
+        for (CCoinsMap::iterator it = mapWrite.begin(); it != mapWrite.end(); it++) {
+            if (!(it->second.flags & CCoinsCacheEntry::DIRTY))
+                continue;
+            // A fresh entry that is spent again must not reach the base
+            if (it->second.flags & CCoinsCacheEntry::FRESH)
+                BOOST_CHECK(!it->second.IsPruned());
+            nWrites++;
+            if (it->second.IsPruned())
+                mapCoins.erase(it->first);
+            else
+                it->second.GetCoins(mapCoins[it->first]);
+        }
+        pindexBest = pindex;
+        return true;
+    }
+};
+
+// Checks the memory accounting against the entries actually held
+class CCoinsViewCacheTest : public CCoinsViewCache
+{
+public:
+    CCoinsViewCacheTest(CCoinsView &baseIn, bool fDummy = false) : CCoinsViewCache(baseIn, fDummy) {}
+
+    void SelfTest() const
+    {
+        size_t nUsage = 0;
+        for (CCoinsMap::const_iterator it = cacheCoins.begin(); it != cacheCoins.end(); it++)
+            nUsage += it->second.DynamicMemoryUsage();
+        BOOST_CHECK_EQUAL(cachedCoinsUsage, nUsage);
+    }
+};
+
+static uint256 RandomTxid(const std::vector<uint256> &vTxids)
+{
+    return vTxids[insecure_rand() % vTxids.size()];
+}
+
+BOOST_AUTO_TEST_CASE(coins_cache_simulation)
+{
+    // A stack of caches, some keeping their entries compressed, on top of a
+    // database is modified at random, and must always agree with a plain map
+    // of the expected contents
+    std::vector<uint256> vTxids;
+    for (int i = 0; i < 40; i++)
+        vTxids.push_back(GetRandHash());
+
+    std::map<uint256, CCoins> mapResult;
+    CCoinsViewTest base;
+    std::vector<CCoinsViewCacheTest*> vStack;
+    vStack.push_back(new CCoinsViewCacheTest(base));
+    vStack.back()->SetCompressed(insecure_rand() % 2);
+
+    bool fRemovedAll = false, fMissed = false, fFound = false;
+    for (int nStep = 0; nStep < 20000; nStep++) {
+        CCoinsViewCacheTest &top = *vStack.back();
+        uint256 txid = RandomTxid(vTxids);
+        CCoins &result = mapResult[txid];
+
+        if (insecure_rand() % 2) {
+            // Add, change or spend an output
+            CCoinsModifier coins = top.ModifyCoins(txid);
+            BOOST_CHECK(*coins == result);
+            unsigned int n = insecure_rand() % 4;
+            if (coins->vout.size() <= n)
+                coins->vout.resize(n + 1);
+            if (insecure_rand() % 3 == 0)
+                coins->vout[n].SetNull();
+            else
+                coins->vout[n] = CTxOut(insecure_rand() % 1000 + 1, CScript() << std::vector<unsigned char>(insecure_rand() % 60, 0x51));
+            coins->Cleanup();
+            result = *coins;
+            fRemovedAll |= result.IsPruned();
+        } else if (insecure_rand() % 10 == 0) {
+            // Overwrite through SetCoins
+            CCoins coins;
+            if (insecure_rand() % 2)
+                coins.vout.push_back(CTxOut(insecure_rand() % 1000 + 1, CScript() << OP_TRUE));
+            BOOST_CHECK(top.SetCoins(txid, coins));
+            result = coins;
+        } else {
+            // Look it up
+            CCoins coins;
+            bool fHave = top.GetCoins(txid, coins);
+            if (fHave) {
+                BOOST_CHECK(coins == result);
+                fFound = true;
+            } else {
+                BOOST_CHECK(result.IsPruned());
+                fMissed = true;
+            }
+        }
+        top.SelfTest();
+
+        if (insecure_rand() % 100 == 0) {
+            // Flush the top cache into the one below, or into the database
+            BOOST_CHECK(vStack.back()->Flush());
+            BOOST_CHECK_EQUAL(vStack.back()->GetCacheSize(), 0U);
+            if (vStack.size() > 1)
+                vStack[vStack.size() - 2]->SelfTest();
+        }
+        if (insecure_rand() % 200 == 0) {
+            if (vStack.size() > 1 && insecure_rand() % 2) {
+                BOOST_CHECK(vStack.back()->Flush());
+                delete vStack.back();
+                vStack.pop_back();
+            } else if (vStack.size() < 4) {
+                vStack.push_back(new CCoinsViewCacheTest(*vStack.back(), true));
+                vStack.back()->SetCompressed(insecure_rand() % 2);
+            }
+        }
+    }
+
+    // Everything ends up in the database, and only unspent entries do
+    while (!vStack.empty()) {
+        BOOST_CHECK(vStack.back()->Flush());
+        delete vStack.back();
+        vStack.pop_back();
+    }
+    for (std::map<uint256, CCoins>::iterator it = mapResult.begin(); it != mapResult.end(); it++) {
+        std::map<uint256, CCoins>::iterator itBase = base.mapCoins.find(it->first);
+        if (it->second.IsPruned())
+            BOOST_CHECK(itBase == base.mapCoins.end());
+        else
+            BOOST_CHECK(itBase != base.mapCoins.end() && itBase->second == it->second);
+    }
+
+    BOOST_CHECK(fRemovedAll);
+    BOOST_CHECK(fMissed);
+    BOOST_CHECK(fFound);
+}
+
+BOOST_AUTO_TEST_CASE(coins_cache_fresh)
+{
+    // Outputs created and spent again between two flushes never reach the
+    // database, and neither do entries that were only read
+    CCoinsViewTest base;
+    uint256 txidOld = GetRandHash(), txidNew = GetRandHash();
+    base.mapCoins[txidOld].vout.push_back(CTxOut(1, CScript() << OP_TRUE));
+
+    CCoinsViewCacheTest cache(base);
+    BOOST_CHECK(cache.HaveCoins(txidOld));
+    {
+        CCoinsModifier coins = cache.ModifyCoins(txidNew);
+        coins->vout.push_back(CTxOut(2, CScript() << OP_TRUE));
+    }
+    BOOST_CHECK(cache.GetCacheSize() == 2);
+    BOOST_CHECK(cache.DynamicMemoryUsage() > 0);
+    {
+        CCoinsModifier coins = cache.ModifyCoins(txidNew);
+        coins->vout[0].SetNull();
+    }
+    // The spent fresh entry is dropped from the cache right away
+    BOOST_CHECK(cache.GetCacheSize() == 1);
+    cache.SelfTest();
+
+    BOOST_CHECK(cache.Flush());
+    BOOST_CHECK_EQUAL(base.nWrites, 0U);
+    BOOST_CHECK(cache.DynamicMemoryUsage() < 1024);
+    BOOST_CHECK(base.mapCoins.count(txidOld) == 1);
+    BOOST_CHECK(base.mapCoins.count(txidNew) == 0);
+}
+
+// Holds writes back until told to go on
+class CCoinsViewBlockingTest : public CCoinsViewTest
+{
+public:
+    boost::mutex mutex;
+    boost::condition_variable cond;
+    bool fBlocked;
+
+    CCoinsViewBlockingTest() : fBlocked(true) {}
+
+    void Release()
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        fBlocked = false;
+        cond.notify_all();
+    }
+
+    bool BatchWrite(CCoinsMap &mapWrite, CBlockIndex *pindex)
+    {
+        {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            while (fBlocked)
+                cond.wait(lock);
+        }
+        return CCoinsViewTest::BatchWrite(mapWrite, pindex);
+    }
+};
+
+BOOST_AUTO_TEST_CASE(coins_async_flush)
+{
+    // A flush returns before the database has the changes, and reads see
+    // them in the meantime
+    CCoinsViewBlockingTest base;
+    uint256 txidOld = GetRandHash(), txidNew = GetRandHash();
+    base.mapCoins[txidOld].vout.push_back(CTxOut(1, CScript() << OP_TRUE));
+    CBlockIndex index;
+
+    CCoinsViewAsyncFlush flush(base);
+    {
+        CCoinsViewCacheTest cache(flush);
+        {
+            CCoinsModifier coins = cache.ModifyCoins(txidOld);
+            coins->vout[0].SetNull();
+        }
+        {
+            CCoinsModifier coins = cache.ModifyCoins(txidNew);
+            coins->vout.push_back(CTxOut(2, CScript() << OP_TRUE));
+        }
+        cache.SetBestBlock(&index);
+        BOOST_CHECK(cache.Flush());
+        BOOST_CHECK(cache.GetCacheSize() == 0);
+    }
+    BOOST_CHECK_EQUAL(base.nWrites, 0U);
+
+    CCoinsViewCacheTest cache(flush);
+    BOOST_CHECK(cache.GetBestBlock() == &index);
+    BOOST_CHECK(cache.HaveCoins(txidNew));
+    BOOST_CHECK(cache.GetCoins(txidNew).vout[0].nValue == 2);
+    BOOST_CHECK(!cache.HaveCoins(txidOld) || cache.GetCoins(txidOld).IsPruned());
+
+    base.Release();
+    BOOST_CHECK(flush.Sync());
+    BOOST_CHECK_EQUAL(base.nWrites, 2U);
+    BOOST_CHECK(base.pindexBest == &index);
+    BOOST_CHECK(base.mapCoins.count(txidOld) == 0);
+    BOOST_CHECK(base.mapCoins.count(txidNew) == 1);
+}
+
+// Gives access to the raw records of the chainstate
+class CCoinsViewDBTest : public CCoinsViewDB
+{
+public:
+    CCoinsViewDBTest() : CCoinsViewDB(1 << 20, true) {}
+
+    void WriteLegacy(const uint256 &txid, const CCoins &coins)
+    {
+        db.Write(std::make_pair('c', txid), coins);
+    }
+
+    void WriteVersion(int nVersion)
+    {
+        db.Write('V', nVersion);
+    }
+
+    void EraseVersion()
+    {
+        db.Erase('V');
+    }
+
+    // A transaction record that can't be read
+    void WriteCorrupt(const uint256 &txid)
+    {
+        db.Write(std::make_pair('T', txid), (unsigned char)0x80);
+    }
+
+    unsigned int CountRecords(char chType)
+    {
+        unsigned int nCount = 0;
+        leveldb::Iterator *pcursor = db.NewIterator();
+        for (pcursor->SeekToFirst(); pcursor->Valid(); pcursor->Next())
+            if (pcursor->key()[0] == chType)
+                nCount++;
+        delete pcursor;
+        return nCount;
+    }
+};
+
+static CCoins RandomCoins(unsigned int nOutputs)
+{
+    CCoins coins;
+    coins.fCoinBase = insecure_rand() % 2;
+    coins.nHeight = insecure_rand() % 100000;
+    coins.nVersion = 1;
+    for (unsigned int i = 0; i < nOutputs; i++) {
+        if (i + 1 < nOutputs && insecure_rand() % 4 == 0) {
+            coins.vout.push_back(CTxOut());
+            continue;
+        }
+        CScript script;
+        if (insecure_rand() % 2)
+            script << OP_DUP << OP_HASH160 << std::vector<unsigned char>(20, insecure_rand()) << OP_EQUALVERIFY << OP_CHECKSIG;
+        else
+            script << std::vector<unsigned char>(insecure_rand() % 40, 0x51);
+        coins.vout.push_back(CTxOut(insecure_rand() % 100000 + 1, script));
+    }
+    return coins;
+}
+
+BOOST_AUTO_TEST_CASE(coins_db_upgrade)
+{
+    // Per-transaction records of older versions are converted to one
+    // record per output, and the statistics of the set don't change
+    CCoinsViewDBTest view;
+    BOOST_CHECK(view.SetBestBlock(pindexGenesisBlock));
+    std::map<uint256, CCoins> mapExpected;
+    unsigned int nOutputs = 0;
+    for (int i = 0; i < 50; i++) {
+        CCoins coins = RandomCoins(1 + insecure_rand() % 20);
+        uint256 txid = GetRandHash();
+        view.WriteLegacy(txid, coins);
+        mapExpected[txid] = coins;
+        for (unsigned int n = 0; n < coins.vout.size(); n++)
+            nOutputs += !coins.vout[n].IsNull();
+    }
+
+    CCoinsStats statsBefore, statsAfter;
+    BOOST_CHECK(view.GetStats(statsBefore));
+    BOOST_CHECK(view.CheckVersion());
+    BOOST_CHECK(view.Upgrade());
+    BOOST_CHECK(view.CheckVersion());
+    BOOST_CHECK(view.GetStats(statsAfter));
+
+    BOOST_CHECK_EQUAL(view.CountRecords('c'), 0U);
+    BOOST_CHECK_EQUAL(view.CountRecords('T'), 50U);
+    BOOST_CHECK_EQUAL(view.CountRecords('O'), nOutputs);
+    BOOST_CHECK_EQUAL(statsBefore.nTransactions, 50U);
+    BOOST_CHECK_EQUAL(statsAfter.nTransactions, statsBefore.nTransactions);
+    BOOST_CHECK_EQUAL(statsAfter.nTransactionOutputs, statsBefore.nTransactionOutputs);
+    BOOST_CHECK_EQUAL(statsAfter.nSerializedSize, statsBefore.nSerializedSize);
+    BOOST_CHECK_EQUAL(statsAfter.nTotalAmount, statsBefore.nTotalAmount);
+    BOOST_CHECK(statsAfter.hashSerialized == statsBefore.hashSerialized);
+
+    for (std::map<uint256, CCoins>::iterator it = mapExpected.begin(); it != mapExpected.end(); it++) {
+        CCoins coins;
+        BOOST_CHECK(view.HaveCoins(it->first));
+        BOOST_CHECK(view.GetCoins(it->first, coins));
+        BOOST_CHECK(coins == it->second);
+    }
+
+    // A second run has nothing left to do
+    BOOST_CHECK(view.Upgrade());
+    BOOST_CHECK_EQUAL(view.CountRecords('O'), nOutputs);
+}
+
+BOOST_AUTO_TEST_CASE(coins_db_version)
+{
+    // A new database gets the current version; one of another version, or
+    // of the current layout without a version, isn't opened
+    CCoinsViewDBTest view;
+    BOOST_CHECK(view.CheckVersion());
+    BOOST_CHECK(view.Upgrade());
+    BOOST_CHECK(view.CheckVersion());
+    {
+        CCoinsViewCache cache(view);
+        *cache.ModifyCoins(GetRandHash()) = RandomCoins(2);
+        BOOST_CHECK(cache.Flush());
+    }
+    BOOST_CHECK(view.CheckVersion());
+    view.WriteVersion(0);
+    BOOST_CHECK(!view.CheckVersion());
+    view.EraseVersion();
+    BOOST_CHECK(!view.CheckVersion());
+}
+
+BOOST_AUTO_TEST_CASE(coins_db_outputs)
+{
+    // Spending an output removes just its record; spending the last one
+    // removes the transaction
+    CCoinsViewDBTest view;
+    BOOST_CHECK(view.SetBestBlock(pindexGenesisBlock));
+    uint256 txidLarge = GetRandHash(), txidSmall = GetRandHash();
+    CCoins coinsLarge = RandomCoins(30), coinsSmall = RandomCoins(1);
+    coinsLarge.vout[0] = CTxOut(1, CScript() << OP_TRUE);
+    {
+        CCoinsViewCache cache(view);
+        *cache.ModifyCoins(txidLarge) = coinsLarge;
+        *cache.ModifyCoins(txidSmall) = coinsSmall;
+        BOOST_CHECK(cache.Flush());
+    }
+    unsigned int nOutputs = view.CountRecords('O');
+    BOOST_CHECK_EQUAL(view.CountRecords('T'), 2U);
+
+    {
+        CCoinsViewCache cache(view);
+        CTxInUndo undo;
+        BOOST_CHECK(cache.ModifyCoins(txidLarge)->Spend(COutPoint(txidLarge, 0), undo));
+        BOOST_CHECK(cache.ModifyCoins(txidSmall)->Spend(COutPoint(txidSmall, 0), undo));
+        BOOST_CHECK(cache.Flush());
+    }
+    BOOST_CHECK_EQUAL(view.CountRecords('O'), nOutputs - 2);
+    BOOST_CHECK_EQUAL(view.CountRecords('T'), 1U);
+    BOOST_CHECK(!view.HaveCoins(txidSmall));
+
+    CCoins coins;
+    coinsLarge.vout[0].SetNull();
+    BOOST_CHECK(view.GetCoins(txidLarge, coins));
+    BOOST_CHECK(coins == coinsLarge);
+
+    CCoinsStats stats;
+    BOOST_CHECK(view.GetStats(stats));
+    BOOST_CHECK_EQUAL(stats.nTransactions, 1U);
+    BOOST_CHECK_EQUAL(stats.nTransactionOutputs, nOutputs - 2);
+}
+
+BOOST_AUTO_TEST_CASE(coins_db_simulation)
+{
+    // Transactions are created, spent and restored again, as blocks are
+    // connected and disconnected, through a stack of caches on top of the
+    // database. Their changes are written without reading the database
+    // back, and it must always end up with the expected contents.
+    CCoinsViewDBTest view;
+    BOOST_CHECK(view.SetBestBlock(pindexGenesisBlock));
+    std::map<uint256, CCoins> mapCreated, mapResult;
+    std::vector<uint256> vTxids;
+    std::vector<CCoinsViewCache*> vStack;
+    vStack.push_back(new CCoinsViewCache(view));
+    vStack.back()->SetCompressed(insecure_rand() % 2);
+
+    for (int nStep = 0; nStep < 5000; nStep++) {
+        CCoinsViewCache &top = *vStack.back();
+        if (vTxids.empty() || insecure_rand() % 5 == 0) {
+            uint256 txid = GetRandHash();
+            CCoins coins = RandomCoins(1 + insecure_rand() % 20);
+            *top.ModifyCoins(txid) = coins;
+            vTxids.push_back(txid);
+            mapCreated[txid] = coins;
+            mapResult[txid] = coins;
+        } else {
+            uint256 txid = RandomTxid(vTxids);
+            const CCoins &created = mapCreated[txid];
+            CCoins &result = mapResult[txid];
+            unsigned int n = insecure_rand() % created.vout.size();
+            CCoinsModifier coins = top.ModifyCoins(txid);
+            // What remains of a spent transaction isn't kept
+            BOOST_CHECK(result.IsPruned() ? coins->IsPruned() : *coins == result);
+            if (result.IsAvailable(n)) {
+                CTxInUndo undo;
+                BOOST_CHECK(coins->Spend(COutPoint(txid, n), undo));
+            } else if (!created.vout[n].IsNull()) {
+                if (coins->IsPruned()) {
+                    coins->fCoinBase = created.fCoinBase;
+                    coins->nHeight = created.nHeight;
+                    coins->nVersion = created.nVersion;
+                }
+                if (coins->vout.size() <= n)
+                    coins->vout.resize(n + 1);
+                coins->vout[n] = created.vout[n];
+            }
+            coins->Cleanup();
+            result = *coins;
+        }
+
+        if (insecure_rand() % 100 == 0)
+            BOOST_CHECK(vStack.back()->Flush());
+        if (insecure_rand() % 200 == 0) {
+            if (vStack.size() > 1 && insecure_rand() % 2) {
+                BOOST_CHECK(vStack.back()->Flush());
+                delete vStack.back();
+                vStack.pop_back();
+            } else if (vStack.size() < 4) {
+                vStack.push_back(new CCoinsViewCache(*vStack.back(), true));
+                vStack.back()->SetCompressed(insecure_rand() % 2);
+            }
+        }
+    }
+
+    while (!vStack.empty()) {
+        BOOST_CHECK(vStack.back()->Flush());
+        delete vStack.back();
+        vStack.pop_back();
+    }
+    unsigned int nTransactions = 0, nOutputs = 0;
+    for (std::map<uint256, CCoins>::iterator it = mapResult.begin(); it != mapResult.end(); it++) {
+        CCoins coins;
+        if (it->second.IsPruned()) {
+            BOOST_CHECK(!view.HaveCoins(it->first));
+            continue;
+        }
+        BOOST_CHECK(view.GetCoins(it->first, coins));
+        BOOST_CHECK(coins == it->second);
+        nTransactions++;
+        for (unsigned int n = 0; n < coins.vout.size(); n++)
+            nOutputs += !coins.vout[n].IsNull();
+    }
+    BOOST_CHECK_EQUAL(view.CountRecords('T'), nTransactions);
+    BOOST_CHECK_EQUAL(view.CountRecords('O'), nOutputs);
+}
+
+BOOST_AUTO_TEST_CASE(coins_db_write_error)
+{
+    // Changes that don't say which outputs are stored are compared with the
+    // database, and a record that can't be read fails the whole write
+    CCoinsViewDBTest view;
+    BOOST_CHECK(view.SetBestBlock(pindexGenesisBlock));
+    uint256 txidGood = GetRandHash(), txidBad = GetRandHash();
+    CCoins coins = RandomCoins(3);
+    {
+        CCoinsViewCache cache(view);
+        *cache.ModifyCoins(txidGood) = coins;
+        BOOST_CHECK(cache.Flush());
+    }
+
+    CCoinsMap mapCoins;
+    mapCoins[txidGood].coins = coins;
+    mapCoins[txidGood].coins.vout[2].SetNull();
+    mapCoins[txidGood].coins.Cleanup();
+    mapCoins[txidGood].flags = CCoinsCacheEntry::DIRTY;
+    BOOST_CHECK(view.BatchWrite(mapCoins, pindexGenesisBlock));
+    CCoins coinsRead;
+    BOOST_CHECK(view.GetCoins(txidGood, coinsRead));
+    BOOST_CHECK(coinsRead == mapCoins[txidGood].coins);
+
+    view.WriteCorrupt(txidBad);
+    mapCoins[txidBad].flags = CCoinsCacheEntry::DIRTY;
+    BOOST_CHECK(!view.BatchWrite(mapCoins, pindexGenesisBlock));
+}
+
+BOOST_AUTO_TEST_CASE(coins_db_batch)
+{
+    // A batch lookup finds the same coins as looking them up one by one,
+    // and a cache keeps them as clean entries
+    CCoinsViewDBTest view;
+    BOOST_CHECK(view.SetBestBlock(pindexGenesisBlock));
+    std::map<uint256, CCoins> mapExpected;
+    {
+        CCoinsViewCache cache(view);
+        for (int i = 0; i < 100; i++) {
+            CCoins coins = RandomCoins(1 + insecure_rand() % 10);
+            uint256 txid = GetRandHash();
+            *cache.ModifyCoins(txid) = coins;
+            mapExpected[txid] = coins;
+        }
+        BOOST_CHECK(cache.Flush());
+    }
+
+    std::vector<uint256> vTxid;
+    for (std::map<uint256, CCoins>::iterator it = mapExpected.begin(); it != mapExpected.end(); it++)
+        if (insecure_rand() % 2)
+            vTxid.push_back(it->first);
+    for (int i = 0; i < 20; i++)
+        vTxid.push_back(GetRandHash());
+
+    CCoinsMap mapCoins;
+    BOOST_CHECK(view.GetCoinsBatch(vTxid, mapCoins));
+    BOOST_FOREACH(const uint256 &txid, vTxid) {
+        CCoins coins;
+        bool fHave = view.GetCoins(txid, coins);
+        BOOST_CHECK_EQUAL(mapCoins.count(txid), fHave ? 1U : 0U);
+        if (fHave)
+            BOOST_CHECK(mapCoins[txid].coins == coins);
+    }
+
+    CCoinsViewTest base;
+    base.mapCoins = mapExpected;
+    CCoinsViewCacheTest cache(base);
+    BOOST_CHECK(cache.HaveCoins(vTxid[0]) == (mapExpected.count(vTxid[0]) == 1));
+    BOOST_CHECK(cache.FetchCoinsBatch(vTxid));
+    cache.SelfTest();
+    BOOST_FOREACH(const uint256 &txid, vTxid) {
+        BOOST_CHECK_EQUAL(cache.HaveCoins(txid), mapExpected.count(txid) == 1);
+        if (mapExpected.count(txid))
+            BOOST_CHECK(cache.GetCoins(txid) == mapExpected[txid]);
+    }
+    BOOST_CHECK(cache.Flush());
+    BOOST_CHECK_EQUAL(base.nWrites, 0U);
+}
+
+BOOST_AUTO_TEST_CASE(coins_cache_compressed)
+{
+    // Compressed entries take much less memory, read back the same, and are
+    // written to the base like any others
+    CKey key;
+    key.MakeNewKey(false);
+    CCoinsViewTest base;
+    CCoinsViewCacheTest cache(base), cacheCompressed(base);
+    cacheCompressed.SetCompressed(true);
+    std::map<uint256, CCoins> mapExpected;
+    for (int i = 0; i < 200; i++) {
+        CCoins coins = RandomCoins(1 + insecure_rand() % 5);
+        // Some with an uncompressed public key, which stays as it is
+        if (i % 10 == 0)
+            coins.vout[0] = CTxOut(1000, CScript() << key.GetPubKey() << OP_CHECKSIG);
+        uint256 txid = GetRandHash();
+        BOOST_CHECK(cache.SetCoins(txid, coins));
+        BOOST_CHECK(cacheCompressed.SetCoins(txid, coins));
+        mapExpected[txid] = coins;
+    }
+    cache.SelfTest();
+    cacheCompressed.SelfTest();
+    BOOST_CHECK(cacheCompressed.DynamicMemoryUsage() < cache.DynamicMemoryUsage() * 2 / 3);
+
+    for (std::map<uint256, CCoins>::iterator it = mapExpected.begin(); it != mapExpected.end(); it++) {
+        CCoins coins;
+        BOOST_CHECK(cacheCompressed.GetCoins(it->first, coins));
+        BOOST_CHECK(coins == it->second);
+    }
+
+    // Handing out a reference expands the entry, until it is modified
+    size_t nUsage = cacheCompressed.DynamicMemoryUsage();
+    uint256 txid = mapExpected.begin()->first;
+    BOOST_CHECK(cacheCompressed.GetCoins(txid) == mapExpected[txid]);
+    BOOST_CHECK(cacheCompressed.DynamicMemoryUsage() > nUsage);
+    {
+        CCoinsModifier coins = cacheCompressed.ModifyCoins(txid);
+        BOOST_CHECK(*coins == mapExpected[txid]);
+    }
+    BOOST_CHECK_EQUAL(cacheCompressed.DynamicMemoryUsage(), nUsage);
+    cacheCompressed.SelfTest();
+
+    BOOST_CHECK(cacheCompressed.Flush());
+    BOOST_CHECK_EQUAL(base.nWrites, 200U);
+    BOOST_CHECK(base.mapCoins == mapExpected);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -1,5 +1,8 @@
 #include <boost/test/unit_test.hpp>
 
+#include <openssl/ecdsa.h>
+#include <openssl/obj_mac.h>
+
 #include <string>
 #include <vector>
 
@@ -138,4 +141,56 @@ BOOST_AUTO_TEST_CASE(key_test1)
     }
 }
 
+// Verification the way CPubKey::Verify used to do it, with a freshly
+// parsed key every time
+static bool ReferenceVerify(const CPubKey &pubkey, const uint256 &hash, const vector<unsigned char> &vchSig)
+{
+    if (!pubkey.IsValid())
+        return false;
+    EC_KEY *pkey = EC_KEY_new_by_curve_name(NID_secp256k1);
+    const unsigned char *pbegin = pubkey.begin();
+    bool fRet = o2i_ECPublicKey(&pkey, &pbegin, pubkey.size()) &&
+                ECDSA_verify(0, (unsigned char*)&hash, sizeof(hash), &vchSig[0], vchSig.size(), pkey) == 1;
+    EC_KEY_free(pkey);
+    return fRet;
+}
+
+static void CheckVerify(const CPubKey &pubkey, const uint256 &hash, const vector<unsigned char> &vchSig)
+{
+    bool fExpected = ReferenceVerify(pubkey, hash, vchSig);
+    // Once when the key is parsed, once when it comes from the cache
+    BOOST_CHECK_EQUAL(pubkey.Verify(hash, vchSig), fExpected);
+    BOOST_CHECK_EQUAL(pubkey.Verify(hash, vchSig), fExpected);
+}
+
+BOOST_AUTO_TEST_CASE(key_verify_cache)
+{
+    for (int i = 0; i < 20; i++)
+    {
+        CKey key;
+        key.MakeNewKey(i % 2 == 0);
+        CPubKey pubkey = key.GetPubKey();
+        uint256 hash = GetRandHash();
+        vector<unsigned char> vchSig;
+        BOOST_CHECK(key.Sign(hash, vchSig));
+
+        BOOST_CHECK(ReferenceVerify(pubkey, hash, vchSig));
+        CheckVerify(pubkey, hash, vchSig);
+        CheckVerify(pubkey, GetRandHash(), vchSig);
+
+        for (int j = 0; j < 10; j++)
+        {
+            vector<unsigned char> vchBad(vchSig);
+            vchBad[GetRand(vchBad.size())] ^= 1 << GetRand(8);
+            CheckVerify(pubkey, hash, vchBad);
+            vchBad.resize(1 + GetRand(vchSig.size() - 1));
+            CheckVerify(pubkey, hash, vchBad);
+
+            vector<unsigned char> vchPubKey(pubkey.begin(), pubkey.end());
+            vchPubKey[1 + GetRand(vchPubKey.size() - 1)] ^= 1 << GetRand(8);
+            CheckVerify(CPubKey(vchPubKey), hash, vchSig);
+        }
+    }
+}
+
 BOOST_AUTO_TEST_SUITE_END()
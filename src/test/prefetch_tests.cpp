@@ -0,0 +1,71 @@
+#include <boost/test/unit_test.hpp>
+#include <boost/thread.hpp>
+
+#include "main.h"
+#include "util.h"
+
+BOOST_AUTO_TEST_SUITE(prefetch_tests)
+
+// Records which coins were asked for
+class CCoinsViewCounting : public CCoinsView
+{
+public:
+    boost::mutex cs;
+    std::multiset<uint256> setFetched;
+
+    bool GetCoins(const uint256 &txid, CCoins &coins)
+    {
+        boost::unique_lock<boost::mutex> lock(cs);
+        setFetched.insert(txid);
+        return false;
+    }
+
+    unsigned int GetFetchedCount()
+    {
+        boost::unique_lock<boost::mutex> lock(cs);
+        return setFetched.size();
+    }
+};
+
+BOOST_AUTO_TEST_CASE(prefetch_block_inputs)
+{
+    CCoinsViewCounting view;
+    CCoinsPrefetcher prefetcher;
+    boost::thread thread(boost::bind(&CCoinsPrefetcher::Thread, &prefetcher, &view));
+
+    // Coinbase, a transaction spending two outputs of one earlier
+    // transaction, and one spending its output within the block
+    CBlock block;
+    block.vtx.resize(3);
+    block.vtx[0].vin.resize(1);
+    block.vtx[0].vout.resize(1);
+    uint256 hashPrev1 = GetRandHash(), hashPrev2 = GetRandHash();
+    block.vtx[1].vin.push_back(CTxIn(COutPoint(hashPrev1, 0)));
+    block.vtx[1].vin.push_back(CTxIn(COutPoint(hashPrev1, 1)));
+    block.vtx[1].vin.push_back(CTxIn(COutPoint(hashPrev2, 0)));
+    block.vtx[1].vout.resize(1);
+    block.vtx[2].vin.push_back(CTxIn(COutPoint(block.vtx[1].GetHash(), 0)));
+    block.vtx[2].vout.resize(1);
+
+    // Blocks added before the thread starts are dropped
+    BOOST_REQUIRE(prefetcher.WaitActive(10000));
+    prefetcher.Add(block);
+    BOOST_REQUIRE(prefetcher.WaitBatches(1, 10000));
+
+    {
+        boost::unique_lock<boost::mutex> lock(view.cs);
+        BOOST_CHECK_EQUAL(view.setFetched.size(), 2U);
+        BOOST_CHECK_EQUAL(view.setFetched.count(hashPrev1), 1U);
+        BOOST_CHECK_EQUAL(view.setFetched.count(hashPrev2), 1U);
+    }
+
+    // Once stopped, the view is left alone
+    prefetcher.Stop();
+    prefetcher.Add(block);
+    BOOST_CHECK_EQUAL(view.GetFetchedCount(), 2U);
+
+    thread.interrupt();
+    thread.join();
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,126 @@
+#include <boost/test/unit_test.hpp>
+#include <limits>
+
+#include "bignum.h"
+#include "script.h"
+
+BOOST_AUTO_TEST_SUITE(scriptnum_tests)
+
+static const int64 values[] =
+{ 0, 1, -1, -2, 127, 128, -255, 256, (1LL << 15) - 1, -(1LL << 16), (1LL << 24), (1LL << 31), 1 - (1LL << 32), 1LL << 40 };
+static const int64 offsets[] = { 1, 0x79, 0x80, 0x81, 0xFF, 0x7FFF, 0x8000, 0xFFFF, 0x10000};
+
+static bool verify(const CBigNum& bignum, const CScriptNum& scriptnum)
+{
+    return bignum.getvch() == scriptnum.getvch() && bignum.getint() == scriptnum.getint();
+}
+
+static void CheckCreateVch(const int64& num)
+{
+    CBigNum bignum(num);
+    CScriptNum scriptnum(num);
+    BOOST_CHECK(verify(bignum, scriptnum));
+
+    // Values that don't fit in nMaxNumSize bytes can't be read back
+    std::vector<unsigned char> vch = bignum.getvch();
+    if (vch.size() > CScriptNum::nMaxNumSize)
+    {
+        BOOST_CHECK_THROW(CScriptNum scriptnum2(vch), scriptnum_error);
+        return;
+    }
+
+    CBigNum bignum2(vch);
+    CScriptNum scriptnum2(vch);
+    BOOST_CHECK(verify(bignum2, scriptnum2));
+    BOOST_CHECK(scriptnum2 == num);
+}
+
+static void CheckAdd(const int64& num1, const int64& num2)
+{
+    const CBigNum bignum1(num1);
+    const CBigNum bignum2(num2);
+    const CScriptNum scriptnum1(num1);
+    const CScriptNum scriptnum2(num2);
+
+    BOOST_CHECK(verify(bignum1 + bignum2, scriptnum1 + scriptnum2));
+    BOOST_CHECK(verify(bignum1 + bignum2, scriptnum1 + num2));
+    BOOST_CHECK(verify(bignum1 - bignum2, scriptnum1 - scriptnum2));
+    BOOST_CHECK(verify(bignum1 - bignum2, scriptnum1 - num2));
+}
+
+static void CheckNegate(const int64& num)
+{
+    const CBigNum bignum(num);
+    const CScriptNum scriptnum(num);
+    BOOST_CHECK(verify(-bignum, -scriptnum));
+}
+
+static void CheckCompare(const int64& num1, const int64& num2)
+{
+    const CBigNum bignum1(num1);
+    const CBigNum bignum2(num2);
+    const CScriptNum scriptnum1(num1);
+    const CScriptNum scriptnum2(num2);
+
+    BOOST_CHECK((bignum1 == bignum2) == (scriptnum1 == scriptnum2));
+    BOOST_CHECK((bignum1 != bignum2) == (scriptnum1 != scriptnum2));
+    BOOST_CHECK((bignum1 <  bignum2) == (scriptnum1 <  scriptnum2));
+    BOOST_CHECK((bignum1 >  bignum2) == (scriptnum1 >  scriptnum2));
+    BOOST_CHECK((bignum1 >= bignum2) == (scriptnum1 >= scriptnum2));
+    BOOST_CHECK((bignum1 <= bignum2) == (scriptnum1 <= scriptnum2));
+}
+
+BOOST_AUTO_TEST_CASE(creation)
+{
+    for (size_t i = 0; i < sizeof(values) / sizeof(values[0]); ++i)
+    {
+        for (size_t j = 0; j < sizeof(offsets) / sizeof(offsets[0]); ++j)
+        {
+            CheckCreateVch(values[i]);
+            CheckCreateVch(values[i] + offsets[j]);
+            CheckCreateVch(values[i] - offsets[j]);
+        }
+    }
+}
+
+BOOST_AUTO_TEST_CASE(operators)
+{
+    for (size_t i = 0; i < sizeof(values) / sizeof(values[0]); ++i)
+    {
+        for (size_t j = 0; j < sizeof(values) / sizeof(values[0]); ++j)
+        {
+            CheckAdd(values[i], values[j]);
+            CheckCompare(values[i], values[j]);
+        }
+        CheckNegate(values[i]);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(nonminimal)
+{
+    // Padding and negative zero read the same as CBigNum does, and are
+    // written back minimally
+    const unsigned char vectors[][4] =
+    {
+        { 0x00, 0x00, 0x00, 0x00 },
+        { 0x00, 0x00, 0x00, 0x80 },
+        { 0x01, 0x00, 0x00, 0x00 },
+        { 0x01, 0x00, 0x00, 0x80 },
+        { 0xff, 0x00, 0x00, 0x00 },
+        { 0xff, 0x00, 0x00, 0x80 },
+        { 0xff, 0xff, 0xff, 0x7f },
+        { 0xff, 0xff, 0xff, 0xff },
+    };
+    for (size_t i = 0; i < sizeof(vectors) / sizeof(vectors[0]); ++i)
+    {
+        for (size_t n = 1; n <= 4; ++n)
+        {
+            std::vector<unsigned char> vch(vectors[i], vectors[i] + n);
+            CBigNum bignum(CBigNum(vch).getvch());
+            CScriptNum scriptnum(vch);
+            BOOST_CHECK(verify(bignum, scriptnum));
+        }
+    }
+}
+
+BOOST_AUTO_TEST_SUITE_END()
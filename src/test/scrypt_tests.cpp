@@ -1,22 +1,27 @@
 #include <boost/test/unit_test.hpp>
+#include <boost/foreach.hpp>
+#include <boost/thread.hpp>
 
+#include "main.h"
 #include "util.h"
 #include "scrypt.h"
 
 BOOST_AUTO_TEST_SUITE(scrypt_tests)
 
+// Known inputs and expected outputs
+#define HASHCOUNT 5
+static const char* inputhex[HASHCOUNT] = { "020000004c1271c211717198227392b029a64a7971931d351b387bb80db027f270411e398a07046f7d4a08dd815412a8712f874a7ebf0507e3878bd24e20a3b73fd750a667d2f451eac7471b00de6659", "0200000011503ee6a855e900c00cfdd98f5f55fffeaee9b6bf55bea9b852d9de2ce35828e204eef76acfd36949ae56d1fbe81c1ac9c0209e6331ad56414f9072506a77f8c6faf551eac7471b00389d01", "02000000a72c8a177f523946f42f22c3e86b8023221b4105e8007e59e81f6beb013e29aaf635295cb9ac966213fb56e046dc71df5b3f7f67ceaeab24038e743f883aff1aaafaf551eac7471b0166249b", "010000007824bc3a8a1b4628485eee3024abd8626721f7f870f8ad4d2f33a27155167f6a4009d1285049603888fe85a84b6c803a53305a8d497965a5e896e1a00568359589faf551eac7471b0065434e", "0200000050bfd4e4a307a8cb6ef4aef69abc5c0f2d579648bd80d7733e1ccc3fbc90ed664a7f74006cb11bde87785f229ecd366c2d4e44432832580e0608c579e4cb76f383f7f551eac7471b00c36982" };
+static const char* expected[HASHCOUNT] = { "00000000002bef4107f882f6115e0b01f348d21195dacd3582aa2dabd7985806" , "00000000003a0d11bdd5eb634e08b7feddcfbbf228ed35d250daf19f1c88fc94", "00000000000b40f895f288e13244728a6c2d9d59d8aff29c65f8dd5114a8ca81", "00000000003007005891cd4923031e99d8e8d72f6e8e7edc6a86181897e105fe", "000000000018f0b426a4afc7130ccb47fa02af730d345b4fe7c7724d3800ec8c" };
+
 BOOST_AUTO_TEST_CASE(scrypt_hashtest)
 {
     // Test Scrypt hash with known inputs against expected outputs
-    #define HASHCOUNT 5
-    const char* inputhex[HASHCOUNT] = { "020000004c1271c211717198227392b029a64a7971931d351b387bb80db027f270411e398a07046f7d4a08dd815412a8712f874a7ebf0507e3878bd24e20a3b73fd750a667d2f451eac7471b00de6659", "0200000011503ee6a855e900c00cfdd98f5f55fffeaee9b6bf55bea9b852d9de2ce35828e204eef76acfd36949ae56d1fbe81c1ac9c0209e6331ad56414f9072506a77f8c6faf551eac7471b00389d01", "02000000a72c8a177f523946f42f22c3e86b8023221b4105e8007e59e81f6beb013e29aaf635295cb9ac966213fb56e046dc71df5b3f7f67ceaeab24038e743f883aff1aaafaf551eac7471b0166249b", "010000007824bc3a8a1b4628485eee3024abd8626721f7f870f8ad4d2f33a27155167f6a4009d1285049603888fe85a84b6c803a53305a8d497965a5e896e1a00568359589faf551eac7471b0065434e", "0200000050bfd4e4a307a8cb6ef4aef69abc5c0f2d579648bd80d7733e1ccc3fbc90ed664a7f74006cb11bde87785f229ecd366c2d4e44432832580e0608c579e4cb76f383f7f551eac7471b00c36982" };
-    const char* expected[HASHCOUNT] = { "00000000002bef4107f882f6115e0b01f348d21195dacd3582aa2dabd7985806" , "00000000003a0d11bdd5eb634e08b7feddcfbbf228ed35d250daf19f1c88fc94", "00000000000b40f895f288e13244728a6c2d9d59d8aff29c65f8dd5114a8ca81", "00000000003007005891cd4923031e99d8e8d72f6e8e7edc6a86181897e105fe", "000000000018f0b426a4afc7130ccb47fa02af730d345b4fe7c7724d3800ec8c" };
 #if defined(USE_SSE2)
     scrypt_detect_sse2();
 #endif
     uint256 scrypthash;
     std::vector<unsigned char> inputbytes;
-    char scratchpad[SCRYPT_SCRATCHPAD_SIZE];
+    char *scratchpad = scrypt_thread_scratchpad();
     for (int i = 0; i < HASHCOUNT; i++) {
         inputbytes = ParseHex(inputhex[i]);
 #if defined(USE_SSE2)
@@ -28,6 +33,113 @@ BOOST_AUTO_TEST_CASE(scrypt_hashtest)
         scrypt_1024_1_1_256_sp_generic((const char*)&inputbytes[0], BEGIN(scrypthash), scratchpad);
         BOOST_CHECK_EQUAL(scrypthash.ToString().c_str(), expected[i]);
     }
+
+    // Test the multi-lane batch path, with counts that exercise every kernel
+    // width, the padded tail and the single-lane remainder
+    scrypt_detect_multiway();
+    unsigned int counts[] = { 1, 3, 4, 7, 13, 37 };
+    BOOST_FOREACH(unsigned int nCount, counts) {
+        std::vector<unsigned char> vInput;
+        std::vector<uint256> vOutput(nCount);
+        for (unsigned int i = 0; i < nCount; i++) {
+            inputbytes = ParseHex(inputhex[i % HASHCOUNT]);
+            vInput.insert(vInput.end(), inputbytes.begin(), inputbytes.end());
+        }
+        scrypt_1024_1_1_256_batch((const char*)&vInput[0], BEGIN(vOutput[0]), nCount);
+        for (unsigned int i = 0; i < nCount; i++)
+            BOOST_CHECK_EQUAL(vOutput[i].ToString().c_str(), expected[i % HASHCOUNT]);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(scrypt_mine_midstate)
+{
+    scrypt_detect_multiway();
+
+    char *scratchpad = scrypt_thread_scratchpad();
+    for (int i = 0; i < HASHCOUNT; i++) {
+        std::vector<unsigned char> inputbytes = ParseHex(inputhex[i]);
+        const char *pheader = (const char*)&inputbytes[0];
+        uint32_t nNonce = le32dec(pheader + 76);
+        scrypt_midstate midstate;
+        scrypt_1024_1_1_256_midstate(pheader, &midstate);
+
+        uint256 scrypthash;
+        scrypt_1024_1_1_256_sp_mine(&midstate, pheader, nNonce, 1, BEGIN(scrypthash), scratchpad);
+        BOOST_CHECK_EQUAL(scrypthash.ToString().c_str(), expected[i]);
+
+        // A run of nonces around the known one matches hashing each header
+        std::vector<uint256> vOutput(21);
+        scrypt_1024_1_1_256_sp_mine(&midstate, pheader, nNonce - 10, 21, BEGIN(vOutput[0]), scratchpad);
+        BOOST_CHECK_EQUAL(vOutput[10].ToString().c_str(), expected[i]);
+        for (int j = 0; j < 21; j++) {
+            le32enc(&inputbytes[76], nNonce - 10 + j);
+            scrypt_1024_1_1_256(pheader, BEGIN(scrypthash));
+            BOOST_CHECK(vOutput[j] == scrypthash);
+        }
+    }
+}
+
+static void GetThreadScratchpad(char **ppScratchpad)
+{
+    *ppScratchpad = scrypt_thread_scratchpad();
+}
+
+BOOST_AUTO_TEST_CASE(scrypt_scratchpad_pool)
+{
+    // Reused within a thread, never shared between threads
+    char *scratchpad = scrypt_thread_scratchpad();
+    BOOST_CHECK(scratchpad != NULL);
+    BOOST_CHECK(((uintptr_t)scratchpad & 63) == 0);
+    BOOST_CHECK(scrypt_thread_scratchpad() == scratchpad);
+
+    char *pOther = NULL;
+    boost::thread t(GetThreadScratchpad, &pOther);
+    t.join();
+    BOOST_CHECK(pOther != NULL);
+    BOOST_CHECK(pOther != scratchpad);
+}
+
+BOOST_AUTO_TEST_CASE(scrypt_checkpow_batch)
+{
+    scrypt_detect_multiway();
+
+    std::vector<CBlockHeader> vHeaders;
+    for (int i = 0; i < 21; i++) {
+        CDataStream ss(ParseHex(inputhex[i % HASHCOUNT]), SER_NETWORK, PROTOCOL_VERSION);
+        CBlockHeader header;
+        ss >> header;
+        vHeaders.push_back(header);
+    }
+    std::vector<bool> vfValid;
+    BOOST_CHECK(CheckProofOfWorkBatch(vHeaders, vfValid));
+    BOOST_CHECK_EQUAL(vfValid.size(), vHeaders.size());
+    BOOST_CHECK(std::count(vfValid.begin(), vfValid.end(), true) == 21);
+
+    // Changing the nonce invalidates only the touched headers
+    vHeaders[6].nNonce++;
+    vHeaders[20].nNonce++;
+    BOOST_CHECK(!CheckProofOfWorkBatch(vHeaders, vfValid));
+    for (int i = 0; i < 21; i++)
+        BOOST_CHECK_EQUAL(vfValid[i], i != 6 && i != 20);
+}
+
+BOOST_AUTO_TEST_CASE(scrypt_block_powhash_cache)
+{
+    CDataStream ss(ParseHex(inputhex[0]), SER_NETWORK, PROTOCOL_VERSION);
+    CBlockHeader header;
+    ss >> header;
+    CBlock block(header);
+    BOOST_CHECK_EQUAL(block.GetPoWHash().ToString(), expected[0]);
+
+    // A seeded hash is used while the header is unchanged...
+    block.SetPoWHash(uint256(1));
+    BOOST_CHECK(block.GetPoWHash() == uint256(1));
+
+    // ...and dropped as soon as it changes
+    block.nNonce++;
+    BOOST_CHECK(block.GetPoWHash() == ((CBlockHeader)block).GetPoWHash());
+    block.nNonce--;
+    BOOST_CHECK_EQUAL(block.GetPoWHash().ToString(), expected[0]);
 }
 
 BOOST_AUTO_TEST_SUITE_END()
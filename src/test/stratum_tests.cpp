@@ -0,0 +1,138 @@
+//
+// Unit tests for the stratum coinbase, merkle branch and share handling
+//
+#include <boost/assign/list_of.hpp>
+#include <boost/test/unit_test.hpp>
+#include <boost/foreach.hpp>
+
+#include "main.h"
+#include "stratum.h"
+#include "util.h"
+
+BOOST_AUTO_TEST_SUITE(stratum_tests)
+
+static CTransaction MakeCoinbase()
+{
+    CTransaction txCoinbase;
+    txCoinbase.vin.resize(1);
+    txCoinbase.vin[0].prevout.SetNull();
+    txCoinbase.vout.resize(1);
+    txCoinbase.vout[0].nValue = 50 * COIN;
+    txCoinbase.vout[0].scriptPubKey = CScript() << OP_DUP << OP_HASH160 << std::vector<unsigned char>(20, 0x42) << OP_EQUALVERIFY << OP_CHECKSIG;
+    return txCoinbase;
+}
+
+BOOST_AUTO_TEST_CASE(stratum_coinbase)
+{
+    BOOST_FOREACH(int nHeight, boost::assign::list_of(1)(16)(17)(1000)(100000)(0x7fffffff))
+    {
+        CTransaction txCoinbase = MakeCoinbase();
+        std::vector<unsigned char> vchCoinbase1, vchCoinbase2;
+        SplitStratumCoinbase(txCoinbase, nHeight, vchCoinbase1, vchCoinbase2);
+
+        // Put back together with zeros, it is the coinbase it was split from
+        std::vector<unsigned char> vchExtraNonce(8, 0);
+        CTransaction txJoined;
+        BOOST_CHECK(JoinStratumCoinbase(vchCoinbase1, vchExtraNonce, vchCoinbase2, txJoined));
+        BOOST_CHECK(txJoined.GetHash() == txCoinbase.GetHash());
+
+        // Any other extra nonce lands right after the height
+        for (unsigned int i = 0; i < vchExtraNonce.size(); i++)
+            vchExtraNonce[i] = i + 1;
+        BOOST_CHECK(JoinStratumCoinbase(vchCoinbase1, vchExtraNonce, vchCoinbase2, txJoined));
+        BOOST_CHECK(txJoined.IsCoinBase());
+        BOOST_CHECK(txJoined.vin[0].scriptSig == (CScript() << nHeight << vchExtraNonce) + COINBASE_FLAGS);
+        BOOST_CHECK(txJoined.vout == txCoinbase.vout);
+
+        // Cut short, or with bytes left over, it doesn't parse
+        std::vector<unsigned char> vchShort(vchCoinbase2.begin(), vchCoinbase2.end() - 1);
+        BOOST_CHECK(!JoinStratumCoinbase(vchCoinbase1, vchExtraNonce, vchShort, txJoined));
+        std::vector<unsigned char> vchLong(vchExtraNonce);
+        vchLong.push_back(0);
+        BOOST_CHECK(!JoinStratumCoinbase(vchCoinbase1, vchLong, vchCoinbase2, txJoined));
+    }
+}
+
+BOOST_AUTO_TEST_CASE(stratum_merkle_branch)
+{
+    for (unsigned int nTx = 1; nTx <= 9; nTx++)
+    {
+        CBlock block;
+        block.vtx.push_back(MakeCoinbase());
+        std::vector<unsigned char> vchCoinbase1, vchCoinbase2;
+        SplitStratumCoinbase(block.vtx[0], 1000, vchCoinbase1, vchCoinbase2);
+        for (unsigned int i = 1; i < nTx; i++)
+        {
+            CTransaction tx;
+            tx.vin.resize(1);
+            tx.vin[0].prevout = COutPoint(GetRandHash(), i);
+            tx.vout.resize(1);
+            tx.vout[0].nValue = i;
+            block.vtx.push_back(tx);
+        }
+        block.BuildMerkleTree();
+        std::vector<uint256> vMerkleBranch = block.GetMerkleBranch(0);
+
+        // The branch gives the merkle root for any extra nonce
+        std::vector<unsigned char> vchExtraNonce(8);
+        for (int i = 0; i < 4; i++)
+        {
+            for (unsigned int j = 0; j < vchExtraNonce.size(); j++)
+                vchExtraNonce[j] = GetRandInt(256);
+            CTransaction txCoinbase;
+            BOOST_CHECK(JoinStratumCoinbase(vchCoinbase1, vchExtraNonce, vchCoinbase2, txCoinbase));
+            block.vtx[0] = txCoinbase;
+            BOOST_CHECK(CBlock::CheckMerkleBranch(txCoinbase.GetHash(), vMerkleBranch, 0) == block.BuildMerkleTree());
+        }
+    }
+}
+
+BOOST_AUTO_TEST_CASE(stratum_share)
+{
+    CBlockHeader header;
+    header.nVersion = 2;
+    header.hashPrevBlock = GetRandHash();
+    header.hashMerkleRoot = GetRandHash();
+    header.nTime = 1400000000;
+    header.nBits = 0x1e0ffff0;
+    header.nNonce = 0;
+
+    uint256 hashMax = ~uint256(0);
+    mruset<uint256> setSubmitted(2);
+    uint256 hashPoW;
+    BOOST_CHECK_EQUAL(CheckStratumShare(header, hashMax, setSubmitted, hashPoW), 0);
+    BOOST_CHECK(hashPoW == header.GetPoWHash());
+    BOOST_CHECK_EQUAL(CheckStratumShare(header, hashMax, setSubmitted, hashPoW), STRATUM_DUPLICATE_SHARE);
+
+    // Above the share target
+    header.nNonce++;
+    BOOST_CHECK_EQUAL(CheckStratumShare(header, uint256(0), setSubmitted, hashPoW), STRATUM_LOW_DIFFICULTY);
+    header.nNonce++;
+    BOOST_CHECK_EQUAL(CheckStratumShare(header, header.GetPoWHash(), setSubmitted, hashPoW), 0);
+
+    // Only the latest shares are remembered
+    BOOST_CHECK_EQUAL(setSubmitted.size(), 2U);
+    header.nNonce = 0;
+    BOOST_CHECK_EQUAL(CheckStratumShare(header, hashMax, setSubmitted, hashPoW), 0);
+}
+
+BOOST_AUTO_TEST_CASE(stratum_authorize)
+{
+    mapArgs["-rpcuser"] = "user";
+    mapArgs["-rpcpassword"] = "secret";
+    BOOST_CHECK(StratumAuthorized("user", "secret"));
+    BOOST_CHECK(StratumAuthorized("user.rig1", "secret"));
+    BOOST_CHECK(!StratumAuthorized("user", "Secret"));
+    BOOST_CHECK(!StratumAuthorized("user", ""));
+    BOOST_CHECK(!StratumAuthorized("user2", "secret"));
+    BOOST_CHECK(!StratumAuthorized("", "secret"));
+
+    // Without a password nobody gets in
+    mapArgs["-rpcpassword"] = "";
+    BOOST_CHECK(!StratumAuthorized("user", ""));
+
+    mapArgs.erase("-rpcuser");
+    mapArgs.erase("-rpcpassword");
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -273,4 +273,48 @@ BOOST_AUTO_TEST_CASE(test_IsStandard)
     BOOST_CHECK(!t.IsStandard());
 }
 
+BOOST_AUTO_TEST_CASE(test_AcceptToMemoryPool)
+{
+    CBasicKeyStore keystore;
+    std::vector<CTransaction> dummyTransactions = SetupDummyInputs(keystore, *pcoinsTip);
+
+    // Enough inputs for the scripts to be run on the script check threads
+    CTransaction t;
+    t.vin.resize(3);
+    t.vin[0].prevout.hash = dummyTransactions[0].GetHash();
+    t.vin[0].prevout.n = 1;
+    t.vin[1].prevout.hash = dummyTransactions[1].GetHash();
+    t.vin[1].prevout.n = 0;
+    t.vin[2].prevout.hash = dummyTransactions[1].GetHash();
+    t.vin[2].prevout.n = 1;
+    t.vout.resize(1);
+    t.vout[0].nValue = 90*CENT;
+    CKey key;
+    key.MakeNewKey(true);
+    t.vout[0].scriptPubKey.SetDestination(key.GetPubKey().GetID());
+    BOOST_CHECK(SignSignature(keystore, dummyTransactions[0], t, 0));
+    BOOST_CHECK(SignSignature(keystore, dummyTransactions[1], t, 1));
+    BOOST_CHECK(SignSignature(keystore, dummyTransactions[1], t, 2));
+
+    // A signature of the wrong key in one input gets the sender punished
+    CTransaction tBad(t);
+    std::swap(tBad.vin[1].scriptSig, tBad.vin[2].scriptSig);
+    CValidationState state;
+    int nDoS = 0;
+    BOOST_CHECK(!tBad.AcceptToMemoryPool(state, true, false));
+    BOOST_CHECK(state.IsInvalid(nDoS) && nDoS == 100);
+
+    {
+        LOCK(cs_main);
+        CValidationState state2;
+        BOOST_CHECK(t.AcceptToMemoryPool(state2, true, false, NULL, false, true));
+    }
+    BOOST_CHECK(mempool.exists(t.GetHash()));
+
+    // Once accepted, it conflicts with itself
+    CValidationState state3;
+    BOOST_CHECK(!t.AcceptToMemoryPool(state3, true, false));
+    mempool.remove(t);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,47 @@
+#include <boost/test/unit_test.hpp>
+
+#include "main.h"
+
+BOOST_AUTO_TEST_SUITE(validationstats_tests)
+
+BOOST_AUTO_TEST_CASE(validationstats_histogram)
+{
+    std::vector<CValidationPhaseStats> vStats;
+    GetValidationStats(vStats, true);
+
+    RecordValidationTime(VALIDATION_CONNECT_WAIT, 0);
+    RecordValidationTime(VALIDATION_CONNECT_WAIT, 1);
+    RecordValidationTime(VALIDATION_CONNECT_WAIT, 1000);
+    RecordValidationTime(VALIDATION_CONNECT_WAIT, 1023);
+    RecordValidationTime(VALIDATION_CONNECT_WAIT, 1024);
+    RecordValidationTime(VALIDATION_CONNECT_WAIT, (int64)1 << 40);
+    {
+        CValidationTimer timer(VALIDATION_FLUSH);
+    }
+
+    GetValidationStats(vStats);
+    BOOST_CHECK_EQUAL(vStats.size(), (size_t)VALIDATION_PHASES);
+    const CValidationPhaseStats &stats = vStats[VALIDATION_CONNECT_WAIT];
+    BOOST_CHECK_EQUAL(stats.strName, "connectblock.wait");
+    BOOST_CHECK_EQUAL(stats.nCount, 6U);
+    BOOST_CHECK_EQUAL(stats.nTotalMicros, 3048 + ((int64)1 << 40));
+    BOOST_CHECK_EQUAL(stats.nMaxMicros, (int64)1 << 40);
+    BOOST_CHECK_EQUAL(stats.vBuckets[0], 1U);   // < 1us
+    BOOST_CHECK_EQUAL(stats.vBuckets[1], 1U);   // < 2us
+    BOOST_CHECK_EQUAL(stats.vBuckets[10], 2U);  // < 1024us
+    BOOST_CHECK_EQUAL(stats.vBuckets[11], 1U);  // < 2048us
+    BOOST_CHECK_EQUAL(stats.vBuckets[CValidationPhaseStats::nBuckets - 1], 1U);
+    BOOST_CHECK_EQUAL(vStats[VALIDATION_FLUSH].nCount, 1U);
+    BOOST_CHECK_EQUAL(vStats[VALIDATION_PROCESSBLOCK].nCount, 0U);
+    BOOST_CHECK_EQUAL(vStats[VALIDATION_CONNECT_FETCH].strName, "connectblock.fetch");
+    BOOST_CHECK_EQUAL(vStats[VALIDATION_CONNECT_INPUTS].strName, "connectblock.inputs");
+
+    // Resetting returns the old numbers and starts over
+    GetValidationStats(vStats, true);
+    BOOST_CHECK_EQUAL(vStats[VALIDATION_CONNECT_WAIT].nCount, 6U);
+    GetValidationStats(vStats);
+    BOOST_CHECK_EQUAL(vStats[VALIDATION_CONNECT_WAIT].nCount, 0U);
+    BOOST_CHECK_EQUAL(vStats[VALIDATION_CONNECT_WAIT].vBuckets[10], 0U);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
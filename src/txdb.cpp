@@ -6,14 +6,167 @@
 #include "txdb.h"
 #include "main.h"
 #include "hash.h"
+#include "ui_interface.h"
 
 using namespace std;
 
-void static BatchWriteCoins(CLevelDBBatch &batch, const uint256 &hash, const CCoins &coins) {
-    if (coins.IsPruned())
-        batch.Erase(make_pair('c', hash));
-    else
-        batch.Write(make_pair('c', hash), coins);
+// The chainstate holds one record per unspent output, so that spending an
+// output only deletes that output's record:
+//  - 'T' + txid: the data of the transaction's CCoins other than the outputs
+//  - 'O' + txid + index: one unspent output, compressed
+//  - 'V': the version of this layout, CHAINSTATE_VERSION
+// A transaction has a 'T' record exactly as long as it has unspent outputs.
+// Older databases stored whole CCoins as 'c' + txid; Upgrade() converts them.
+
+static const int CHAINSTATE_VERSION = 1;
+
+/** The per-transaction part of the chainstate records */
+class CCoinsHeader
+{
+public:
+    int nVersion;
+    unsigned int nCode; // height * 2 + coinbase flag
+    unsigned int nOutputs; // no output records from this index on
+
+    CCoinsHeader() : nVersion(0), nCode(0), nOutputs(0) { }
+    CCoinsHeader(const CCoins &coins) : nVersion(coins.nVersion), nCode(coins.nHeight * 2 + (coins.fCoinBase ? 1 : 0)), nOutputs(coins.vout.size()) { }
+
+    void Apply(CCoins &coins) const {
+        coins.nVersion = nVersion;
+        coins.nHeight = nCode / 2;
+        coins.fCoinBase = nCode & 1;
+    }
+
+    IMPLEMENT_SERIALIZE(
+        READWRITE(VARINT(this->nVersion));
+        READWRITE(VARINT(nCode));
+        READWRITE(VARINT(nOutputs));
+    )
+};
+
+/** Key of an output record. The index is stored big-endian, so that the
+ *  outputs of a transaction are adjacent and in order. */
+class CCoinsOutputKey
+{
+public:
+    uint256 txid;
+    unsigned int n;
+
+    CCoinsOutputKey() : n(0) { }
+    CCoinsOutputKey(const uint256 &txidIn, unsigned int nIn) : txid(txidIn), n(nIn) { }
+
+    unsigned int GetSerializeSize(int nType, int nVersion) const {
+        return 1 + sizeof(txid) + 4;
+    }
+
+    template<typename Stream>
+    void Serialize(Stream &s, int nType, int nVersion) const {
+        unsigned char vch[4] = { (unsigned char)(n >> 24), (unsigned char)(n >> 16), (unsigned char)(n >> 8), (unsigned char)n };
+        s << 'O' << txid;
+        s.write((const char*)vch, 4);
+    }
+
+    template<typename Stream>
+    void Unserialize(Stream &s, int nType, int nVersion) {
+        char chType;
+        unsigned char vch[4];
+        s >> chType >> txid;
+        s.read((char*)vch, 4);
+        if (chType != 'O')
+            throw std::ios_base::failure("CCoinsOutputKey::Unserialize() : not an output key");
+        n = ((unsigned int)vch[0] << 24) | ((unsigned int)vch[1] << 16) | ((unsigned int)vch[2] << 8) | vch[3];
+    }
+};
+
+// Read the output records of txid into coins.vout
+void static ReadCoinsOutputs(leveldb::Iterator *pcursor, const uint256 &txid, CCoins &coins) {
+    CDataStream ssKeySet(SER_DISK, CLIENT_VERSION);
+    ssKeySet << CCoinsOutputKey(txid, 0);
+    pcursor->Seek(ssKeySet.str());
+
+    coins.vout.clear();
+    for (; pcursor->Valid(); pcursor->Next()) {
+        leveldb::Slice slKey = pcursor->key();
+        if (slKey.size() != ssKeySet.size() || memcmp(slKey.data(), &ssKeySet[0], 1 + sizeof(txid)) != 0)
+            break;
+        CDataStream ssKey(slKey.data(), slKey.data()+slKey.size(), SER_DISK, CLIENT_VERSION);
+        CCoinsOutputKey key;
+        ssKey >> key;
+        if (key.n >= coins.vout.size())
+            coins.vout.resize(key.n + 1);
+        leveldb::Slice slValue = pcursor->value();
+        CDataStream ssValue(slValue.data(), slValue.data()+slValue.size(), SER_DISK, CLIENT_VERSION);
+        CTxOutCompressor txout(coins.vout[key.n]);
+        ssValue >> txout;
+    }
+}
+
+// Up to this many outputs a transaction's records are read one by one
+static const unsigned int nMaxPointReads = 16;
+
+// Read the records of txid into coins. Point reads go through the bloom
+// filters, which makes asking for missing transactions and spent outputs
+// cheap; only the outputs of large transactions are scanned instead.
+bool static ReadCoins(CLevelDB &db, const uint256 &txid, CCoins &coins) {
+    CCoinsHeader header;
+    if (!db.Read(make_pair('T', txid), header))
+        return false;
+    header.Apply(coins);
+    if (header.nOutputs > nMaxPointReads) {
+        leveldb::Iterator *pcursor = db.NewLookupIterator();
+        bool fOk = true;
+        try {
+            ReadCoinsOutputs(pcursor, txid, coins);
+        } catch (std::exception &e) {
+            fOk = error("%s() : deserialize error", __PRETTY_FUNCTION__);
+        }
+        delete pcursor;
+        return fOk;
+    }
+    coins.vout.assign(header.nOutputs, CTxOut());
+    for (unsigned int i = 0; i < header.nOutputs; i++) {
+        CTxOutCompressor txout(coins.vout[i]);
+        if (!db.Read(CCoinsOutputKey(txid, i), txout))
+            coins.vout[i].SetNull();
+    }
+    coins.Cleanup();
+    return true;
+}
+
+// Queue the changes that turn the records of hash into coins, given which
+// outputs the database has unspent as a bitmap (see CCoinsCacheEntry); an
+// empty bitmap means the transaction has no records. Either may be pruned.
+// The data other than the outputs can't change while a transaction has
+// unspent outputs, so only the outputs that were spent or added are
+// touched, and the header only when an output past its nOutputs comes
+// back. Returns the number of records changed.
+unsigned int static BatchWriteCoins(CLevelDBBatch &batch, const uint256 &hash, const std::vector<unsigned char> &vchBaseUnspent, const CCoins &coins) {
+    unsigned int nChanged = 0;
+    unsigned int nBaseOutputs = 0;
+    for (unsigned int i = vchBaseUnspent.size() * 8; i > 0 && nBaseOutputs == 0; i--)
+        if (CCoinsCacheEntry::IsUnspent(vchBaseUnspent, i - 1))
+            nBaseOutputs = i;
+    bool fHave = !coins.IsPruned(), fHaveBase = nBaseOutputs > 0;
+    if (fHave && coins.vout.size() > nBaseOutputs) {
+        batch.Write(make_pair('T', hash), CCoinsHeader(coins));
+        nChanged++;
+    } else if (!fHave && fHaveBase) {
+        batch.Erase(make_pair('T', hash));
+        nChanged++;
+    }
+    for (unsigned int i = 0; i < std::max((unsigned int)coins.vout.size(), nBaseOutputs); i++) {
+        bool fOut = i < coins.vout.size() && !coins.vout[i].IsNull();
+        bool fOutBase = CCoinsCacheEntry::IsUnspent(vchBaseUnspent, i);
+        if (fOut && !fOutBase) {
+            CTxOut txout(coins.vout[i]);
+            batch.Write(CCoinsOutputKey(hash, i), CTxOutCompressor(txout));
+            nChanged++;
+        } else if (!fOut && fOutBase) {
+            batch.Erase(CCoinsOutputKey(hash, i));
+            nChanged++;
+        }
+    }
+    return nChanged;
 }
 
 void static BatchWriteHashBestChain(CLevelDBBatch &batch, const uint256 &hash) {
@@ -23,18 +176,71 @@ void static BatchWriteHashBestChain(CLevelDBBatch &batch, const uint256 &hash) {
 CCoinsViewDB::CCoinsViewDB(size_t nCacheSize, bool fMemory, bool fWipe) : db(GetDataDir() / "chainstate", nCacheSize, fMemory, fWipe) {
 }
 
-bool CCoinsViewDB::GetCoins(const uint256 &txid, CCoins &coins) { 
-    return db.Read(make_pair('c', txid), coins); 
+bool CCoinsViewDB::GetCoins(const uint256 &txid, CCoins &coins) {
+    return ReadCoins(db, txid, coins);
+}
+
+// Whether the records of a come before those of b in the database, which
+// compares keys bytewise, unlike uint256's operator<
+bool static TxidKeyLess(const uint256 &a, const uint256 &b) {
+    return memcmp(a.begin(), b.begin(), sizeof(a)) < 0;
+}
+
+bool CCoinsViewDB::GetCoinsBatch(const std::vector<uint256> &vTxid, CCoinsMap &mapCoins) {
+    // In key order, both cursors only ever move forward, mostly within table
+    // blocks that the previous seek already brought in, rather than looking
+    // up every transaction from scratch
+    std::vector<uint256> vSorted(vTxid);
+    std::sort(vSorted.begin(), vSorted.end(), TxidKeyLess);
+    leveldb::Iterator *pcursor = db.NewLookupIterator();
+    leveldb::Iterator *pcursorOutputs = db.NewLookupIterator();
+    bool fOk = true;
+    try {
+        BOOST_FOREACH(const uint256 &txid, vSorted) {
+            CDataStream ssKeySet(SER_DISK, CLIENT_VERSION);
+            ssKeySet << make_pair('T', txid);
+            pcursor->Seek(ssKeySet.str());
+            if (!pcursor->Valid())
+                break;
+            leveldb::Slice slKey = pcursor->key();
+            if (slKey.size() != ssKeySet.size() || memcmp(slKey.data(), &ssKeySet[0], ssKeySet.size()) != 0)
+                continue;
+            leveldb::Slice slValue = pcursor->value();
+            CDataStream ssValue(slValue.data(), slValue.data()+slValue.size(), SER_DISK, CLIENT_VERSION);
+            CCoinsHeader header;
+            ssValue >> header;
+            CCoins &coins = mapCoins[txid].coins;
+            header.Apply(coins);
+            ReadCoinsOutputs(pcursorOutputs, txid, coins);
+        }
+    } catch (std::exception &e) {
+        fOk = error("%s() : deserialize error", __PRETTY_FUNCTION__);
+    }
+    delete pcursorOutputs;
+    delete pcursor;
+    return fOk;
+}
+
+// Which outputs of txid the database has unspent; false on a read error
+bool static ReadUnspent(CLevelDB &db, const uint256 &txid, std::vector<unsigned char> &vchUnspent) {
+    CCoins coins;
+    if (!ReadCoins(db, txid, coins) && db.Exists(make_pair('T', txid)))
+        return error("%s() : cannot read %s", __PRETTY_FUNCTION__, txid.ToString().c_str());
+    CCoinsCacheEntry::GetUnspent(coins, vchUnspent);
+    return true;
 }
 
 bool CCoinsViewDB::SetCoins(const uint256 &txid, const CCoins &coins) {
+    std::vector<unsigned char> vchUnspent;
+    if (!ReadUnspent(db, txid, vchUnspent))
+        return false;
     CLevelDBBatch batch;
-    BatchWriteCoins(batch, txid, coins);
+    BatchWriteCoins(batch, txid, vchUnspent, coins);
     return db.WriteBatch(batch);
 }
 
 bool CCoinsViewDB::HaveCoins(const uint256 &txid) {
-    return db.Exists(make_pair('c', txid)); 
+    return db.Exists(make_pair('T', txid));
 }
 
 CBlockIndex *CCoinsViewDB::GetBestBlock() {
@@ -53,18 +259,123 @@ bool CCoinsViewDB::SetBestBlock(CBlockIndex *pindex) {
     return db.WriteBatch(batch);
 }
 
-bool CCoinsViewDB::BatchWrite(const std::map<uint256, CCoins> &mapCoins, CBlockIndex *pindex) {
-    printf("Committing %u changed transactions to coin database...\n", (unsigned int)mapCoins.size());
-
+bool CCoinsViewDB::BatchWrite(CCoinsMap &mapCoins, CBlockIndex *pindex) {
     CLevelDBBatch batch;
-    for (std::map<uint256, CCoins>::const_iterator it = mapCoins.begin(); it != mapCoins.end(); it++)
-        BatchWriteCoins(batch, it->first, it->second);
+    const std::vector<unsigned char> vchNone;
+    unsigned int nCount = 0, nChanged = 0, nRecords = 0;
+    for (CCoinsMap::const_iterator it = mapCoins.begin(); it != mapCoins.end(); it++, nCount++) {
+        if (!(it->second.flags & CCoinsCacheEntry::DIRTY))
+            continue;
+        // Entries the database never had need no erase either
+        bool fFresh = it->second.flags & CCoinsCacheEntry::FRESH;
+        if (fFresh && it->second.IsPruned())
+            continue;
+        // Which outputs are stored is known from the cache entry, except for
+        // entries that a view other than a cache made dirty
+        const std::vector<unsigned char> *pvchBase = fFresh ? &vchNone : &it->second.vchBaseUnspent;
+        std::vector<unsigned char> vchRead;
+        if (!fFresh && pvchBase->empty()) {
+            if (!ReadUnspent(db, it->first, vchRead))
+                return false;
+            pvchBase = &vchRead;
+        }
+        const CCoins *pcoins = &it->second.coins;
+        CCoins coinsExpanded;
+        if (it->second.flags & CCoinsCacheEntry::COMPRESSED) {
+            it->second.GetCoins(coinsExpanded);
+            pcoins = &coinsExpanded;
+        }
+        nRecords += BatchWriteCoins(batch, it->first, *pvchBase, *pcoins);
+        nChanged++;
+    }
+    printf("Committing %u changed transactions (out of %u, %u records) to coin database...\n", nChanged, nCount, nRecords);
+
     if (pindex)
         BatchWriteHashBestChain(batch, pindex->GetBlockHash());
 
     return db.WriteBatch(batch);
 }
 
+// Whether there are records of the given type
+bool static HasRecords(CLevelDB &db, char chType) {
+    leveldb::Iterator *pcursor = db.NewIterator();
+    pcursor->Seek(std::string(1, chType));
+    bool fHave = pcursor->Valid() && pcursor->key()[0] == chType;
+    delete pcursor;
+    return fHave;
+}
+
+bool CCoinsViewDB::CheckVersion() {
+    int nVersion = 0;
+    if (db.Read('V', nVersion)) {
+        if (nVersion != CHAINSTATE_VERSION)
+            return error("%s() : chainstate version %d, expected %d", __PRETTY_FUNCTION__, nVersion, CHAINSTATE_VERSION);
+        return true;
+    }
+    // Without a version, it must be a new database or one of the old layout,
+    // possibly halfway through Upgrade()
+    if (HasRecords(db, 'T') && !HasRecords(db, 'c'))
+        return error("%s() : chainstate of an unknown version", __PRETTY_FUNCTION__);
+    return true;
+}
+
+bool CCoinsViewDB::Upgrade() {
+    if (!HasRecords(db, 'c'))
+        return db.Exists('V') || db.Write('V', CHAINSTATE_VERSION);
+
+    leveldb::Iterator *pcursor = db.NewIterator();
+    CDataStream ssKeySet(SER_DISK, CLIENT_VERSION);
+    ssKeySet << make_pair('c', uint256(0));
+    pcursor->Seek(ssKeySet.str());
+
+    // Every batch converts a range of transactions at once, so an upgrade
+    // that is interrupted simply continues on the next start
+    printf("Upgrading coin database to one record per output...\n");
+    uiInterface.InitMessage(_("Upgrading coin database..."));
+    int64 nStart = GetTimeMillis();
+    CLevelDBBatch batch;
+    const std::vector<unsigned char> vchNone;
+    unsigned int nTransactions = 0, nRecords = 0;
+    bool fOk = true;
+    for (; pcursor->Valid(); pcursor->Next()) {
+        uint256 txid;
+        CCoins coins;
+        try {
+            leveldb::Slice slKey = pcursor->key();
+            CDataStream ssKey(slKey.data(), slKey.data()+slKey.size(), SER_DISK, CLIENT_VERSION);
+            char chType;
+            ssKey >> chType;
+            if (chType != 'c')
+                break;
+            ssKey >> txid;
+            leveldb::Slice slValue = pcursor->value();
+            CDataStream ssValue(slValue.data(), slValue.data()+slValue.size(), SER_DISK, CLIENT_VERSION);
+            ssValue >> coins;
+        } catch (std::exception &e) {
+            fOk = error("%s() : deserialize error", __PRETTY_FUNCTION__);
+            break;
+        }
+        nRecords += BatchWriteCoins(batch, txid, vchNone, coins);
+        batch.Erase(make_pair('c', txid));
+        if (++nTransactions % 10000 == 0) {
+            if (!db.WriteBatch(batch)) {
+                fOk = false;
+                break;
+            }
+            batch.Clear();
+            printf("Upgraded %u transactions\n", nTransactions);
+        }
+    }
+    delete pcursor;
+    if (fOk) {
+        batch.Write('V', CHAINSTATE_VERSION);
+        fOk = db.WriteBatch(batch);
+    }
+    if (fOk)
+        printf("Upgraded %u transactions into %u records in %"PRI64d"ms\n", nTransactions, nRecords, GetTimeMillis() - nStart);
+    return fOk;
+}
+
 CBlockTreeDB::CBlockTreeDB(size_t nCacheSize, bool fMemory, bool fWipe) : CLevelDB(GetDataDir() / "blocks" / "index", nCacheSize, fMemory, fWipe) {
 }
 
@@ -73,6 +384,11 @@ bool CBlockTreeDB::WriteBlockIndex(const CDiskBlockIndex& blockindex)
     return Write(make_pair('b', blockindex.GetBlockHash()), blockindex);
 }
 
+bool CBlockTreeDB::WritePoWHash(const uint256 &hashBlock, const uint256 &hashPoW)
+{
+    return Write(make_pair('p', hashBlock), hashPoW);
+}
+
 bool CBlockTreeDB::ReadBestInvalidWork(CBigNum& bnBestInvalidWork)
 {
     return Read('I', bnBestInvalidWork);
@@ -113,8 +429,11 @@ bool CBlockTreeDB::ReadLastBlockFile(int &nFile) {
 
 bool CCoinsViewDB::GetStats(CCoinsStats &stats) {
     leveldb::Iterator *pcursor = db.NewIterator();
+    leveldb::Iterator *pcursorOutputs = db.NewIterator();
     pcursor->SeekToFirst();
 
+    // Transactions are hashed as the old per-transaction records were, so
+    // the result doesn't depend on the database layout
     CHashWriter ss(SER_GETHASH, PROTOCOL_VERSION);
     stats.hashBlock = GetBestBlock()->GetBlockHash();
     ss << stats.hashBlock;
@@ -126,13 +445,25 @@ bool CCoinsViewDB::GetStats(CCoinsStats &stats) {
             CDataStream ssKey(slKey.data(), slKey.data()+slKey.size(), SER_DISK, CLIENT_VERSION);
             char chType;
             ssKey >> chType;
-            if (chType == 'c') {
+            if (chType == 'T' || chType == 'c') {
                 leveldb::Slice slValue = pcursor->value();
                 CDataStream ssValue(slValue.data(), slValue.data()+slValue.size(), SER_DISK, CLIENT_VERSION);
-                CCoins coins;
-                ssValue >> coins;
                 uint256 txhash;
                 ssKey >> txhash;
+                CCoins coins;
+                if (chType == 'T') {
+                    CCoinsHeader header;
+                    ssValue >> header;
+                    header.Apply(coins);
+                    ReadCoinsOutputs(pcursorOutputs, txhash, coins);
+                    if (coins.IsPruned()) {
+                        pcursor->Next();
+                        continue;
+                    }
+                } else {
+                    // not upgraded yet
+                    ssValue >> coins;
+                }
                 ss << txhash;
                 ss << VARINT(coins.nVersion);
                 ss << (coins.fCoinBase ? 'c' : 'n'); 
@@ -147,14 +478,17 @@ bool CCoinsViewDB::GetStats(CCoinsStats &stats) {
                         nTotalAmount += out.nValue;
                     }
                 }
-                stats.nSerializedSize += 32 + slValue.size();
+                stats.nSerializedSize += 32 + ::GetSerializeSize(coins, SER_DISK, CLIENT_VERSION);
                 ss << VARINT(0);
             }
             pcursor->Next();
         } catch (std::exception &e) {
+            delete pcursorOutputs;
+            delete pcursor;
             return error("%s() : deserialize error", __PRETTY_FUNCTION__);
         }
     }
+    delete pcursorOutputs;
     delete pcursor;
     stats.nHeight = GetBestBlock()->nHeight;
     stats.hashSerialized = ss.GetHash();
@@ -237,6 +571,32 @@ bool CBlockTreeDB::LoadBlockIndexGuts()
             return error("%s() : deserialize error", __PRETTY_FUNCTION__);
         }
     }
+
+    // Load the proof-of-work hashes stored for indexed blocks
+    CDataStream ssKeyPoW(SER_DISK, CLIENT_VERSION);
+    ssKeyPoW << make_pair('p', uint256(0));
+    pcursor->Seek(ssKeyPoW.str());
+    while (pcursor->Valid()) {
+        boost::this_thread::interruption_point();
+        try {
+            leveldb::Slice slKey = pcursor->key();
+            CDataStream ssKey(slKey.data(), slKey.data()+slKey.size(), SER_DISK, CLIENT_VERSION);
+            char chType;
+            ssKey >> chType;
+            if (chType != 'p')
+                break;
+            uint256 hashBlock;
+            ssKey >> hashBlock;
+            leveldb::Slice slValue = pcursor->value();
+            CDataStream ssValue(slValue.data(), slValue.data()+slValue.size(), SER_DISK, CLIENT_VERSION);
+            std::map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashBlock);
+            if (mi != mapBlockIndex.end())
+                ssValue >> mi->second->hashPoW;
+            pcursor->Next();
+        } catch (std::exception &e) {
+            return error("%s() : deserialize error", __PRETTY_FUNCTION__);
+        }
+    }
     delete pcursor;
 
     return true;
@@ -17,12 +17,20 @@ public:
     CCoinsViewDB(size_t nCacheSize, bool fMemory = false, bool fWipe = false);
 
     bool GetCoins(const uint256 &txid, CCoins &coins);
+    bool GetCoinsBatch(const std::vector<uint256> &vTxid, CCoinsMap &mapCoins);
     bool SetCoins(const uint256 &txid, const CCoins &coins);
     bool HaveCoins(const uint256 &txid);
     CBlockIndex *GetBestBlock();
     bool SetBestBlock(CBlockIndex *pindex);
-    bool BatchWrite(const std::map<uint256, CCoins> &mapCoins, CBlockIndex *pindex);
+    bool BatchWrite(CCoinsMap &mapCoins, CBlockIndex *pindex);
     bool GetStats(CCoinsStats &stats);
+
+    // Whether the records are of the layout this version writes, or of one
+    // that Upgrade() converts
+    bool CheckVersion();
+
+    // Convert the per-transaction records of older versions
+    bool Upgrade();
 };
 
 /** Access to the block database (blocks/index/) */
@@ -35,6 +43,7 @@ private:
     void operator=(const CBlockTreeDB&);
 public:
     bool WriteBlockIndex(const CDiskBlockIndex& blockindex);
+    bool WritePoWHash(const uint256 &hashBlock, const uint256 &hashPoW);
     bool ReadBestInvalidWork(CBigNum& bnBestInvalidWork);
     bool WriteBestInvalidWork(const CBigNum& bnBestInvalidWork);
     bool ReadBlockFileInfo(int nFile, CBlockFileInfo &fileinfo);
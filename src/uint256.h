@@ -587,6 +587,53 @@ public:
         else
             *this = 0;
     }
+
+    // Fast keyed hash for hash tables (Bob Jenkins' lookup3 mix). The salt
+    // keeps peers from choosing keys that all land in one bucket.
+    uint64 GetHash(const uint256& salt) const
+    {
+        uint32_t a, b, c;
+        a = b = c = 0xdeadbeef + (WIDTH << 2);
+
+#define HASH_ROT(x, k) (((x) << (k)) | ((x) >> (32 - (k))))
+#define HASH_MIX(a, b, c) \
+        do { \
+            a -= c; a ^= HASH_ROT(c, 4);  c += b; \
+            b -= a; b ^= HASH_ROT(a, 6);  a += c; \
+            c -= b; c ^= HASH_ROT(b, 8);  b += a; \
+            a -= c; a ^= HASH_ROT(c, 16); c += b; \
+            b -= a; b ^= HASH_ROT(a, 19); a += c; \
+            c -= b; c ^= HASH_ROT(b, 4);  b += a; \
+        } while (0)
+#define HASH_FINAL(a, b, c) \
+        do { \
+            c ^= b; c -= HASH_ROT(b, 14); \
+            a ^= c; a -= HASH_ROT(c, 11); \
+            b ^= a; b -= HASH_ROT(a, 25); \
+            c ^= b; c -= HASH_ROT(b, 16); \
+            a ^= c; a -= HASH_ROT(c, 4);  \
+            b ^= a; b -= HASH_ROT(a, 14); \
+            c ^= b; c -= HASH_ROT(b, 24); \
+        } while (0)
+
+        a += pn[0] ^ salt.pn[0];
+        b += pn[1] ^ salt.pn[1];
+        c += pn[2] ^ salt.pn[2];
+        HASH_MIX(a, b, c);
+        a += pn[3] ^ salt.pn[3];
+        b += pn[4] ^ salt.pn[4];
+        c += pn[5] ^ salt.pn[5];
+        HASH_MIX(a, b, c);
+        a += pn[6] ^ salt.pn[6];
+        b += pn[7] ^ salt.pn[7];
+        HASH_FINAL(a, b, c);
+
+#undef HASH_FINAL
+#undef HASH_MIX
+#undef HASH_ROT
+
+        return ((((uint64)b) << 32) | c);
+    }
 };
 
 inline bool operator==(const uint256& a, uint64 b)                           { return (base_uint256)a == b; }